@@ -0,0 +1,205 @@
+#pragma once
+
+//
+// Tagged non-paged NX pool. Everything the driver allocates goes through here, so it shows up under
+// TPM_POOL_TAG in !poolused and is never executable.
+//
+namespace pool
+{
+    inline void* Allocate(_In_ size_t size)
+    {
+        return ExAllocatePool2(POOL_FLAG_NON_PAGED, size, TPM_POOL_TAG);
+    }
+
+    inline void Free(_In_opt_ void* p)
+    {
+        if (p)
+        {
+            ExFreePoolWithTag(p, TPM_POOL_TAG);
+        }
+    }
+}
+
+//
+// Fixed-size NX buffers recycled through a LOOKASIDE_LIST_EX, so buffers handed out and back
+// repeatedly do not hit the pool in the steady state.
+//
+class TpmLookasideList
+{
+private:
+
+    LOOKASIDE_LIST_EX list;
+    uint32_t size = 0;
+    bool initialized = false;
+
+public:
+
+    ~TpmLookasideList()
+    {
+        if (this->initialized)
+        {
+            ExDeleteLookasideListEx(&this->list);
+        }
+    }
+
+    //
+    // Initializes the list for buffers of the given size.
+    //
+    // Parameters:
+    // - size: Size of every buffer in bytes.
+    //
+    // Returns:
+    // - STATUS_SUCCESS: The list is ready.
+    // - Any status returned by ExInitializeLookasideListEx.
+    //
+    NTSTATUS Init(_In_ uint32_t size)
+    {
+        if (this->initialized)
+        {
+            return STATUS_SUCCESS;
+        }
+
+        NTSTATUS status = ExInitializeLookasideListEx(&this->list, NULL, NULL, NonPagedPoolNx, EX_LOOKASIDE_LIST_EX_FLAGS_FAIL_NO_RAISE, size, TPM_POOL_TAG, 0);
+        if (NT_ERROR(status))
+        {
+            DbgError("TpmLookasideList::Init - ExInitializeLookasideListEx failed with 0x%08x.\n", status);
+            return status;
+        }
+
+        this->size = size;
+        this->initialized = true;
+        return STATUS_SUCCESS;
+    }
+
+    //
+    // Returns a buffer of GetSize() bytes, or nullptr. Its contents are undefined.
+    //
+    uint8_t* Allocate()
+    {
+        return this->initialized ? (uint8_t*)ExAllocateFromLookasideListEx(&this->list) : nullptr;
+    }
+
+    void Free(_In_opt_ uint8_t* buffer)
+    {
+        if (buffer)
+        {
+            ExFreeToLookasideListEx(&this->list, buffer);
+        }
+    }
+
+    uint32_t GetSize()
+    {
+        return this->size;
+    }
+};
+
+//
+// Bump allocator over one long-lived block, for buffers that only live for the duration of a
+// command. Allocation is a pointer increment; everything allocated under a TpmScratchScope is
+// released at once when the scope ends, and the arena is empty again once the outermost scope
+// of a command completes.
+//
+class TpmScratchArena
+{
+private:
+
+    uint8_t* block = nullptr;
+    uint32_t capacity = 0;
+    uint32_t used = 0;
+    uint32_t highWater = 0;
+
+public:
+
+    ~TpmScratchArena()
+    {
+        pool::Free(this->block);
+    }
+
+    //
+    // Allocates the backing block.
+    //
+    // Parameters:
+    // - capacity: Size of the block in bytes.
+    //
+    // Returns:
+    // - true: The arena is ready.
+    // - false: The block could not be allocated.
+    //
+    bool Init(_In_ uint32_t capacity)
+    {
+        this->block = (uint8_t*)pool::Allocate(capacity);
+        if (!this->block)
+        {
+            DbgError("TpmScratchArena::Init - failed to allocate %u bytes.\n", capacity);
+            return false;
+        }
+        this->capacity = capacity;
+        return true;
+    }
+
+    //
+    // Returns size bytes aligned to SCRATCH_ARENA_ALIGNMENT, or nullptr if the arena is exhausted.
+    // The contents are undefined.
+    //
+    void* Allocate(_In_ uint32_t size)
+    {
+        uint32_t offset = (this->used + SCRATCH_ARENA_ALIGNMENT - 1) & ~(SCRATCH_ARENA_ALIGNMENT - 1);
+        if (offset > this->capacity || size > this->capacity - offset)
+        {
+            DbgError("TpmScratchArena::Allocate - %u bytes do not fit (%u used).\n", size, this->used);
+            return nullptr;
+        }
+
+        this->used = offset + size;
+        this->highWater = max(this->highWater, this->used);
+        return this->block + offset;
+    }
+
+    template<typename T>
+    T* Allocate()
+    {
+        return (T*)this->Allocate(sizeof(T));
+    }
+
+    uint32_t GetMark()
+    {
+        return this->used;
+    }
+
+    void Rewind(_In_ uint32_t mark)
+    {
+        this->used = mark;
+    }
+
+    //
+    // Returns the largest number of bytes ever in use at once.
+    //
+    uint32_t GetHighWater()
+    {
+        return this->highWater;
+    }
+};
+
+//
+// Releases everything allocated from an arena while the scope was alive.
+//
+class TpmScratchScope
+{
+private:
+
+    TpmScratchArena* arena;
+    uint32_t mark;
+
+public:
+
+    TpmScratchScope(_In_ TpmScratchArena* arena)
+    {
+        this->arena = arena;
+        this->mark = arena->GetMark();
+    }
+
+    ~TpmScratchScope()
+    {
+        this->arena->Rewind(this->mark);
+    }
+};
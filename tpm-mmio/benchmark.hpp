@@ -0,0 +1,636 @@
+#pragma once
+
+//
+// Transport benchmark, compiled in with TPM_BENCHMARK. Sends TPM2_GetTestResult padded to each of
+// CommandSizes through the engine, BENCHMARK_ITERATIONS times per size, and reads the latency and
+// MMIO counts back from the engine's command statistics. The padding makes the TPM answer with a
+// size error, so every size costs a full transfer in and a header-sized transfer out without
+// side effects.
+//
+// Results are checked against per-transport ceilings. A ceiling is linear in the command size:
+// Fixed + size * PerKilobyte / 1024 for the p99 round trip, Fixed + size * PerByte for register
+// accesses per command. Ceilings come from runs on real hardware, noted with their platform; a
+// transport without one is reported as having no baseline and is not checked.
+//
+// The response decoders are checked and measured over TpmParserCorpus first; that part sends no
+// command.
+//
+// On a CRB device listed in CrbWriteCombinedDevices, every size is then run with the data buffer
+// mapped uncached and write-combined, whatever CRB_WRITE_COMBINED says, and the two are printed
+// side by side. Under each mapping, DataChecks are sent too: TPM2_Hash over patterned payloads,
+// which the TPM has to read whole to get the digest right, and a GetCapability whose response
+// fills a good part of the buffer. Their responses must be well-formed and byte for byte the
+// same under both mappings, or the comparison fails.
+//
+// With MMIO_FAULT_INJECTION, FaultScenarios run last: each arms a fault script (see fault.hpp)
+// and times one command through the recovery path it forces. A scenario's bound is the sum of
+// the timeouts that path may wait out; the wait loops only count their stalls, so a scenario
+// fails if it takes more than twice its bound.
+//
+namespace benchmark
+{
+    struct TPM_BENCHMARK_BASELINE
+    {
+        const char* Transport;
+        const char* Platform;               // Where the ceilings were measured, nullptr if they were not
+        uint32_t P99Microseconds;
+        uint32_t P99MicrosecondsPerKilobyte;
+        uint32_t MmioAccesses;
+        uint32_t MmioAccessesPerByte;
+    };
+
+    static constexpr TPM_BENCHMARK_BASELINE Baselines[] =
+    {
+        { "CRB",  nullptr, 0, 0, 0, 0 },
+        { "TIS",  nullptr, 0, 0, 0, 0 },
+        { "FIFO", nullptr, 0, 0, 0, 0 },
+    };
+
+    static constexpr uint32_t CommandSizes[] =
+    {
+        sizeof(TPM2_COMMAND_HEADER), 64, 256, 1024, 2048, TRANSPORT_STAGING_BUFFER_SIZE
+    };
+
+    //
+    // Deterministic commands whose responses are compared across data buffer mappings. A nonzero
+    // entry is the size of a TPM2_Hash payload; 0 is GetCapability(TPM_CAP_COMMANDS).
+    //
+    static constexpr uint16_t DataChecks[] =
+    {
+        1, 63, 256, MAX_DIGEST_BUFFER, 0
+    };
+
+    struct TPM_BENCHMARK_RESULT
+    {
+        uint32_t CommandSize;
+        uint32_t ResponseSize;
+        uint64_t CommandsPerSecond;
+        uint64_t P50Microseconds;
+        uint64_t P99Microseconds;
+        uint64_t P999Microseconds;
+        uint64_t MmioAccesses;              // Reads and writes per command
+        uint64_t MmioAccessesPerByte100;    // Per byte moved in either direction, in hundredths
+    };
+
+    struct TPM_FAULT_SCENARIO
+    {
+        const char* Name;
+        const char* Transport;          // "CRB", or "TIS" for TIS and FIFO
+        uint32_t BoundMilliseconds;
+        uint32_t FaultCount;
+        TPM_FAULT Faults[2];
+    };
+
+#define CRB_REGISTER(field) FIELD_OFFSET(PTP_CRB_REGISTERS, field)
+#define TIS_REGISTER(field) FIELD_OFFSET(TIS_PC_REGISTERS, field)
+
+    static constexpr TPM_FAULT_SCENARIO FaultScenarios[] =
+    {
+        { "Slow control registers", "CRB", 100, 2, {
+            { TpmFaultDelay, CRB_REGISTER(CrbControlRequest), 0, 50 },
+            { TpmFaultDelay, CRB_REGISTER(CrbControlStart), 0, 50 } } },
+        { "cmdReady never clears", "CRB", RETRY_CNT_MAX * PTP_TIMEOUT_C / 1000, 1, {
+            { TpmFaultSetBits, CRB_REGISTER(CrbControlRequest), PTP_CRB_CONTROL_AREA_REQUEST_COMMAND_READY } } },
+        { "Start completes on cancel", "CRB", PTP_TIMEOUT_MAX / 1000, 1, {
+            { TpmFaultSetBits, CRB_REGISTER(CrbControlStart), PTP_CRB_CONTROL_START, 0, 0,
+                0, 0, CRB_REGISTER(CrbControlCancel), PTP_CRB_CONTROL_CANCEL } } },
+        { "Start never drops", "CRB", (PTP_TIMEOUT_MAX + PTP_TIMEOUT_B) / 1000, 1, {
+            { TpmFaultSetBits, CRB_REGISTER(CrbControlStart), PTP_CRB_CONTROL_START } } },
+
+        { "Slow status register", "TIS", 100, 1, {
+            { TpmFaultDelay, TIS_REGISTER(Status), 0, 50 } } },
+        { "Burst count stuck at zero", "TIS", TIS_TIMEOUT_D / 1000, 2, {
+            { TpmFaultClearBits, TIS_REGISTER(BurstCount), 0xFF },
+            { TpmFaultClearBits, TIS_REGISTER(BurstCount) + 1, 0xFF } } },
+        { "Spurious stsValid after tpmGo", "TIS", TIS_TIMEOUT_D / 1000, 1, {
+            { TpmFaultSetBits, TIS_REGISTER(Status), TIS_PC_VALID | TIS_PC_STS_DATA, 0, 1,
+                TIS_REGISTER(Status), TIS_PC_STS_GO } } },
+        { "dataAvail completes on cancel", "TIS", TIS_TIMEOUT_MAX / 1000, 1, {
+            { TpmFaultClearBits, TIS_REGISTER(Status), TIS_PC_STS_DATA, 0, 0,
+                TIS_REGISTER(Status), TIS_PC_STS_GO, TIS_REGISTER(Status), TIS_PC_STS_CANCEL } } },
+        { "dataAvail never set", "TIS", (TIS_TIMEOUT_MAX + TIS_TIMEOUT_B) / 1000, 1, {
+            { TpmFaultClearBits, TIS_REGISTER(Status), TIS_PC_STS_DATA, 0, 0,
+                TIS_REGISTER(Status), TIS_PC_STS_GO } } },
+    };
+
+#undef TIS_REGISTER
+#undef CRB_REGISTER
+
+    //
+    // Runs BENCHMARK_ITERATIONS commands of one size.
+    //
+    // Parameters:
+    // - tpm: Engine to drive. Its command statistics are reset.
+    // - commandSize: Size of the command, header included.
+    // - command: Buffer of at least commandSize bytes.
+    // - response: Buffer of TRANSPORT_STAGING_BUFFER_SIZE bytes.
+    // - statistics: Scratch statistics.
+    // - result: Receives the measurements.
+    //
+    // Returns:
+    // - STATUS_SUCCESS: result holds the measurements.
+    // - Any status returned by SubmitVirtualizedCommand or GetCommandStatistics.
+    //
+    template<typename Transport>
+    NTSTATUS RunSize(
+        _In_ TpmEngine<Transport>* tpm,
+        _In_ uint32_t commandSize,
+        _Inout_updates_bytes_(commandSize) uint8_t* command,
+        _Out_writes_bytes_(TRANSPORT_STAGING_BUFFER_SIZE) uint8_t* response,
+        _Out_ TPM_COMMAND_STATISTICS* statistics,
+        _Out_ TPM_BENCHMARK_RESULT* result
+    )
+    {
+        RtlZeroMemory(result, sizeof(*result));
+        result->CommandSize = commandSize;
+        tpm->ResetCommandStatistics();
+
+        uint64_t start = trace::Timestamp();
+        for (uint32_t i = 0; i < BENCHMARK_ITERATIONS; i++)
+        {
+            TPM2_COMMAND_HEADER header;
+            header.tag = _byteswap_ushort(TPM_ST_NO_SESSIONS);
+            header.paramSize = _byteswap_ulong(commandSize);
+            header.commandCode = _byteswap_ulong(TPM_CC_GetTestResult);
+            memcpy(command, &header, sizeof(header));
+
+            uint32_t responseSize = TRANSPORT_STAGING_BUFFER_SIZE;
+            NTSTATUS status = tpm->SubmitVirtualizedCommand(commandSize, command, &responseSize, response);
+            if (NT_ERROR(status))
+            {
+                DbgError("benchmark::RunSize - %u byte command failed with 0x%08x.\n", commandSize, status);
+                return status;
+            }
+            result->ResponseSize = responseSize;
+        }
+        uint64_t elapsed = trace::Timestamp() - start;
+
+        NTSTATUS status = tpm->GetCommandStatistics(TPM_CC_GetTestResult, statistics);
+        if (NT_ERROR(status))
+        {
+            return status;
+        }
+
+        uint64_t commands = statistics->Commands;
+        uint64_t accesses = statistics->MmioReads + statistics->MmioWrites;
+        result->CommandsPerSecond = elapsed ? (commands * trace::Frequency()) / elapsed : 0;
+        result->P50Microseconds = TpmCommandStatistics::GetQuantile(&statistics->Total, 500);
+        result->P99Microseconds = TpmCommandStatistics::GetQuantile(&statistics->Total, 990);
+        result->P999Microseconds = TpmCommandStatistics::GetQuantile(&statistics->Total, 999);
+        result->MmioAccesses = commands ? accesses / commands : 0;
+        result->MmioAccessesPerByte100 = commands ? (accesses * 100) / (commands * (commandSize + result->ResponseSize)) : 0;
+        return STATUS_SUCCESS;
+    }
+
+    //
+    // Runs every size of CommandSizes and prints one line per size.
+    //
+    // Parameters:
+    // - tpm: Engine to drive. Its command statistics are reset.
+    // - label: Printed in front of every line.
+    // - command: Buffer of TRANSPORT_STAGING_BUFFER_SIZE bytes.
+    // - response: Buffer of TRANSPORT_STAGING_BUFFER_SIZE bytes.
+    // - statistics: Scratch statistics.
+    // - results: Receives one result per size.
+    //
+    // Returns:
+    // - STATUS_SUCCESS: results hold the measurements.
+    // - Any status returned by RunSize.
+    //
+    template<typename Transport>
+    NTSTATUS RunSizes(
+        _In_ TpmEngine<Transport>* tpm,
+        _In_ const char* label,
+        _Inout_updates_bytes_(TRANSPORT_STAGING_BUFFER_SIZE) uint8_t* command,
+        _Out_writes_bytes_(TRANSPORT_STAGING_BUFFER_SIZE) uint8_t* response,
+        _Out_ TPM_COMMAND_STATISTICS* statistics,
+        _Out_writes_(ARRAYSIZE(CommandSizes)) TPM_BENCHMARK_RESULT* results
+    )
+    {
+        for (uint32_t i = 0; i < ARRAYSIZE(CommandSizes); i++)
+        {
+            const TPM_BENCHMARK_RESULT& result = results[i];
+            NTSTATUS status = RunSize(tpm, CommandSizes[i], command, response, statistics, &results[i]);
+            if (NT_ERROR(status))
+            {
+                return status;
+            }
+
+            Dbg("Benchmark %s %4u bytes: %llu commands/s, p50 %llu us, p99 %llu us, p999 %llu us, %llu MMIO accesses (%llu.%02llu per byte).\n",
+                label, result.CommandSize, result.CommandsPerSecond,
+                result.P50Microseconds, result.P99Microseconds, result.P999Microseconds,
+                result.MmioAccesses, result.MmioAccessesPerByte100 / 100, result.MmioAccessesPerByte100 % 100);
+        }
+        return STATUS_SUCCESS;
+    }
+
+    //
+    // Builds data check index into command.
+    //
+    // Returns:
+    // - uint32_t: Size of the command.
+    //
+    inline uint32_t BuildDataCheck(
+        _In_ uint32_t index,
+        _Out_writes_bytes_(TRANSPORT_STAGING_BUFFER_SIZE) uint8_t* command
+    )
+    {
+        uint32_t size = sizeof(TPM2_COMMAND_HEADER);
+        auto put16 = [command, &size](uint16_t value) {
+            value = _byteswap_ushort(value);
+            memcpy(command + size, &value, sizeof(value));
+            size += sizeof(value);
+        };
+        auto put32 = [command, &size](uint32_t value) {
+            value = _byteswap_ulong(value);
+            memcpy(command + size, &value, sizeof(value));
+            size += sizeof(value);
+        };
+
+        TPM_CC commandCode = TPM_CC_GetCapability;
+        uint16_t payloadSize = DataChecks[index];
+        if (payloadSize != 0)
+        {
+            commandCode = TPM_CC_Hash;
+            put16(payloadSize);
+            for (uint16_t i = 0; i < payloadSize; i++)
+            {
+                command[size++] = (uint8_t)(i * 7 + index + 1);
+            }
+            put16(TPM_ALG_SHA256);
+            put32(TPM_RH_NULL);
+        }
+        else
+        {
+            put32(TPM_CAP_COMMANDS);
+            put32(TPM_CC_FIRST);
+            put32(MAX_CAP_CC);
+        }
+
+        TPM2_COMMAND_HEADER header;
+        header.tag = _byteswap_ushort(TPM_ST_NO_SESSIONS);
+        header.paramSize = _byteswap_ulong(size);
+        header.commandCode = _byteswap_ulong(commandCode);
+        memcpy(command, &header, sizeof(header));
+        return size;
+    }
+
+    //
+    // Sends every data check and keeps the responses, after checking their headers.
+    //
+    // Parameters:
+    // - tpm: Engine to drive.
+    // - label: Printed in errors.
+    // - command: Buffer of TRANSPORT_STAGING_BUFFER_SIZE bytes.
+    // - responses: Receives one response per data check, TRANSPORT_STAGING_BUFFER_SIZE bytes apart.
+    // - responseSizes: Receives the size of every response.
+    //
+    // Returns:
+    // - STATUS_SUCCESS: Every response is well-formed and successful.
+    // - STATUS_UNSUCCESSFUL: A response header is malformed or carries an error.
+    // - Any status returned by SubmitVirtualizedCommand.
+    //
+    template<typename Transport>
+    NTSTATUS RunDataChecks(
+        _In_ TpmEngine<Transport>* tpm,
+        _In_ const char* label,
+        _Out_writes_bytes_(TRANSPORT_STAGING_BUFFER_SIZE) uint8_t* command,
+        _Out_writes_bytes_(ARRAYSIZE(DataChecks) * TRANSPORT_STAGING_BUFFER_SIZE) uint8_t* responses,
+        _Out_writes_(ARRAYSIZE(DataChecks)) uint32_t* responseSizes
+    )
+    {
+        for (uint32_t i = 0; i < ARRAYSIZE(DataChecks); i++)
+        {
+            uint8_t* response = responses + i * TRANSPORT_STAGING_BUFFER_SIZE;
+            uint32_t commandSize = BuildDataCheck(i, command);
+            responseSizes[i] = TRANSPORT_STAGING_BUFFER_SIZE;
+            NTSTATUS status = tpm->SubmitVirtualizedCommand(commandSize, command, &responseSizes[i], response);
+            if (NT_ERROR(status))
+            {
+                DbgError("Benchmark %s data check %u failed with 0x%08x.\n", label, i, status);
+                return status;
+            }
+
+            TPM2_RESPONSE_HEADER header = { 0 };
+            if (responseSizes[i] >= sizeof(header))
+            {
+                memcpy(&header, response, sizeof(header));
+            }
+            if (responseSizes[i] < sizeof(header) ||
+                _byteswap_ushort(header.tag) != TPM_ST_NO_SESSIONS ||
+                _byteswap_ulong(header.paramSize) != responseSizes[i] ||
+                _byteswap_ulong(header.responseCode) != TPM_RC_SUCCESS)
+            {
+                DbgError("Benchmark %s data check %u: malformed or failed response, %u bytes, responseCode 0x%08x.\n",
+                    label, i, responseSizes[i], _byteswap_ulong(header.responseCode));
+                return STATUS_UNSUCCESSFUL;
+            }
+        }
+        return STATUS_SUCCESS;
+    }
+
+    //
+    // Only CRB has a data buffer whose mapping can be compared.
+    //
+    template<typename Transport>
+    NTSTATUS CompareWriteCombining(
+        _In_ TpmEngine<Transport>* tpm,
+        _Inout_updates_bytes_(TRANSPORT_STAGING_BUFFER_SIZE) uint8_t* command,
+        _Out_writes_bytes_(TRANSPORT_STAGING_BUFFER_SIZE) uint8_t* response,
+        _Out_ TPM_COMMAND_STATISTICS* statistics
+    )
+    {
+        UNREFERENCED_PARAMETER(tpm);
+        UNREFERENCED_PARAMETER(command);
+        UNREFERENCED_PARAMETER(response);
+        UNREFERENCED_PARAMETER(statistics);
+        return STATUS_SUCCESS;
+    }
+
+    //
+    // Runs every size and the data checks with the CRB data buffer mapped uncached, then
+    // write-combined, prints the speed-up per size, and restores the mapping the transport had.
+    //
+    // Returns:
+    // - STATUS_SUCCESS: Both mappings gave the same responses, or the device is not listed.
+    // - STATUS_UNSUCCESSFUL: A data check response was malformed, or differed when write-combined.
+    // - STATUS_INSUFFICIENT_RESOURCES: The data buffer could not be mapped, or the responses kept.
+    // - Any status returned by RunSizes or RunDataChecks.
+    //
+    inline NTSTATUS CompareWriteCombining(
+        _In_ TpmEngine<CrbTransport>* tpm,
+        _Inout_updates_bytes_(TRANSPORT_STAGING_BUFFER_SIZE) uint8_t* command,
+        _Out_writes_bytes_(TRANSPORT_STAGING_BUFFER_SIZE) uint8_t* response,
+        _Out_ TPM_COMMAND_STATISTICS* statistics
+    )
+    {
+        CrbTransport* transport = tpm->GetTransport();
+        if (!transport->IsWriteCombinedAllowed())
+        {
+            Dbg("Benchmark CRB: device not in CrbWriteCombinedDevices, write-combining not compared.\n");
+            return STATUS_SUCCESS;
+        }
+
+        TPM_BENCHMARK_RESULT uncached[ARRAYSIZE(CommandSizes)];
+        TPM_BENCHMARK_RESULT combined[ARRAYSIZE(CommandSizes)];
+        uint32_t uncachedSizes[ARRAYSIZE(DataChecks)];
+        uint32_t combinedSizes[ARRAYSIZE(DataChecks)];
+        uint8_t* uncachedResponses = new uint8_t[ARRAYSIZE(DataChecks) * TRANSPORT_STAGING_BUFFER_SIZE];
+        uint8_t* combinedResponses = new uint8_t[ARRAYSIZE(DataChecks) * TRANSPORT_STAGING_BUFFER_SIZE];
+        bool wasWriteCombined = transport->IsWriteCombined();
+        bool compared = true;
+
+        NTSTATUS status = (uncachedResponses && combinedResponses) ? STATUS_SUCCESS : STATUS_INSUFFICIENT_RESOURCES;
+        if (NT_SUCCESS(status))
+        {
+            status = transport->MapDataBuffer(false) ? STATUS_SUCCESS : STATUS_INSUFFICIENT_RESOURCES;
+        }
+        if (NT_SUCCESS(status))
+        {
+            status = RunSizes(tpm, "CRB uncached", command, response, statistics, uncached);
+        }
+        if (NT_SUCCESS(status))
+        {
+            status = RunDataChecks(tpm, "CRB uncached", command, uncachedResponses, uncachedSizes);
+        }
+        if (NT_SUCCESS(status))
+        {
+            status = transport->MapDataBuffer(true) ? STATUS_SUCCESS : STATUS_INSUFFICIENT_RESOURCES;
+        }
+        if (NT_SUCCESS(status) && !transport->IsWriteCombined())
+        {
+            Dbg("Benchmark CRB: data buffer could not be mapped write-combined, not compared.\n");
+            compared = false;
+        }
+        if (NT_SUCCESS(status) && compared)
+        {
+            status = RunSizes(tpm, "CRB write-combined", command, response, statistics, combined);
+        }
+        if (NT_SUCCESS(status) && compared)
+        {
+            status = RunDataChecks(tpm, "CRB write-combined", command, combinedResponses, combinedSizes);
+        }
+        if (!transport->MapDataBuffer(wasWriteCombined) && NT_SUCCESS(status))
+        {
+            status = STATUS_INSUFFICIENT_RESOURCES;
+        }
+        if (NT_ERROR(status) || !compared)
+        {
+            delete[] combinedResponses;
+            delete[] uncachedResponses;
+            return status;
+        }
+
+        for (uint32_t i = 0; i < ARRAYSIZE(DataChecks); i++)
+        {
+            const uint8_t* uncachedResponse = uncachedResponses + i * TRANSPORT_STAGING_BUFFER_SIZE;
+            const uint8_t* combinedResponse = combinedResponses + i * TRANSPORT_STAGING_BUFFER_SIZE;
+            if (combinedSizes[i] != uncachedSizes[i] || memcmp(combinedResponse, uncachedResponse, uncachedSizes[i]) != 0)
+            {
+                DbgError("Benchmark CRB data check %u: %u byte response write-combined differs from the %u byte one uncached.\n",
+                    i, combinedSizes[i], uncachedSizes[i]);
+                status = STATUS_UNSUCCESSFUL;
+            }
+        }
+        delete[] combinedResponses;
+        delete[] uncachedResponses;
+
+        for (uint32_t i = 0; i < ARRAYSIZE(CommandSizes); i++)
+        {
+            Dbg("Benchmark CRB %4u bytes: write-combined %llu commands/s, p50 %llu us; uncached %llu commands/s, p50 %llu us.\n",
+                CommandSizes[i], combined[i].CommandsPerSecond, combined[i].P50Microseconds,
+                uncached[i].CommandsPerSecond, uncached[i].P50Microseconds);
+            if (combined[i].ResponseSize != uncached[i].ResponseSize)
+            {
+                DbgError("Benchmark CRB %u bytes: %u byte response write-combined, %u uncached.\n",
+                    CommandSizes[i], combined[i].ResponseSize, uncached[i].ResponseSize);
+                status = STATUS_UNSUCCESSFUL;
+            }
+        }
+        return status;
+    }
+
+    //
+    // Checks a result against the ceilings of its transport.
+    //
+    // Returns:
+    // - STATUS_SUCCESS: The result stays within the ceilings.
+    // - STATUS_UNSUCCESSFUL: The result exceeds a ceiling.
+    // - STATUS_NOT_FOUND: No ceilings were measured for the transport; nothing was checked.
+    //
+    inline NTSTATUS CheckBaseline(
+        _In_ const char* transport,
+        _In_ const TPM_BENCHMARK_RESULT* result
+    )
+    {
+        for (const TPM_BENCHMARK_BASELINE& baseline : Baselines)
+        {
+            if (strcmp(baseline.Transport, transport) != 0 || baseline.Platform == nullptr)
+            {
+                continue;
+            }
+
+            uint64_t p99Ceiling = baseline.P99Microseconds + ((uint64_t)result->CommandSize * baseline.P99MicrosecondsPerKilobyte) / 1024;
+            uint64_t mmioCeiling = baseline.MmioAccesses + (uint64_t)result->CommandSize * baseline.MmioAccessesPerByte;
+            bool passed = true;
+            if (result->P99Microseconds > p99Ceiling)
+            {
+                DbgError("Benchmark regression: %s %u bytes p99 %llu us, ceiling %llu us.\n",
+                    transport, result->CommandSize, result->P99Microseconds, p99Ceiling);
+                passed = false;
+            }
+            if (result->MmioAccesses > mmioCeiling)
+            {
+                DbgError("Benchmark regression: %s %u bytes %llu MMIO accesses per command, ceiling %llu.\n",
+                    transport, result->CommandSize, result->MmioAccesses, mmioCeiling);
+                passed = false;
+            }
+            return passed ? STATUS_SUCCESS : STATUS_UNSUCCESSFUL;
+        }
+        return STATUS_NOT_FOUND;
+    }
+
+    //
+    // Times one TPM2_GetTestResult through each fault scenario of the transport. Scenarios bounded
+    // above FAULT_SCENARIO_MAX_MS are listed but not run.
+    //
+    // Parameters:
+    // - tpm: Engine to drive.
+    // - command: Buffer of at least a command header.
+    // - response: Buffer of TRANSPORT_STAGING_BUFFER_SIZE bytes.
+    //
+    // Returns:
+    // - STATUS_SUCCESS: Every scenario returned within twice its bound.
+    // - STATUS_UNSUCCESSFUL: At least one did not.
+    // - STATUS_NOT_FOUND: The TPM interface base address is unknown.
+    //
+    template<typename Transport>
+    NTSTATUS RunFaultScenarios(
+        _In_ TpmEngine<Transport>* tpm,
+        _Inout_updates_bytes_(sizeof(TPM2_COMMAND_HEADER)) uint8_t* command,
+        _Out_writes_bytes_(TRANSPORT_STAGING_BUFFER_SIZE) uint8_t* response
+    )
+    {
+        // The simulator has no registers to fault.
+        if (strcmp(Transport::Name, "SIM") == 0)
+        {
+            return STATUS_SUCCESS;
+        }
+
+        uintptr_t tpmBaseAddress = 0;
+        if (!acpi::GetTpm2PhysicalAddress(&tpmBaseAddress))
+        {
+            return STATUS_NOT_FOUND;
+        }
+
+        NTSTATUS status = STATUS_SUCCESS;
+        for (const TPM_FAULT_SCENARIO& scenario : FaultScenarios)
+        {
+            bool crb = (strcmp(Transport::Name, "CRB") == 0);
+            if (crb != (strcmp(scenario.Transport, "CRB") == 0))
+            {
+                continue;
+            }
+            if (scenario.BoundMilliseconds > FAULT_SCENARIO_MAX_MS)
+            {
+                Dbg("Fault %s %s: not run, bound %u ms.\n", Transport::Name, scenario.Name, scenario.BoundMilliseconds);
+                continue;
+            }
+
+            TPM2_COMMAND_HEADER header;
+            header.tag = _byteswap_ushort(TPM_ST_NO_SESSIONS);
+            header.paramSize = _byteswap_ulong(sizeof(header));
+            header.commandCode = _byteswap_ulong(TPM_CC_GetTestResult);
+            memcpy(command, &header, sizeof(header));
+
+            fault::Arm(tpmBaseAddress, scenario.Faults, scenario.FaultCount);
+            uint32_t responseSize = TRANSPORT_STAGING_BUFFER_SIZE;
+            uint64_t start = trace::Timestamp();
+            NTSTATUS commandStatus = tpm->SubmitVirtualizedCommand(sizeof(header), command, &responseSize, response);
+            uint64_t elapsed = trace::Timestamp() - start;
+            fault::Disarm();
+
+            uint64_t frequency = trace::Frequency();
+            uint64_t microseconds = frequency ? (elapsed * 1000000) / frequency : 0;
+            Dbg("Fault %s %s: 0x%08x after %llu us, bound %u ms.\n",
+                Transport::Name, scenario.Name, commandStatus, microseconds, scenario.BoundMilliseconds);
+            if (microseconds > (uint64_t)scenario.BoundMilliseconds * 2000)
+            {
+                DbgError("Fault %s %s: recovery took %llu us, more than twice its bound.\n",
+                    Transport::Name, scenario.Name, microseconds);
+                status = STATUS_UNSUCCESSFUL;
+            }
+        }
+        return status;
+    }
+
+    //
+    // Runs the parser corpus, the benchmark over every command size, printing one line per size,
+    // the CRB write-combining comparison and the fault scenarios. Must run before the engine is handed to the command queue; the command statistics are
+    // reset afterwards.
+    //
+    // Parameters:
+    // - tpm: Engine to drive.
+    //
+    // Returns:
+    // - STATUS_SUCCESS: Every corpus sample decoded as expected and every size ran within the
+    //   ceilings of its transport, if it has any.
+    // - STATUS_UNSUCCESSFUL: A corpus sample was misdecoded, a size regressed, write-combining changed
+    //   a response or a fault scenario overran its bound.
+    // - STATUS_INSUFFICIENT_RESOURCES: The buffers could not be allocated.
+    // - Any status returned by TpmParserCorpus::Run, RunSizes, CompareWriteCombining or RunFaultScenarios.
+    //
+    template<typename Transport>
+    NTSTATUS Run(_In_ TpmEngine<Transport>* tpm)
+    {
+        NTSTATUS corpusStatus = TpmParserCorpus::Run(tpm);
+        if (NT_ERROR(corpusStatus))
+        {
+            return corpusStatus;
+        }
+
+        uint8_t* command = new uint8_t[TRANSPORT_STAGING_BUFFER_SIZE];
+        uint8_t* response = new uint8_t[TRANSPORT_STAGING_BUFFER_SIZE];
+        TPM_COMMAND_STATISTICS* statistics = new TPM_COMMAND_STATISTICS;
+        NTSTATUS status = STATUS_INSUFFICIENT_RESOURCES;
+
+        if (command && response && statistics)
+        {
+            RtlZeroMemory(command, TRANSPORT_STAGING_BUFFER_SIZE);
+
+            TPM_BENCHMARK_RESULT results[ARRAYSIZE(CommandSizes)];
+            status = RunSizes(tpm, Transport::Name, command, response, statistics, results);
+            for (uint32_t i = 0; NT_SUCCESS(status) && i < ARRAYSIZE(CommandSizes); i++)
+            {
+                NTSTATUS baselineStatus = CheckBaseline(Transport::Name, &results[i]);
+                if (baselineStatus == STATUS_NOT_FOUND)
+                {
+                    Dbg("Benchmark %s: no baseline, results not checked.\n", Transport::Name);
+                    break;
+                }
+                if (NT_ERROR(baselineStatus))
+                {
+                    status = STATUS_UNSUCCESSFUL;
+                }
+            }
+
+            if (NT_SUCCESS(status))
+            {
+                status = CompareWriteCombining(tpm, command, response, statistics);
+            }
+
+#if MMIO_FAULT_INJECTION
+            if (NT_SUCCESS(status))
+            {
+                status = RunFaultScenarios(tpm, command, response);
+            }
+#endif
+        }
+
+        tpm->ResetCommandStatistics();
+        delete statistics;
+        delete[] response;
+        delete[] command;
+        return status;
+    }
+}
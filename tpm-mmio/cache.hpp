@@ -0,0 +1,521 @@
+#pragma once
+
+//
+// Counters exposed by TpmResponseCache.
+//
+struct TPM_RESPONSE_CACHE_STATISTICS
+{
+    uint64_t Hits;
+    uint64_t Misses;
+    uint64_t Inserts;
+    uint64_t Evictions;
+    uint64_t Invalidations;
+};
+
+//
+// Responses to side-effect-free commands, replayed without going to the TPM. Every entry owns a
+// TRANSPORT_STAGING_BUFFER_SIZE response buffer allocated by Init, so inserting and evicting never
+// touch the pool.
+//
+class TpmResponseCache
+{
+private:
+
+    struct CACHE_ENTRY
+    {
+        uint32_t hash;
+        uint32_t commandSize;
+        uint8_t  command[RESPONSE_CACHE_MAX_COMMAND_SIZE];
+        uint32_t responseSize;      // 0 if the entry is empty
+        uint8_t* response;
+        uint64_t lastUse;
+    };
+
+    CACHE_ENTRY entries[RESPONSE_CACHE_ENTRIES] = { };
+
+    //
+    // Response buffers of every entry, in one allocation.
+    //
+    uint8_t* responses = nullptr;
+
+    //
+    // Monotonic use counter, used to find the least recently used entry.
+    //
+    uint64_t useCounter = 0;
+
+    TPM_RESPONSE_CACHE_STATISTICS statistics = { };
+
+    //
+    // Reads the command code out of a marshalled command.
+    //
+    // Parameters:
+    // - command: Pointer to the marshalled command.
+    //
+    // Returns:
+    // - TPM_CC: The command code in host byte order.
+    //
+    static TPM_CC GetCommandCode(_In_ const uint8_t* command)
+    {
+        uint32_t data32 = 0;
+        memcpy(&data32, command + FIELD_OFFSET(TPM2_COMMAND_HEADER, commandCode), sizeof(uint32_t));
+        return _byteswap_ulong(data32);
+    }
+
+    //
+    // FNV-1a hash of the marshalled command, used to skip full compares on mismatching entries.
+    //
+    static uint32_t HashCommand(
+        _In_reads_bytes_(size) const uint8_t* command,
+        _In_ uint32_t size
+    )
+    {
+        uint32_t hash = 0x811C9DC5;
+        for (uint32_t i = 0; i < size; i++)
+        {
+            hash ^= command[i];
+            hash *= 0x01000193;
+        }
+        return hash;
+    }
+
+    //
+    // Finds the entry holding the response to a marshalled command.
+    //
+    // Returns:
+    // - CACHE_ENTRY*: The matching entry, or nullptr if the command is not cached.
+    //
+    CACHE_ENTRY* Find(
+        _In_reads_bytes_(size) const uint8_t* command,
+        _In_ uint32_t size,
+        _In_ uint32_t hash
+    )
+    {
+        for (uint32_t i = 0; i < RESPONSE_CACHE_ENTRIES; i++)
+        {
+            CACHE_ENTRY* entry = &this->entries[i];
+            if (entry->responseSize != 0 && entry->hash == hash && entry->commandSize == size &&
+                memcmp(entry->command, command, size) == 0)
+            {
+                return entry;
+            }
+        }
+        return nullptr;
+    }
+
+    //
+    // Checks that a GetCapability(TPM_CAP_TPM_PROPERTIES) response only carries PT_FIXED properties.
+    // The TPM may return properties past the ones asked for, so the request alone does not tell.
+    //
+    static bool HasOnlyFixedProperties(
+        _In_reads_bytes_(responseSize) const uint8_t* response,
+        _In_ uint32_t responseSize
+    )
+    {
+        // TPMI_YES_NO moreData, TPM_CAP capability, uint32_t count
+        constexpr uint32_t propertiesOffset = sizeof(TPM2_RESPONSE_HEADER) + sizeof(uint8_t) + sizeof(TPM_CAP) + sizeof(uint32_t);
+        if (responseSize < propertiesOffset)
+        {
+            return false;
+        }
+
+        uint32_t capability = 0;
+        uint32_t count = 0;
+        memcpy(&capability, response + sizeof(TPM2_RESPONSE_HEADER) + sizeof(uint8_t), sizeof(capability));
+        memcpy(&count, response + propertiesOffset - sizeof(uint32_t), sizeof(count));
+        count = _byteswap_ulong(count);
+        if (_byteswap_ulong(capability) != TPM_CAP_TPM_PROPERTIES || count > MAX_TPM_PROPERTIES ||
+            responseSize != propertiesOffset + count * sizeof(TPMS_TAGGED_PROPERTY))
+        {
+            return false;
+        }
+
+        for (uint32_t i = 0; i < count; i++)
+        {
+            uint32_t property = 0;
+            memcpy(&property, response + propertiesOffset + i * sizeof(TPMS_TAGGED_PROPERTY), sizeof(property));
+            property = _byteswap_ulong(property);
+            if (property < PT_FIXED || property >= PT_VAR)
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    //
+    // Marks an entry empty. Its response buffer stays allocated.
+    //
+    void Release(_Inout_ CACHE_ENTRY* entry)
+    {
+        entry->responseSize = 0;
+        entry->commandSize = 0;
+    }
+
+public:
+
+    ~TpmResponseCache()
+    {
+        pool::Free(this->responses);
+    }
+
+    //
+    // Allocates the response buffers of every entry. Until it succeeds, nothing is cached.
+    //
+    // Returns:
+    // - true: The cache is ready.
+    // - false: The response buffers could not be allocated.
+    //
+    bool Init()
+    {
+        if (this->responses)
+        {
+            return true;
+        }
+
+        this->responses = (uint8_t*)pool::Allocate(RESPONSE_CACHE_ENTRIES * TRANSPORT_STAGING_BUFFER_SIZE);
+        if (!this->responses)
+        {
+            DbgError("TpmResponseCache::Init - failed to allocate the response buffers.\n");
+            return false;
+        }
+        for (uint32_t i = 0; i < RESPONSE_CACHE_ENTRIES; i++)
+        {
+            this->entries[i].response = this->responses + i * TRANSPORT_STAGING_BUFFER_SIZE;
+        }
+        return true;
+    }
+
+    //
+    // Checks whether a command is free of side effects and its response can be replayed.
+    // Only ReadPublic, NV_ReadPublic and GetCapability for fixed TPM properties qualify.
+    //
+    // Parameters:
+    // - command: Pointer to the marshalled command.
+    // - size: Size of the marshalled command.
+    //
+    // Returns:
+    // - true: The response may be cached.
+    // - false: The command must always go to the TPM.
+    //
+    bool IsCacheable(
+        _In_reads_bytes_(size) const uint8_t* command,
+        _In_ uint32_t size
+    )
+    {
+        if (size < sizeof(TPM2_COMMAND_HEADER) || size > RESPONSE_CACHE_MAX_COMMAND_SIZE)
+        {
+            return false;
+        }
+
+        switch (GetCommandCode(command))
+        {
+        case TPM_CC_ReadPublic:
+            return size == sizeof(TPM2_READ_PUBLIC_COMMAND);
+        case TPM_CC_NV_ReadPublic:
+            return size == sizeof(TPM2_NV_READPUBLIC_COMMAND);
+        case TPM_CC_GetCapability:
+        {
+            if (size != sizeof(TPM2_GET_CAPABILITY_COMMAND))
+            {
+                return false;
+            }
+            TPM2_GET_CAPABILITY_COMMAND getCapability;
+            memcpy(&getCapability, command, sizeof(getCapability));
+            uint32_t property = _byteswap_ulong(getCapability.Property);
+            uint32_t propertyCount = _byteswap_ulong(getCapability.PropertyCount);
+            //
+            // PT_FIXED properties never change while the TPM is powered; PT_VAR ones do.
+            //
+            return _byteswap_ulong(getCapability.Capability) == TPM_CAP_TPM_PROPERTIES &&
+                property >= PT_FIXED && property < PT_VAR && propertyCount <= PT_VAR - property;
+        }
+        default:
+            return false;
+        }
+    }
+
+    //
+    // Checks whether a command may change state that cached responses depend on.
+    // Anything not known to be read-only is treated as mutating.
+    //
+    // Parameters:
+    // - command: Pointer to the marshalled command.
+    // - size: Size of the marshalled command.
+    //
+    // Returns:
+    // - true: Cached responses must be dropped before this command runs.
+    // - false: The command is read-only.
+    //
+    bool IsInvalidating(
+        _In_reads_bytes_(size) const uint8_t* command,
+        _In_ uint32_t size
+    )
+    {
+        if (size < sizeof(TPM2_COMMAND_HEADER))
+        {
+            return true;
+        }
+        return IsInvalidatingCommandCode(GetCommandCode(command));
+    }
+
+    //
+    // Same as IsInvalidating, for a command that is only known by its command code.
+    //
+    // Parameters:
+    // - commandCode: Command code of the command, in host byte order.
+    //
+    // Returns:
+    // - true: Cached responses must be dropped before this command runs.
+    // - false: The command is read-only.
+    //
+    static bool IsInvalidatingCommandCode(_In_ TPM_CC commandCode)
+    {
+        switch (commandCode)
+        {
+        case TPM_CC_ReadPublic:
+        case TPM_CC_NV_ReadPublic:
+        case TPM_CC_GetCapability:
+        case TPM_CC_NV_Read:
+        case TPM_CC_PCR_Read:
+        case TPM_CC_GetRandom:
+        case TPM_CC_ReadClock:
+        case TPM_CC_GetTestResult:
+            return false;
+        default:
+            return true;
+        }
+    }
+
+    //
+    // Looks up a cached response for a marshalled command.
+    //
+    // Parameters:
+    // - command: Pointer to the marshalled command.
+    // - size: Size of the marshalled command.
+    // - response: Pointer to the buffer that receives the cached response.
+    // - responseSize: Pointer to a variable that on input specifies the size of the response buffer,
+    //                 and on output reflects the size of the cached response.
+    //
+    // Returns:
+    // - STATUS_SUCCESS: Cache hit, the response was copied.
+    // - STATUS_NOT_FOUND: Cache miss.
+    // - STATUS_BUFFER_TOO_SMALL: Cache hit, but the response buffer is too small.
+    //
+    NTSTATUS Lookup(
+        _In_reads_bytes_(size) const uint8_t* command,
+        _In_ uint32_t size,
+        _Out_writes_bytes_(*responseSize) uint8_t* response,
+        _Inout_ uint32_t* responseSize
+    )
+    {
+        CACHE_ENTRY* entry = this->Find(command, size, HashCommand(command, size));
+        if (entry == nullptr)
+        {
+            this->statistics.Misses++;
+            return STATUS_NOT_FOUND;
+        }
+
+        if (*responseSize < entry->responseSize)
+        {
+            this->statistics.Misses++;
+            return STATUS_BUFFER_TOO_SMALL;
+        }
+
+        memcpy(response, entry->response, entry->responseSize);
+        *responseSize = entry->responseSize;
+        entry->lastUse = ++this->useCounter;
+        this->statistics.Hits++;
+        return STATUS_SUCCESS;
+    }
+
+    //
+    // Stores the response to a cacheable command, evicting the least recently used entry if the cache is full.
+    // Only TPM_RC_SUCCESS responses should be inserted. GetCapability responses carrying any property
+    // outside PT_FIXED are not stored.
+    //
+    // Parameters:
+    // - command: Pointer to the marshalled command.
+    // - size: Size of the marshalled command.
+    // - response: Pointer to the response.
+    // - responseSize: Size of the response.
+    //
+    void Insert(
+        _In_reads_bytes_(size) const uint8_t* command,
+        _In_ uint32_t size,
+        _In_reads_bytes_(responseSize) const uint8_t* response,
+        _In_ uint32_t responseSize
+    )
+    {
+        if (!this->responses || size < sizeof(TPM2_COMMAND_HEADER) || size > RESPONSE_CACHE_MAX_COMMAND_SIZE ||
+            responseSize == 0 || responseSize > TRANSPORT_STAGING_BUFFER_SIZE)
+        {
+            return;
+        }
+        if (GetCommandCode(command) == TPM_CC_GetCapability && !HasOnlyFixedProperties(response, responseSize))
+        {
+            return;
+        }
+
+        uint32_t hash = HashCommand(command, size);
+        CACHE_ENTRY* entry = this->Find(command, size, hash);
+        if (entry == nullptr)
+        {
+            entry = &this->entries[0];
+            for (uint32_t i = 0; i < RESPONSE_CACHE_ENTRIES; i++)
+            {
+                if (this->entries[i].responseSize == 0)
+                {
+                    entry = &this->entries[i];
+                    break;
+                }
+                if (this->entries[i].lastUse < entry->lastUse)
+                {
+                    entry = &this->entries[i];
+                }
+            }
+        }
+
+        if (entry->responseSize != 0)
+        {
+            this->statistics.Evictions++;
+            this->Release(entry);
+        }
+
+        memcpy(entry->response, response, responseSize);
+        entry->responseSize = responseSize;
+        memcpy(entry->command, command, size);
+        entry->commandSize = size;
+        entry->hash = hash;
+        entry->lastUse = ++this->useCounter;
+        this->statistics.Inserts++;
+    }
+
+    //
+    // Drops every cached response.
+    //
+    void Invalidate()
+    {
+        bool dropped = false;
+        for (uint32_t i = 0; i < RESPONSE_CACHE_ENTRIES; i++)
+        {
+            if (this->entries[i].responseSize != 0)
+            {
+                this->Release(&this->entries[i]);
+                dropped = true;
+            }
+        }
+        if (dropped)
+        {
+            this->statistics.Invalidations++;
+        }
+    }
+
+    //
+    // Copies the hit/miss counters.
+    //
+    void GetStatistics(_Out_ TPM_RESPONSE_CACHE_STATISTICS* statisticsOut)
+    {
+        *statisticsOut = this->statistics;
+    }
+
+    //
+    // Zeroes the hit/miss counters.
+    //
+    void ResetStatistics()
+    {
+        RtlZeroMemory(&this->statistics, sizeof(this->statistics));
+    }
+
+    //
+    // Checks on a scratch cache that GetCapability is only answered from the cache for PT_FIXED
+    // properties: requests for PT_VAR properties are never cacheable, and a response that carries
+    // a PT_VAR property past the ones asked for is not stored.
+    //
+    // Returns:
+    // - true: The cache behaved as expected.
+    // - false: It did not, or the scratch cache could not be allocated.
+    //
+    static bool SelfCheck()
+    {
+        TpmResponseCache* cache = new TpmResponseCache();
+        if (!cache || !cache->Init())
+        {
+            delete cache;
+            DbgError("TpmResponseCache::SelfCheck - failed to allocate the cache.\n");
+            return false;
+        }
+
+        bool passed = true;
+        TPM2_GET_CAPABILITY_COMMAND command = templates::GetCapability;
+        command.Capability = _byteswap_ulong(TPM_CAP_TPM_PROPERTIES);
+        const TPM_PT variableProperties[] = { TPM_PT_PERMANENT, TPM_PT_STARTUP_CLEAR, TPM_PT_HR_LOADED, TPM_PT_LOCKOUT_COUNTER };
+        for (TPM_PT property : variableProperties)
+        {
+            command.Property = _byteswap_ulong(property);
+            command.PropertyCount = _byteswap_ulong(1);
+            if (cache->IsCacheable((const uint8_t*)&command, sizeof(command)))
+            {
+                DbgError("TpmResponseCache::SelfCheck - GetCapability(0x%x) is cacheable.\n", property);
+                passed = false;
+            }
+        }
+
+        // TPMI_YES_NO moreData, TPM_CAP capability, uint32_t count, two TPMS_TAGGED_PROPERTY
+        uint8_t response[sizeof(TPM2_RESPONSE_HEADER) + sizeof(uint8_t) + sizeof(TPM_CAP) + sizeof(uint32_t) + 2 * sizeof(TPMS_TAGGED_PROPERTY)];
+        uint8_t lookup[sizeof(response)];
+        const TPM_PT overreach[] = { PT_VAR - 1, TPM_PT_PERMANENT };
+        const TPM_PT fixed[] = { PT_VAR - 2, PT_VAR - 1 };
+        struct
+        {
+            const TPM_PT* Properties;
+            bool Cached;
+        } responses[] = { { overreach, false }, { fixed, true } };
+
+        command.Property = _byteswap_ulong(PT_VAR - 2);
+        command.PropertyCount = _byteswap_ulong(2);
+        for (const auto& expected : responses)
+        {
+            if (!cache->IsCacheable((const uint8_t*)&command, sizeof(command)))
+            {
+                DbgError("TpmResponseCache::SelfCheck - GetCapability(0x%x) is not cacheable.\n", PT_VAR - 2);
+                passed = false;
+                break;
+            }
+
+            uint8_t* cursor = response;
+            auto put32 = [&cursor](uint32_t value) {
+                value = _byteswap_ulong(value);
+                memcpy(cursor, &value, sizeof(value));
+                cursor += sizeof(value);
+            };
+            uint16_t tag = _byteswap_ushort(TPM_ST_NO_SESSIONS);
+            memcpy(cursor, &tag, sizeof(tag));
+            cursor += sizeof(tag);
+            put32(sizeof(response));
+            put32(TPM_RC_SUCCESS);
+            *cursor++ = 0;      // moreData
+            put32(TPM_CAP_TPM_PROPERTIES);
+            put32(2);
+            for (uint32_t i = 0; i < 2; i++)
+            {
+                put32(expected.Properties[i]);
+                put32(i);
+            }
+
+            cache->Invalidate();
+            cache->Insert((const uint8_t*)&command, sizeof(command), response, sizeof(response));
+
+            uint32_t lookupSize = sizeof(lookup);
+            bool cached = NT_SUCCESS(cache->Lookup((const uint8_t*)&command, sizeof(command), lookup, &lookupSize));
+            if (cached != expected.Cached)
+            {
+                DbgError("TpmResponseCache::SelfCheck - response with property 0x%x %s.\n",
+                    expected.Properties[1], cached ? "was cached" : "was not cached");
+                passed = false;
+            }
+        }
+
+        delete cache;
+        return passed;
+    }
+};
@@ -0,0 +1,823 @@
+#pragma once
+
+//
+// Corpus of marshalled responses for the response decoders: ReadPublic for every object type and
+// key size the driver meets, NV_Read, GetCapability for properties, handles and PCR banks,
+// PCR_Read, and malformed variants of each. Every sample carries the
+// status and fields its decoders must produce, so the corpus checks the decoders as well as
+// feeding the parser benchmark. Samples are built into a caller buffer on demand, so the same
+// bytes can seed a fuzzer.
+//
+enum TPM_CORPUS_MUTATION
+{
+    TpmCorpusIntact,
+    TpmCorpusTruncated,             // Last byte dropped
+    TpmCorpusTrailingByte,          // One byte past the last field
+    TpmCorpusOversizedUnique,       // unique.size and unique one past the capacity of a TPMU_PUBLIC_ID member
+    TpmCorpusUnknownType,           // Object type no decoder knows
+    TpmCorpusSizeMismatch,          // NV_Read data size other than the one requested
+    TpmCorpusCountOverflow,         // List count and entries one past the capacity of the TPML
+    TpmCorpusOversizedSelect,       // sizeofSelect one past PCR_SELECT_MAX
+    TpmCorpusOversizedDigest        // Digest one byte larger than a TPMU_HA
+};
+
+struct TPM_CORPUS_PUBLIC_SAMPLE
+{
+    const char* Name;
+    TPMI_ALG_PUBLIC Type;
+    uint8_t ParametersSize;
+    uint8_t Parameters[16];         // Marshalled TPMU_PUBLIC_PARMS
+    uint16_t UniqueSize;
+    uint16_t UniqueYSize;           // ECC only
+    uint16_t Scheme;                // Expected scheme, or symmetric algorithm for SYMCIPHER
+    uint16_t KeyBits;               // Expected RSA keyBits, ECC curveID or SYMCIPHER keyBits
+    uint32_t Exponent;              // Expected RSA exponent
+    TPM_CORPUS_MUTATION Mutation;
+    NTSTATUS CompactStatus;         // Expected from ParseReadPublicResponseCompact
+    NTSTATUS Status;                // Expected from ParseReadPublicResponse
+};
+
+struct TPM_CORPUS_NV_SAMPLE
+{
+    const char* Name;
+    uint16_t DataSize;
+    TPM_CORPUS_MUTATION Mutation;
+    NTSTATUS Status;                // Expected from ParseNvReadResponse
+};
+
+struct TPM_CORPUS_CAPABILITY_SAMPLE
+{
+    const char* Name;
+    TPM_CAP Capability;
+    uint32_t Count;                 // Properties, handles or PCR banks
+    TPM_CORPUS_MUTATION Mutation;
+    NTSTATUS Status;                // Expected from ParseGetCapabilityResponse
+};
+
+struct TPM_CORPUS_PCR_SAMPLE
+{
+    const char* Name;
+    uint32_t Banks;
+    uint32_t Digests;
+    uint16_t DigestSize;
+    TPM_CORPUS_MUTATION Mutation;
+    NTSTATUS Status;                // Expected from ParsePcrReadResponse
+};
+
+class TpmParserCorpus
+{
+private:
+
+    static constexpr TPM_CORPUS_PUBLIC_SAMPLE PublicSamples[] =
+    {
+        // sym AES-128-CFB, scheme NULL, 2048 bits, default exponent
+        { "RSA-2048 storage", TPM_ALG_RSA, 14, { 0x00, 0x06, 0x00, 0x80, 0x00, 0x43, 0x00, 0x10, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00 },
+            256, 0, TPM_ALG_NULL, 2048, 0, TpmCorpusIntact, STATUS_SUCCESS, STATUS_SUCCESS },
+        // sym NULL, RSASSA-SHA256, 2048 bits, exponent 65537
+        { "RSA-2048 signing e=65537", TPM_ALG_RSA, 12, { 0x00, 0x10, 0x00, 0x14, 0x00, 0x0B, 0x08, 0x00, 0x00, 0x01, 0x00, 0x01 },
+            256, 0, TPM_ALG_RSASSA, 2048, 65537, TpmCorpusIntact, STATUS_SUCCESS, STATUS_SUCCESS },
+        { "RSA-3072 storage", TPM_ALG_RSA, 14, { 0x00, 0x06, 0x00, 0x80, 0x00, 0x43, 0x00, 0x10, 0x0C, 0x00, 0x00, 0x00, 0x00, 0x00 },
+            384, 0, TPM_ALG_NULL, 3072, 0, TpmCorpusIntact, STATUS_SUCCESS, STATUS_BUFFER_TOO_SMALL },
+        // sym NULL, RSAES, 4096 bits, exponent 3
+        { "RSA-4096 decrypt e=3", TPM_ALG_RSA, 10, { 0x00, 0x10, 0x00, 0x15, 0x10, 0x00, 0x00, 0x00, 0x00, 0x03 },
+            512, 0, TPM_ALG_RSAES, 4096, 3, TpmCorpusIntact, STATUS_SUCCESS, STATUS_BUFFER_TOO_SMALL },
+        // sym AES-128-CFB, ECDSA-SHA256, P-256, KDF NULL
+        { "ECC P-256 signing", TPM_ALG_ECC, 14, { 0x00, 0x06, 0x00, 0x80, 0x00, 0x43, 0x00, 0x18, 0x00, 0x0B, 0x00, 0x03, 0x00, 0x10 },
+            32, 32, TPM_ALG_ECDSA, TPM_ECC_NIST_P256, 0, TpmCorpusIntact, STATUS_SUCCESS, STATUS_SUCCESS },
+        // sym NULL, ECDH, P-384, KDF NULL
+        { "ECC P-384 agreement", TPM_ALG_ECC, 8, { 0x00, 0x10, 0x00, 0x19, 0x00, 0x04, 0x00, 0x10 },
+            48, 48, TPM_ALG_ECDH, TPM_ECC_NIST_P384, 0, TpmCorpusIntact, STATUS_SUCCESS, STATUS_BUFFER_TOO_SMALL },
+        { "KEYEDHASH HMAC-SHA256", TPM_ALG_KEYEDHASH, 4, { 0x00, 0x05, 0x00, 0x0B },
+            32, 0, TPM_ALG_HMAC, 0, 0, TpmCorpusIntact, STATUS_SUCCESS, STATUS_SUCCESS },
+        { "KEYEDHASH sealed data", TPM_ALG_KEYEDHASH, 2, { 0x00, 0x10 },
+            32, 0, TPM_ALG_NULL, 0, 0, TpmCorpusIntact, STATUS_SUCCESS, STATUS_SUCCESS },
+        { "SYMCIPHER AES-128-CFB", TPM_ALG_SYMCIPHER, 6, { 0x00, 0x06, 0x00, 0x80, 0x00, 0x43 },
+            32, 0, TPM_ALG_AES, 128, 0, TpmCorpusIntact, STATUS_SUCCESS, STATUS_SUCCESS },
+
+        { "RSA-2048 truncated", TPM_ALG_RSA, 12, { 0x00, 0x10, 0x00, 0x14, 0x00, 0x0B, 0x08, 0x00, 0x00, 0x01, 0x00, 0x01 },
+            256, 0, 0, 0, 0, TpmCorpusTruncated, STATUS_DEVICE_BUSY, STATUS_DEVICE_BUSY },
+        { "ECC P-256 trailing byte", TPM_ALG_ECC, 14, { 0x00, 0x06, 0x00, 0x80, 0x00, 0x43, 0x00, 0x18, 0x00, 0x0B, 0x00, 0x03, 0x00, 0x10 },
+            32, 32, 0, 0, 0, TpmCorpusTrailingByte, STATUS_DEVICE_BUSY, STATUS_DEVICE_BUSY },
+        // Well-formed but for the unique size, so only the decoders' capacity checks reject them
+        { "KEYEDHASH oversized unique", TPM_ALG_KEYEDHASH, 4, { 0x00, 0x05, 0x00, 0x0B },
+            sizeof(TPMU_HA) + 1, 0, 0, 0, 0, TpmCorpusOversizedUnique, STATUS_DEVICE_BUSY, STATUS_DEVICE_BUSY },
+        { "SYMCIPHER oversized unique", TPM_ALG_SYMCIPHER, 6, { 0x00, 0x06, 0x00, 0x80, 0x00, 0x43 },
+            sizeof(TPMU_HA) + 1, 0, 0, 0, 0, TpmCorpusOversizedUnique, STATUS_DEVICE_BUSY, STATUS_DEVICE_BUSY },
+        { "Unknown type", TPM_ALG_RSA, 12, { 0x00, 0x10, 0x00, 0x14, 0x00, 0x0B, 0x08, 0x00, 0x00, 0x01, 0x00, 0x01 },
+            256, 0, 0, 0, 0, TpmCorpusUnknownType, STATUS_NOT_SUPPORTED, STATUS_NOT_SUPPORTED },
+    };
+
+    static constexpr TPM_CORPUS_NV_SAMPLE NvSamples[] =
+    {
+        { "NV_Read 32 bytes", 32, TpmCorpusIntact, STATUS_SUCCESS },
+        { "NV_Read 512 bytes", 512, TpmCorpusIntact, STATUS_SUCCESS },
+        { "NV_Read 1024 bytes", MAX_NV_INDEX_SIZE, TpmCorpusIntact, STATUS_SUCCESS },
+        { "NV_Read truncated", 512, TpmCorpusTruncated, STATUS_DEVICE_BUSY },
+        { "NV_Read size mismatch", 512, TpmCorpusSizeMismatch, STATUS_DEVICE_BUSY },
+    };
+
+    static constexpr TPM_CORPUS_CAPABILITY_SAMPLE CapabilitySamples[] =
+    {
+        { "GetCapability 1 property", TPM_CAP_TPM_PROPERTIES, 1, TpmCorpusIntact, STATUS_SUCCESS },
+        { "GetCapability 64 properties", TPM_CAP_TPM_PROPERTIES, 64, TpmCorpusIntact, STATUS_SUCCESS },
+        { "GetCapability 16 handles", TPM_CAP_HANDLES, 16, TpmCorpusIntact, STATUS_SUCCESS },
+        { "GetCapability 4 PCR banks", TPM_CAP_PCRS, 4, TpmCorpusIntact, STATUS_SUCCESS },
+        { "GetCapability no handles", TPM_CAP_HANDLES, 0, TpmCorpusIntact, STATUS_SUCCESS },
+
+        { "GetCapability properties truncated", TPM_CAP_TPM_PROPERTIES, 8, TpmCorpusTruncated, STATUS_DEVICE_BUSY },
+        { "GetCapability handles trailing byte", TPM_CAP_HANDLES, 8, TpmCorpusTrailingByte, STATUS_DEVICE_BUSY },
+        { "GetCapability PCR banks truncated", TPM_CAP_PCRS, 2, TpmCorpusTruncated, STATUS_DEVICE_BUSY },
+        { "GetCapability PCR banks trailing byte", TPM_CAP_PCRS, 2, TpmCorpusTrailingByte, STATUS_DEVICE_BUSY },
+        { "GetCapability PCR bank count overflow", TPM_CAP_PCRS, HASH_COUNT + 1, TpmCorpusCountOverflow, STATUS_DEVICE_BUSY },
+        { "GetCapability PCR select oversized", TPM_CAP_PCRS, 1, TpmCorpusOversizedSelect, STATUS_DEVICE_BUSY },
+        { "GetCapability algorithms", TPM_CAP_ALGS, 0, TpmCorpusIntact, STATUS_NOT_SUPPORTED },
+    };
+
+    static constexpr TPM_CORPUS_PCR_SAMPLE PcrSamples[] =
+    {
+        { "PCR_Read SHA-256 PCR 0-7", 1, 8, SHA256_DIGEST_SIZE, TpmCorpusIntact, STATUS_SUCCESS },
+        { "PCR_Read SHA-1 PCR 0", 1, 1, SHA1_DIGEST_SIZE, TpmCorpusIntact, STATUS_SUCCESS },
+        { "PCR_Read SHA-384 PCR 0-7", 1, 8, SHA384_DIGEST_SIZE, TpmCorpusIntact, STATUS_SUCCESS },
+        { "PCR_Read no values", 0, 0, 0, TpmCorpusIntact, STATUS_SUCCESS },
+
+        { "PCR_Read truncated", 1, 8, SHA256_DIGEST_SIZE, TpmCorpusTruncated, STATUS_DEVICE_BUSY },
+        { "PCR_Read trailing byte", 1, 8, SHA256_DIGEST_SIZE, TpmCorpusTrailingByte, STATUS_DEVICE_BUSY },
+        { "PCR_Read digest count overflow", 1, 9, SHA256_DIGEST_SIZE, TpmCorpusCountOverflow, STATUS_DEVICE_BUSY },
+        { "PCR_Read select oversized", 1, 8, SHA256_DIGEST_SIZE, TpmCorpusOversizedSelect, STATUS_DEVICE_BUSY },
+        { "PCR_Read digest oversized", 1, 1, sizeof(TPMU_HA) + 1, TpmCorpusOversizedDigest, STATUS_DEVICE_BUSY },
+    };
+
+    //
+    // Big-endian writer over the sample buffer.
+    //
+    struct CORPUS_WRITER
+    {
+        uint8_t* buffer;
+        uint32_t size;
+
+        void Put16(_In_ uint16_t value)
+        {
+            value = _byteswap_ushort(value);
+            memcpy(this->buffer + this->size, &value, sizeof(value));
+            this->size += sizeof(value);
+        }
+
+        void Put32(_In_ uint32_t value)
+        {
+            value = _byteswap_ulong(value);
+            memcpy(this->buffer + this->size, &value, sizeof(value));
+            this->size += sizeof(value);
+        }
+
+        void PutPattern(_In_ uint16_t size)
+        {
+            for (uint16_t i = 0; i < size; i++)
+            {
+                this->buffer[this->size++] = (uint8_t)(i * 7 + 1);
+            }
+        }
+
+        void PutSized(_In_ uint16_t size)
+        {
+            this->Put16(size);
+            this->PutPattern(size);
+        }
+    };
+
+    static void PatchSizes(
+        _Inout_ CORPUS_WRITER* writer,
+        _In_ TPM_CORPUS_MUTATION mutation
+    )
+    {
+        if (mutation == TpmCorpusTruncated)
+        {
+            writer->size--;
+        }
+        else if (mutation == TpmCorpusTrailingByte)
+        {
+            writer->buffer[writer->size++] = 0;
+        }
+
+        uint32_t paramSize = _byteswap_ulong(writer->size);
+        memcpy(writer->buffer + FIELD_OFFSET(TPM2_RESPONSE_HEADER, paramSize), &paramSize, sizeof(paramSize));
+    }
+
+    template<typename Engine>
+    static bool CheckPublicSample(
+        _In_ Engine* tpm,
+        _In_ const TPM_CORPUS_PUBLIC_SAMPLE* sample,
+        _In_reads_bytes_(size) const uint8_t* response,
+        _In_ uint32_t size,
+        _Out_writes_bytes_(COMPACT_PUBLIC_MAX_SIZE) TPM_COMPACT_PUBLIC* compactPublic,
+        _Out_ TPM2B_PUBLIC* outPublic,
+        _Out_ TPM2B_NAME* name,
+        _Out_ TPM2B_NAME* qualifiedName
+    )
+    {
+        NTSTATUS compactStatus = tpm->ParseReadPublicResponseCompact(response, size, compactPublic, COMPACT_PUBLIC_MAX_SIZE, name, qualifiedName);
+        NTSTATUS status = tpm->ParseReadPublicResponse((const TPM2_READ_PUBLIC_RESPONSE*)response, size, outPublic, name, qualifiedName);
+        if (compactStatus != sample->CompactStatus || status != sample->Status)
+        {
+            DbgError("Corpus %s: compact 0x%08x, expected 0x%08x; TPM2B_PUBLIC 0x%08x, expected 0x%08x.\n",
+                sample->Name, compactStatus, sample->CompactStatus, status, sample->Status);
+            return false;
+        }
+
+        if (NT_SUCCESS(compactStatus) &&
+            !CheckParameters(sample, compactPublic->type, &compactPublic->parameters, compactPublic->uniqueSize, compactPublic->uniqueYSize))
+        {
+            return false;
+        }
+        if (NT_SUCCESS(status))
+        {
+            const TPMT_PUBLIC* publicArea = &outPublic->publicArea;
+            uint16_t uniqueSize = (publicArea->type == TPM_ALG_ECC) ? publicArea->unique.ecc.x.size : publicArea->unique.rsa.size;
+            uint16_t uniqueYSize = (publicArea->type == TPM_ALG_ECC) ? publicArea->unique.ecc.y.size : 0;
+            if (!CheckParameters(sample, publicArea->type, &publicArea->parameters, uniqueSize, uniqueYSize))
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    static bool CheckParameters(
+        _In_ const TPM_CORPUS_PUBLIC_SAMPLE* sample,
+        _In_ TPMI_ALG_PUBLIC type,
+        _In_ const TPMU_PUBLIC_PARMS* parameters,
+        _In_ uint16_t uniqueSize,
+        _In_ uint16_t uniqueYSize
+    )
+    {
+        uint16_t scheme = 0;
+        uint16_t keyBits = 0;
+        uint32_t exponent = 0;
+        switch (type)
+        {
+        case TPM_ALG_RSA:
+            scheme = parameters->rsaDetail.scheme.scheme;
+            keyBits = parameters->rsaDetail.keyBits;
+            exponent = parameters->rsaDetail.exponent;
+            break;
+        case TPM_ALG_ECC:
+            scheme = parameters->eccDetail.scheme.scheme;
+            keyBits = parameters->eccDetail.curveID;
+            break;
+        case TPM_ALG_KEYEDHASH:
+            scheme = parameters->keyedHashDetail.scheme.scheme;
+            break;
+        case TPM_ALG_SYMCIPHER:
+            scheme = parameters->symDetail.algorithm;
+            keyBits = parameters->symDetail.keyBits.aes;
+            break;
+        }
+
+        if (type != sample->Type || scheme != sample->Scheme || keyBits != sample->KeyBits || exponent != sample->Exponent ||
+            uniqueSize != sample->UniqueSize || uniqueYSize != sample->UniqueYSize)
+        {
+            DbgError("Corpus %s: decoded type 0x%x scheme 0x%x keyBits %u exponent %u unique %u/%u.\n",
+                sample->Name, type, scheme, keyBits, exponent, uniqueSize, uniqueYSize);
+            return false;
+        }
+        return true;
+    }
+
+    //
+    // Runs decode over samples responses CORPUS_ITERATIONS times and prints the throughput.
+    //
+    template<typename Decode>
+    static void Measure(
+        _In_ const char* decoder,
+        _In_ uint32_t samples,
+        _In_reads_(samples) const uint32_t* sizes,
+        _In_ Decode decode
+    )
+    {
+        if (!samples)
+        {
+            return;
+        }
+
+        uint64_t bytes = 0;
+        uint64_t start = trace::Timestamp();
+        for (uint32_t i = 0; i < CORPUS_ITERATIONS; i++)
+        {
+            for (uint32_t j = 0; j < samples; j++)
+            {
+                (void)decode(j);
+                bytes += sizes[j];
+            }
+        }
+        uint64_t elapsed = trace::Timestamp() - start;
+
+        uint64_t frequency = trace::Frequency();
+        uint64_t responses = (uint64_t)CORPUS_ITERATIONS * samples;
+        uint64_t responsesPerSecond = elapsed ? (responses * frequency) / elapsed : 0;
+        uint64_t picosecondsPerByte = frequency ? (elapsed * 1000000000000ull / frequency) / bytes : 0;
+        Dbg("Parser %s: %llu responses/s, %llu.%03llu ns/byte over %u samples.\n",
+            decoder, responsesPerSecond, picosecondsPerByte / 1000, picosecondsPerByte % 1000, samples);
+    }
+
+    static constexpr uint32_t PcrUpdateCounter = 0x1234;
+
+    static TPMI_ALG_HASH GetPcrBank(_In_ uint16_t digestSize)
+    {
+        switch (digestSize)
+        {
+        case SHA1_DIGEST_SIZE:
+            return TPM_ALG_SHA1;
+        case SHA384_DIGEST_SIZE:
+            return TPM_ALG_SHA384;
+        default:
+            return TPM_ALG_SHA256;
+        }
+    }
+
+    static void PutPcrSelection(
+        _Inout_ CORPUS_WRITER* writer,
+        _In_ uint32_t banks,
+        _In_ TPMI_ALG_HASH hashAlg,
+        _In_ TPM_CORPUS_MUTATION mutation
+    )
+    {
+        writer->Put32(banks);
+        for (uint32_t i = 0; i < banks; i++)
+        {
+            writer->Put16(hashAlg);
+            uint8_t sizeofSelect = (mutation == TpmCorpusOversizedSelect) ? PCR_SELECT_MAX + 1 : PCR_SELECT_MAX;
+            writer->buffer[writer->size++] = sizeofSelect;
+            writer->PutPattern(sizeofSelect);
+        }
+    }
+
+    template<typename Engine>
+    static bool CheckCapabilitySample(
+        _In_ Engine* tpm,
+        _In_ const TPM_CORPUS_CAPABILITY_SAMPLE* sample,
+        _In_reads_bytes_(size) const uint8_t* response,
+        _In_ uint32_t size,
+        _Out_ TPMS_CAPABILITY_DATA* capabilityData
+    )
+    {
+        TPMI_YES_NO moreData = NO;
+        NTSTATUS status = tpm->ParseGetCapabilityResponse((const TPM2_GET_CAPABILITY_RESPONSE*)response, size, &moreData, capabilityData);
+        if (status != sample->Status)
+        {
+            DbgError("Corpus %s: 0x%08x, expected 0x%08x.\n", sample->Name, status, sample->Status);
+            return false;
+        }
+        if (NT_ERROR(status))
+        {
+            return true;
+        }
+
+        uint32_t count = 0;
+        bool last = true;
+        switch (capabilityData->capability)
+        {
+        case TPM_CAP_TPM_PROPERTIES:
+            count = capabilityData->data.tpmProperties.count;
+            last = !count || capabilityData->data.tpmProperties.tpmProperty[count - 1].property == PT_FIXED + count - 1;
+            break;
+        case TPM_CAP_HANDLES:
+            count = capabilityData->data.handles.count;
+            last = !count || capabilityData->data.handles.handle[count - 1] == PERSISTENT_FIRST + count - 1;
+            break;
+        case TPM_CAP_PCRS:
+            count = capabilityData->data.assignedPCR.count;
+            last = !count || capabilityData->data.assignedPCR.pcrSelections[count - 1].sizeofSelect == PCR_SELECT_MAX;
+            break;
+        }
+
+        if (capabilityData->capability != sample->Capability || count != sample->Count || !last)
+        {
+            DbgError("Corpus %s: decoded capability 0x%x with %u entries.\n", sample->Name, capabilityData->capability, count);
+            return false;
+        }
+        return true;
+    }
+
+    template<typename Engine>
+    static bool CheckPcrSample(
+        _In_ Engine* tpm,
+        _In_ const TPM_CORPUS_PCR_SAMPLE* sample,
+        _In_reads_bytes_(size) const uint8_t* response,
+        _In_ uint32_t size,
+        _Out_ TPML_PCR_SELECTION* pcrSelectionOut,
+        _Out_ TPML_DIGEST* pcrValues
+    )
+    {
+        uint32_t pcrUpdateCounter = 0;
+        NTSTATUS status = tpm->ParsePcrReadResponse(response, size, &pcrUpdateCounter, pcrSelectionOut, pcrValues);
+        if (status != sample->Status)
+        {
+            DbgError("Corpus %s: 0x%08x, expected 0x%08x.\n", sample->Name, status, sample->Status);
+            return false;
+        }
+        if (NT_ERROR(status))
+        {
+            return true;
+        }
+
+        bool sizes = true;
+        for (uint32_t i = 0; i < pcrValues->count; i++)
+        {
+            sizes = sizes && pcrValues->digests[i].size == sample->DigestSize;
+        }
+        if (pcrUpdateCounter != PcrUpdateCounter || pcrSelectionOut->count != sample->Banks ||
+            pcrValues->count != sample->Digests || !sizes)
+        {
+            DbgError("Corpus %s: decoded update counter %u, %u banks, %u values.\n",
+                sample->Name, pcrUpdateCounter, pcrSelectionOut->count, pcrValues->count);
+            return false;
+        }
+        return true;
+    }
+
+public:
+
+    static constexpr uint32_t PublicSampleCount = ARRAYSIZE(PublicSamples);
+    static constexpr uint32_t NvSampleCount = ARRAYSIZE(NvSamples);
+    static constexpr uint32_t CapabilitySampleCount = ARRAYSIZE(CapabilitySamples);
+    static constexpr uint32_t PcrSampleCount = ARRAYSIZE(PcrSamples);
+
+    //
+    // Builds a ReadPublic response sample.
+    //
+    // Parameters:
+    // - index: Sample index, below PublicSampleCount.
+    // - buffer: Buffer that receives the response, READ_PUBLIC_RESPONSE_MAX_SIZE bytes.
+    //
+    // Returns:
+    // - uint32_t: Size of the response.
+    //
+    static uint32_t BuildPublicSample(
+        _In_ uint32_t index,
+        _Out_writes_bytes_(READ_PUBLIC_RESPONSE_MAX_SIZE) uint8_t* buffer
+    )
+    {
+        const TPM_CORPUS_PUBLIC_SAMPLE* sample = &PublicSamples[index];
+        CORPUS_WRITER writer = { buffer, 0 };
+
+        writer.Put16(TPM_ST_NO_SESSIONS);
+        writer.Put32(0);
+        writer.Put32(TPM_RC_SUCCESS);
+
+        uint32_t publicSizeOffset = writer.size;
+        writer.Put16(0);
+        writer.Put16(sample->Mutation == TpmCorpusUnknownType ? (uint16_t)0x0099 : sample->Type);
+        writer.Put16(TPM_ALG_SHA256);
+        writer.Put32(0x00030072);       // fixedTPM, fixedParent, sensitiveDataOrigin, userWithAuth, restricted, decrypt
+        writer.Put16(0);                // authPolicy
+        memcpy(writer.buffer + writer.size, sample->Parameters, sample->ParametersSize);
+        writer.size += sample->ParametersSize;
+        writer.PutSized(sample->UniqueSize);
+        if (sample->Type == TPM_ALG_ECC)
+        {
+            writer.PutSized(sample->UniqueYSize);
+        }
+        uint16_t publicSize = _byteswap_ushort((uint16_t)(writer.size - publicSizeOffset - sizeof(uint16_t)));
+        memcpy(writer.buffer + publicSizeOffset, &publicSize, sizeof(publicSize));
+
+        writer.PutSized(sizeof(uint16_t) + SHA256_DIGEST_SIZE);     // name
+        writer.PutSized(sizeof(uint16_t) + SHA256_DIGEST_SIZE);     // qualifiedName
+
+        PatchSizes(&writer, sample->Mutation);
+        return writer.size;
+    }
+
+    //
+    // Builds an NV_Read response sample.
+    //
+    // Parameters:
+    // - index: Sample index, below NvSampleCount.
+    // - buffer: Buffer that receives the response, sizeof(TPM2_NV_READ_RESPONSE) bytes.
+    // - requestedSize: Receives the size the sample answers.
+    //
+    // Returns:
+    // - uint32_t: Size of the response.
+    //
+    static uint32_t BuildNvSample(
+        _In_ uint32_t index,
+        _Out_writes_bytes_(sizeof(TPM2_NV_READ_RESPONSE)) uint8_t* buffer,
+        _Out_ uint16_t* requestedSize
+    )
+    {
+        const TPM_CORPUS_NV_SAMPLE* sample = &NvSamples[index];
+        CORPUS_WRITER writer = { buffer, 0 };
+
+        writer.Put16(TPM_ST_SESSIONS);
+        writer.Put32(0);
+        writer.Put32(TPM_RC_SUCCESS);
+        writer.Put32(sizeof(uint16_t) + sample->DataSize);
+        writer.PutSized(sample->DataSize);
+        writer.Put16(0);                // nonce
+        writer.buffer[writer.size++] = 0x01;    // continueSession
+        writer.Put16(0);                // hmac
+
+        *requestedSize = (sample->Mutation == TpmCorpusSizeMismatch) ? sample->DataSize - 1 : sample->DataSize;
+        if (sample->Mutation == TpmCorpusTruncated)
+        {
+            writer.size = sizeof(TPM2_RESPONSE_HEADER) + sizeof(uint32_t) + sizeof(uint16_t) + sample->DataSize / 2;
+        }
+        PatchSizes(&writer, TpmCorpusIntact);
+        return writer.size;
+    }
+
+    //
+    // Builds a GetCapability response sample.
+    //
+    // Parameters:
+    // - index: Sample index, below CapabilitySampleCount.
+    // - buffer: Buffer that receives the response, sizeof(TPM2_GET_CAPABILITY_RESPONSE) bytes.
+    //
+    // Returns:
+    // - uint32_t: Size of the response.
+    //
+    static uint32_t BuildCapabilitySample(
+        _In_ uint32_t index,
+        _Out_writes_bytes_(sizeof(TPM2_GET_CAPABILITY_RESPONSE)) uint8_t* buffer
+    )
+    {
+        const TPM_CORPUS_CAPABILITY_SAMPLE* sample = &CapabilitySamples[index];
+        CORPUS_WRITER writer = { buffer, 0 };
+
+        writer.Put16(TPM_ST_NO_SESSIONS);
+        writer.Put32(0);
+        writer.Put32(TPM_RC_SUCCESS);
+        writer.buffer[writer.size++] = NO;      // moreData
+        writer.Put32(sample->Capability);
+
+        switch (sample->Capability)
+        {
+        case TPM_CAP_TPM_PROPERTIES:
+            writer.Put32(sample->Count);
+            for (uint32_t i = 0; i < sample->Count; i++)
+            {
+                writer.Put32(PT_FIXED + i);
+                writer.Put32(i * 7 + 1);
+            }
+            break;
+        case TPM_CAP_HANDLES:
+            writer.Put32(sample->Count);
+            for (uint32_t i = 0; i < sample->Count; i++)
+            {
+                writer.Put32(PERSISTENT_FIRST + i);
+            }
+            break;
+        case TPM_CAP_PCRS:
+            PutPcrSelection(&writer, sample->Count, TPM_ALG_SHA256, sample->Mutation);
+            break;
+        default:
+            writer.Put32(0);
+            break;
+        }
+
+        PatchSizes(&writer, sample->Mutation);
+        return writer.size;
+    }
+
+    //
+    // Builds a PCR_Read response sample.
+    //
+    // Parameters:
+    // - index: Sample index, below PcrSampleCount.
+    // - buffer: Buffer that receives the response, PCR_READ_RESPONSE_MAX_SIZE bytes.
+    //
+    // Returns:
+    // - uint32_t: Size of the response.
+    //
+    static uint32_t BuildPcrSample(
+        _In_ uint32_t index,
+        _Out_writes_bytes_(PCR_READ_RESPONSE_MAX_SIZE) uint8_t* buffer
+    )
+    {
+        const TPM_CORPUS_PCR_SAMPLE* sample = &PcrSamples[index];
+        CORPUS_WRITER writer = { buffer, 0 };
+
+        writer.Put16(TPM_ST_NO_SESSIONS);
+        writer.Put32(0);
+        writer.Put32(TPM_RC_SUCCESS);
+        writer.Put32(PcrUpdateCounter);
+        PutPcrSelection(&writer, sample->Banks, GetPcrBank(sample->DigestSize), sample->Mutation);
+        writer.Put32(sample->Digests);
+        for (uint32_t i = 0; i < sample->Digests; i++)
+        {
+            writer.PutSized(sample->DigestSize);
+        }
+
+        PatchSizes(&writer, sample->Mutation);
+        return writer.size;
+    }
+
+    //
+    // Checks every sample against its expected decoding, then measures the throughput of the
+    // ReadPublic, NV_Read, GetCapability and PCR_Read decoders over the intact samples.
+    //
+    // Parameters:
+    // - tpm: Engine whose decoders are run. No command is sent.
+    //
+    // Returns:
+    // - STATUS_SUCCESS: Every sample decoded as expected.
+    // - STATUS_UNSUCCESSFUL: At least one sample did not.
+    // - STATUS_INSUFFICIENT_RESOURCES: The buffers could not be allocated.
+    //
+    template<typename Engine>
+    static NTSTATUS Run(_In_ Engine* tpm)
+    {
+        constexpr uint32_t publicBufferSize = max((uint32_t)READ_PUBLIC_RESPONSE_MAX_SIZE, (uint32_t)sizeof(TPM2_READ_PUBLIC_RESPONSE));
+
+        uint8_t* publicResponses[PublicSampleCount] = { };
+        uint32_t publicSizes[PublicSampleCount] = { };
+        uint8_t* nvResponses[NvSampleCount] = { };
+        uint32_t nvSizes[NvSampleCount] = { };
+        uint16_t nvRequested[NvSampleCount] = { };
+        TPM_COMPACT_PUBLIC* compactPublic = (TPM_COMPACT_PUBLIC*)new uint8_t[COMPACT_PUBLIC_MAX_SIZE];
+        TPM2B_PUBLIC* outPublic = new TPM2B_PUBLIC;
+        TPM2B_NAME* names = new TPM2B_NAME[2];
+        uint8_t* nvData = new uint8_t[MAX_NV_INDEX_SIZE];
+        uint8_t* capabilityResponses[CapabilitySampleCount] = { };
+        uint32_t capabilitySizes[CapabilitySampleCount] = { };
+        uint8_t* pcrResponses[PcrSampleCount] = { };
+        uint32_t pcrSizes[PcrSampleCount] = { };
+        TPMS_CAPABILITY_DATA* capabilityData = new TPMS_CAPABILITY_DATA;
+        TPML_PCR_SELECTION* pcrSelectionOut = new TPML_PCR_SELECTION;
+        TPML_DIGEST* pcrValues = new TPML_DIGEST;
+        NTSTATUS status = (compactPublic && outPublic && names && nvData && capabilityData && pcrSelectionOut && pcrValues) ?
+            STATUS_SUCCESS : STATUS_INSUFFICIENT_RESOURCES;
+
+        for (uint32_t i = 0; NT_SUCCESS(status) && i < PublicSampleCount; i++)
+        {
+            publicResponses[i] = new uint8_t[publicBufferSize];
+            if (!publicResponses[i])
+            {
+                status = STATUS_INSUFFICIENT_RESOURCES;
+                break;
+            }
+            RtlZeroMemory(publicResponses[i], publicBufferSize);
+            publicSizes[i] = BuildPublicSample(i, publicResponses[i]);
+            if (!CheckPublicSample(tpm, &PublicSamples[i], publicResponses[i], publicSizes[i], compactPublic, outPublic, &names[0], &names[1]))
+            {
+                status = STATUS_UNSUCCESSFUL;
+            }
+        }
+
+        for (uint32_t i = 0; status != STATUS_INSUFFICIENT_RESOURCES && i < NvSampleCount; i++)
+        {
+            nvResponses[i] = new uint8_t[sizeof(TPM2_NV_READ_RESPONSE)];
+            if (!nvResponses[i])
+            {
+                status = STATUS_INSUFFICIENT_RESOURCES;
+                break;
+            }
+            RtlZeroMemory(nvResponses[i], sizeof(TPM2_NV_READ_RESPONSE));
+            nvSizes[i] = BuildNvSample(i, nvResponses[i], &nvRequested[i]);
+            NTSTATUS nvStatus = tpm->ParseNvReadResponse((const TPM2_NV_READ_RESPONSE*)nvResponses[i], nvSizes[i], nvData, nvRequested[i]);
+            if (nvStatus != NvSamples[i].Status)
+            {
+                DbgError("Corpus %s: 0x%08x, expected 0x%08x.\n", NvSamples[i].Name, nvStatus, NvSamples[i].Status);
+                status = STATUS_UNSUCCESSFUL;
+            }
+        }
+
+        for (uint32_t i = 0; status != STATUS_INSUFFICIENT_RESOURCES && i < CapabilitySampleCount; i++)
+        {
+            capabilityResponses[i] = new uint8_t[sizeof(TPM2_GET_CAPABILITY_RESPONSE)];
+            if (!capabilityResponses[i])
+            {
+                status = STATUS_INSUFFICIENT_RESOURCES;
+                break;
+            }
+            RtlZeroMemory(capabilityResponses[i], sizeof(TPM2_GET_CAPABILITY_RESPONSE));
+            capabilitySizes[i] = BuildCapabilitySample(i, capabilityResponses[i]);
+            if (!CheckCapabilitySample(tpm, &CapabilitySamples[i], capabilityResponses[i], capabilitySizes[i], capabilityData))
+            {
+                status = STATUS_UNSUCCESSFUL;
+            }
+        }
+
+        for (uint32_t i = 0; status != STATUS_INSUFFICIENT_RESOURCES && i < PcrSampleCount; i++)
+        {
+            pcrResponses[i] = new uint8_t[PCR_READ_RESPONSE_MAX_SIZE];
+            if (!pcrResponses[i])
+            {
+                status = STATUS_INSUFFICIENT_RESOURCES;
+                break;
+            }
+            RtlZeroMemory(pcrResponses[i], PCR_READ_RESPONSE_MAX_SIZE);
+            pcrSizes[i] = BuildPcrSample(i, pcrResponses[i]);
+            if (!CheckPcrSample(tpm, &PcrSamples[i], pcrResponses[i], pcrSizes[i], pcrSelectionOut, pcrValues))
+            {
+                status = STATUS_UNSUCCESSFUL;
+            }
+        }
+
+        if (NT_SUCCESS(status))
+        {
+            //
+            // Throughput over the samples each decoder accepts, so rejections do not print.
+            //
+            const uint8_t* accepted[PublicSampleCount] = { };
+            uint32_t acceptedSizes[PublicSampleCount] = { };
+            uint32_t count = 0;
+            for (uint32_t i = 0; i < PublicSampleCount; i++)
+            {
+                if (PublicSamples[i].Status == STATUS_SUCCESS)
+                {
+                    accepted[count] = publicResponses[i];
+                    acceptedSizes[count++] = publicSizes[i];
+                }
+            }
+            Measure("ReadPublic TPM2B_PUBLIC", count, acceptedSizes, [&](uint32_t j) {
+                return tpm->ParseReadPublicResponse((const TPM2_READ_PUBLIC_RESPONSE*)accepted[j], acceptedSizes[j], outPublic, &names[0], &names[1]);
+            });
+
+            count = 0;
+            for (uint32_t i = 0; i < PublicSampleCount; i++)
+            {
+                if (PublicSamples[i].CompactStatus == STATUS_SUCCESS)
+                {
+                    accepted[count] = publicResponses[i];
+                    acceptedSizes[count++] = publicSizes[i];
+                }
+            }
+            Measure("ReadPublic compact", count, acceptedSizes, [&](uint32_t j) {
+                return tpm->ParseReadPublicResponseCompact(accepted[j], acceptedSizes[j], compactPublic, COMPACT_PUBLIC_MAX_SIZE, &names[0], &names[1]);
+            });
+
+            uint32_t nvAccepted[NvSampleCount] = { };
+            uint32_t nvAcceptedSizes[NvSampleCount] = { };
+            count = 0;
+            for (uint32_t i = 0; i < NvSampleCount; i++)
+            {
+                if (NvSamples[i].Status == STATUS_SUCCESS)
+                {
+                    nvAccepted[count] = i;
+                    nvAcceptedSizes[count++] = nvSizes[i];
+                }
+            }
+            Measure("NV_Read", count, nvAcceptedSizes, [&](uint32_t j) {
+                uint32_t i = nvAccepted[j];
+                return tpm->ParseNvReadResponse((const TPM2_NV_READ_RESPONSE*)nvResponses[i], nvSizes[i], nvData, nvRequested[i]);
+            });
+
+            const uint8_t* capabilityAccepted[CapabilitySampleCount] = { };
+            uint32_t capabilityAcceptedSizes[CapabilitySampleCount] = { };
+            count = 0;
+            for (uint32_t i = 0; i < CapabilitySampleCount; i++)
+            {
+                if (CapabilitySamples[i].Status == STATUS_SUCCESS)
+                {
+                    capabilityAccepted[count] = capabilityResponses[i];
+                    capabilityAcceptedSizes[count++] = capabilitySizes[i];
+                }
+            }
+            Measure("GetCapability", count, capabilityAcceptedSizes, [&](uint32_t j) {
+                TPMI_YES_NO moreData = NO;
+                return tpm->ParseGetCapabilityResponse((const TPM2_GET_CAPABILITY_RESPONSE*)capabilityAccepted[j], capabilityAcceptedSizes[j], &moreData, capabilityData);
+            });
+
+            const uint8_t* pcrAccepted[PcrSampleCount] = { };
+            uint32_t pcrAcceptedSizes[PcrSampleCount] = { };
+            count = 0;
+            for (uint32_t i = 0; i < PcrSampleCount; i++)
+            {
+                if (PcrSamples[i].Status == STATUS_SUCCESS)
+                {
+                    pcrAccepted[count] = pcrResponses[i];
+                    pcrAcceptedSizes[count++] = pcrSizes[i];
+                }
+            }
+            Measure("PCR_Read", count, pcrAcceptedSizes, [&](uint32_t j) {
+                uint32_t pcrUpdateCounter = 0;
+                return tpm->ParsePcrReadResponse(pcrAccepted[j], pcrAcceptedSizes[j], &pcrUpdateCounter, pcrSelectionOut, pcrValues);
+            });
+        }
+
+        for (uint32_t i = 0; i < PcrSampleCount; i++)
+        {
+            delete[] pcrResponses[i];
+        }
+        for (uint32_t i = 0; i < CapabilitySampleCount; i++)
+        {
+            delete[] capabilityResponses[i];
+        }
+        delete pcrValues;
+        delete pcrSelectionOut;
+        delete capabilityData;
+
+        for (uint32_t i = 0; i < NvSampleCount; i++)
+        {
+            delete[] nvResponses[i];
+        }
+        for (uint32_t i = 0; i < PublicSampleCount; i++)
+        {
+            delete[] publicResponses[i];
+        }
+        delete[] nvData;
+        delete[] names;
+        delete outPublic;
+        delete[] (uint8_t*)compactPublic;
+        return status;
+    }
+};
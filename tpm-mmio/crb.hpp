@@ -4,7 +4,33 @@ class TpmCrb
 {
 private:
 
-    TpmPtp* ptpInterface = nullptr;
+    //
+    // CRB IdleByPass state from the interface identifier.
+    //
+    uint8_t idleByPassState = 0xFF;
+
+    //
+    // Mapped data buffer, or nullptr to map every access.
+    //
+    uint8_t* dataBuffer = nullptr;
+
+    //
+    // true if dataBuffer is mapped write-combined, and must be fenced before Start and after completion.
+    //
+    bool writeCombined = false;
+
+    //
+    // Command in flight, whose phases are marked as the CRB moves through them. May be nullptr.
+    //
+    TPM_COMMAND_TRACE* commandTrace = nullptr;
+
+    void Mark(_In_ TPM_PHASE phase)
+    {
+        if (this->commandTrace)
+        {
+            trace::Mark(this->commandTrace, phase);
+        }
+    }
 
    //
    // Polls a 32-bit hardware register at the specified address, waiting for specified bits to be set and/or cleared within a timeout period.
@@ -38,42 +64,45 @@ private:
                 KeStallExecutionProcessor(30);
             }
         }
+        history::Stall((uintptr_t)registerAddress, timeOut);
         return STATUS_TIMEOUT;
     }
 
 public:
 
-    TpmCrb(TpmPtp* ptpInterface)
+    //
+    // Caches the interface state used by every command.
+    //
+    // Parameters:
+    // - idleByPassState: CRB IdleByPass state detected by TpmPtp.
+    // - dataBuffer: Mapped CRB data buffer, or nullptr.
+    // - writeCombined: true if dataBuffer is mapped MmWriteCombined.
+    // - commandTrace: Record the phases of each command are charged to, or nullptr.
+    //
+    void Init(
+        _In_ uint8_t idleByPassState,
+        _In_opt_ uint8_t* dataBuffer,
+        _In_ bool writeCombined,
+        _In_opt_ TPM_COMMAND_TRACE* commandTrace
+    )
     {
-        this->ptpInterface = ptpInterface;
+        this->idleByPassState = idleByPassState;
+        this->dataBuffer = dataBuffer;
+        this->writeCombined = dataBuffer && writeCombined;
+        this->commandTrace = commandTrace;
     }
 
     //
-    // Sends a command to the TPM CRB (Command Response Buffer) interface and retrieves the response.
-    // This function is designed to interact with the TPM hardware via the CRB interface,
-    // sending a command buffer and awaiting a response.
+    // Moves the TPM CRB into the Ready state, so a command can be written into the data buffer.
     //
     // Parameters:
     // - crbReg: Pointer to the CRB registers used to initiate commands and read responses.
-    // - bufferIn: Pointer to the buffer containing the command data to be sent to the TPM.
-    // - sizeIn: Size of the input buffer in bytes.
-    // - bufferOut: Pointer to the buffer where the TPM's response will be stored.
-    // - sizeOut: Pointer to a variable that on input specifies the maximum size of the output buffer,
-    //            and on output reflects the actual size of the data written to the output buffer.
     //
     // Returns:
-    // - STATUS_SUCCESS: The command was successfully sent and a response was received.
-    // - STATUS_DEVICE_BUSY: The device is busy or in idle mode.
-    // - STATUS_NOT_SUPPORTED: The command or TPM version aren't supported.
-    // - STATUS_BUFFER_TOO_SMALL: The response is too small.
+    // - STATUS_SUCCESS: The TPM is ready to receive a command.
+    // - STATUS_DEVICE_BUSY: The device is busy or in idle mode. The TPM was sent back to Idle.
     //
-    NTSTATUS CrbCommand(
-        _In_ PTP_CRB_REGISTERS* crbReg,
-        _In_reads_bytes_(sizeIn) const uint8_t* bufferIn,
-        _In_ uint32_t sizeIn,
-        _Inout_updates_bytes_(*sizeOut) uint8_t* bufferOut,
-        _Inout_ uint32_t* sizeOut
-    )
+    NTSTATUS CrbPrepare(_In_ PTP_CRB_REGISTERS* crbReg)
     {
         NTSTATUS status = STATUS_UNSUCCESSFUL;
         uint8_t retryCnt = 0;
@@ -85,7 +114,7 @@ public:
             // STEP 0:
             // if idleByPassState == 0, enforce Idle state before sending command
             //
-            if (this->ptpInterface->idleByPassState == 0)
+            if (this->idleByPassState == 0)
             {
                 if (mmio::Read((uintptr_t)&crbReg->CrbControlStatus, sizeof(uint32_t), &bit))
                 {
@@ -116,8 +145,8 @@ public:
                                 //
                                 // Try to goIdle to recover TPM
                                 //
-                                status = STATUS_DEVICE_BUSY;
-                                goto GoIdle_Exit;
+                                this->CrbGoIdle(crbReg);
+                                return STATUS_DEVICE_BUSY;
                             }
                         }
                     }
@@ -152,8 +181,8 @@ public:
                 }
                 else
                 {
-                    status = STATUS_DEVICE_BUSY;
-                    goto GoIdle_Exit;
+                    this->CrbGoIdle(crbReg);
+                    return STATUS_DEVICE_BUSY;
                 }
             }
 
@@ -175,23 +204,31 @@ public:
                 }
                 else
                 {
-                    status = STATUS_DEVICE_BUSY;
-                    goto GoIdle_Exit;
+                    this->CrbGoIdle(crbReg);
+                    return STATUS_DEVICE_BUSY;
                 }
             }
 
-            break;
+            this->Mark(TpmPhaseReady);
+            return STATUS_SUCCESS;
         }
+    }
 
+    //
+    // Points the TPM at the command in the data buffer and sets Start. The command must have been
+    // written after a successful CrbPrepare.
+    //
+    // Parameters:
+    // - crbReg: Pointer to the CRB registers used to initiate commands and read responses.
+    //
+    void CrbStart(_In_ PTP_CRB_REGISTERS* crbReg)
+    {
         //
-        // STEP 2:
-        // Command Reception occurs following a Ready state between the write of the
-        // first byte of a command to the Command Buffer and the receipt of a write
-        // of 1 to Start.
+        // Combined stores of the upload must reach the data buffer before Start does.
         //
-        for (uint32_t i = 0; i < sizeIn; i++)
+        if (this->writeCombined)
         {
-            (void)mmio::Write((uintptr_t)&crbReg->CrbDataBuffer[i], sizeof(uint8_t), const_cast<uint8_t*>(&bufferIn[i]));
+            mmio::Fence();
         }
 
         uint32_t highAddressPart = (uint32_t)((uintptr_t)crbReg->CrbDataBuffer >> 32);
@@ -209,10 +246,101 @@ public:
         // Command Execution occurs after receipt of a 1 to Start and the TPM
         // clearing Start to 0.
         //
-        bit = PTP_CRB_CONTROL_START;
+        uint32_t bit = PTP_CRB_CONTROL_START;
         (void)mmio::Write((uintptr_t)&crbReg->CrbControlStart, sizeof(uint32_t), &bit);
+        this->Mark(TpmPhaseTransferIn);
+    }
+
+    //
+    // Returns the TPM to the Idle state by setting TPM_CRB_CTRL_STS_x.Status.goIdle to 1.
+    // The data buffer contents are undefined afterwards.
+    //
+    // Parameters:
+    // - crbReg: Pointer to the CRB registers used to initiate commands and read responses.
+    //
+    void CrbGoIdle(_In_ PTP_CRB_REGISTERS* crbReg)
+    {
+        uint32_t bit32 = PTP_CRB_CONTROL_AREA_REQUEST_GO_IDLE;
+        (void)mmio::Write((uintptr_t)&crbReg->CrbControlRequest, sizeof(uint32_t), &bit32);
+    }
+
+    //
+    // Moves the TPM CRB into the Ready state, uploads the command into the data buffer and sets Start.
+    // Returns as soon as the TPM has been told to execute, so the caller can do useful work while the
+    // command runs and collect the response later with CrbReceive.
+    //
+    // Parameters:
+    // - crbReg: Pointer to the CRB registers used to initiate commands and read responses.
+    // - bufferIn: Pointer to the buffer containing the command data to be sent to the TPM.
+    // - sizeIn: Size of the input buffer in bytes.
+    //
+    // Returns:
+    // - STATUS_SUCCESS: The command was uploaded and the TPM started executing it.
+    // - STATUS_DEVICE_BUSY: The device is busy or in idle mode.
+    //
+    NTSTATUS CrbSend(
+        _In_ PTP_CRB_REGISTERS* crbReg,
+        _In_reads_bytes_(sizeIn) const uint8_t* bufferIn,
+        _In_ uint32_t sizeIn
+    )
+    {
+        NTSTATUS status = this->CrbPrepare(crbReg);
+        if (NT_ERROR(status))
+        {
+            return status;
+        }
+
+        //
+        // STEP 2:
+        // Command Reception occurs following a Ready state between the write of the
+        // first byte of a command to the Command Buffer and the receipt of a write
+        // of 1 to Start.
+        //
+        if (this->dataBuffer)
+        {
+            WRITE_REGISTER_BUFFER_UCHAR((volatile UCHAR*)this->dataBuffer, const_cast<uint8_t*>(bufferIn), sizeIn);
+            mmio::Count(&mmio::Counters().Writes, sizeIn);
+            record::Access(TpmMmioWrite, (uintptr_t)crbReg->CrbDataBuffer, sizeIn, bufferIn);
+            (void)replay::Access(TpmMmioWrite, (uintptr_t)crbReg->CrbDataBuffer, sizeIn, const_cast<uint8_t*>(bufferIn));
+        }
+        else
+        {
+            for (uint32_t i = 0; i < sizeIn; i++)
+            {
+                (void)mmio::Write((uintptr_t)&crbReg->CrbDataBuffer[i], sizeof(uint8_t), const_cast<uint8_t*>(&bufferIn[i]));
+            }
+        }
 
-        status = this->CrbWaitRegisterBits(
+        this->CrbStart(crbReg);
+        return STATUS_SUCCESS;
+    }
+
+    //
+    // Waits for a command started with CrbStart to complete and checks the response header.
+    // The response is left in the data buffer and the TPM is left in Command Completion, unless
+    // an error is returned, in which case the TPM was sent back to Idle.
+    //
+    // Parameters:
+    // - crbReg: Pointer to the CRB registers used to initiate commands and read responses.
+    // - header: Receives the response header.
+    // - sizeOut: Pointer to a variable that on input specifies the maximum response size accepted,
+    //            and on output receives the size of the response.
+    //
+    // Returns:
+    // - STATUS_SUCCESS: A response is in the data buffer.
+    // - STATUS_DEVICE_BUSY: The command did not complete, even after a cancel.
+    // - STATUS_NOT_SUPPORTED: The command or TPM version aren't supported.
+    // - STATUS_BUFFER_TOO_SMALL: The response is larger than *sizeOut.
+    //
+    NTSTATUS CrbWaitResponse(
+        _In_ PTP_CRB_REGISTERS* crbReg,
+        _Out_ TPM2_RESPONSE_HEADER* header,
+        _Inout_ uint32_t* sizeOut
+    )
+    {
+        uint32_t bit = 0;
+
+        NTSTATUS status = this->CrbWaitRegisterBits(
             &crbReg->CrbControlStart,
             0,
             PTP_CRB_CONTROL_START,
@@ -242,10 +370,11 @@ public:
                 //
                 // Still in Command Execution state. Try to goIdle, the behavior is agnostic.
                 //
-                status = STATUS_DEVICE_BUSY;
-                goto GoIdle_Exit;
+                this->CrbGoIdle(crbReg);
+                return STATUS_DEVICE_BUSY;
             }
         }
+        this->Mark(TpmPhaseExecute);
 
         //
         // STEP 4:
@@ -257,54 +386,140 @@ public:
         //
         // Get response data header
         //
-        for (uint32_t i = 0; i < sizeof(TPM2_RESPONSE_HEADER); i++)
+        if (this->writeCombined)
+        {
+            mmio::Fence();
+        }
+        if (this->dataBuffer)
         {
-            (void)mmio::Read((uintptr_t)&crbReg->CrbDataBuffer[i], sizeof(uint8_t), &bufferOut[i]);
+            READ_REGISTER_BUFFER_UCHAR((volatile UCHAR*)this->dataBuffer, (PUCHAR)header, sizeof(TPM2_RESPONSE_HEADER));
+            mmio::Count(&mmio::Counters().Reads, sizeof(TPM2_RESPONSE_HEADER));
+            (void)replay::Access(TpmMmioRead, (uintptr_t)crbReg->CrbDataBuffer, sizeof(TPM2_RESPONSE_HEADER), header);
+            record::Access(TpmMmioRead, (uintptr_t)crbReg->CrbDataBuffer, sizeof(TPM2_RESPONSE_HEADER), header);
+        }
+        else
+        {
+            for (uint32_t i = 0; i < sizeof(TPM2_RESPONSE_HEADER); i++)
+            {
+                (void)mmio::Read((uintptr_t)&crbReg->CrbDataBuffer[i], sizeof(uint8_t), (uint8_t*)header + i);
+            }
         }
 
         //
         // Check the response data header (tag, parasize and returncode)
         //
-        uint16_t data16 = 0;
-        memcpy(&data16, bufferOut, sizeof(uint16_t));
 
         // TPM2 should not use this RSP_COMMAND
-        if (_byteswap_ushort(data16) == TPM_ST_RSP_COMMAND)
+        if (_byteswap_ushort(header->tag) == TPM_ST_RSP_COMMAND)
         {
             DbgError("TPM_ST_RSP error: %x\n", TPM_ST_RSP_COMMAND);
-            status = STATUS_NOT_SUPPORTED;
-            goto GoIdle_Exit;
+            this->CrbGoIdle(crbReg);
+            return STATUS_NOT_SUPPORTED;
         }
 
-        uint32_t data32 = 0;
-        memcpy(&data32, (bufferOut + 2), sizeof(uint32_t));
-        uint32_t tpmOutSize = _byteswap_ulong(data32);
-        if (*sizeOut < tpmOutSize)
+        uint32_t tpmOutSize = _byteswap_ulong(header->paramSize);
+        if (*sizeOut < tpmOutSize || tpmOutSize < sizeof(TPM2_RESPONSE_HEADER) || tpmOutSize > sizeof(crbReg->CrbDataBuffer))
         {
             //
             // Command completed, but buffer is not enough
             //
-            status = STATUS_BUFFER_TOO_SMALL;
-            goto GoIdle_Exit;
+            this->CrbGoIdle(crbReg);
+            return STATUS_BUFFER_TOO_SMALL;
         }
 
         *sizeOut = tpmOutSize;
+        this->Mark(TpmPhaseTransferOut);
+        return STATUS_SUCCESS;
+    }
+
+    //
+    // Waits for a command started by CrbSend to complete, reads the response out of the data buffer
+    // and returns the TPM to the Idle state.
+    //
+    // Parameters:
+    // - crbReg: Pointer to the CRB registers used to initiate commands and read responses.
+    // - bufferOut: Pointer to the buffer where the TPM's response will be stored.
+    // - sizeOut: Pointer to a variable that on input specifies the maximum size of the output buffer,
+    //            and on output reflects the actual size of the data written to the output buffer.
+    //
+    // Returns:
+    // - STATUS_SUCCESS: A response was received.
+    // - STATUS_DEVICE_BUSY: The command did not complete, even after a cancel.
+    // - STATUS_NOT_SUPPORTED: The command or TPM version aren't supported.
+    // - STATUS_BUFFER_TOO_SMALL: The response is too small.
+    //
+    NTSTATUS CrbReceive(
+        _In_ PTP_CRB_REGISTERS* crbReg,
+        _Inout_updates_bytes_(*sizeOut) uint8_t* bufferOut,
+        _Inout_ uint32_t* sizeOut
+    )
+    {
+        TPM2_RESPONSE_HEADER header = { 0 };
+        NTSTATUS status = this->CrbWaitResponse(crbReg, &header, sizeOut);
+        if (NT_ERROR(status))
+        {
+            return status;
+        }
+
         //
         // Continue reading the remaining data
         //
-        for (uint32_t i = sizeof(TPM2_RESPONSE_HEADER); i < tpmOutSize; i++) {
-            (void)mmio::Read((uintptr_t)&crbReg->CrbDataBuffer[i], sizeof(uint8_t), &bufferOut[i]);
+        memcpy(bufferOut, &header, sizeof(header));
+        if (this->dataBuffer)
+        {
+            READ_REGISTER_BUFFER_UCHAR(
+                (volatile UCHAR*)(this->dataBuffer + sizeof(header)),
+                bufferOut + sizeof(header),
+                *sizeOut - (uint32_t)sizeof(header)
+            );
+            mmio::Count(&mmio::Counters().Reads, *sizeOut - (uint32_t)sizeof(header));
+            (void)replay::Access(TpmMmioRead, (uintptr_t)&crbReg->CrbDataBuffer[sizeof(header)], *sizeOut - (uint32_t)sizeof(header), bufferOut + sizeof(header));
+            record::Access(TpmMmioRead, (uintptr_t)&crbReg->CrbDataBuffer[sizeof(header)], *sizeOut - (uint32_t)sizeof(header), bufferOut + sizeof(header));
+        }
+        else
+        {
+            for (uint32_t i = sizeof(TPM2_RESPONSE_HEADER); i < *sizeOut; i++) {
+                (void)mmio::Read((uintptr_t)&crbReg->CrbDataBuffer[i], sizeof(uint8_t), &bufferOut[i]);
+            }
         }
 
+        this->CrbGoIdle(crbReg);
+        this->Mark(TpmPhaseTransferOut);
+        return STATUS_SUCCESS;
+    }
 
-    GoIdle_Exit:
-
-        //
-        //  Return to Idle state by setting TPM_CRB_CTRL_STS_x.Status.goIdle to 1.
-        //
-        uint32_t bit32 = PTP_CRB_CONTROL_AREA_REQUEST_GO_IDLE;
-        (void)mmio::Write((uintptr_t)&crbReg->CrbControlRequest, sizeof(uint32_t), &bit32);
-
-        return status;
+    //
+    // Sends a command to the TPM CRB (Command Response Buffer) interface and retrieves the response.
+    // This function is designed to interact with the TPM hardware via the CRB interface,
+    // sending a command buffer and awaiting a response.
+    //
+    // Parameters:
+    // - crbReg: Pointer to the CRB registers used to initiate commands and read responses.
+    // - bufferIn: Pointer to the buffer containing the command data to be sent to the TPM.
+    // - sizeIn: Size of the input buffer in bytes.
+    // - bufferOut: Pointer to the buffer where the TPM's response will be stored.
+    // - sizeOut: Pointer to a variable that on input specifies the maximum size of the output buffer,
+    //            and on output reflects the actual size of the data written to the output buffer.
+    //
+    // Returns:
+    // - STATUS_SUCCESS: The command was successfully sent and a response was received.
+    // - STATUS_DEVICE_BUSY: The device is busy or in idle mode.
+    // - STATUS_NOT_SUPPORTED: The command or TPM version aren't supported.
+    // - STATUS_BUFFER_TOO_SMALL: The response is too small.
+    //
+    NTSTATUS CrbCommand(
+        _In_ PTP_CRB_REGISTERS* crbReg,
+        _In_reads_bytes_(sizeIn) const uint8_t* bufferIn,
+        _In_ uint32_t sizeIn,
+        _Inout_updates_bytes_(*sizeOut) uint8_t* bufferOut,
+        _Inout_ uint32_t* sizeOut
+    )
+    {
+        NTSTATUS status = this->CrbSend(crbReg, bufferIn, sizeIn);
+        if (NT_ERROR(status))
+        {
+            return status;
+        }
+        return this->CrbReceive(crbReg, bufferOut, sizeOut);
     }
 };
@@ -3,8 +3,30 @@
 
 #define SYNC_EXTERN extern "C"
 
+//
+// Compile-time trace level, in ETW level numbering. Dbg, DbgError and the TraceLogging events
+// above it compile to nothing, arguments included.
+//
+#define TPM_TRACE_LEVEL_NONE     0
+#define TPM_TRACE_LEVEL_ERROR    2
+#define TPM_TRACE_LEVEL_INFO     4
+#define TPM_TRACE_LEVEL_VERBOSE  5
+
+#ifndef TPM_TRACE_LEVEL
+#define TPM_TRACE_LEVEL TPM_TRACE_LEVEL_INFO
+#endif
+
+#if TPM_TRACE_LEVEL >= TPM_TRACE_LEVEL_INFO
 #define Dbg( X, ... ) DbgPrintEx(0, 0,"[sync] " X, __VA_ARGS__ )
+#else
+#define Dbg( X, ... ) ((void)0)
+#endif
+
+#if TPM_TRACE_LEVEL >= TPM_TRACE_LEVEL_ERROR
 #define DbgError( X, ... ) DbgPrintEx(0, 0, "ERROR: " X, __VA_ARGS__ )
+#else
+#define DbgError( X, ... ) ((void)0)
+#endif
 #define KdBreak if (KD_DEBUGGER_ENABLED) __debugbreak();
 
 #pragma pack(push, 1)
@@ -302,6 +324,101 @@ enum PTP_INTERFACE_TYPE
 #define TIS_TIMEOUT_MAX (90000 * 1000) // 90s
 #define TIS_PC_STS_DATA 0x00000010
 #define TIS_PC_STS_CANCEL 0x01000000
+#define RESPONSE_CACHE_ENTRIES 16
+#define RESPONSE_CACHE_MAX_COMMAND_SIZE 32
+#define INVENTORY_RECORD_ALIGNMENT 4
+#define RM_MAX_OBJECTS 16
+#define RM_VIRTUAL_HANDLE_FIRST (TPM_HANDLE)(0x80FF0000)
+#define RM_CONTEXT_BLOCK_SIZE sizeof(TPM2_CONTEXT_SAVE_RESPONSE)
+#define RETRY_YIELDED_MAX_RETRIES 64
+#define RETRY_YIELDED_DELAY_US 0
+#define RETRY_RETRY_MAX_RETRIES 16
+#define RETRY_RETRY_DELAY_US 1000 // 1ms
+#define RETRY_RETRY_MAX_DELAY_US 32000 // 32ms
+#define RETRY_TESTING_MAX_RETRIES 20
+#define RETRY_TESTING_DELAY_US 10000 // 10ms
+#define RETRY_TESTING_MAX_DELAY_US 200000 // 200ms
+#define RETRY_NV_RATE_MAX_RETRIES 10
+#define RETRY_NV_RATE_DELAY_US 100000 // 100ms
+#define RETRY_NV_RATE_MAX_DELAY_US 1000000 // 1s
+#define RETRY_NV_UNAVAILABLE_MAX_RETRIES 10
+#define RETRY_NV_UNAVAILABLE_DELAY_US 10000 // 10ms
+#define RETRY_NV_UNAVAILABLE_MAX_DELAY_US 100000 // 100ms
+#define RETRY_STALL_MAX_US 50 // Longest backoff spun at DISPATCH_LEVEL or above
+
+#define NAME_MARSHAL_BUFFER_SIZE PUBLIC_AREA_MAX_SIZE // Marshalled TPMT_PUBLIC, decoded or compact
+#define FINGERPRINT_MD5_SIZE 16
+#define FINGERPRINT_CHUNK_SIZE 4096
+#define FINGERPRINT_LINE_BYTES 32 // 64 hex digits per DbgPrint line
+#define COMPACT_RSA_KEY_BYTES_MAX 512 // RSA-4096
+#define COMPACT_ECC_KEY_BYTES_MAX 66 // P-521
+#define COMPACT_PUBLIC_MAX_SIZE (sizeof(TPM_COMPACT_PUBLIC) + sizeof(TPMU_HA) + COMPACT_RSA_KEY_BYTES_MAX)
+#define PUBLIC_AREA_MAX_SIZE (sizeof(TPMT_PUBLIC) - MAX_RSA_KEY_BYTES + COMPACT_RSA_KEY_BYTES_MAX) // Marshalled TPMT_PUBLIC, RSA-4096 or P-521
+#define READ_PUBLIC_RESPONSE_MAX_SIZE (sizeof(TPM2_RESPONSE_HEADER) + sizeof(uint16_t) + PUBLIC_AREA_MAX_SIZE + 2 * sizeof(TPM2B_NAME))
+#define PCR_READ_RESPONSE_MAX_SIZE (sizeof(TPM2_RESPONSE_HEADER) + sizeof(uint32_t) + sizeof(TPML_PCR_SELECTION) + sizeof(TPML_DIGEST)) // Decoded forms bound the marshalled ones
+#define TRANSPORT_STAGING_BUFFER_SIZE 0xF80 // Size of the CRB data buffer
+#define TPM_POOL_TAG 'oimT' // "Tmio" in pool dumps
+#define SCRATCH_ARENA_SIZE 0x4000
+#define SCRATCH_ARENA_ALIGNMENT 16
+#define LATENCY_HISTOGRAM_SUB_BUCKETS 4 // Per power of two, so bucket bounds are within 25%
+#define LATENCY_HISTOGRAM_BUCKETS 108 // Up to 2^28 us, about 4.5 minutes
+#define COMMAND_STATISTICS_SLOTS (TPM_CC_LAST - TPM_CC_FIRST + 2) // One per command code, plus one for the rest
+#define COMMAND_QUEUE_DEPTH_MAX 64
+#define TPM_MMIO_DEVICE_NAME L"\\Device\\TpmMmio"
+#define TPM_MMIO_SYMBOLIC_LINK_NAME L"\\DosDevices\\TpmMmio"
+#define IOCTL_TPM_MMIO_SUBMIT_COMMAND CTL_CODE(FILE_DEVICE_UNKNOWN, 0x800, METHOD_OUT_DIRECT, FILE_READ_ACCESS | FILE_WRITE_ACCESS)
+#define IOCTL_TPM_MMIO_REGISTER_RING CTL_CODE(FILE_DEVICE_UNKNOWN, 0x801, METHOD_BUFFERED, FILE_READ_ACCESS | FILE_WRITE_ACCESS)
+#define IOCTL_TPM_MMIO_GET_MMIO_HISTORY CTL_CODE(FILE_DEVICE_UNKNOWN, 0x802, METHOD_BUFFERED, FILE_READ_ACCESS)
+#define RING_ENTRIES_MAX 64
+#define RING_SLOT_SIZE PAGE_SIZE // Holds any command or response up to TRANSPORT_STAGING_BUFFER_SIZE
+#define RING_REGISTRATIONS_MAX 8 // Doorbells the worker waits on, besides its own event
+#define RING_BATCH_MAX 8 // Ring entries served before the worker looks at submitted commands again
+#define TPM_DEVICE_ID_ANY 0xFFFF
+#ifndef CRB_WRITE_COMBINED
+#define CRB_WRITE_COMBINED 0 // Map the CRB data buffer write-combined on allow-listed devices; off until measured per device
+#endif
+#ifndef MMIO_RECORD
+#define MMIO_RECORD 0 // Record every register access to MMIO_RECORD_FILE_NAME
+#endif
+#define MMIO_RECORD_BUFFER_SIZE (4 * 1024 * 1024)
+#define MMIO_RECORD_FILE_NAME L"\\SystemRoot\\TpmMmio.trace"
+#define MMIO_TRACE_MAGIC 'TRMT' // "TMRT" in a hex dump
+#define MMIO_TRACE_VERSION 1
+#ifndef MMIO_REPLAY
+#define MMIO_REPLAY 0 // Replay MMIO_REPLAY_FILE_NAME in place of the device, and fail the load if the driver diverges from it
+#endif
+#define MMIO_REPLAY_FILE_NAME MMIO_RECORD_FILE_NAME
+#ifndef MMIO_HISTORY
+#define MMIO_HISTORY 1 // Keep the last register accesses of each processor
+#endif
+#define MMIO_HISTORY_ENTRIES 64 // Per processor, power of two
+#ifndef TPM_BENCHMARK
+#define TPM_BENCHMARK 0 // Run the response cache self-check and the transport benchmark at load, and fail the load on a regression
+#endif
+#define BENCHMARK_ITERATIONS 256 // Commands per size
+#define CORPUS_ITERATIONS 4096 // Passes over the response corpus per decoder
+#ifndef MMIO_FAULT_INJECTION
+#define MMIO_FAULT_INJECTION 0 // Perturb register reads from a fault script, and run the fault scenarios with the benchmark
+#endif
+#define FAULT_SCRIPT_MAX 4 // Faults per script
+#define FAULT_SCENARIO_MAX_MS 5000 // Fault scenarios whose recovery may take longer are listed but not run
+#ifndef TPM_STRESS
+#define TPM_STRESS 0 // Run concurrent clients against the command queue at load, and fail the load if one fails
+#endif
+#define STRESS_CLIENTS_MAX 64 // One client per processor, up to this many
+#define STRESS_COMMANDS_PER_CLIENT 256
+#ifndef TPM_SIMULATOR
+#define TPM_SIMULATOR 0 // Send commands to the TPM 2.0 reference simulator over TCP instead of the platform TPM
+#endif
+#define SIMULATOR_ADDRESS 0x7F000001 // 127.0.0.1
+#define SIMULATOR_COMMAND_PORT 2321
+#define SIMULATOR_PLATFORM_PORT 2322
+#define SIMULATOR_SIGNAL_POWER_ON 1
+#define SIMULATOR_SEND_COMMAND 8
+#define SIMULATOR_SIGNAL_NV_ON 11
+#define SIMULATOR_SESSION_END 20
+#define SIMULATOR_FRAME_HEADER_SIZE 9 // TPM_SEND_COMMAND, locality, command size
+#define SIMULATOR_WSK_WAIT_MS 5000 // Longest wait for the WSK subsystem at load
 
 #define SHA1_DIGEST_SIZE  20
 #define SHA1_BLOCK_SIZE   64
@@ -610,6 +727,7 @@ typedef uint32_t TPM_CC;
 #define TPM_CC_ZGen_2Phase                 (TPM_CC)(0x0000018D)
 #define TPM_CC_EC_Ephemeral                (TPM_CC)(0x0000018E)
 #define TPM_CC_LAST                        (TPM_CC)(0x0000018E)
+#define CC_VEND                            (TPM_CC)(0x20000000)
 
 // Table 15 - TPM_RC Constants (Actions)
 typedef uint32_t TPM_RC;
@@ -854,6 +972,7 @@ typedef uint32_t TPM_PT;
 #define TPM_PT_TOTAL_COMMANDS       (TPM_PT)(PT_FIXED + 41)
 #define TPM_PT_LIBRARY_COMMANDS     (TPM_PT)(PT_FIXED + 42)
 #define TPM_PT_VENDOR_COMMANDS      (TPM_PT)(PT_FIXED + 43)
+#define TPM_PT_NV_BUFFER_MAX        (TPM_PT)(PT_FIXED + 44)
 #define PT_VAR                      (TPM_PT)(PT_GROUP * 2)
 #define TPM_PT_PERMANENT            (TPM_PT)(PT_VAR + 0)
 #define TPM_PT_STARTUP_CLEAR        (TPM_PT)(PT_VAR + 1)
@@ -2100,6 +2219,95 @@ typedef struct {
 	TPM2B_NAME              QualifiedName;
 } TPM2_READ_PUBLIC_RESPONSE;
 
+typedef struct {
+	TPM2_COMMAND_HEADER    Header;
+	TPM_CAP                Capability;
+	uint32_t               Property;
+	uint32_t               PropertyCount;
+} TPM2_GET_CAPABILITY_COMMAND;
+
+typedef struct {
+	TPM2_RESPONSE_HEADER    Header;
+	TPMI_YES_NO             MoreData;
+	TPMS_CAPABILITY_DATA    CapabilityData;
+} TPM2_GET_CAPABILITY_RESPONSE;
+
+typedef struct {
+	TPM2_COMMAND_HEADER    Header;
+	TPMI_RH_NV_INDEX       NvIndex;
+} TPM2_NV_READPUBLIC_COMMAND;
+
+typedef struct {
+	TPM2_RESPONSE_HEADER    Header;
+	TPM2B_NV_PUBLIC         NvPublic;
+	TPM2B_NAME              NvName;
+} TPM2_NV_READPUBLIC_RESPONSE;
+
+typedef struct {
+	TPM2_COMMAND_HEADER    Header;
+	TPMI_RH_NV_AUTH        AuthHandle;
+	TPMI_RH_NV_INDEX       NvIndex;
+	uint32_t               AuthSessionSize;
+	TPMS_AUTH_COMMAND      AuthSession;
+	uint16_t               Size;
+	uint16_t               Offset;
+} TPM2_NV_READ_COMMAND;
+
+typedef struct {
+	TPM2_RESPONSE_HEADER    Header;
+	uint32_t                AuthSessionSize;
+	TPM2B_MAX_NV_BUFFER     Data;
+	TPMS_AUTH_RESPONSE      AuthSession;
+} TPM2_NV_READ_RESPONSE;
+
+typedef struct {
+	TPM2_COMMAND_HEADER    Header;
+	TPML_ALG               ToTest;
+} TPM2_INCREMENTAL_SELF_TEST_COMMAND;
+
+typedef struct {
+	TPM2_RESPONSE_HEADER    Header;
+	TPML_ALG                ToDoList;
+} TPM2_INCREMENTAL_SELF_TEST_RESPONSE;
+
+typedef struct {
+	TPM2_COMMAND_HEADER    Header;
+	TPMI_YES_NO            FullTest;
+} TPM2_SELF_TEST_COMMAND;
+
+typedef struct {
+	TPM2_RESPONSE_HEADER    Header;
+} TPM2_SELF_TEST_RESPONSE;
+
+typedef struct {
+	TPM2_COMMAND_HEADER    Header;
+	TPMI_DH_CONTEXT        SaveHandle;
+} TPM2_CONTEXT_SAVE_COMMAND;
+
+typedef struct {
+	TPM2_RESPONSE_HEADER    Header;
+	TPMS_CONTEXT            Context;
+} TPM2_CONTEXT_SAVE_RESPONSE;
+
+typedef struct {
+	TPM2_COMMAND_HEADER    Header;
+	TPMS_CONTEXT           Context;
+} TPM2_CONTEXT_LOAD_COMMAND;
+
+typedef struct {
+	TPM2_RESPONSE_HEADER    Header;
+	TPMI_DH_CONTEXT         LoadedHandle;
+} TPM2_CONTEXT_LOAD_RESPONSE;
+
+typedef struct {
+	TPM2_COMMAND_HEADER    Header;
+	TPMI_DH_CONTEXT        FlushHandle;
+} TPM2_FLUSH_CONTEXT_COMMAND;
+
+typedef struct {
+	TPM2_RESPONSE_HEADER    Header;
+} TPM2_FLUSH_CONTEXT_RESPONSE;
+
 typedef struct {
 	uint32_t    Signature;
 	uint32_t    Length;
@@ -0,0 +1,354 @@
+#pragma once
+
+//
+// Control device for raw command submission from user mode. Only SYSTEM and Administrators may
+// open it.
+//
+// IOCTL_TPM_MMIO_SUBMIT_COMMAND takes a marshalled command as its input buffer and returns the
+// response in its output buffer. The output buffer is METHOD_OUT_DIRECT; the queue runs the command
+// from kernel copies and writes the response into the caller's locked pages once complete. Commands
+// from every handle go through the shared TpmCommandQueue and have their transient handles
+// virtualized.
+//
+// IOCTL_TPM_MMIO_REGISTER_RING maps a TpmCommandRing into the caller for submitting many commands
+// per kernel transition (see ring.hpp). One ring per handle; it is unmapped when the handle is
+// closed.
+//
+// IOCTL_TPM_MMIO_GET_MMIO_HISTORY returns the recent register accesses (see history.hpp).
+//
+// {0b3c8f5e-7d41-4a9a-b2c6-5e8f1d7a4c93}
+//
+static const GUID TpmMmioDeviceClassGuid =
+    { 0x0b3c8f5e, 0x7d41, 0x4a9a, { 0xb2, 0xc6, 0x5e, 0x8f, 0x1d, 0x7a, 0x4c, 0x93 } };
+
+namespace device
+{
+    struct TPM_DEVICE_EXTENSION
+    {
+        TpmCommandQueue* commandQueue;
+    };
+
+    inline NTSTATUS CompleteRequest(
+        _Inout_ PIRP irp,
+        _In_ NTSTATUS status,
+        _In_ ULONG_PTR information
+    )
+    {
+        irp->IoStatus.Status = status;
+        irp->IoStatus.Information = information;
+        IoCompleteRequest(irp, IO_NO_INCREMENT);
+        return status;
+    }
+
+    inline NTSTATUS DispatchCreateClose(
+        _In_ PDEVICE_OBJECT deviceObject,
+        _Inout_ PIRP irp
+    )
+    {
+        UNREFERENCED_PARAMETER(deviceObject);
+        return CompleteRequest(irp, STATUS_SUCCESS, 0);
+    }
+
+    //
+    // Runs the command of an IOCTL_TPM_MMIO_SUBMIT_COMMAND request through the command queue.
+    //
+    // Parameters:
+    // - extension: Device extension.
+    // - irp: Request. The command is in the system buffer, the output buffer is described by MdlAddress.
+    // - responseSize: Receives the size of the response.
+    //
+    // Returns:
+    // - STATUS_SUCCESS: The response is in the output buffer; the TPM response code is in the response.
+    // - STATUS_INVALID_PARAMETER: The command is malformed, or a buffer is missing or too small.
+    // - STATUS_INSUFFICIENT_RESOURCES: The output buffer could not be mapped.
+    // - Any status returned by TpmCommandQueue::Submit.
+    //
+    inline NTSTATUS SubmitCommand(
+        _In_ TPM_DEVICE_EXTENSION* extension,
+        _In_ PIRP irp,
+        _Out_ uint32_t* responseSize
+    )
+    {
+        *responseSize = 0;
+
+        PIO_STACK_LOCATION stack = IoGetCurrentIrpStackLocation(irp);
+        uint32_t commandSize = stack->Parameters.DeviceIoControl.InputBufferLength;
+        uint32_t outputSize = stack->Parameters.DeviceIoControl.OutputBufferLength;
+        uint8_t* command = (uint8_t*)irp->AssociatedIrp.SystemBuffer;
+
+        if (!command || !TpmCommandQueue::IsWellFormed(command, commandSize))
+        {
+            DbgError("SubmitCommand - malformed command - %x.\n", commandSize);
+            return STATUS_INVALID_PARAMETER;
+        }
+
+        if (!irp->MdlAddress || outputSize < sizeof(TPM2_RESPONSE_HEADER))
+        {
+            return STATUS_INVALID_PARAMETER;
+        }
+
+        uint8_t* response = (uint8_t*)MmGetSystemAddressForMdlSafe(irp->MdlAddress, NormalPagePriority | MdlMappingNoExecute);
+        if (!response)
+        {
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        TPM_QUEUED_COMMAND queuedCommand;
+        RtlZeroMemory(&queuedCommand, sizeof(queuedCommand));
+        queuedCommand.command = command;
+        queuedCommand.commandSize = commandSize;
+        queuedCommand.response = response;
+        queuedCommand.responseSize = outputSize;
+
+        NTSTATUS status = extension->commandQueue->Submit(&queuedCommand);
+        if (NT_ERROR(status))
+        {
+            return status;
+        }
+
+        *responseSize = queuedCommand.responseSize;
+        return STATUS_SUCCESS;
+    }
+
+    //
+    // Maps a command ring into the caller and registers it with the command queue, for the
+    // lifetime of the handle.
+    //
+    // Parameters:
+    // - extension: Device extension.
+    // - irp: Request. TPM_RING_REGISTRATION in, TPM_RING_MAPPING out, through the system buffer.
+    // - information: Receives the number of bytes returned.
+    //
+    // Returns:
+    // - STATUS_SUCCESS: The ring is mapped and served.
+    // - STATUS_INVALID_PARAMETER: A buffer is too small.
+    // - STATUS_INVALID_DEVICE_STATE: The handle already has a ring.
+    // - Any status returned by TpmCommandRing::Init or TpmCommandQueue::RegisterRing.
+    //
+    inline NTSTATUS RegisterRing(
+        _In_ TPM_DEVICE_EXTENSION* extension,
+        _In_ PIRP irp,
+        _Out_ ULONG_PTR* information
+    )
+    {
+        *information = 0;
+
+        PIO_STACK_LOCATION stack = IoGetCurrentIrpStackLocation(irp);
+        if (stack->Parameters.DeviceIoControl.InputBufferLength < sizeof(TPM_RING_REGISTRATION) ||
+            stack->Parameters.DeviceIoControl.OutputBufferLength < sizeof(TPM_RING_MAPPING))
+        {
+            return STATUS_INVALID_PARAMETER;
+        }
+        if (stack->FileObject->FsContext)
+        {
+            return STATUS_INVALID_DEVICE_STATE;
+        }
+
+        TPM_RING_REGISTRATION registration;
+        memcpy(&registration, irp->AssociatedIrp.SystemBuffer, sizeof(registration));
+
+        TpmCommandRing* ring = new TpmCommandRing();
+        if (!ring)
+        {
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        TPM_RING_MAPPING mapping;
+        NTSTATUS status = ring->Init(&registration, &mapping);
+        if (NT_SUCCESS(status))
+        {
+            status = extension->commandQueue->RegisterRing(ring);
+        }
+        if (NT_ERROR(status))
+        {
+            ring->Unmap();
+            delete ring;
+            return status;
+        }
+
+        //
+        // Two registrations racing on the same handle: the loser backs out.
+        //
+        if (InterlockedCompareExchangePointer(&stack->FileObject->FsContext, ring, nullptr) != nullptr)
+        {
+            extension->commandQueue->UnregisterRing(ring);
+            ring->Unmap();
+            delete ring;
+            return STATUS_INVALID_DEVICE_STATE;
+        }
+
+        memcpy(irp->AssociatedIrp.SystemBuffer, &mapping, sizeof(mapping));
+        *information = sizeof(mapping);
+        return STATUS_SUCCESS;
+    }
+
+    //
+    // Unregisters and unmaps the ring of a handle being closed. Runs in the context of the process
+    // that mapped it.
+    //
+    inline NTSTATUS DispatchCleanup(
+        _In_ PDEVICE_OBJECT deviceObject,
+        _Inout_ PIRP irp
+    )
+    {
+        TPM_DEVICE_EXTENSION* extension = (TPM_DEVICE_EXTENSION*)deviceObject->DeviceExtension;
+        PIO_STACK_LOCATION stack = IoGetCurrentIrpStackLocation(irp);
+
+        TpmCommandRing* ring = (TpmCommandRing*)InterlockedExchangePointer(&stack->FileObject->FsContext, nullptr);
+        if (ring)
+        {
+            extension->commandQueue->UnregisterRing(ring);
+            ring->Unmap();
+            delete ring;
+        }
+        return CompleteRequest(irp, STATUS_SUCCESS, 0);
+    }
+
+    //
+    // Copies a register access history snapshot for IOCTL_TPM_MMIO_GET_MMIO_HISTORY.
+    //
+    // Parameters:
+    // - irp: Request. TPM_MMIO_HISTORY_QUERY in, TPM_MMIO_HISTORY_SNAPSHOT out, through the system buffer.
+    // - information: Receives the number of bytes returned.
+    //
+    // Returns:
+    // - STATUS_INVALID_PARAMETER: The input buffer is too small.
+    // - Any status returned by history::GetSnapshot.
+    //
+    inline NTSTATUS GetMmioHistory(
+        _In_ PIRP irp,
+        _Out_ ULONG_PTR* information
+    )
+    {
+        *information = 0;
+
+        PIO_STACK_LOCATION stack = IoGetCurrentIrpStackLocation(irp);
+        if (stack->Parameters.DeviceIoControl.InputBufferLength < sizeof(TPM_MMIO_HISTORY_QUERY))
+        {
+            return STATUS_INVALID_PARAMETER;
+        }
+
+        TPM_MMIO_HISTORY_QUERY query;
+        memcpy(&query, irp->AssociatedIrp.SystemBuffer, sizeof(query));
+
+        uint32_t written = 0;
+        NTSTATUS status = history::GetSnapshot(
+            query.Source,
+            (TPM_MMIO_HISTORY_SNAPSHOT*)irp->AssociatedIrp.SystemBuffer,
+            stack->Parameters.DeviceIoControl.OutputBufferLength,
+            &written
+        );
+        *information = written;
+        return status;
+    }
+
+    inline NTSTATUS DispatchDeviceControl(
+        _In_ PDEVICE_OBJECT deviceObject,
+        _Inout_ PIRP irp
+    )
+    {
+        TPM_DEVICE_EXTENSION* extension = (TPM_DEVICE_EXTENSION*)deviceObject->DeviceExtension;
+        PIO_STACK_LOCATION stack = IoGetCurrentIrpStackLocation(irp);
+
+        switch (stack->Parameters.DeviceIoControl.IoControlCode)
+        {
+        case IOCTL_TPM_MMIO_SUBMIT_COMMAND:
+        {
+            uint32_t responseSize = 0;
+            NTSTATUS status = SubmitCommand(extension, irp, &responseSize);
+            return CompleteRequest(irp, status, responseSize);
+        }
+        case IOCTL_TPM_MMIO_REGISTER_RING:
+        {
+            ULONG_PTR information = 0;
+            NTSTATUS status = RegisterRing(extension, irp, &information);
+            return CompleteRequest(irp, status, information);
+        }
+        case IOCTL_TPM_MMIO_GET_MMIO_HISTORY:
+        {
+            ULONG_PTR information = 0;
+            NTSTATUS status = GetMmioHistory(irp, &information);
+            return CompleteRequest(irp, status, information);
+        }
+        default:
+            return CompleteRequest(irp, STATUS_INVALID_DEVICE_REQUEST, 0);
+        }
+    }
+
+    //
+    // Creates the control device and its symbolic link.
+    //
+    // Parameters:
+    // - driverObject: Driver object.
+    // - commandQueue: Started command queue. Owned by the device on success, deleted with it.
+    //
+    // Returns:
+    // - STATUS_SUCCESS: The device accepts requests.
+    // - Any status returned by IoCreateDeviceSecure or IoCreateSymbolicLink.
+    //
+    inline NTSTATUS Create(
+        _In_ PDRIVER_OBJECT driverObject,
+        _In_ TpmCommandQueue* commandQueue
+    )
+    {
+        UNICODE_STRING deviceName = RTL_CONSTANT_STRING(TPM_MMIO_DEVICE_NAME);
+        UNICODE_STRING symbolicLinkName = RTL_CONSTANT_STRING(TPM_MMIO_SYMBOLIC_LINK_NAME);
+
+        PDEVICE_OBJECT deviceObject = nullptr;
+        NTSTATUS status = IoCreateDeviceSecure(
+            driverObject,
+            sizeof(TPM_DEVICE_EXTENSION),
+            &deviceName,
+            FILE_DEVICE_UNKNOWN,
+            FILE_DEVICE_SECURE_OPEN,
+            FALSE,
+            &SDDL_DEVOBJ_SYS_ALL_ADM_ALL,
+            &TpmMmioDeviceClassGuid,
+            &deviceObject
+        );
+        if (NT_ERROR(status))
+        {
+            DbgError("device::Create - IoCreateDeviceSecure failed with 0x%08x.\n", status);
+            return status;
+        }
+
+        status = IoCreateSymbolicLink(&symbolicLinkName, &deviceName);
+        if (NT_ERROR(status))
+        {
+            DbgError("device::Create - IoCreateSymbolicLink failed with 0x%08x.\n", status);
+            IoDeleteDevice(deviceObject);
+            return status;
+        }
+
+        TPM_DEVICE_EXTENSION* extension = (TPM_DEVICE_EXTENSION*)deviceObject->DeviceExtension;
+        extension->commandQueue = commandQueue;
+
+        driverObject->MajorFunction[IRP_MJ_CREATE] = DispatchCreateClose;
+        driverObject->MajorFunction[IRP_MJ_CLOSE] = DispatchCreateClose;
+        driverObject->MajorFunction[IRP_MJ_CLEANUP] = DispatchCleanup;
+        driverObject->MajorFunction[IRP_MJ_DEVICE_CONTROL] = DispatchDeviceControl;
+
+        deviceObject->Flags |= DO_DIRECT_IO;
+        deviceObject->Flags &= ~DO_DEVICE_INITIALIZING;
+        return STATUS_SUCCESS;
+    }
+
+    //
+    // Deletes the control device, after its command queue has drained. Does nothing if it was never created.
+    //
+    inline void Delete(_In_ PDRIVER_OBJECT driverObject)
+    {
+        PDEVICE_OBJECT deviceObject = driverObject->DeviceObject;
+        if (!deviceObject)
+        {
+            return;
+        }
+
+        UNICODE_STRING symbolicLinkName = RTL_CONSTANT_STRING(TPM_MMIO_SYMBOLIC_LINK_NAME);
+        (void)IoDeleteSymbolicLink(&symbolicLinkName);
+
+        TPM_DEVICE_EXTENSION* extension = (TPM_DEVICE_EXTENSION*)deviceObject->DeviceExtension;
+        delete extension->commandQueue;
+        IoDeleteDevice(deviceObject);
+    }
+}
@@ -0,0 +1,175 @@
+#pragma once
+
+//
+// Register fault injection for exercising the transport recovery paths on a live TPM. Compiled
+// in with MMIO_FAULT_INJECTION; everything here is a no-op otherwise.
+//
+// A script is a list of TPM_FAULT, each of which perturbs what the driver reads back from one
+// register: delays the read, or forces bits set or clear. A fault can be armed by a write to a
+// register (e.g. tpmGo, to only fault the response phase) and released by another (e.g. Cancel,
+// to have the command complete as soon as it is cancelled), and can wear off after a number of
+// reads. Writes always reach the device, so the TPM itself never sees the fault.
+//
+// Scripts must not be armed while commands are running on other threads.
+//
+enum TPM_FAULT_KIND
+{
+    TpmFaultDelay,                  // Stall DelayMicroseconds before the read
+    TpmFaultSetBits,                // Read Mask bits as 1
+    TpmFaultClearBits               // Read Mask bits as 0
+};
+
+struct TPM_FAULT
+{
+    TPM_FAULT_KIND Kind;
+    uint32_t Register;              // Offset of the faulted register from the interface base
+    uint32_t Mask;
+    uint32_t DelayMicroseconds;
+    uint32_t Reads;                 // Faulted reads before the fault wears off, 0 for no limit
+    uint32_t TriggerRegister;       // Offset of the register whose write arms the fault ...
+    uint32_t TriggerMask;           // ... with these bits set, 0 to arm at once
+    uint32_t ReleaseRegister;       // Offset of the register whose write releases the fault ...
+    uint32_t ReleaseMask;           // ... with these bits set, 0 to never release
+};
+
+namespace fault
+{
+    struct MMIO_FAULT_STATE
+    {
+        TPM_FAULT fault;
+        uint32_t reads;
+        bool armed;
+        bool released;
+    };
+
+    struct MMIO_FAULT_SCRIPT
+    {
+        uintptr_t base;
+        uint32_t count;
+        MMIO_FAULT_STATE faults[FAULT_SCRIPT_MAX];
+    };
+
+    inline MMIO_FAULT_SCRIPT& Script()
+    {
+        static MMIO_FAULT_SCRIPT script = { 0 };
+        return script;
+    }
+
+    //
+    // Replaces the active script.
+    //
+    // Parameters:
+    // - base: Physical base address of the TPM interface the register offsets are relative to.
+    // - faults: Faults to inject, up to FAULT_SCRIPT_MAX.
+    // - count: Number of faults.
+    //
+    inline void Arm(
+        _In_ uintptr_t base,
+        _In_reads_(count) const TPM_FAULT* faults,
+        _In_ uint32_t count
+    )
+    {
+#if MMIO_FAULT_INJECTION
+        MMIO_FAULT_SCRIPT& script = Script();
+        RtlZeroMemory(&script, sizeof(script));
+        script.base = base;
+        script.count = min(count, (uint32_t)FAULT_SCRIPT_MAX);
+        for (uint32_t i = 0; i < script.count; i++)
+        {
+            script.faults[i].fault = faults[i];
+            script.faults[i].armed = (faults[i].TriggerMask == 0);
+        }
+#else
+        UNREFERENCED_PARAMETER(base);
+        UNREFERENCED_PARAMETER(faults);
+        UNREFERENCED_PARAMETER(count);
+#endif
+    }
+
+    inline void Disarm()
+    {
+#if MMIO_FAULT_INJECTION
+        RtlZeroMemory(&Script(), sizeof(MMIO_FAULT_SCRIPT));
+#endif
+    }
+
+    //
+    // Applies the active faults of a register to the value just read from it.
+    //
+    inline void Read(
+        _In_ uintptr_t physicalAddress,
+        _In_ uint32_t len,
+        _Inout_updates_bytes_(len) void* data
+    )
+    {
+#if MMIO_FAULT_INJECTION
+        MMIO_FAULT_SCRIPT& script = Script();
+        for (uint32_t i = 0; i < script.count; i++)
+        {
+            MMIO_FAULT_STATE& state = script.faults[i];
+            const TPM_FAULT& fault = state.fault;
+            if (!state.armed || state.released || script.base + fault.Register != physicalAddress ||
+                (fault.Reads && state.reads >= fault.Reads))
+            {
+                continue;
+            }
+            state.reads++;
+
+            uint64_t value = 0;
+            memcpy(&value, data, min(len, (uint32_t)sizeof(value)));
+            switch (fault.Kind)
+            {
+            case TpmFaultDelay:
+                KeStallExecutionProcessor(fault.DelayMicroseconds);
+                break;
+            case TpmFaultSetBits:
+                value |= fault.Mask;
+                break;
+            case TpmFaultClearBits:
+                value &= ~(uint64_t)fault.Mask;
+                break;
+            }
+            memcpy(data, &value, min(len, (uint32_t)sizeof(value)));
+        }
+#else
+        UNREFERENCED_PARAMETER(physicalAddress);
+        UNREFERENCED_PARAMETER(len);
+        UNREFERENCED_PARAMETER(data);
+#endif
+    }
+
+    //
+    // Arms and releases the faults triggered by a register write.
+    //
+    inline void Write(
+        _In_ uintptr_t physicalAddress,
+        _In_ uint32_t len,
+        _In_reads_bytes_(len) const void* data
+    )
+    {
+#if MMIO_FAULT_INJECTION
+        MMIO_FAULT_SCRIPT& script = Script();
+        uint64_t value = 0;
+        memcpy(&value, data, min(len, (uint32_t)sizeof(value)));
+        for (uint32_t i = 0; i < script.count; i++)
+        {
+            MMIO_FAULT_STATE& state = script.faults[i];
+            const TPM_FAULT& fault = state.fault;
+            if (!state.armed && fault.TriggerMask && script.base + fault.TriggerRegister == physicalAddress &&
+                (value & fault.TriggerMask) == fault.TriggerMask)
+            {
+                state.armed = true;
+            }
+            else if (state.armed && fault.ReleaseMask && script.base + fault.ReleaseRegister == physicalAddress &&
+                (value & fault.ReleaseMask) == fault.ReleaseMask)
+            {
+                state.released = true;
+            }
+        }
+#else
+        UNREFERENCED_PARAMETER(physicalAddress);
+        UNREFERENCED_PARAMETER(len);
+        UNREFERENCED_PARAMETER(data);
+#endif
+    }
+}
@@ -0,0 +1,252 @@
+#pragma once
+
+//
+// Digests computed by TpmFingerprintEngine.
+//
+struct TPM_FINGERPRINT
+{
+    uint8_t Md5[FINGERPRINT_MD5_SIZE];
+    uint8_t Sha1[SHA1_DIGEST_SIZE];
+    uint8_t Sha256[SHA256_DIGEST_SIZE];
+};
+
+//
+// Dumps buffers as hex along with their MD5, SHA-1 and SHA-256 fingerprints.
+//
+// The providers and hash objects are opened once with BCRYPT_HASH_REUSABLE_FLAG. The data is fed to
+// all three hashes in FINGERPRINT_CHUNK_SIZE pieces, so each piece is read from memory once and hashed
+// while it is still in cache.
+//
+class TpmFingerprintEngine
+{
+private:
+
+    static const uint32_t DigestCount = 3;
+
+    BCRYPT_ALG_HANDLE algorithms[DigestCount] = { };
+    BCRYPT_HASH_HANDLE hashes[DigestCount] = { };
+
+    template<typename T>
+    static T ReadUnaligned(const void* source)
+    {
+        T value;
+        RtlCopyMemory(&value, source, sizeof(T));
+        return value;
+    }
+
+    template<typename T>
+    static void WriteUnaligned(void* destination, T value)
+    {
+        RtlCopyMemory(destination, &value, sizeof(T));
+    }
+
+    //
+    // Converts four bytes to eight hex digits at once. Each byte is spread into its own 16-bit lane,
+    // split into nibbles (high nibble in the low byte, so it lands first in memory), and every lane is
+    // mapped to '0'-'9' or 'a'-'f' without branches.
+    //
+    static uint64_t EncodeHex4(_In_ uint32_t value)
+    {
+        uint64_t lanes = (uint64_t)(value & 0x000000FF) |
+            ((uint64_t)(value & 0x0000FF00) << 8) |
+            ((uint64_t)(value & 0x00FF0000) << 16) |
+            ((uint64_t)(value & 0xFF000000) << 24);
+
+        uint64_t nibbles = ((lanes >> 4) & 0x000F000F000F000FULL) | ((lanes & 0x000F000F000F000FULL) << 8);
+
+        // 1 in every lane holding 10-15.
+        uint64_t letters = ((nibbles + 0x0606060606060606ULL) >> 4) & 0x0101010101010101ULL;
+
+        return nibbles + 0x3030303030303030ULL + letters * ('a' - '0' - 10);
+    }
+
+public:
+
+    ~TpmFingerprintEngine()
+    {
+        for (uint32_t i = 0; i < DigestCount; i++)
+        {
+            if (this->hashes[i])
+            {
+                BCryptDestroyHash(this->hashes[i]);
+            }
+            if (this->algorithms[i])
+            {
+                BCryptCloseAlgorithmProvider(this->algorithms[i], 0);
+            }
+        }
+    }
+
+    //
+    // Opens the MD5, SHA-1 and SHA-256 providers and their reusable hash objects.
+    //
+    // Returns:
+    // - STATUS_SUCCESS: The engine is ready.
+    // - Any status returned by CNG.
+    //
+    NTSTATUS Init()
+    {
+        const PCWSTR algorithmIds[DigestCount] = { BCRYPT_MD5_ALGORITHM, BCRYPT_SHA1_ALGORITHM, BCRYPT_SHA256_ALGORITHM };
+
+        for (uint32_t i = 0; i < DigestCount; i++)
+        {
+            if (this->hashes[i])
+            {
+                continue;
+            }
+
+            NTSTATUS status = BCryptOpenAlgorithmProvider(&this->algorithms[i], algorithmIds[i], NULL, BCRYPT_HASH_REUSABLE_FLAG);
+            if (NT_ERROR(status))
+            {
+                DbgError("TpmFingerprintEngine::Init - BCryptOpenAlgorithmProvider failed with 0x%08x.\n", status);
+                this->algorithms[i] = nullptr;
+                return status;
+            }
+
+            status = BCryptCreateHash(this->algorithms[i], &this->hashes[i], NULL, 0, NULL, 0, BCRYPT_HASH_REUSABLE_FLAG);
+            if (NT_ERROR(status))
+            {
+                DbgError("TpmFingerprintEngine::Init - BCryptCreateHash failed with 0x%08x.\n", status);
+                this->hashes[i] = nullptr;
+                return status;
+            }
+        }
+        return STATUS_SUCCESS;
+    }
+
+    //
+    // Computes every fingerprint of a buffer in a single pass over it.
+    //
+    // Parameters:
+    // - buffer: Data to fingerprint.
+    // - size: Size of buffer in bytes.
+    // - fingerprint: Receives the digests.
+    //
+    // Returns:
+    // - STATUS_SUCCESS: The digests were computed.
+    // - STATUS_INVALID_DEVICE_STATE: Init was not called or failed.
+    // - Any status returned by CNG.
+    //
+    NTSTATUS Compute(
+        _In_reads_bytes_(size) const uint8_t* buffer,
+        _In_ uint32_t size,
+        _Out_ TPM_FINGERPRINT* fingerprint
+    )
+    {
+        PUCHAR digests[DigestCount] = { fingerprint->Md5, fingerprint->Sha1, fingerprint->Sha256 };
+        const ULONG digestSizes[DigestCount] = { sizeof(fingerprint->Md5), sizeof(fingerprint->Sha1), sizeof(fingerprint->Sha256) };
+
+        for (uint32_t i = 0; i < DigestCount; i++)
+        {
+            if (!this->hashes[i])
+            {
+                return STATUS_INVALID_DEVICE_STATE;
+            }
+        }
+
+        NTSTATUS status = STATUS_SUCCESS;
+        for (uint32_t offset = 0; offset < size && NT_SUCCESS(status); offset += FINGERPRINT_CHUNK_SIZE)
+        {
+            ULONG chunkSize = min(size - offset, (uint32_t)FINGERPRINT_CHUNK_SIZE);
+            for (uint32_t i = 0; i < DigestCount && NT_SUCCESS(status); i++)
+            {
+                status = BCryptHashData(this->hashes[i], (PUCHAR)(buffer + offset), chunkSize, 0);
+            }
+        }
+
+        //
+        // Finish every hash even after a failure, since finishing is what resets a reusable hash object.
+        //
+        for (uint32_t i = 0; i < DigestCount; i++)
+        {
+            NTSTATUS finishStatus = BCryptFinishHash(this->hashes[i], digests[i], digestSizes[i], 0);
+            if (NT_SUCCESS(status))
+            {
+                status = finishStatus;
+            }
+        }
+        return status;
+    }
+
+    //
+    // Returns the size of the buffer EncodeHex needs for size bytes, including the terminator.
+    //
+    static uint32_t GetHexSize(_In_ uint32_t size)
+    {
+        return size * 2 + 1;
+    }
+
+    //
+    // Encodes a buffer as lowercase hex.
+    //
+    // Parameters:
+    // - buffer: Data to encode.
+    // - size: Size of buffer in bytes.
+    // - hex: Receives the null-terminated hex string, GetHexSize(size) bytes.
+    //
+    static void EncodeHex(
+        _In_reads_bytes_(size) const uint8_t* buffer,
+        _In_ uint32_t size,
+        _Out_writes_z_(size * 2 + 1) char* hex
+    )
+    {
+        static const char digits[] = "0123456789abcdef";
+
+        uint32_t i = 0;
+        for (; i + sizeof(uint32_t) <= size; i += sizeof(uint32_t))
+        {
+            WriteUnaligned<uint64_t>(hex + i * 2, EncodeHex4(ReadUnaligned<uint32_t>(buffer + i)));
+        }
+
+        for (; i < size; i++)
+        {
+            hex[i * 2] = digits[buffer[i] >> 4];
+            hex[i * 2 + 1] = digits[buffer[i] & 0x0F];
+        }
+        hex[size * 2] = '\0';
+    }
+
+    //
+    // Prints a buffer as hex, followed by its fingerprints. The hex is printed in lines of
+    // FINGERPRINT_LINE_BYTES bytes to stay below the DbgPrint message limit.
+    //
+    // Parameters:
+    // - label: Name printed before the buffer.
+    // - buffer: Data to print.
+    // - size: Size of buffer in bytes.
+    //
+    void Print(
+        _In_z_ const char* label,
+        _In_reads_bytes_(size) const uint8_t* buffer,
+        _In_ uint32_t size
+    )
+    {
+        Dbg("%s (size: %u):\n", label, size);
+
+        char* hex = new char[GetHexSize(size)];
+        if (hex)
+        {
+            EncodeHex(buffer, size, hex);
+            for (uint32_t offset = 0; offset < size; offset += FINGERPRINT_LINE_BYTES)
+            {
+                uint32_t lineSize = min(size - offset, (uint32_t)FINGERPRINT_LINE_BYTES);
+                DbgPrintEx(0, 0, "\t%.*s\n", lineSize * 2, hex + offset * 2);
+            }
+            delete[] hex;
+        }
+
+        TPM_FINGERPRINT fingerprint;
+        if (NT_ERROR(this->Compute(buffer, size, &fingerprint)))
+        {
+            return;
+        }
+
+        char digestHex[sizeof(fingerprint.Sha256) * 2 + 1];
+        EncodeHex(fingerprint.Md5, sizeof(fingerprint.Md5), digestHex);
+        DbgPrintEx(0, 0, "\t[!] MD5: %s\n", digestHex);
+        EncodeHex(fingerprint.Sha1, sizeof(fingerprint.Sha1), digestHex);
+        DbgPrintEx(0, 0, "\t[!] SHA-1: %s\n", digestHex);
+        EncodeHex(fingerprint.Sha256, sizeof(fingerprint.Sha256), digestHex);
+        DbgPrintEx(0, 0, "\t[!] SHA-256: %s\n", digestHex);
+    }
+};
@@ -0,0 +1,347 @@
+#pragma once
+
+//
+// Always-on history of the last MMIO_HISTORY_ENTRIES register accesses on each processor, for
+// diagnosing slow or stalled commands without a debugger. Compiled in unless MMIO_HISTORY is 0.
+//
+// Every processor has its own ring, so logging never contends on a lock. Writers reserve a slot
+// with an interlocked increment; each entry carries the sequence number it was written with, and
+// snapshots drop entries that were being overwritten while they were copied.
+//
+// The wait loops log a timeout entry and capture a snapshot when they give up, so the accesses that
+// led up to the stall can be read with IOCTL_TPM_MMIO_GET_MMIO_HISTORY afterwards.
+//
+enum TPM_MMIO_HISTORY_KIND : uint8_t
+{
+    TpmMmioHistoryRead,
+    TpmMmioHistoryWrite,
+    TpmMmioHistoryTimeout           // A wait loop gave up on the register; Value is the time waited in us
+};
+
+struct TPM_MMIO_HISTORY_ENTRY
+{
+    volatile LONG64 Sequence;       // 1-based position in the ring of the processor, 0 while written
+    uint64_t Timestamp;             // ReadTimeStampCounter
+    uint64_t Address;               // Physical address
+    uint64_t Value;
+    uint8_t Width;
+    uint8_t Kind;                   // TPM_MMIO_HISTORY_KIND
+    uint16_t Processor;
+    uint32_t Reserved;
+};
+
+enum TPM_MMIO_HISTORY_SOURCE : uint32_t
+{
+    TpmMmioHistoryNone,
+    TpmMmioHistoryLive,             // Taken when requested
+    TpmMmioHistoryLastStall         // Taken by the last wait loop that timed out
+};
+
+//
+// Input of IOCTL_TPM_MMIO_GET_MMIO_HISTORY.
+//
+struct TPM_MMIO_HISTORY_QUERY
+{
+    uint32_t Source;                // TpmMmioHistoryLive or TpmMmioHistoryLastStall
+    uint32_t Reserved;
+};
+
+//
+// Output of IOCTL_TPM_MMIO_GET_MMIO_HISTORY, followed by EntryCount entries. Entries are grouped
+// by processor and ordered by sequence within a processor; merge them on Timestamp.
+//
+struct TPM_MMIO_HISTORY_SNAPSHOT
+{
+    uint32_t Source;                // TPM_MMIO_HISTORY_SOURCE
+    uint32_t EntryCount;            // Entries that follow, or the capacity needed with STATUS_BUFFER_OVERFLOW
+    uint64_t Timestamp;             // ReadTimeStampCounter when the snapshot was taken
+};
+
+namespace history
+{
+    struct MMIO_HISTORY_RING
+    {
+        volatile LONG64 next;
+        TPM_MMIO_HISTORY_ENTRY entries[MMIO_HISTORY_ENTRIES];
+    };
+
+    struct MMIO_HISTORY_STATE
+    {
+        MMIO_HISTORY_RING* rings;
+        uint32_t processors;
+        TPM_MMIO_HISTORY_SNAPSHOT* stall;
+        volatile LONG stallBusy;
+    };
+
+    inline MMIO_HISTORY_STATE& History()
+    {
+        static MMIO_HISTORY_STATE history = { 0 };
+        return history;
+    }
+
+    //
+    // Returns the size of a snapshot holding every ring.
+    //
+    inline uint32_t GetSnapshotSize()
+    {
+        return sizeof(TPM_MMIO_HISTORY_SNAPSHOT) + History().processors * MMIO_HISTORY_ENTRIES * sizeof(TPM_MMIO_HISTORY_ENTRY);
+    }
+
+    //
+    // Allocates a ring per active processor and the stall snapshot. Must be paired with Shutdown.
+    //
+    // Returns:
+    // - STATUS_SUCCESS: Logging, or MMIO_HISTORY is off.
+    // - STATUS_INSUFFICIENT_RESOURCES: The rings could not be allocated.
+    //
+    inline NTSTATUS Init()
+    {
+#if MMIO_HISTORY
+        MMIO_HISTORY_STATE& history = History();
+        history.processors = KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+        history.stall = (TPM_MMIO_HISTORY_SNAPSHOT*)pool::Allocate(GetSnapshotSize());
+        MMIO_HISTORY_RING* rings = (MMIO_HISTORY_RING*)pool::Allocate(history.processors * sizeof(MMIO_HISTORY_RING));
+        if (!history.stall || !rings)
+        {
+            DbgError("history::Init - failed to allocate rings for %u processors.\n", history.processors);
+            pool::Free(history.stall);
+            pool::Free(rings);
+            RtlZeroMemory(&history, sizeof(history));
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+        RtlZeroMemory(history.stall, GetSnapshotSize());
+        RtlZeroMemory(rings, history.processors * sizeof(MMIO_HISTORY_RING));
+        history.rings = rings;
+#endif
+        return STATUS_SUCCESS;
+    }
+
+    //
+    // Frees the rings, once no more accesses can be made.
+    //
+    inline void Shutdown()
+    {
+#if MMIO_HISTORY
+        MMIO_HISTORY_STATE& history = History();
+        pool::Free(history.rings);
+        pool::Free(history.stall);
+        RtlZeroMemory(&history, sizeof(history));
+#endif
+    }
+
+    //
+    // Logs one access in the ring of the current processor. Safe at any IRQL.
+    //
+    // Parameters:
+    // - kind: Kind of the entry.
+    // - physicalAddress: Physical address of the register.
+    // - width: Width of the access, at most 8 bytes are kept.
+    // - value: Value read or written.
+    //
+    inline void Log(
+        _In_ TPM_MMIO_HISTORY_KIND kind,
+        _In_ uint64_t physicalAddress,
+        _In_ uint32_t width,
+        _In_reads_bytes_(width) const void* value
+    )
+    {
+#if MMIO_HISTORY
+        MMIO_HISTORY_STATE& history = History();
+        if (!history.rings)
+        {
+            return;
+        }
+
+        //
+        // Below DISPATCH_LEVEL the writer could be preempted or moved to another processor between
+        // the sequence updates, leaving its slot half written while others log into the same ring.
+        //
+        KIRQL oldIrql = KeGetCurrentIrql();
+        bool raised = oldIrql < DISPATCH_LEVEL;
+        if (raised)
+        {
+            oldIrql = KeRaiseIrqlToDpcLevel();
+        }
+
+        ULONG processor = KeGetCurrentProcessorNumberEx(NULL);
+        if (processor >= history.processors)
+        {
+            if (raised)
+            {
+                KeLowerIrql(oldIrql);
+            }
+            return;
+        }
+
+        MMIO_HISTORY_RING* ring = &history.rings[processor];
+        LONG64 sequence = InterlockedIncrement64(&ring->next);
+        TPM_MMIO_HISTORY_ENTRY* entry = &ring->entries[(sequence - 1) & (MMIO_HISTORY_ENTRIES - 1)];
+
+        (void)InterlockedExchange64(&entry->Sequence, 0);
+        entry->Timestamp = ReadTimeStampCounter();
+        entry->Address = physicalAddress;
+        entry->Value = 0;
+        RtlCopyMemory(&entry->Value, value, min(width, (uint32_t)sizeof(entry->Value)));
+        entry->Width = (uint8_t)width;
+        entry->Kind = (uint8_t)kind;
+        entry->Processor = (uint16_t)processor;
+        entry->Reserved = 0;
+        WriteRelease64(&entry->Sequence, sequence);
+
+        if (raised)
+        {
+            KeLowerIrql(oldIrql);
+        }
+#else
+        UNREFERENCED_PARAMETER(kind);
+        UNREFERENCED_PARAMETER(physicalAddress);
+        UNREFERENCED_PARAMETER(width);
+        UNREFERENCED_PARAMETER(value);
+#endif
+    }
+
+    //
+    // Copies every ring into a snapshot of GetSnapshotSize bytes. Writers are not stopped; entries
+    // rewritten during the copy are left out.
+    //
+    inline void Take(
+        _In_ TPM_MMIO_HISTORY_SOURCE source,
+        _Out_ TPM_MMIO_HISTORY_SNAPSHOT* snapshot
+    )
+    {
+        MMIO_HISTORY_STATE& history = History();
+        TPM_MMIO_HISTORY_ENTRY* entries = (TPM_MMIO_HISTORY_ENTRY*)(snapshot + 1);
+        uint32_t count = 0;
+
+        snapshot->Source = source;
+        snapshot->Timestamp = ReadTimeStampCounter();
+        for (uint32_t processor = 0; processor < history.processors; processor++)
+        {
+            MMIO_HISTORY_RING* ring = &history.rings[processor];
+            LONG64 next = ReadAcquire64(&ring->next);
+            LONG64 first = max(next - MMIO_HISTORY_ENTRIES, 0ll) + 1;
+            for (LONG64 sequence = first; sequence <= next; sequence++)
+            {
+                const TPM_MMIO_HISTORY_ENTRY* entry = &ring->entries[(sequence - 1) & (MMIO_HISTORY_ENTRIES - 1)];
+                if (ReadAcquire64(&entry->Sequence) != sequence)
+                {
+                    continue;
+                }
+                RtlCopyMemory(&entries[count], (const void*)entry, sizeof(*entry));
+                KeMemoryBarrier();
+                if (ReadAcquire64(&entry->Sequence) != sequence)
+                {
+                    continue;
+                }
+                entries[count].Sequence = sequence;
+                count++;
+            }
+        }
+        snapshot->EntryCount = count;
+    }
+
+    //
+    // Logs a wait loop giving up on a register and keeps a snapshot of the history that led to it.
+    // A stall during another capture keeps the earlier snapshot.
+    //
+    // Parameters:
+    // - physicalAddress: Physical address of the register polled.
+    // - waitedMicroseconds: Time spent polling.
+    //
+    inline void Stall(
+        _In_ uint64_t physicalAddress,
+        _In_ uint32_t waitedMicroseconds
+    )
+    {
+#if MMIO_HISTORY
+        Log(TpmMmioHistoryTimeout, physicalAddress, sizeof(waitedMicroseconds), &waitedMicroseconds);
+
+        MMIO_HISTORY_STATE& history = History();
+        if (!history.rings || InterlockedCompareExchange(&history.stallBusy, 1, 0) != 0)
+        {
+            return;
+        }
+        Take(TpmMmioHistoryLastStall, history.stall);
+        WriteRelease(&history.stallBusy, 0);
+        Dbg("Register 0x%llx stalled for %u us, MMIO history captured.\n", physicalAddress, waitedMicroseconds);
+#else
+        UNREFERENCED_PARAMETER(physicalAddress);
+        UNREFERENCED_PARAMETER(waitedMicroseconds);
+#endif
+    }
+
+    //
+    // Copies a snapshot out, for IOCTL_TPM_MMIO_GET_MMIO_HISTORY.
+    //
+    // Parameters:
+    // - source: TpmMmioHistoryLive to take one now, TpmMmioHistoryLastStall for the last stall.
+    // - snapshot: Receives the snapshot.
+    // - size: Size of snapshot in bytes.
+    // - written: Receives the number of bytes written.
+    //
+    // Returns:
+    // - STATUS_SUCCESS: snapshot holds the entries.
+    // - STATUS_BUFFER_OVERFLOW: Only the header was written; EntryCount is the capacity needed.
+    // - STATUS_BUFFER_TOO_SMALL: size cannot hold the header.
+    // - STATUS_NOT_FOUND: No wait loop has stalled yet.
+    // - STATUS_DEVICE_BUSY: A stall is being captured.
+    // - STATUS_NOT_SUPPORTED: MMIO_HISTORY is off, or the rings could not be allocated.
+    // - STATUS_INVALID_PARAMETER: Unknown source.
+    //
+    inline NTSTATUS GetSnapshot(
+        _In_ uint32_t source,
+        _Out_writes_bytes_(size) TPM_MMIO_HISTORY_SNAPSHOT* snapshot,
+        _In_ uint32_t size,
+        _Out_ uint32_t* written
+    )
+    {
+        *written = 0;
+
+        MMIO_HISTORY_STATE& history = History();
+        if (!history.rings)
+        {
+            return STATUS_NOT_SUPPORTED;
+        }
+        if (source != TpmMmioHistoryLive && source != TpmMmioHistoryLastStall)
+        {
+            return STATUS_INVALID_PARAMETER;
+        }
+        if (size < sizeof(TPM_MMIO_HISTORY_SNAPSHOT))
+        {
+            return STATUS_BUFFER_TOO_SMALL;
+        }
+        if (size < GetSnapshotSize())
+        {
+            snapshot->Source = TpmMmioHistoryNone;
+            snapshot->EntryCount = history.processors * MMIO_HISTORY_ENTRIES;
+            snapshot->Timestamp = 0;
+            *written = sizeof(TPM_MMIO_HISTORY_SNAPSHOT);
+            return STATUS_BUFFER_OVERFLOW;
+        }
+
+        if (source == TpmMmioHistoryLive)
+        {
+            Take(TpmMmioHistoryLive, snapshot);
+        }
+        else
+        {
+            if (InterlockedCompareExchange(&history.stallBusy, 1, 0) != 0)
+            {
+                return STATUS_DEVICE_BUSY;
+            }
+            bool stalled = (history.stall->Source == TpmMmioHistoryLastStall);
+            if (stalled)
+            {
+                RtlCopyMemory(snapshot, history.stall, sizeof(*snapshot) + history.stall->EntryCount * sizeof(TPM_MMIO_HISTORY_ENTRY));
+            }
+            WriteRelease(&history.stallBusy, 0);
+            if (!stalled)
+            {
+                return STATUS_NOT_FOUND;
+            }
+        }
+
+        *written = sizeof(*snapshot) + snapshot->EntryCount * sizeof(TPM_MMIO_HISTORY_ENTRY);
+        return STATUS_SUCCESS;
+    }
+}
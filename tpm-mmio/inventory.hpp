@@ -0,0 +1,238 @@
+#pragma once
+
+//
+// Header of one object in a TpmObjectInventory arena. It is followed by publicSize bytes of
+// marshalled TPM2B_PUBLIC (as returned by the TPM), nameSize bytes of Name and
+// qualifiedNameSize bytes of qualified Name, then padding up to INVENTORY_RECORD_ALIGNMENT.
+//
+struct TPM_INVENTORY_RECORD
+{
+    TPM_HANDLE handle;
+    uint16_t   publicSize;
+    uint16_t   nameSize;
+    uint16_t   qualifiedNameSize;
+    uint16_t   reserved;
+};
+
+//
+// Compact store for the objects returned by a batched ReadPublic. All records live back to back
+// in a single allocation, so an RSA-2048 key costs roughly 300 bytes instead of a full
+// TPM2B_PUBLIC and two TPM2B_NAME, and keys larger than a TPM2B_PUBLIC (RSA-4096, P-521)
+// only cost what they use.
+//
+class TpmObjectInventory
+{
+private:
+
+    uint8_t* arena = nullptr;
+    uint32_t arenaSize = 0;
+    uint32_t arenaUsed = 0;
+
+    //
+    // Offset of each record in the arena.
+    //
+    uint32_t* offsets = nullptr;
+    uint32_t count = 0;
+    uint32_t capacity = 0;
+
+    //
+    // Size of a record, including its payload and trailing padding.
+    //
+    static uint32_t GetRecordSize(
+        _In_ uint32_t publicSize,
+        _In_ uint32_t nameSize,
+        _In_ uint32_t qualifiedNameSize
+    )
+    {
+        uint32_t size = sizeof(TPM_INVENTORY_RECORD) + publicSize + nameSize + qualifiedNameSize;
+        return (size + INVENTORY_RECORD_ALIGNMENT - 1) & ~(uint32_t)(INVENTORY_RECORD_ALIGNMENT - 1);
+    }
+
+public:
+
+    ~TpmObjectInventory()
+    {
+        this->Clear();
+    }
+
+    //
+    // Frees the arena and forgets every record.
+    //
+    void Clear()
+    {
+        delete[] this->arena;
+        delete[] this->offsets;
+        this->arena = nullptr;
+        this->offsets = nullptr;
+        this->arenaSize = 0;
+        this->arenaUsed = 0;
+        this->count = 0;
+        this->capacity = 0;
+    }
+
+    //
+    // Drops any previous contents and allocates room for objectCount worst-case records.
+    //
+    // Parameters:
+    // - objectCount: Number of objects that will be appended.
+    //
+    // Returns:
+    // - true: The arena was allocated.
+    // - false: Out of memory.
+    //
+    bool Reserve(_In_ uint32_t objectCount)
+    {
+        this->Clear();
+        if (objectCount == 0)
+        {
+            return true;
+        }
+
+        uint32_t recordSizeMax = GetRecordSize(sizeof(uint16_t) + PUBLIC_AREA_MAX_SIZE, sizeof(TPMU_NAME), sizeof(TPMU_NAME));
+        this->offsets = new uint32_t[objectCount];
+        this->arena = new uint8_t[objectCount * recordSizeMax];
+        if (!this->offsets || !this->arena)
+        {
+            this->Clear();
+            return false;
+        }
+
+        this->arenaSize = objectCount * recordSizeMax;
+        this->capacity = objectCount;
+        return true;
+    }
+
+    //
+    // Appends one object. The payloads are copied as-is.
+    //
+    // Parameters:
+    // - handle: Handle of the object.
+    // - publicArea: Marshalled TPM2B_PUBLIC of the object.
+    // - publicSize: Size of publicArea in bytes, including the TPM2B size field.
+    // - name: Name of the object.
+    // - nameSize: Size of name in bytes.
+    // - qualifiedName: Qualified Name of the object.
+    // - qualifiedNameSize: Size of qualifiedName in bytes.
+    //
+    // Returns:
+    // - true: The object was appended.
+    // - false: The inventory is full or a payload is larger than its TPM2B counterpart
+    //          (PUBLIC_AREA_MAX_SIZE for the public area).
+    //
+    bool Append(
+        _In_ TPM_HANDLE handle,
+        _In_reads_bytes_(publicSize) const uint8_t* publicArea,
+        _In_ uint16_t publicSize,
+        _In_reads_bytes_(nameSize) const uint8_t* name,
+        _In_ uint16_t nameSize,
+        _In_reads_bytes_(qualifiedNameSize) const uint8_t* qualifiedName,
+        _In_ uint16_t qualifiedNameSize
+    )
+    {
+        if (publicSize > sizeof(uint16_t) + PUBLIC_AREA_MAX_SIZE || nameSize > sizeof(TPMU_NAME) || qualifiedNameSize > sizeof(TPMU_NAME))
+        {
+            return false;
+        }
+
+        uint32_t recordSize = GetRecordSize(publicSize, nameSize, qualifiedNameSize);
+        if (this->count >= this->capacity || this->arenaUsed + recordSize > this->arenaSize)
+        {
+            return false;
+        }
+
+        TPM_INVENTORY_RECORD* record = (TPM_INVENTORY_RECORD*)(this->arena + this->arenaUsed);
+        record->handle = handle;
+        record->publicSize = publicSize;
+        record->nameSize = nameSize;
+        record->qualifiedNameSize = qualifiedNameSize;
+        record->reserved = 0;
+
+        uint8_t* buffer = (uint8_t*)(record + 1);
+        memcpy(buffer, publicArea, publicSize);
+        buffer += publicSize;
+        memcpy(buffer, name, nameSize);
+        buffer += nameSize;
+        memcpy(buffer, qualifiedName, qualifiedNameSize);
+
+        this->offsets[this->count++] = this->arenaUsed;
+        this->arenaUsed += recordSize;
+        return true;
+    }
+
+    //
+    // Moves the records into an allocation of exactly the size they use.
+    // The inventory is left untouched if the new allocation fails.
+    //
+    void Shrink()
+    {
+        if (this->arenaUsed == this->arenaSize)
+        {
+            return;
+        }
+
+        if (this->arenaUsed == 0)
+        {
+            delete[] this->arena;
+            this->arena = nullptr;
+            this->arenaSize = 0;
+            return;
+        }
+
+        uint8_t* newArena = new uint8_t[this->arenaUsed];
+        if (!newArena)
+        {
+            return;
+        }
+
+        memcpy(newArena, this->arena, this->arenaUsed);
+        delete[] this->arena;
+        this->arena = newArena;
+        this->arenaSize = this->arenaUsed;
+    }
+
+    //
+    // Returns the number of objects in the inventory.
+    //
+    uint32_t GetCount() const
+    {
+        return this->count;
+    }
+
+    //
+    // Returns the number of arena bytes used by the records.
+    //
+    uint32_t GetArenaSize() const
+    {
+        return this->arenaUsed;
+    }
+
+    //
+    // Returns the record at index, or nullptr if index is out of range.
+    //
+    const TPM_INVENTORY_RECORD* GetRecord(_In_ uint32_t index) const
+    {
+        if (index >= this->count)
+        {
+            return nullptr;
+        }
+        return (const TPM_INVENTORY_RECORD*)(this->arena + this->offsets[index]);
+    }
+
+    //
+    // Accessors for the payloads that follow a record header.
+    //
+    static const uint8_t* GetPublicArea(_In_ const TPM_INVENTORY_RECORD* record)
+    {
+        return (const uint8_t*)(record + 1);
+    }
+
+    static const uint8_t* GetName(_In_ const TPM_INVENTORY_RECORD* record)
+    {
+        return GetPublicArea(record) + record->publicSize;
+    }
+
+    static const uint8_t* GetQualifiedName(_In_ const TPM_INVENTORY_RECORD* record)
+    {
+        return GetName(record) + record->nameSize;
+    }
+};
@@ -3,143 +3,72 @@
 #include <bcrypt.h>
 #include <ntstrsafe.h>
 #include <aux_klib.h>
-
-#pragma warning(disable : 4996) // Disable "ExAllocatePool" is deprecated.
+#include <TraceLoggingProvider.h>
+#include <wdmsec.h>
+#include <wsk.h>
 
 #include "stdint.hpp"
 #include "defs.hpp"
+#include "trace.hpp"
+#include "alloc.hpp"
+#include "record.hpp"
+#include "replay.hpp"
+#include "history.hpp"
+#include "fault.hpp"
 #include "mmio.hpp"
 #include "acpi.hpp"
 #include "ptp.hpp"
 #include "crb.hpp"
 #include "tis.hpp"
+#include "simulator.hpp"
+#include "templates.hpp"
+#include "marshal.hpp"
+#include "transport.hpp"
+#include "cache.hpp"
+#include "pubkey.hpp"
+#include "inventory.hpp"
+#include "resmgr.hpp"
+#include "retry.hpp"
+#include "stats.hpp"
+#include "selftest.hpp"
+#include "name.hpp"
+#include "fingerprint.hpp"
 #include "tpm.hpp"
+#include "corpus.hpp"
+#include "benchmark.hpp"
+#include "ring.hpp"
+#include "queue.hpp"
+#include "stress.hpp"
+#include "device.hpp"
 
-void* operator new(size_t size) { return ExAllocatePool(NonPagedPool, size); }
-void operator delete(void* p, size_t /*size*/) { if (p) ExFreePool(p); }
+void* operator new(size_t size) { return pool::Allocate(size); }
+void operator delete(void* p, size_t /*size*/) { pool::Free(p); }
+void* operator new[](size_t size) { return pool::Allocate(size); }
+void operator delete[](void* p) { pool::Free(p); }
 
 void DriverUnload(_In_ PDRIVER_OBJECT driverObject) 
 {
-	UNREFERENCED_PARAMETER(driverObject);
 	Dbg("Unloading tpm-mmio.sys.\n"); 
+	device::Delete(driverObject);
+	(void)record::Stop(MMIO_RECORD_FILE_NAME);
+	(void)replay::Stop();
+	history::Shutdown();
+	trace::Unregister();
 }
 
-void PrintBufferContents(const char* label, const uint8_t* buffer, uint16_t size) 
-{
-    char outputBuffer[1024];
-    char tempBuffer[5];
-    RtlZeroMemory(outputBuffer, sizeof(outputBuffer));
-    RtlZeroMemory(tempBuffer, sizeof(tempBuffer));
-
-    for (uint16_t i = 0; i < size; i++)
-    {
-        RtlStringCbPrintfA(tempBuffer, sizeof(tempBuffer), "%02x", buffer[i]);
-        RtlStringCbCatA(outputBuffer, sizeof(outputBuffer), tempBuffer);
-    }
-    Dbg("%s (size: %u): %s\n", label, size, outputBuffer);
-
-    BCRYPT_ALG_HANDLE hAlgorithm;
-    BCRYPT_HASH_HANDLE hHash;
-    UCHAR hashBuffer[64];
-    ULONG hashLength = 0;
-    ULONG resultLength = 0;
-
-    if (NT_SUCCESS(BCryptOpenAlgorithmProvider(&hAlgorithm, BCRYPT_MD5_ALGORITHM, NULL, 0)))
-    {
-        if (NT_SUCCESS(BCryptGetProperty(hAlgorithm, BCRYPT_HASH_LENGTH, (PUCHAR)&hashLength, sizeof(hashLength), &resultLength, 0)))
-        {
-            if (NT_SUCCESS(BCryptCreateHash(hAlgorithm, &hHash, NULL, 0, NULL, 0, 0)))
-            {
-                if (NT_SUCCESS(BCryptHashData(hHash, (PUCHAR)buffer, size, 0)))
-                {
-                    if (NT_SUCCESS(BCryptFinishHash(hHash, hashBuffer, hashLength, 0)))
-                    {
-                        RtlZeroMemory(outputBuffer, sizeof(outputBuffer));
-                        RtlStringCbCatA(outputBuffer, sizeof(outputBuffer), "\t[!] MD5: ");
-                        for (ULONG i = 0; i < hashLength; i++)
-                        {
-                            RtlStringCbPrintfA(tempBuffer, sizeof(tempBuffer), "%02x", hashBuffer[i]);
-                            RtlStringCbCatA(outputBuffer, sizeof(outputBuffer), tempBuffer);
-                        }
-                        DbgPrintEx(0, 0, "%s\n", outputBuffer);
-                    }
-                }
-                BCryptDestroyHash(hHash);
-            }
-        }
-        BCryptCloseAlgorithmProvider(hAlgorithm, 0);
-    }
-
-
-    if (NT_SUCCESS(BCryptOpenAlgorithmProvider(&hAlgorithm, BCRYPT_SHA1_ALGORITHM, NULL, 0)))
-    {
-        if (NT_SUCCESS(BCryptGetProperty(hAlgorithm, BCRYPT_HASH_LENGTH, (PUCHAR)&hashLength, sizeof(hashLength), &resultLength, 0)))
-        {
-            if (NT_SUCCESS(BCryptCreateHash(hAlgorithm, &hHash, NULL, 0, NULL, 0, 0)))
-            {
-                if (NT_SUCCESS(BCryptHashData(hHash, (PUCHAR)buffer, size, 0)))
-                {
-                    if (NT_SUCCESS(BCryptFinishHash(hHash, hashBuffer, hashLength, 0)))
-                    {
-                        RtlZeroMemory(outputBuffer, sizeof(outputBuffer));
-                        RtlStringCbCatA(outputBuffer, sizeof(outputBuffer), "\t[!] SHA-1: ");
-                        for (ULONG i = 0; i < hashLength; i++)
-                        {
-                            RtlStringCbPrintfA(tempBuffer, sizeof(tempBuffer), "%02x", hashBuffer[i]);
-                            RtlStringCbCatA(outputBuffer, sizeof(outputBuffer), tempBuffer);
-                        }
-                        DbgPrintEx(0, 0, "%s\n", outputBuffer);
-                    }
-                }
-                BCryptDestroyHash(hHash);
-            }
-        }
-        BCryptCloseAlgorithmProvider(hAlgorithm, 0);
-    }
-
-    if (NT_SUCCESS(BCryptOpenAlgorithmProvider(&hAlgorithm, BCRYPT_SHA256_ALGORITHM, NULL, 0)))
-    {
-        if (NT_SUCCESS(BCryptGetProperty(hAlgorithm, BCRYPT_HASH_LENGTH, (PUCHAR)&hashLength, sizeof(hashLength), &resultLength, 0)))
-        {
-            if (NT_SUCCESS(BCryptCreateHash(hAlgorithm, &hHash, NULL, 0, NULL, 0, 0)))
-            {
-                if (NT_SUCCESS(BCryptHashData(hHash, (PUCHAR)buffer, size, 0)))
-                {
-                    if (NT_SUCCESS(BCryptFinishHash(hHash, hashBuffer, hashLength, 0)))
-                    {
-                        RtlZeroMemory(outputBuffer, sizeof(outputBuffer));
-                        RtlStringCbCatA(outputBuffer, sizeof(outputBuffer), "\t[!] SHA-256: ");
-                        for (ULONG i = 0; i < hashLength; i++)
-                        {
-                            RtlStringCbPrintfA(tempBuffer, sizeof(tempBuffer), "%02x", hashBuffer[i]);
-                            RtlStringCbCatA(outputBuffer, sizeof(outputBuffer), tempBuffer);
-                        }
-                        DbgPrintEx(0, 0, "%s\n", outputBuffer);
-                    }
-                }
-                BCryptDestroyHash(hHash);
-            }
-        }
-        BCryptCloseAlgorithmProvider(hAlgorithm, 0);
-    }
-}
-
-SYNC_EXTERN NTSTATUS DriverEntry(_In_ PDRIVER_OBJECT driverObject, _In_ PUNICODE_STRING registryPath)
+//
+// Reads and prints the EK, its certificate and the persistent objects.
+//
+template<typename Engine>
+NTSTATUS DumpTpm(_In_ Engine* tpm)
 {
-	UNREFERENCED_PARAMETER(registryPath);
-	driverObject->DriverUnload = DriverUnload;
-
-	Tpm* tpm = new Tpm();
-	if (!tpm)
+	TpmFingerprintEngine* fingerprintEngine = new TpmFingerprintEngine();
+	if (!fingerprintEngine)
 	{
-		DbgError("Failed to instantiate Tpm class.\n");
+		DbgError("Failed to instantiate TpmFingerprintEngine class.\n");
 		return STATUS_INSUFFICIENT_RESOURCES;
-	}	
-	else if (!tpm->Init())
-	{
-		DbgError("Failed to initialize Tpm class.\n");
-		return STATUS_DEVICE_HARDWARE_ERROR;
 	}
+	fingerprintEngine->Init();
 
     //
     // EK reserved handle from TCG Provisioning Guidance PDF.
@@ -149,18 +78,285 @@ SYNC_EXTERN NTSTATUS DriverEntry(_In_ PDRIVER_OBJECT driverObject, _In_ PUNICODE
 	TPM2B_NAME name = { 0 };
 	TPM2B_NAME qualifiedName = { 0 };
 
+	//
+	// Only test what the EK read needs now; the rest is tested in the background below.
+	//
+	const TPM_ALG_ID ekAlgorithms[] = { TPM_ALG_SHA256, TPM_ALG_RSA };
+	tpm->EnsureAlgorithmsTested(ekAlgorithms, ARRAYSIZE(ekAlgorithms));
+
+	//
+	// Names returned by the TPM are checked against a locally computed nameAlg || H(publicArea).
+	//
+	TpmNameEngine* nameEngine = new TpmNameEngine();
+
 	NTSTATUS status = tpm->ReadPublic(objectHandle, &outPublic, &name, &qualifiedName);
 	if (NT_SUCCESS(status))
 	{
 		Dbg("ReadEkPub succeeded.\n");
-		PrintBufferContents("EK", outPublic.publicArea.unique.rsa.buffer, outPublic.publicArea.unique.rsa.size);
+		fingerprintEngine->Print("EK", outPublic.publicArea.unique.rsa.buffer, outPublic.publicArea.unique.rsa.size);
+		if (nameEngine)
+		{
+			NTSTATUS verifyStatus = nameEngine->VerifyName(&outPublic.publicArea, &name);
+			Dbg("EK Name %s (0x%08x).\n", NT_SUCCESS(verifyStatus) ? "verified" : "not verified", verifyStatus);
+		}
+	}
+	else if (status == STATUS_BUFFER_TOO_SMALL)
+	{
+		//
+		// High-range EK (RSA-3072/4096, P-384/P-521), larger than a TPM2B_PUBLIC.
+		//
+		TPM_COMPACT_PUBLIC* compactPublic = tpm->AllocateCompactPublic();
+		if (compactPublic)
+		{
+			status = tpm->ReadPublicCompact(objectHandle, compactPublic, COMPACT_PUBLIC_MAX_SIZE, &name, &qualifiedName);
+			if (NT_SUCCESS(status))
+			{
+				Dbg("ReadEkPub succeeded (type 0x%04x, %u bytes).\n", compactPublic->type, TpmCompactPublic::GetSize(compactPublic));
+				fingerprintEngine->Print("EK", TpmCompactPublic::GetUnique(compactPublic), compactPublic->uniqueSize);
+				if (nameEngine)
+				{
+					NTSTATUS verifyStatus = nameEngine->VerifyName(compactPublic, &name);
+					Dbg("EK Name %s (0x%08x).\n", NT_SUCCESS(verifyStatus) ? "verified" : "not verified", verifyStatus);
+				}
+			}
+			else
+			{
+				Dbg("ReadEkPub failed.\n");
+			}
+			tpm->FreeCompactPublic(compactPublic);
+		}
 	}
 	else
 	{
 		Dbg("ReadEkPub failed.\n");
 	}	
 
-	delete tpm;
+	tpm->StartBackgroundSelfTest();
+
+    //
+    // RSA EK certificate NV index from TCG EK Credential Profile.
+    //
+	TPMI_RH_NV_INDEX ekCertIndex = 0x01C00002;
+	TPM2B_NV_PUBLIC nvPublic = { 0 };
+	TPM2B_NAME nvName = { 0 };
+
+	if (NT_SUCCESS(tpm->NvReadPublic(ekCertIndex, &nvPublic, &nvName)))
+	{
+		uint32_t ekCertSize = nvPublic.nvPublic.dataSize;
+		uint8_t* ekCert = new uint8_t[ekCertSize];
+		if (ekCert)
+		{
+			if (NT_SUCCESS(tpm->NvRead(ekCertIndex, ekCertIndex, 0, ekCert, &ekCertSize)))
+			{
+				Dbg("ReadEkCert succeeded.\n");
+				fingerprintEngine->Print("EK Cert", ekCert, ekCertSize);
+			}
+			else
+			{
+				Dbg("ReadEkCert failed.\n");
+			}
+			delete[] ekCert;
+		}
+	}
+	else
+	{
+		Dbg("EK certificate NV index not found.\n");
+	}
+
+	//
+	// SRTM measurements, PCR 0-7 of the SHA-256 bank.
+	//
+	TPML_PCR_SELECTION pcrSelection = { 1, { { TPM_ALG_SHA256, PCR_SELECT_MAX, { 0xFF } } } };
+	TPML_PCR_SELECTION* pcrSelectionOut = new TPML_PCR_SELECTION;
+	TPML_DIGEST* pcrValues = new TPML_DIGEST;
+	if (pcrSelectionOut && pcrValues)
+	{
+		uint32_t pcrUpdateCounter = 0;
+		if (NT_SUCCESS(tpm->PcrRead(&pcrSelection, &pcrUpdateCounter, pcrSelectionOut, pcrValues)))
+		{
+			Dbg("PCR_Read succeeded (update counter %u, %u values).\n", pcrUpdateCounter, pcrValues->count);
+			for (uint32_t i = 0; i < pcrValues->count; i++)
+			{
+				fingerprintEngine->Print("PCR", pcrValues->digests[i].buffer, pcrValues->digests[i].size);
+			}
+		}
+		else
+		{
+			Dbg("PCR_Read failed.\n");
+		}
+	}
+	delete pcrValues;
+	delete pcrSelectionOut;
+
+	TpmObjectInventory* inventory = new TpmObjectInventory();
+	if (inventory)
+	{
+		if (NT_SUCCESS(tpm->ReadPersistentObjects(inventory)))
+		{
+			Dbg("Found %u persistent objects (%u bytes).\n", inventory->GetCount(), inventory->GetArenaSize());
+			for (uint32_t i = 0; i < inventory->GetCount(); i++)
+			{
+				TPMI_DH_OBJECT persistentHandle = 0;
+				NTSTATUS objectStatus = tpm->GetInventoryObject(inventory, i, &persistentHandle, &outPublic, &name, &qualifiedName);
+				if (objectStatus == STATUS_BUFFER_TOO_SMALL)
+				{
+					TPM_COMPACT_PUBLIC* compactPublic = tpm->AllocateCompactPublic();
+					if (compactPublic)
+					{
+						if (NT_SUCCESS(tpm->GetInventoryObjectCompact(inventory, i, &persistentHandle, compactPublic, COMPACT_PUBLIC_MAX_SIZE, &name, &qualifiedName)))
+						{
+							Dbg("Persistent object 0x%08x: type 0x%04x, nameAlg 0x%04x, %u key bytes.\n", persistentHandle, compactPublic->type, compactPublic->nameAlg, compactPublic->uniqueSize + compactPublic->uniqueYSize);
+							fingerprintEngine->Print("Name", name.name, name.size);
+							if (nameEngine && NT_ERROR(nameEngine->VerifyName(compactPublic, &name)))
+							{
+								Dbg("Persistent object 0x%08x: Name does not match its public area.\n", persistentHandle);
+							}
+						}
+						tpm->FreeCompactPublic(compactPublic);
+					}
+				}
+				else if (NT_SUCCESS(objectStatus))
+				{
+					Dbg("Persistent object 0x%08x: type 0x%04x, nameAlg 0x%04x.\n", persistentHandle, outPublic.publicArea.type, outPublic.publicArea.nameAlg);
+					fingerprintEngine->Print("Name", name.name, name.size);
+					if (nameEngine && NT_ERROR(nameEngine->VerifyName(&outPublic.publicArea, &name)))
+					{
+						Dbg("Persistent object 0x%08x: Name does not match its public area.\n", persistentHandle);
+					}
+				}
+			}
+		}
+		else
+		{
+			Dbg("ReadPersistentObjects failed.\n");
+		}
+		delete inventory;
+	}
+
+	delete nameEngine;
+
+	TPM_RESPONSE_CACHE_STATISTICS cacheStatistics = { 0 };
+	tpm->GetResponseCacheStatistics(&cacheStatistics);
+	Dbg("Response cache: %llu hits, %llu misses.\n", cacheStatistics.Hits, cacheStatistics.Misses);
+
+	TPM_RETRY_STATISTICS retryStatistics = { 0 };
+	tpm->GetRetryStatistics(&retryStatistics);
+	Dbg("Retries: %llu (%llu yielded, %llu retry, %llu testing, %llu NV rate), %llu exhausted, %llu us backoff.\n",
+		retryStatistics.Retries, retryStatistics.Yielded, retryStatistics.Retry, retryStatistics.Testing,
+		retryStatistics.NvRate, retryStatistics.Exhausted, retryStatistics.DelayMicroseconds);
+
+	TPM_COMMAND_STATISTICS* commandStatistics = new TPM_COMMAND_STATISTICS;
+	if (commandStatistics)
+	{
+		for (TPM_CC commandCode = TPM_CC_FIRST; commandCode <= TPM_CC_LAST; commandCode++)
+		{
+			if (NT_ERROR(tpm->GetCommandStatistics(commandCode, commandStatistics)))
+			{
+				continue;
+			}
+
+			Dbg("CC 0x%03x: %llu sent, %llu errors, p50 %llu us, p99 %llu us (execute p50 %llu us), %llu/%llu MMIO reads/writes, %llu maps.\n",
+				commandCode, commandStatistics->Commands, commandStatistics->Errors,
+				TpmCommandStatistics::GetPercentile(&commandStatistics->Total, 50),
+				TpmCommandStatistics::GetPercentile(&commandStatistics->Total, 99),
+				TpmCommandStatistics::GetPercentile(&commandStatistics->Phases[TpmPhaseExecute], 50),
+				commandStatistics->MmioReads, commandStatistics->MmioWrites, commandStatistics->MmioMaps);
+		}
+		delete commandStatistics;
+	}
+
+	delete fingerprintEngine;
+	return status;
+}
+
+SYNC_EXTERN NTSTATUS DriverEntry(_In_ PDRIVER_OBJECT driverObject, _In_ PUNICODE_STRING registryPath)
+{
+	UNREFERENCED_PARAMETER(registryPath);
+	driverObject->DriverUnload = DriverUnload;
+	trace::Register();
+	(void)record::Start();
+	(void)history::Init();
+
+	NTSTATUS replayStatus = replay::Start(MMIO_REPLAY_FILE_NAME);
+	if (NT_ERROR(replayStatus))
+	{
+		(void)record::Stop(MMIO_RECORD_FILE_NAME);
+		history::Shutdown();
+		trace::Unregister();
+		return replayStatus;
+	}
+
+#if TPM_BENCHMARK
+	if (!TpmResponseCache::SelfCheck())
+	{
+		(void)record::Stop(MMIO_RECORD_FILE_NAME);
+		(void)replay::Stop();
+		history::Shutdown();
+		trace::Unregister();
+		return STATUS_UNSUCCESSFUL;
+	}
+#endif
+
+	TpmCommandQueue* commandQueue = new TpmCommandQueue();
+	if (!commandQueue)
+	{
+		DbgError("Failed to instantiate TpmCommandQueue class.\n");
+		(void)record::Stop(MMIO_RECORD_FILE_NAME);
+		(void)replay::Stop();
+		history::Shutdown();
+		trace::Unregister();
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	//
+	// Dump the TPM once, then hand the engine to the command queue for the device.
+	//
+	NTSTATUS status = RunTpmEngine([commandQueue](auto* tpm) {
+		NTSTATUS dumpStatus = DumpTpm(tpm);
+		if (NT_ERROR(dumpStatus))
+		{
+			Dbg("DumpTpm failed with status code: 0x%x.\n", dumpStatus);
+		}
+#if TPM_BENCHMARK
+		NTSTATUS benchmarkStatus = benchmark::Run(tpm);
+		if (NT_ERROR(benchmarkStatus))
+		{
+			delete tpm;
+			return benchmarkStatus;
+		}
+#endif
+		return commandQueue->Start(tpm);
+	});
+
+#if TPM_STRESS
+	if (NT_SUCCESS(status))
+	{
+		status = stress::Run(commandQueue);
+	}
+#endif
+
+	//
+	// A replay is checked once everything run at load has been replayed, before any client can
+	// reach the device.
+	//
+	if (NT_SUCCESS(status))
+	{
+		status = replay::Check();
+	}
+
+	if (NT_SUCCESS(status))
+	{
+		status = device::Create(driverObject, commandQueue);
+	}
+
+	if (NT_ERROR(status))
+	{
+		delete commandQueue;
+		(void)record::Stop(MMIO_RECORD_FILE_NAME);
+		(void)replay::Stop();
+		history::Shutdown();
+		trace::Unregister();
+	}
 
     Dbg("Returning with status code: 0x%x.\n", status);
 
@@ -0,0 +1,273 @@
+#pragma once
+
+//
+// Marshals a command straight into its transport buffer: the mapped CRB data buffer, or the
+// staging buffer a FIFO/TIS command is sent from. Values are written big-endian as they go, so
+// there is no intermediate command structure to build and copy.
+//
+// Writes to device memory go through WRITE_REGISTER_BUFFER_UCHAR, which is safe for any alignment
+// on both x64 and ARM64. Overflowing the buffer is sticky and reported by Finish.
+//
+class TpmCommandWriter
+{
+private:
+
+    uint8_t* buffer = nullptr;
+    uint32_t capacity = 0;
+    uint32_t offset = 0;
+    bool deviceMemory = false;
+    bool overflow = false;
+    TPM_CC commandCode = 0;
+
+    void Put(
+        _In_ uint32_t position,
+        _In_reads_bytes_(size) const void* data,
+        _In_ uint32_t size
+    )
+    {
+        if (this->deviceMemory)
+        {
+            WRITE_REGISTER_BUFFER_UCHAR((volatile UCHAR*)(this->buffer + position), (PUCHAR)data, size);
+            mmio::Count(&mmio::Counters().Writes, size);
+            record::Bulk(TpmMmioWrite, this->buffer + position, size, data);
+            (void)replay::Bulk(TpmMmioWrite, this->buffer + position, size, const_cast<void*>(data));
+        }
+        else
+        {
+            RtlCopyMemory(this->buffer + position, data, size);
+        }
+    }
+
+public:
+
+    //
+    // Points the writer at an empty transport buffer.
+    //
+    // Parameters:
+    // - buffer: Buffer the command is marshalled into.
+    // - capacity: Size of buffer in bytes.
+    // - deviceMemory: true if buffer is mapped MMIO.
+    //
+    void Reset(
+        _Out_writes_bytes_(capacity) uint8_t* buffer,
+        _In_ uint32_t capacity,
+        _In_ bool deviceMemory
+    )
+    {
+        this->buffer = buffer;
+        this->capacity = capacity;
+        this->offset = 0;
+        this->deviceMemory = deviceMemory;
+        this->overflow = false;
+        this->commandCode = 0;
+    }
+
+    void WriteBytes(
+        _In_reads_bytes_(size) const void* data,
+        _In_ uint32_t size
+    )
+    {
+        if (this->overflow || size > this->capacity - this->offset)
+        {
+            this->overflow = true;
+            return;
+        }
+        this->Put(this->offset, data, size);
+        this->offset += size;
+    }
+
+    void WriteUint8(_In_ uint8_t value)
+    {
+        this->WriteBytes(&value, sizeof(value));
+    }
+
+    void WriteUint16(_In_ uint16_t value)
+    {
+        value = _byteswap_ushort(value);
+        this->WriteBytes(&value, sizeof(value));
+    }
+
+    void WriteUint32(_In_ uint32_t value)
+    {
+        value = _byteswap_ulong(value);
+        this->WriteBytes(&value, sizeof(value));
+    }
+
+    //
+    // Writes a big-endian command header, such as the one of a command template. paramSize is
+    // overwritten by Finish.
+    //
+    void WriteHeader(_In_ const TPM2_COMMAND_HEADER& header)
+    {
+        this->commandCode = _byteswap_ulong(header.commandCode);
+        this->WriteBytes(&header, sizeof(header));
+    }
+
+    //
+    // Patches paramSize in the header with the number of bytes written.
+    //
+    // Parameters:
+    // - size: Receives the size of the command.
+    //
+    // Returns:
+    // - STATUS_SUCCESS: The command is complete.
+    // - STATUS_BUFFER_TOO_SMALL: The command did not fit, or has no header.
+    //
+    NTSTATUS Finish(_Out_ uint32_t* size)
+    {
+        *size = 0;
+        if (this->overflow || this->offset < sizeof(TPM2_COMMAND_HEADER))
+        {
+            DbgError("TpmCommandWriter::Finish - command does not fit - %x.\n", this->offset);
+            return STATUS_BUFFER_TOO_SMALL;
+        }
+
+        uint32_t paramSize = _byteswap_ulong(this->offset);
+        this->Put(FIELD_OFFSET(TPM2_COMMAND_HEADER, paramSize), &paramSize, sizeof(paramSize));
+        *size = this->offset;
+        return STATUS_SUCCESS;
+    }
+
+    //
+    // Returns the command code of the header written by WriteHeader.
+    //
+    TPM_CC GetCommandCode()
+    {
+        return this->commandCode;
+    }
+
+    uint8_t* GetBuffer()
+    {
+        return this->buffer;
+    }
+};
+
+//
+// Decodes a response where the transport left it: in the mapped CRB data buffer, or in the staging
+// buffer a FIFO/TIS response was read into. The view is only valid until the response is released.
+//
+// Reads past the end of the response fail without touching the destination, and are sticky so a
+// whole sequence of reads can be checked once with IsValid.
+//
+class TpmResponseReader
+{
+private:
+
+    const uint8_t* buffer = nullptr;
+    uint32_t size = 0;
+    uint32_t offset = 0;
+    bool deviceMemory = false;
+    bool underflow = false;
+
+public:
+
+    //
+    // Points the reader at a complete response.
+    //
+    // Parameters:
+    // - buffer: Response to decode.
+    // - size: Size of the response in bytes, taken from its header.
+    // - deviceMemory: true if buffer is mapped MMIO.
+    //
+    void Reset(
+        _In_reads_bytes_(size) const uint8_t* buffer,
+        _In_ uint32_t size,
+        _In_ bool deviceMemory
+    )
+    {
+        this->buffer = buffer;
+        this->size = size;
+        this->offset = 0;
+        this->deviceMemory = deviceMemory;
+        this->underflow = false;
+    }
+
+    void ReadBytes(
+        _Out_writes_bytes_(size) void* data,
+        _In_ uint32_t size
+    )
+    {
+        if (this->underflow || size > this->size - this->offset)
+        {
+            this->underflow = true;
+            return;
+        }
+
+        if (this->deviceMemory)
+        {
+            READ_REGISTER_BUFFER_UCHAR((volatile UCHAR*)(this->buffer + this->offset), (PUCHAR)data, size);
+            mmio::Count(&mmio::Counters().Reads, size);
+            (void)replay::Bulk(TpmMmioRead, this->buffer + this->offset, size, data);
+            record::Bulk(TpmMmioRead, this->buffer + this->offset, size, data);
+        }
+        else
+        {
+            RtlCopyMemory(data, this->buffer + this->offset, size);
+        }
+        this->offset += size;
+    }
+
+    uint8_t ReadUint8()
+    {
+        uint8_t value = 0;
+        this->ReadBytes(&value, sizeof(value));
+        return value;
+    }
+
+    uint16_t ReadUint16()
+    {
+        uint16_t value = 0;
+        this->ReadBytes(&value, sizeof(value));
+        return _byteswap_ushort(value);
+    }
+
+    uint32_t ReadUint32()
+    {
+        uint32_t value = 0;
+        this->ReadBytes(&value, sizeof(value));
+        return _byteswap_ulong(value);
+    }
+
+    //
+    // Reads the response header and returns its response code, or TPM_RC_FAILURE if the response
+    // is too short to have one.
+    //
+    TPM_RC ReadHeader()
+    {
+        TPM2_RESPONSE_HEADER header = { 0 };
+        this->ReadBytes(&header, sizeof(header));
+        return this->underflow ? TPM_RC_FAILURE : _byteswap_ulong(header.responseCode);
+    }
+
+    //
+    // Returns the response code without moving the read position.
+    //
+    TPM_RC PeekResponseCode()
+    {
+        uint32_t savedOffset = this->offset;
+        bool savedUnderflow = this->underflow;
+
+        this->offset = 0;
+        this->underflow = false;
+        TPM_RC responseCode = this->ReadHeader();
+
+        this->offset = savedOffset;
+        this->underflow = savedUnderflow;
+        return responseCode;
+    }
+
+    uint32_t GetSize()
+    {
+        return this->size;
+    }
+
+    uint32_t GetOffset()
+    {
+        return this->offset;
+    }
+
+    bool IsValid()
+    {
+        return !this->underflow;
+    }
+};
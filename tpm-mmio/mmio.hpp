@@ -2,6 +2,45 @@
 
 namespace mmio
 {
+    //
+    // Register accesses and mappings made so far. A bulk buffer transfer counts one access per byte.
+    // Shared by every engine, so updates go through Count.
+    //
+    struct MMIO_COUNTERS
+    {
+        uint64_t Reads;
+        uint64_t Writes;
+        uint64_t Maps;
+    };
+
+    inline MMIO_COUNTERS& Counters()
+    {
+        static MMIO_COUNTERS counters = { 0 };
+        return counters;
+    }
+
+    //
+    // Adds to one of the global counters. The queue worker, command rings and stress clients
+    // access registers concurrently.
+    //
+    inline void Count(_Inout_ uint64_t* counter, _In_ uint64_t count)
+    {
+        (void)InterlockedAdd64((volatile LONG64*)counter, (LONG64)count);
+    }
+
+    //
+    // Full fence for write-combined mappings: drains pending combined stores before the next
+    // register write, and keeps later reads from being satisfied ahead of earlier register reads.
+    //
+    inline void Fence()
+    {
+#if defined(_M_ARM64)
+        __dmb(_ARM64_BARRIER_SY);
+#else
+        _mm_mfence();
+#endif
+    }
+
     //
     // Maps a given MMIO (Memory-Mapped I/O) physical address to a virtual address 
     // and writes the specified bytes to the mapped memory.
@@ -22,12 +61,19 @@ namespace mmio
         _In_reads_bytes_(len) PVOID pData  
     )
     {
+#if MMIO_REPLAY
+        Count(&Counters().Writes, (len == 8) ? 2 : 1);
+        history::Log(TpmMmioHistoryWrite, physicalAddress, len, pData);
+        return replay::Access(TpmMmioWrite, physicalAddress, len, pData);
+#else
         PHYSICAL_ADDRESS physAddress;
         RtlZeroMemory(&physAddress, sizeof(PHYSICAL_ADDRESS));        
         physAddress.QuadPart = (LONGLONG)physicalAddress;
         PVOID virtualAddress = MmMapIoSpace(physAddress, len, MmNonCached);
         if (virtualAddress)
         {
+            Count(&Counters().Maps, 1);
+            Count(&Counters().Writes, (len == 8) ? 2 : 1);
             switch (len)
             {
             case 1:
@@ -44,10 +90,14 @@ namespace mmio
                 break;
             }
             MmUnmapIoSpace(virtualAddress, len);
+            fault::Write(physicalAddress, len, pData);
+            record::Access(TpmMmioWrite, physicalAddress, len, pData);
+            history::Log(TpmMmioHistoryWrite, physicalAddress, len, pData);
             return true;
         }
         DbgError("Failed to map physical address to virtual address. (%s)\n", __FUNCTION__);
         return false;
+#endif
     }
 
     //
@@ -70,12 +120,20 @@ namespace mmio
         _Out_writes_bytes_(len) PVOID pData 
     )
     {
+#if MMIO_REPLAY
+        Count(&Counters().Reads, (len == 8) ? 2 : 1);
+        bool replayed = replay::Access(TpmMmioRead, physicalAddress, len, pData);
+        history::Log(TpmMmioHistoryRead, physicalAddress, len, pData);
+        return replayed;
+#else
         PHYSICAL_ADDRESS physAddress;
         RtlZeroMemory(&physAddress, sizeof(PHYSICAL_ADDRESS));
         physAddress.QuadPart = (LONGLONG)physicalAddress;
         PVOID virtualAddress = MmMapIoSpace(physAddress, len, MmNonCached);
         if (virtualAddress)
         {
+            Count(&Counters().Maps, 1);
+            Count(&Counters().Reads, (len == 8) ? 2 : 1);
             switch (len)
             {
             case 1:
@@ -92,9 +150,13 @@ namespace mmio
                 break;
             }
             MmUnmapIoSpace(virtualAddress, len);
+            fault::Read(physicalAddress, len, pData);
+            record::Access(TpmMmioRead, physicalAddress, len, pData);
+            history::Log(TpmMmioHistoryRead, physicalAddress, len, pData);
             return true;
         }
         DbgError("Failed to map physical address to virtual address. (%s)\n", __FUNCTION__);
         return false;
+#endif
     }
 };
\ No newline at end of file
@@ -0,0 +1,588 @@
+#pragma once
+
+//
+// Computes object Names on the host: nameAlg || H_nameAlg(TPMT_PUBLIC), with TPMT_PUBLIC
+// re-marshalled canonically from its decoded or compact form. Lets callers check the Name returned by
+// ReadPublic, or derive the Name of a cached public area without asking the TPM.
+//
+// Hashing goes through CNG, which picks the SHA-NI/AVX2 implementation when the CPU has one.
+// Hash objects are created once per algorithm with BCRYPT_HASH_REUSABLE_FLAG and reused.
+//
+class TpmNameEngine
+{
+private:
+
+    //
+    // One reusable hash object per supported nameAlg: SHA-1, SHA-256, SHA-384, SHA-512.
+    //
+    BCRYPT_ALG_HANDLE algorithms[4] = { };
+    BCRYPT_HASH_HANDLE hashes[4] = { };
+
+    template<typename T>
+    void WriteUnaligned(void* destination, T value)
+    {
+        RtlCopyMemory(destination, &value, sizeof(T));
+    }
+
+    //
+    // Maps a nameAlg to its slot, CNG algorithm name and digest size.
+    //
+    // Returns:
+    // - true: The hash algorithm is supported.
+    // - false: The hash algorithm is not supported.
+    //
+    static bool GetHashAlgorithm(
+        _In_ TPMI_ALG_HASH nameAlg,
+        _Out_ uint32_t* index,
+        _Out_ PCWSTR* algorithmId,
+        _Out_ uint32_t* digestSize
+    )
+    {
+        switch (nameAlg)
+        {
+        case TPM_ALG_SHA1:
+            *index = 0;
+            *algorithmId = BCRYPT_SHA1_ALGORITHM;
+            *digestSize = SHA1_DIGEST_SIZE;
+            return true;
+        case TPM_ALG_SHA256:
+            *index = 1;
+            *algorithmId = BCRYPT_SHA256_ALGORITHM;
+            *digestSize = SHA256_DIGEST_SIZE;
+            return true;
+        case TPM_ALG_SHA384:
+            *index = 2;
+            *algorithmId = BCRYPT_SHA384_ALGORITHM;
+            *digestSize = SHA384_DIGEST_SIZE;
+            return true;
+        case TPM_ALG_SHA512:
+            *index = 3;
+            *algorithmId = BCRYPT_SHA512_ALGORITHM;
+            *digestSize = SHA512_DIGEST_SIZE;
+            return true;
+        default:
+            return false;
+        }
+    }
+
+    //
+    // Marshals a TPMT_SYM_DEF_OBJECT.
+    //
+    // Returns:
+    // - uint8_t*: The buffer position after the structure, or nullptr if the algorithm is not supported.
+    //
+    uint8_t* MarshalSymDefObject(
+        _In_ const TPMT_SYM_DEF_OBJECT* symmetric,
+        _Out_ uint8_t* buffer
+    )
+    {
+        this->WriteUnaligned<uint16_t>(buffer, _byteswap_ushort(symmetric->algorithm));
+        buffer += sizeof(uint16_t);
+
+        switch (symmetric->algorithm)
+        {
+        case TPM_ALG_AES:
+        case TPM_ALG_SM4:
+            this->WriteUnaligned<uint16_t>(buffer, _byteswap_ushort(symmetric->keyBits.sym));
+            buffer += sizeof(uint16_t);
+            this->WriteUnaligned<uint16_t>(buffer, _byteswap_ushort(symmetric->mode.sym));
+            buffer += sizeof(uint16_t);
+            break;
+        case TPM_ALG_XOR:
+            this->WriteUnaligned<uint16_t>(buffer, _byteswap_ushort(symmetric->keyBits.xor));
+            buffer += sizeof(uint16_t);
+            break;
+        case TPM_ALG_NULL:
+            break;
+        default:
+            return nullptr;
+        }
+        return buffer;
+    }
+
+    //
+    // Marshals a TPMU_PUBLIC_PARMS.
+    //
+    // Returns:
+    // - uint8_t*: The buffer position after the structure, or nullptr if the type or a scheme is not supported.
+    //
+    uint8_t* MarshalParameters(
+        _In_ TPMI_ALG_PUBLIC type,
+        _In_ const TPMU_PUBLIC_PARMS* parameters,
+        _Out_ uint8_t* buffer
+    )
+    {
+        switch (type)
+        {
+        case TPM_ALG_KEYEDHASH:
+        {
+            const TPMT_KEYEDHASH_SCHEME* scheme = &parameters->keyedHashDetail.scheme;
+            this->WriteUnaligned<uint16_t>(buffer, _byteswap_ushort(scheme->scheme));
+            buffer += sizeof(uint16_t);
+            switch (scheme->scheme)
+            {
+            case TPM_ALG_HMAC:
+                this->WriteUnaligned<uint16_t>(buffer, _byteswap_ushort(scheme->details.hmac.hashAlg));
+                buffer += sizeof(uint16_t);
+                break;
+            case TPM_ALG_XOR:
+                this->WriteUnaligned<uint16_t>(buffer, _byteswap_ushort(scheme->details.xor.hashAlg));
+                buffer += sizeof(uint16_t);
+                this->WriteUnaligned<uint16_t>(buffer, _byteswap_ushort(scheme->details.xor.kdf));
+                buffer += sizeof(uint16_t);
+                break;
+            case TPM_ALG_NULL:
+                break;
+            default:
+                return nullptr;
+            }
+            break;
+        }
+        case TPM_ALG_SYMCIPHER:
+            buffer = this->MarshalSymDefObject(&parameters->symDetail, buffer);
+            break;
+        case TPM_ALG_RSA:
+        {
+            const TPMS_RSA_PARMS* rsa = &parameters->rsaDetail;
+            buffer = this->MarshalSymDefObject(&rsa->symmetric, buffer);
+            if (buffer == nullptr)
+            {
+                return nullptr;
+            }
+
+            this->WriteUnaligned<uint16_t>(buffer, _byteswap_ushort(rsa->scheme.scheme));
+            buffer += sizeof(uint16_t);
+            switch (rsa->scheme.scheme)
+            {
+            case TPM_ALG_RSASSA:
+            case TPM_ALG_RSAPSS:
+            case TPM_ALG_OAEP:
+                this->WriteUnaligned<uint16_t>(buffer, _byteswap_ushort(rsa->scheme.details.anySig.hashAlg));
+                buffer += sizeof(uint16_t);
+                break;
+            case TPM_ALG_RSAES:
+            case TPM_ALG_NULL:
+                break;
+            default:
+                return nullptr;
+            }
+
+            this->WriteUnaligned<uint16_t>(buffer, _byteswap_ushort(rsa->keyBits));
+            buffer += sizeof(uint16_t);
+            this->WriteUnaligned<uint32_t>(buffer, _byteswap_ulong(rsa->exponent));
+            buffer += sizeof(uint32_t);
+            break;
+        }
+        case TPM_ALG_ECC:
+        {
+            const TPMS_ECC_PARMS* ecc = &parameters->eccDetail;
+            buffer = this->MarshalSymDefObject(&ecc->symmetric, buffer);
+            if (buffer == nullptr)
+            {
+                return nullptr;
+            }
+
+            this->WriteUnaligned<uint16_t>(buffer, _byteswap_ushort(ecc->scheme.scheme));
+            buffer += sizeof(uint16_t);
+            switch (ecc->scheme.scheme)
+            {
+            case TPM_ALG_ECDSA:
+            case TPM_ALG_ECSCHNORR:
+            case TPM_ALG_SM2:
+            case TPM_ALG_ECDH:
+                this->WriteUnaligned<uint16_t>(buffer, _byteswap_ushort(ecc->scheme.details.any.hashAlg));
+                buffer += sizeof(uint16_t);
+                break;
+            case TPM_ALG_ECDAA:
+                this->WriteUnaligned<uint16_t>(buffer, _byteswap_ushort(ecc->scheme.details.ecdaa.hashAlg));
+                buffer += sizeof(uint16_t);
+                this->WriteUnaligned<uint16_t>(buffer, _byteswap_ushort(ecc->scheme.details.ecdaa.count));
+                buffer += sizeof(uint16_t);
+                break;
+            case TPM_ALG_NULL:
+                break;
+            default:
+                return nullptr;
+            }
+
+            this->WriteUnaligned<uint16_t>(buffer, _byteswap_ushort(ecc->curveID));
+            buffer += sizeof(uint16_t);
+            this->WriteUnaligned<uint16_t>(buffer, _byteswap_ushort(ecc->kdf.scheme));
+            buffer += sizeof(uint16_t);
+            switch (ecc->kdf.scheme)
+            {
+            case TPM_ALG_MGF1:
+            case TPM_ALG_KDF1_SP800_108:
+            case TPM_ALG_KDF1_SP800_56a:
+            case TPM_ALG_KDF2:
+                this->WriteUnaligned<uint16_t>(buffer, _byteswap_ushort(ecc->kdf.details.mgf1.hashAlg));
+                buffer += sizeof(uint16_t);
+                break;
+            case TPM_ALG_NULL:
+                break;
+            default:
+                return nullptr;
+            }
+            break;
+        }
+        default:
+            return nullptr;
+        }
+
+        return buffer;
+    }
+
+    //
+    // Marshals a TPM2B with a size-checked payload.
+    //
+    // Returns:
+    // - uint8_t*: The buffer position after the structure, or nullptr if size exceeds capacity.
+    //
+    uint8_t* MarshalSized(
+        _In_ uint16_t size,
+        _In_reads_bytes_(size) const uint8_t* data,
+        _In_ uint32_t capacity,
+        _Out_ uint8_t* buffer
+    )
+    {
+        if (size > capacity)
+        {
+            return nullptr;
+        }
+
+        this->WriteUnaligned<uint16_t>(buffer, _byteswap_ushort(size));
+        buffer += sizeof(uint16_t);
+        memcpy(buffer, data, size);
+        return buffer + size;
+    }
+
+    //
+    // Builds nameAlg || H_nameAlg(marshalled).
+    //
+    NTSTATUS HashName(
+        _In_ TPMI_ALG_HASH nameAlg,
+        _In_reads_bytes_(marshalledSize) const uint8_t* marshalled,
+        _In_ uint32_t marshalledSize,
+        _Out_ TPM2B_NAME* name
+    )
+    {
+        uint32_t digestSize = 0;
+        NTSTATUS status = this->Hash(nameAlg, marshalled, marshalledSize, name->name + sizeof(TPMI_ALG_HASH), &digestSize);
+        if (NT_ERROR(status))
+        {
+            return status;
+        }
+
+        this->WriteUnaligned<uint16_t>(name->name, _byteswap_ushort(nameAlg));
+        name->size = (uint16_t)(sizeof(TPMI_ALG_HASH) + digestSize);
+        return STATUS_SUCCESS;
+    }
+
+    static NTSTATUS CompareName(
+        _In_ const TPM2B_NAME* computedName,
+        _In_ const TPM2B_NAME* name
+    )
+    {
+        if (computedName->size != name->size ||
+            RtlCompareMemory(computedName->name, name->name, computedName->size) != computedName->size)
+        {
+            return STATUS_DATA_ERROR;
+        }
+        return STATUS_SUCCESS;
+    }
+
+public:
+
+    ~TpmNameEngine()
+    {
+        for (uint32_t i = 0; i < ARRAYSIZE(this->algorithms); i++)
+        {
+            if (this->hashes[i])
+            {
+                BCryptDestroyHash(this->hashes[i]);
+            }
+            if (this->algorithms[i])
+            {
+                BCryptCloseAlgorithmProvider(this->algorithms[i], 0);
+            }
+        }
+    }
+
+    //
+    // Marshals a TPMT_PUBLIC in host byte order into its canonical TPM wire format.
+    //
+    // Parameters:
+    // - publicArea: Decoded public area.
+    // - buffer: Buffer that receives the marshalled public area, at least NAME_MARSHAL_BUFFER_SIZE bytes.
+    //
+    // Returns:
+    // - uint32_t: Marshalled size, or 0 if the public area uses an unsupported type or scheme,
+    //             or one of its sized fields exceeds its capacity.
+    //
+    uint32_t MarshalPublicArea(
+        _In_ const TPMT_PUBLIC* publicArea,
+        _Out_writes_bytes_(NAME_MARSHAL_BUFFER_SIZE) uint8_t* buffer
+    )
+    {
+        uint8_t* start = buffer;
+
+        this->WriteUnaligned<uint16_t>(buffer, _byteswap_ushort(publicArea->type));
+        buffer += sizeof(uint16_t);
+        this->WriteUnaligned<uint16_t>(buffer, _byteswap_ushort(publicArea->nameAlg));
+        buffer += sizeof(uint16_t);
+
+        uint32_t objectAttributes = 0;
+        memcpy(&objectAttributes, &publicArea->objectAttributes, sizeof(uint32_t));
+        this->WriteUnaligned<uint32_t>(buffer, _byteswap_ulong(objectAttributes));
+        buffer += sizeof(uint32_t);
+
+        buffer = this->MarshalSized(publicArea->authPolicy.size, publicArea->authPolicy.buffer, sizeof(TPMU_HA), buffer);
+        if (buffer == nullptr)
+        {
+            return 0;
+        }
+
+        // TPMU_PUBLIC_PARMS
+        buffer = this->MarshalParameters(publicArea->type, &publicArea->parameters, buffer);
+        if (buffer == nullptr)
+        {
+            return 0;
+        }
+
+        // TPMU_PUBLIC_ID
+        switch (publicArea->type)
+        {
+        case TPM_ALG_KEYEDHASH:
+            buffer = this->MarshalSized(publicArea->unique.keyedHash.size, publicArea->unique.keyedHash.buffer, sizeof(TPMU_HA), buffer);
+            break;
+        case TPM_ALG_SYMCIPHER:
+            buffer = this->MarshalSized(publicArea->unique.sym.size, publicArea->unique.sym.buffer, sizeof(TPMU_HA), buffer);
+            break;
+        case TPM_ALG_RSA:
+            buffer = this->MarshalSized(publicArea->unique.rsa.size, publicArea->unique.rsa.buffer, MAX_RSA_KEY_BYTES, buffer);
+            break;
+        case TPM_ALG_ECC:
+            buffer = this->MarshalSized(publicArea->unique.ecc.x.size, publicArea->unique.ecc.x.buffer, MAX_ECC_KEY_BYTES, buffer);
+            if (buffer != nullptr)
+            {
+                buffer = this->MarshalSized(publicArea->unique.ecc.y.size, publicArea->unique.ecc.y.buffer, MAX_ECC_KEY_BYTES, buffer);
+            }
+            break;
+        }
+
+        if (buffer == nullptr)
+        {
+            return 0;
+        }
+        return (uint32_t)(buffer - start);
+    }
+
+    //
+    // Marshals a compact public area into the canonical TPMT_PUBLIC wire format. The unique field
+    // is taken from the payload, so keys larger than a TPMT_PUBLIC holds are marshalled whole.
+    //
+    // Parameters:
+    // - compactPublic: Compact public area.
+    // - buffer: Buffer that receives the marshalled public area, at least NAME_MARSHAL_BUFFER_SIZE bytes.
+    //
+    // Returns:
+    // - uint32_t: Marshalled size, or 0 if the public area uses an unsupported type or scheme,
+    //             or one of its sized fields exceeds its capacity.
+    //
+    uint32_t MarshalCompactPublic(
+        _In_ const TPM_COMPACT_PUBLIC* compactPublic,
+        _Out_writes_bytes_(NAME_MARSHAL_BUFFER_SIZE) uint8_t* buffer
+    )
+    {
+        uint8_t* start = buffer;
+
+        this->WriteUnaligned<uint16_t>(buffer, _byteswap_ushort(compactPublic->type));
+        buffer += sizeof(uint16_t);
+        this->WriteUnaligned<uint16_t>(buffer, _byteswap_ushort(compactPublic->nameAlg));
+        buffer += sizeof(uint16_t);
+
+        uint32_t objectAttributes = 0;
+        memcpy(&objectAttributes, &compactPublic->objectAttributes, sizeof(uint32_t));
+        this->WriteUnaligned<uint32_t>(buffer, _byteswap_ulong(objectAttributes));
+        buffer += sizeof(uint32_t);
+
+        buffer = this->MarshalSized(compactPublic->authPolicySize, TpmCompactPublic::GetAuthPolicy(compactPublic), sizeof(TPMU_HA), buffer);
+        if (buffer == nullptr)
+        {
+            return 0;
+        }
+
+        buffer = this->MarshalParameters(compactPublic->type, &compactPublic->parameters, buffer);
+        if (buffer == nullptr)
+        {
+            return 0;
+        }
+
+        // TPMU_PUBLIC_ID
+        switch (compactPublic->type)
+        {
+        case TPM_ALG_KEYEDHASH:
+        case TPM_ALG_SYMCIPHER:
+            buffer = this->MarshalSized(compactPublic->uniqueSize, TpmCompactPublic::GetUnique(compactPublic), sizeof(TPMU_HA), buffer);
+            break;
+        case TPM_ALG_RSA:
+            buffer = this->MarshalSized(compactPublic->uniqueSize, TpmCompactPublic::GetUnique(compactPublic), COMPACT_RSA_KEY_BYTES_MAX, buffer);
+            break;
+        case TPM_ALG_ECC:
+            buffer = this->MarshalSized(compactPublic->uniqueSize, TpmCompactPublic::GetUnique(compactPublic), COMPACT_ECC_KEY_BYTES_MAX, buffer);
+            if (buffer != nullptr)
+            {
+                buffer = this->MarshalSized(compactPublic->uniqueYSize, TpmCompactPublic::GetUniqueY(compactPublic), COMPACT_ECC_KEY_BYTES_MAX, buffer);
+            }
+            break;
+        default:
+            return 0;
+        }
+
+        if (buffer == nullptr)
+        {
+            return 0;
+        }
+        return (uint32_t)(buffer - start);
+    }
+
+    //
+    // Hashes data with a TPM hash algorithm.
+    //
+    // Parameters:
+    // - hashAlg: Hash algorithm.
+    // - data: Data to hash.
+    // - dataSize: Size of data in bytes.
+    // - digest: Buffer that receives the digest, at least sizeof(TPMU_HA) bytes.
+    // - digestSize: Receives the size of the digest.
+    //
+    // Returns:
+    // - STATUS_SUCCESS: The digest was computed.
+    // - STATUS_NOT_SUPPORTED: The hash algorithm is not supported.
+    // - Any status returned by CNG.
+    //
+    NTSTATUS Hash(
+        _In_ TPMI_ALG_HASH hashAlg,
+        _In_reads_bytes_(dataSize) const uint8_t* data,
+        _In_ uint32_t dataSize,
+        _Out_writes_bytes_(sizeof(TPMU_HA)) uint8_t* digest,
+        _Out_ uint32_t* digestSize
+    )
+    {
+        uint32_t index = 0;
+        PCWSTR algorithmId = nullptr;
+        if (!GetHashAlgorithm(hashAlg, &index, &algorithmId, digestSize))
+        {
+            return STATUS_NOT_SUPPORTED;
+        }
+
+        NTSTATUS status = STATUS_SUCCESS;
+        if (this->hashes[index] == nullptr)
+        {
+            status = BCryptOpenAlgorithmProvider(&this->algorithms[index], algorithmId, NULL, BCRYPT_HASH_REUSABLE_FLAG | BCRYPT_PROV_DISPATCH);
+            if (NT_ERROR(status))
+            {
+                this->algorithms[index] = nullptr;
+                return status;
+            }
+
+            status = BCryptCreateHash(this->algorithms[index], &this->hashes[index], NULL, 0, NULL, 0, BCRYPT_HASH_REUSABLE_FLAG);
+            if (NT_ERROR(status))
+            {
+                BCryptCloseAlgorithmProvider(this->algorithms[index], 0);
+                this->algorithms[index] = nullptr;
+                this->hashes[index] = nullptr;
+                return status;
+            }
+        }
+
+        status = BCryptHashData(this->hashes[index], (PUCHAR)data, dataSize, 0);
+        if (NT_ERROR(status))
+        {
+            return status;
+        }
+
+        //
+        // Finishing a reusable hash object also resets it for the next call.
+        //
+        return BCryptFinishHash(this->hashes[index], digest, *digestSize, 0);
+    }
+
+    //
+    // Computes the Name of an object from its public area.
+    //
+    // Parameters:
+    // - publicArea: Decoded public area.
+    // - name: Receives nameAlg || H_nameAlg(publicArea).
+    //
+    // Returns:
+    // - STATUS_SUCCESS: The Name was computed.
+    // - STATUS_NOT_SUPPORTED: The public area or its nameAlg cannot be marshalled or hashed.
+    // - Any status returned by Hash.
+    //
+    NTSTATUS ComputeName(
+        _In_ const TPMT_PUBLIC* publicArea,
+        _Out_ TPM2B_NAME* name
+    )
+    {
+        uint8_t marshalled[NAME_MARSHAL_BUFFER_SIZE];
+        uint32_t marshalledSize = this->MarshalPublicArea(publicArea, marshalled);
+        if (marshalledSize == 0)
+        {
+            return STATUS_NOT_SUPPORTED;
+        }
+        return this->HashName(publicArea->nameAlg, marshalled, marshalledSize, name);
+    }
+
+    //
+    // Same as ComputeName, for a compact public area (see pubkey.hpp), e.g. an RSA-4096 or P-521 key.
+    //
+    NTSTATUS ComputeName(
+        _In_ const TPM_COMPACT_PUBLIC* compactPublic,
+        _Out_ TPM2B_NAME* name
+    )
+    {
+        uint8_t marshalled[NAME_MARSHAL_BUFFER_SIZE];
+        uint32_t marshalledSize = this->MarshalCompactPublic(compactPublic, marshalled);
+        if (marshalledSize == 0)
+        {
+            return STATUS_NOT_SUPPORTED;
+        }
+        return this->HashName(compactPublic->nameAlg, marshalled, marshalledSize, name);
+    }
+
+    //
+    // Checks a Name, e.g. the one returned by ReadPublic, against a public area.
+    //
+    // Parameters:
+    // - publicArea: Decoded public area.
+    // - name: Name to check.
+    //
+    // Returns:
+    // - STATUS_SUCCESS: The Name matches the public area.
+    // - STATUS_DATA_ERROR: The Name does not match the public area.
+    // - Any status returned by ComputeName.
+    //
+    NTSTATUS VerifyName(
+        _In_ const TPMT_PUBLIC* publicArea,
+        _In_ const TPM2B_NAME* name
+    )
+    {
+        TPM2B_NAME computedName = { 0 };
+        NTSTATUS status = this->ComputeName(publicArea, &computedName);
+        return NT_ERROR(status) ? status : CompareName(&computedName, name);
+    }
+
+    //
+    // Same as VerifyName, for a compact public area.
+    //
+    NTSTATUS VerifyName(
+        _In_ const TPM_COMPACT_PUBLIC* compactPublic,
+        _In_ const TPM2B_NAME* name
+    )
+    {
+        TPM2B_NAME computedName = { 0 };
+        NTSTATUS status = this->ComputeName(compactPublic, &computedName);
+        return NT_ERROR(status) ? status : CompareName(&computedName, name);
+    }
+};
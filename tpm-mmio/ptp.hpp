@@ -86,6 +86,23 @@ private:
 		return status;
 	}
 
+	//
+	// Reads the vendor and device ID of the TPM, from where the detected interface keeps them.
+	//
+	void ReadDeviceId()
+	{
+		uintptr_t idAddress = (this->cachedInterface == PTP_INTERFACE_TYPE::PtpInterfaceCrb) ?
+			(uintptr_t)&((PTP_CRB_REGISTERS*)this->tpmBaseAddress)->Vid :
+			(uintptr_t)&((TIS_PC_REGISTERS*)this->tpmBaseAddress)->Vid;
+
+		uint32_t id = 0;
+		if (mmio::Read(idAddress, sizeof(id), &id))
+		{
+			this->vendorId = (uint16_t)id;
+			this->deviceId = (uint16_t)(id >> 16);
+		}
+	}
+
 public:
 
 	//
@@ -94,6 +111,12 @@ public:
 	PTP_INTERFACE_TYPE cachedInterface = PTP_INTERFACE_TYPE::PtpInterfaceNull;
 	uint8_t idleByPassState = 0xFF;
 
+	//
+	// Vendor and device ID of the TPM, 0 if they could not be read.
+	//
+	uint16_t vendorId = 0;
+	uint16_t deviceId = 0;
+
 	TpmPtp(uintptr_t tpmBaseAddress)
 	{
 		this->tpmBaseAddress = tpmBaseAddress;
@@ -106,7 +129,8 @@ public:
 			DbgError("Failed to get TPM PTP interface, double check you have TPM enabled in BIOS & PTP awareness is enabled.\n");
 			return false;
 		}
-		Dbg("ptpInterface: 0x%x\n", this->cachedInterface);
+		this->ReadDeviceId();
+		Dbg("ptpInterface: 0x%x, VID 0x%04x, DID 0x%04x\n", this->cachedInterface, this->vendorId, this->deviceId);
 		return true;
 	}
 
@@ -0,0 +1,53 @@
+#pragma once
+
+//
+// Decoded public area with its sized fields moved out of line. The fixed part is followed by
+// authPolicySize bytes of authPolicy, uniqueSize bytes of unique (keyedHash, sym, RSA modulus or
+// ECC x) and, for ECC, uniqueYSize bytes of y. Unlike TPMT_PUBLIC it holds 3072/4096-bit RSA and
+// P-384/P-521 keys, and only takes as much memory as the key it describes.
+//
+struct TPM_COMPACT_PUBLIC
+{
+    TPMI_ALG_PUBLIC      type;
+    TPMI_ALG_HASH        nameAlg;
+    TPMA_OBJECT          objectAttributes;
+    TPMU_PUBLIC_PARMS    parameters;
+    uint16_t             authPolicySize;
+    uint16_t             uniqueSize;
+    uint16_t             uniqueYSize;
+    uint16_t             reserved;
+};
+
+//
+// Accessors for the payloads that follow a TPM_COMPACT_PUBLIC header.
+//
+class TpmCompactPublic
+{
+public:
+
+    //
+    // Returns the size of a compact public area, including its payload.
+    //
+    static uint32_t GetSize(_In_ const TPM_COMPACT_PUBLIC* compactPublic)
+    {
+        return sizeof(TPM_COMPACT_PUBLIC) + compactPublic->authPolicySize + compactPublic->uniqueSize + compactPublic->uniqueYSize;
+    }
+
+    static const uint8_t* GetAuthPolicy(_In_ const TPM_COMPACT_PUBLIC* compactPublic)
+    {
+        return (const uint8_t*)(compactPublic + 1);
+    }
+
+    static const uint8_t* GetUnique(_In_ const TPM_COMPACT_PUBLIC* compactPublic)
+    {
+        return GetAuthPolicy(compactPublic) + compactPublic->authPolicySize;
+    }
+
+    //
+    // Returns the y coordinate of an ECC key. Empty for every other type.
+    //
+    static const uint8_t* GetUniqueY(_In_ const TPM_COMPACT_PUBLIC* compactPublic)
+    {
+        return GetUnique(compactPublic) + compactPublic->uniqueSize;
+    }
+};
@@ -0,0 +1,552 @@
+#pragma once
+
+//
+// Command submitted to a TpmCommandQueue. Owned by the submitter, which is blocked in Submit until
+// the command completes.
+//
+struct TPM_QUEUED_COMMAND
+{
+    LIST_ENTRY link;
+    uint32_t commandSize;
+    uint8_t* command;           // Marshalled command. Copied before it runs; left unchanged.
+    uint32_t responseSize;      // Size of response on input, size of the response on output
+    uint8_t* response;
+    NTSTATUS status;
+    uint64_t queuedTime;        // KeQueryPerformanceCounter when the command was queued
+    KEVENT completed;
+};
+
+typedef NTSTATUS TPM_QUEUE_EXECUTE_ROUTINE(_In_ void* engine, _Inout_ TPM_QUEUED_COMMAND* command, _In_ uint64_t queueTime);
+typedef void TPM_QUEUE_DELETE_ROUTINE(_In_ void* engine);
+
+//
+// Serializes commands from any number of submitters onto one TpmEngine, owned and driven by a
+// worker thread. The engine is only ever touched by the worker, so it needs no locking of its own.
+//
+// Commands come from Submit, one at a time, and from registered TpmCommandRings, which the worker
+// drains directly when their doorbell is set. Rings are served RING_BATCH_MAX commands at a time so
+// Submit callers are not starved by a busy ring.
+//
+class TpmCommandQueue
+{
+private:
+
+    //
+    // Engine of any transport, and the routines instantiated for it by Start.
+    //
+    void* engine = nullptr;
+    TPM_QUEUE_EXECUTE_ROUTINE* executeRoutine = nullptr;
+    TPM_QUEUE_DELETE_ROUTINE* deleteRoutine = nullptr;
+
+    KSPIN_LOCK lock;
+    LIST_ENTRY pending;
+    uint32_t depth = 0;
+    bool stopping = false;
+
+    //
+    // Acquisitions of lock, and how many of them found it held. Updated under the lock.
+    //
+    uint64_t lockAcquisitions = 0;
+    uint64_t lockContentions = 0;
+    KEVENT workAvailable;
+    HANDLE worker = NULL;
+
+    //
+    // Registered rings. Changed under ringLock held exclusive; the worker holds it shared while
+    // it serves the rings, so a ring is never in use once UnregisterRing returns.
+    //
+    EX_PUSH_LOCK ringLock;
+    TpmCommandRing* rings[RING_REGISTRATIONS_MAX] = { };
+    uint32_t ringCount = 0;
+    KWAIT_BLOCK waitBlocks[RING_REGISTRATIONS_MAX + 1];
+
+    //
+    // Kernel copies of the command and response being run, whether submitted or taken from a
+    // ring. The engine never reads or writes memory its caller can change under it.
+    //
+    uint8_t* stagedCommand = nullptr;
+    uint8_t* stagedResponse = nullptr;
+
+    template<typename Engine>
+    static NTSTATUS Execute(
+        _In_ void* engine,
+        _Inout_ TPM_QUEUED_COMMAND* command,
+        _In_ uint64_t queueTime
+    )
+    {
+        Engine* tpm = (Engine*)engine;
+        tpm->SetQueueTime(queueTime);
+        NTSTATUS status = tpm->SubmitVirtualizedCommand(command->commandSize, command->command, &command->responseSize, command->response);
+        tpm->SetQueueTime(0);
+        return status;
+    }
+
+    template<typename Engine>
+    static void Delete(_In_ void* engine)
+    {
+        Engine* tpm = (Engine*)engine;
+        tpm->FlushVirtualObjects();
+        delete tpm;
+    }
+
+    void AcquireLock(_Out_ PKIRQL irql)
+    {
+        bool contended = !KeTestSpinLock(&this->lock);
+        KeAcquireSpinLock(&this->lock, irql);
+        this->lockAcquisitions++;
+        this->lockContentions += contended ? 1 : 0;
+    }
+
+    //
+    // Removes the oldest pending command, or returns nullptr if there is none.
+    //
+    TPM_QUEUED_COMMAND* Dequeue()
+    {
+        TPM_QUEUED_COMMAND* command = nullptr;
+
+        KIRQL irql;
+        this->AcquireLock(&irql);
+        if (!IsListEmpty(&this->pending))
+        {
+            command = CONTAINING_RECORD(RemoveHeadList(&this->pending), TPM_QUEUED_COMMAND, link);
+            this->depth--;
+        }
+        KeReleaseSpinLock(&this->lock, irql);
+        return command;
+    }
+
+    bool IsStopping()
+    {
+        KIRQL irql;
+        this->AcquireLock(&irql);
+        bool stopping = this->stopping;
+        KeReleaseSpinLock(&this->lock, irql);
+        return stopping;
+    }
+
+    //
+    // Runs the command in stagedCommand, with its response in stagedResponse.
+    //
+    // Parameters:
+    // - commandSize: Size of the staged command.
+    // - responseCapacity: Size the response may take, up to TRANSPORT_STAGING_BUFFER_SIZE.
+    // - queueTime: Time the command waited in the queue, charged to its statistics.
+    // - responseSize: Receives the size of the response.
+    //
+    NTSTATUS RunStagedCommand(
+        _In_ uint32_t commandSize,
+        _In_ uint32_t responseCapacity,
+        _In_ uint64_t queueTime,
+        _Out_ uint32_t* responseSize
+    )
+    {
+        TPM_QUEUED_COMMAND command;
+        RtlZeroMemory(&command, sizeof(command));
+        command.command = this->stagedCommand;
+        command.commandSize = commandSize;
+        command.response = this->stagedResponse;
+        command.responseSize = min(responseCapacity, (uint32_t)TRANSPORT_STAGING_BUFFER_SIZE);
+
+        NTSTATUS status = this->executeRoutine(this->engine, &command, queueTime);
+        *responseSize = NT_ERROR(status) ? 0 : command.responseSize;
+        return status;
+    }
+
+    //
+    // Runs one submitted command. The command is copied in before it runs, and the response is
+    // copied out only once complete, as for ring entries: the response buffer of an IOCTL is the
+    // caller's locked pages, which the caller can write while the engine reads them back.
+    //
+    NTSTATUS RunQueuedCommand(
+        _Inout_ TPM_QUEUED_COMMAND* command,
+        _In_ uint64_t queueTime
+    )
+    {
+        if (command->commandSize > TRANSPORT_STAGING_BUFFER_SIZE)
+        {
+            return STATUS_INVALID_PARAMETER;
+        }
+        memcpy(this->stagedCommand, command->command, command->commandSize);
+
+        uint32_t responseSize = 0;
+        NTSTATUS status = this->RunStagedCommand(command->commandSize, command->responseSize, queueTime, &responseSize);
+        if (NT_ERROR(status))
+        {
+            return status;
+        }
+
+        memcpy(command->response, this->stagedResponse, responseSize);
+        command->responseSize = responseSize;
+        return STATUS_SUCCESS;
+    }
+
+    //
+    // Runs one ring entry. The command is copied out of its slot before it is checked, and the
+    // response is copied back once complete, so the process cannot change either under the engine.
+    //
+    // Parameters:
+    // - ring: Ring the entry was taken from.
+    // - submission: Entry taken with TpmCommandRing::Next.
+    // - responseSize: Receives the size of the response written to the slot.
+    //
+    // Returns:
+    // - STATUS_SUCCESS: The response is in the slot.
+    // - STATUS_INVALID_PARAMETER: The entry names no valid slot, or the command is malformed.
+    // - Any status returned by TpmEngine::SubmitVirtualizedCommand.
+    //
+    NTSTATUS RunRingCommand(
+        _In_ TpmCommandRing* ring,
+        _In_ const TPM_RING_SUBMISSION* submission,
+        _Out_ uint32_t* responseSize
+    )
+    {
+        *responseSize = 0;
+
+        uint8_t* slot = ring->GetSlot(submission);
+        if (!slot || submission->CommandSize > TRANSPORT_STAGING_BUFFER_SIZE)
+        {
+            return STATUS_INVALID_PARAMETER;
+        }
+
+        memcpy(this->stagedCommand, slot, submission->CommandSize);
+        if (!IsWellFormed(this->stagedCommand, submission->CommandSize))
+        {
+            return STATUS_INVALID_PARAMETER;
+        }
+
+        NTSTATUS status = this->RunStagedCommand(submission->CommandSize, TRANSPORT_STAGING_BUFFER_SIZE, 0, responseSize);
+        if (NT_ERROR(status))
+        {
+            return status;
+        }
+
+        memcpy(slot, this->stagedResponse, *responseSize);
+        return STATUS_SUCCESS;
+    }
+
+    //
+    // Serves up to RING_BATCH_MAX entries of every registered ring.
+    //
+    // Returns:
+    // - true: A ring still had entries when its batch ran out.
+    // - false: Every ring is drained, or blocked on a full completion ring.
+    //
+    bool ServeRings()
+    {
+        bool more = false;
+
+        KeEnterCriticalRegion();
+        ExAcquirePushLockShared(&this->ringLock);
+        for (uint32_t i = 0; i < this->ringCount; i++)
+        {
+            TpmCommandRing* ring = this->rings[i];
+            TPM_RING_SUBMISSION submission;
+            uint32_t done = 0;
+            while (done < RING_BATCH_MAX && ring->Next(&submission))
+            {
+                uint32_t responseSize = 0;
+                NTSTATUS status = this->RunRingCommand(ring, &submission, &responseSize);
+                ring->Complete(&submission, status, responseSize);
+                done++;
+            }
+
+            if (done)
+            {
+                ring->Notify();
+            }
+            more |= (done == RING_BATCH_MAX);
+        }
+        ExReleasePushLockShared(&this->ringLock);
+        KeLeaveCriticalRegion();
+        return more;
+    }
+
+    //
+    // Waits until a command is submitted or the doorbell of a ring is set. The doorbells are
+    // referenced for the wait, so a ring unregistered meanwhile does not free its event under it.
+    //
+    void WaitForWork()
+    {
+        PVOID objects[RING_REGISTRATIONS_MAX + 1];
+        uint32_t count = 0;
+        objects[count++] = &this->workAvailable;
+
+        KeEnterCriticalRegion();
+        ExAcquirePushLockShared(&this->ringLock);
+        for (uint32_t i = 0; i < this->ringCount; i++)
+        {
+            objects[count] = this->rings[i]->GetDoorbell();
+            ObReferenceObject(objects[count]);
+            count++;
+        }
+        ExReleasePushLockShared(&this->ringLock);
+        KeLeaveCriticalRegion();
+
+        (void)KeWaitForMultipleObjects(count, objects, WaitAny, Executive, KernelMode, FALSE, NULL, this->waitBlocks);
+
+        for (uint32_t i = 1; i < count; i++)
+        {
+            ObDereferenceObject(objects[i]);
+        }
+    }
+
+    //
+    // Runs every pending command in order.
+    //
+    void RunPending()
+    {
+        for (TPM_QUEUED_COMMAND* command = this->Dequeue(); command; command = this->Dequeue())
+        {
+            uint64_t queueTime = trace::Timestamp() - command->queuedTime;
+            command->status = this->RunQueuedCommand(command, queueTime);
+            (void)KeSetEvent(&command->completed, IO_NO_INCREMENT, FALSE);
+        }
+    }
+
+    //
+    // Worker thread. Runs pending commands in order, and ring entries, until the queue is stopped
+    // and drained.
+    //
+    static void WorkerRoutine(_In_ PVOID context)
+    {
+        TpmCommandQueue* queue = (TpmCommandQueue*)context;
+        bool more = false;
+        while (true)
+        {
+            if (!more)
+            {
+                queue->WaitForWork();
+            }
+
+            queue->RunPending();
+            more = queue->ServeRings();
+
+            if (queue->IsStopping())
+            {
+                //
+                // A command may have been queued after the drain above and before stopping was
+                // set. Submit refuses new ones once it is, under the same lock, so this drain is
+                // the last.
+                //
+                queue->RunPending();
+                break;
+            }
+        }
+        (void)PsTerminateSystemThread(STATUS_SUCCESS);
+    }
+
+public:
+
+    TpmCommandQueue()
+    {
+        KeInitializeSpinLock(&this->lock);
+        InitializeListHead(&this->pending);
+        KeInitializeEvent(&this->workAvailable, SynchronizationEvent, FALSE);
+        ExInitializePushLock(&this->ringLock);
+    }
+
+    //
+    // Stops accepting commands, waits for the pending ones to run, and deletes the engine after
+    // flushing its virtual objects.
+    //
+    ~TpmCommandQueue()
+    {
+        if (this->worker)
+        {
+            KIRQL irql;
+            this->AcquireLock(&irql);
+            this->stopping = true;
+            KeReleaseSpinLock(&this->lock, irql);
+
+            (void)KeSetEvent(&this->workAvailable, IO_NO_INCREMENT, FALSE);
+            (void)ZwWaitForSingleObject(this->worker, FALSE, NULL);
+            (void)ZwClose(this->worker);
+        }
+
+        if (this->engine)
+        {
+            this->deleteRoutine(this->engine);
+        }
+        pool::Free(this->stagedCommand);
+        pool::Free(this->stagedResponse);
+    }
+
+    //
+    // Checks that a command has a header whose paramSize matches its size.
+    //
+    static bool IsWellFormed(
+        _In_reads_bytes_(commandSize) const uint8_t* command,
+        _In_ uint32_t commandSize
+    )
+    {
+        if (commandSize < sizeof(TPM2_COMMAND_HEADER) || commandSize > TRANSPORT_STAGING_BUFFER_SIZE)
+        {
+            return false;
+        }
+
+        uint32_t paramSize = 0;
+        memcpy(&paramSize, command + FIELD_OFFSET(TPM2_COMMAND_HEADER, paramSize), sizeof(paramSize));
+        return _byteswap_ulong(paramSize) == commandSize;
+    }
+
+    //
+    // Takes ownership of an initialized engine and starts the worker thread that drives it.
+    //
+    // Parameters:
+    // - engine: Engine to drive. Deleted with the queue, even if the worker could not be started.
+    //
+    // Returns:
+    // - STATUS_SUCCESS: Commands can be submitted.
+    // - STATUS_INSUFFICIENT_RESOURCES: The staging buffers could not be allocated.
+    // - Any status returned by PsCreateSystemThread.
+    //
+    template<typename Engine>
+    NTSTATUS Start(_In_ Engine* engine)
+    {
+        this->engine = engine;
+        this->executeRoutine = &Execute<Engine>;
+        this->deleteRoutine = &Delete<Engine>;
+
+        this->stagedCommand = (uint8_t*)pool::Allocate(TRANSPORT_STAGING_BUFFER_SIZE);
+        this->stagedResponse = (uint8_t*)pool::Allocate(TRANSPORT_STAGING_BUFFER_SIZE);
+        if (!this->stagedCommand || !this->stagedResponse)
+        {
+            DbgError("TpmCommandQueue::Start - failed to allocate the staging buffers.\n");
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        //
+        // The kernel handle is kept to wait for the thread to exit when the queue is deleted.
+        //
+        OBJECT_ATTRIBUTES attributes;
+        InitializeObjectAttributes(&attributes, NULL, OBJ_KERNEL_HANDLE, NULL, NULL);
+        NTSTATUS status = PsCreateSystemThread(&this->worker, THREAD_ALL_ACCESS, &attributes, NULL, NULL, WorkerRoutine, this);
+        if (NT_ERROR(status))
+        {
+            DbgError("TpmCommandQueue::Start - PsCreateSystemThread failed with 0x%08x.\n", status);
+            this->worker = NULL;
+            return status;
+        }
+        return STATUS_SUCCESS;
+    }
+
+    //
+    // Queues a command and waits for it to complete. Must be called at PASSIVE_LEVEL.
+    //
+    // Parameters:
+    // - command: Command to run. command, commandSize, response and responseSize must be set;
+    //            the rest is initialized here. The response is written once, when complete.
+    //
+    // Returns:
+    // - STATUS_INVALID_PARAMETER: The command is larger than TRANSPORT_STAGING_BUFFER_SIZE.
+    // - STATUS_DEVICE_BUSY: COMMAND_QUEUE_DEPTH_MAX commands are already pending.
+    // - STATUS_DELETE_PENDING: The queue is stopping, or was never started.
+    // - Any status returned by TpmEngine::SubmitVirtualizedCommand.
+    //
+    NTSTATUS Submit(_Inout_ TPM_QUEUED_COMMAND* command)
+    {
+        KeInitializeEvent(&command->completed, NotificationEvent, FALSE);
+        command->status = STATUS_PENDING;
+        command->queuedTime = trace::Timestamp();
+
+        KIRQL irql;
+        this->AcquireLock(&irql);
+        if (this->stopping || !this->worker)
+        {
+            KeReleaseSpinLock(&this->lock, irql);
+            return STATUS_DELETE_PENDING;
+        }
+        if (this->depth >= COMMAND_QUEUE_DEPTH_MAX)
+        {
+            KeReleaseSpinLock(&this->lock, irql);
+            return STATUS_DEVICE_BUSY;
+        }
+        InsertTailList(&this->pending, &command->link);
+        this->depth++;
+        KeReleaseSpinLock(&this->lock, irql);
+
+        (void)KeSetEvent(&this->workAvailable, IO_NO_INCREMENT, FALSE);
+        (void)KeWaitForSingleObject(&command->completed, Executive, KernelMode, FALSE, NULL);
+        return command->status;
+    }
+
+    //
+    // Returns how often the queue lock was taken, and how often it was found held.
+    //
+    // Parameters:
+    // - acquisitions: Receives the number of acquisitions so far.
+    // - contentions: Receives the number of those that had to wait.
+    //
+    void GetLockStatistics(
+        _Out_ uint64_t* acquisitions,
+        _Out_ uint64_t* contentions
+    )
+    {
+        KIRQL irql;
+        KeAcquireSpinLock(&this->lock, &irql);
+        *acquisitions = this->lockAcquisitions;
+        *contentions = this->lockContentions;
+        KeReleaseSpinLock(&this->lock, irql);
+    }
+
+    //
+    // Has the worker serve a ring whenever its doorbell is set.
+    //
+    // Parameters:
+    // - ring: Initialized ring. Must stay alive until UnregisterRing returns.
+    //
+    // Returns:
+    // - STATUS_SUCCESS: The ring is served.
+    // - STATUS_INSUFFICIENT_RESOURCES: RING_REGISTRATIONS_MAX rings are already registered.
+    // - STATUS_DELETE_PENDING: The queue is stopping, or was never started.
+    //
+    NTSTATUS RegisterRing(_In_ TpmCommandRing* ring)
+    {
+        if (!this->worker || this->IsStopping())
+        {
+            return STATUS_DELETE_PENDING;
+        }
+
+        NTSTATUS status = STATUS_SUCCESS;
+        KeEnterCriticalRegion();
+        ExAcquirePushLockExclusive(&this->ringLock);
+        if (this->ringCount < RING_REGISTRATIONS_MAX)
+        {
+            this->rings[this->ringCount++] = ring;
+        }
+        else
+        {
+            status = STATUS_INSUFFICIENT_RESOURCES;
+        }
+        ExReleasePushLockExclusive(&this->ringLock);
+        KeLeaveCriticalRegion();
+
+        //
+        // Wake the worker so it waits on the new doorbell, and picks up anything already submitted.
+        //
+        (void)KeSetEvent(&this->workAvailable, IO_NO_INCREMENT, FALSE);
+        return status;
+    }
+
+    //
+    // Stops serving a ring. Waits for the worker to finish the batch it may be running from it.
+    //
+    void UnregisterRing(_In_ TpmCommandRing* ring)
+    {
+        KeEnterCriticalRegion();
+        ExAcquirePushLockExclusive(&this->ringLock);
+        for (uint32_t i = 0; i < this->ringCount; i++)
+        {
+            if (this->rings[i] == ring)
+            {
+                this->rings[i] = this->rings[--this->ringCount];
+                this->rings[this->ringCount] = nullptr;
+                break;
+            }
+        }
+        ExReleasePushLockExclusive(&this->ringLock);
+        KeLeaveCriticalRegion();
+
+        (void)KeSetEvent(&this->workAvailable, IO_NO_INCREMENT, FALSE);
+    }
+};
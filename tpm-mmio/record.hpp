@@ -0,0 +1,221 @@
+#pragma once
+
+//
+// Recording of every register access made through the mmio layer, for replaying a session in place
+// of the device with MMIO_REPLAY. Compiled in with MMIO_RECORD; everything here is a no-op otherwise.
+//
+// The trace file is a TPM_MMIO_TRACE_HEADER followed by RecordCount records. Each record is a
+// TPM_MMIO_RECORD followed by its Length data bytes, padded to 8: the value read or written for a
+// register access, or the bytes transferred for a bulk data buffer access.
+//
+struct TPM_MMIO_TRACE_HEADER
+{
+    uint32_t Magic;                 // MMIO_TRACE_MAGIC
+    uint16_t Version;               // MMIO_TRACE_VERSION
+    uint16_t HeaderSize;
+    uint64_t Frequency;             // Timestamp ticks per second
+    uint32_t RecordCount;
+    uint32_t DroppedRecords;        // Accesses not recorded because the buffer was full
+    uint64_t DataSize;              // Bytes of records following the header
+};
+
+enum TPM_MMIO_DIRECTION : uint8_t
+{
+    TpmMmioRead,
+    TpmMmioWrite
+};
+
+struct TPM_MMIO_RECORD
+{
+    uint64_t Timestamp;             // Ticks since the recording started
+    uint64_t Address;               // Physical address
+    uint32_t Length;                // Access width, or size of a bulk transfer
+    uint8_t Direction;              // TPM_MMIO_DIRECTION
+    uint8_t Reserved[3];
+};
+
+namespace record
+{
+    struct MMIO_RECORDER
+    {
+        uint8_t* buffer;
+        volatile LONG used;
+        volatile LONG records;
+        volatile LONG dropped;
+        uint64_t startTime;
+    };
+
+    inline MMIO_RECORDER& Recorder()
+    {
+        static MMIO_RECORDER recorder = { 0 };
+        return recorder;
+    }
+
+    //
+    // Starts recording into a buffer of MMIO_RECORD_BUFFER_SIZE bytes. Accesses made once it is
+    // full are counted as dropped.
+    //
+    // Returns:
+    // - STATUS_SUCCESS: Recording, or MMIO_RECORD is off.
+    // - STATUS_INSUFFICIENT_RESOURCES: The buffer could not be allocated.
+    //
+    inline NTSTATUS Start()
+    {
+#if MMIO_RECORD
+        MMIO_RECORDER& recorder = Recorder();
+        recorder.buffer = (uint8_t*)pool::Allocate(MMIO_RECORD_BUFFER_SIZE);
+        if (!recorder.buffer)
+        {
+            DbgError("record::Start - failed to allocate the record buffer.\n");
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+        recorder.startTime = trace::Timestamp();
+#endif
+        return STATUS_SUCCESS;
+    }
+
+    //
+    // Appends one access. Safe at any IRQL and from concurrent callers.
+    //
+    // Parameters:
+    // - direction: TpmMmioRead or TpmMmioWrite.
+    // - physicalAddress: Physical address of the access.
+    // - length: Width of the access, or size of the bulk transfer.
+    // - data: Bytes read or written.
+    //
+    inline void Access(
+        _In_ TPM_MMIO_DIRECTION direction,
+        _In_ uint64_t physicalAddress,
+        _In_ uint32_t length,
+        _In_reads_bytes_(length) const void* data
+    )
+    {
+#if MMIO_RECORD
+        MMIO_RECORDER& recorder = Recorder();
+        if (!recorder.buffer)
+        {
+            return;
+        }
+
+        //
+        // Reserve the record, or drop it if it does not fit.
+        //
+        LONG size = (LONG)(sizeof(TPM_MMIO_RECORD) + ALIGN_UP_BY(length, 8));
+        LONG offset;
+        do
+        {
+            offset = recorder.used;
+            if (length > MMIO_RECORD_BUFFER_SIZE || offset + size > MMIO_RECORD_BUFFER_SIZE)
+            {
+                (void)InterlockedIncrement(&recorder.dropped);
+                return;
+            }
+        } while (InterlockedCompareExchange(&recorder.used, offset + size, offset) != offset);
+
+        TPM_MMIO_RECORD* entry = (TPM_MMIO_RECORD*)(recorder.buffer + offset);
+        entry->Timestamp = trace::Timestamp() - recorder.startTime;
+        entry->Address = physicalAddress;
+        entry->Length = length;
+        entry->Direction = (uint8_t)direction;
+        RtlZeroMemory(entry->Reserved, sizeof(entry->Reserved));
+        RtlZeroMemory((uint8_t*)(entry + 1), size - sizeof(TPM_MMIO_RECORD));
+        RtlCopyMemory((uint8_t*)(entry + 1), data, length);
+        (void)InterlockedIncrement(&recorder.records);
+#else
+        UNREFERENCED_PARAMETER(direction);
+        UNREFERENCED_PARAMETER(physicalAddress);
+        UNREFERENCED_PARAMETER(length);
+        UNREFERENCED_PARAMETER(data);
+#endif
+    }
+
+    //
+    // Appends a bulk transfer through a mapping of device memory, recorded at its physical address.
+    //
+    inline void Bulk(
+        _In_ TPM_MMIO_DIRECTION direction,
+        _In_ const volatile void* virtualAddress,
+        _In_ uint32_t length,
+        _In_reads_bytes_(length) const void* data
+    )
+    {
+#if MMIO_RECORD
+        if (Recorder().buffer)
+        {
+            Access(direction, (uint64_t)MmGetPhysicalAddress((PVOID)virtualAddress).QuadPart, length, data);
+        }
+#else
+        UNREFERENCED_PARAMETER(direction);
+        UNREFERENCED_PARAMETER(virtualAddress);
+        UNREFERENCED_PARAMETER(length);
+        UNREFERENCED_PARAMETER(data);
+#endif
+    }
+
+    //
+    // Stops recording and writes the trace file. Must be called at PASSIVE_LEVEL, once no more
+    // accesses can be made.
+    //
+    // Parameters:
+    // - fileName: Path of the trace file, e.g. MMIO_RECORD_FILE_NAME. Overwritten if it exists.
+    //
+    // Returns:
+    // - STATUS_SUCCESS: The trace is written, or MMIO_RECORD is off.
+    // - Any status returned by ZwCreateFile or ZwWriteFile.
+    //
+    inline NTSTATUS Stop(_In_ PCWSTR fileName)
+    {
+#if MMIO_RECORD
+        MMIO_RECORDER& recorder = Recorder();
+        if (!recorder.buffer)
+        {
+            return STATUS_SUCCESS;
+        }
+
+        TPM_MMIO_TRACE_HEADER header;
+        RtlZeroMemory(&header, sizeof(header));
+        header.Magic = MMIO_TRACE_MAGIC;
+        header.Version = MMIO_TRACE_VERSION;
+        header.HeaderSize = sizeof(header);
+        header.Frequency = trace::Frequency();
+        header.RecordCount = (uint32_t)recorder.records;
+        header.DroppedRecords = (uint32_t)recorder.dropped;
+        header.DataSize = (uint64_t)recorder.used;
+
+        UNICODE_STRING name;
+        RtlInitUnicodeString(&name, fileName);
+        OBJECT_ATTRIBUTES attributes;
+        InitializeObjectAttributes(&attributes, &name, OBJ_KERNEL_HANDLE | OBJ_CASE_INSENSITIVE, NULL, NULL);
+
+        HANDLE file = NULL;
+        IO_STATUS_BLOCK ioStatus;
+        NTSTATUS status = ZwCreateFile(&file, FILE_GENERIC_WRITE, &attributes, &ioStatus, NULL, FILE_ATTRIBUTE_NORMAL,
+            0, FILE_OVERWRITE_IF, FILE_SYNCHRONOUS_IO_NONALERT | FILE_NON_DIRECTORY_FILE, NULL, 0);
+        if (NT_SUCCESS(status))
+        {
+            status = ZwWriteFile(file, NULL, NULL, NULL, &ioStatus, &header, sizeof(header), NULL, NULL);
+            if (NT_SUCCESS(status) && header.DataSize)
+            {
+                status = ZwWriteFile(file, NULL, NULL, NULL, &ioStatus, recorder.buffer, (ULONG)header.DataSize, NULL, NULL);
+            }
+            (void)ZwClose(file);
+        }
+
+        if (NT_ERROR(status))
+        {
+            DbgError("record::Stop - failed to write %ws - 0x%08x.\n", fileName, status);
+        }
+        else
+        {
+            Dbg("Recorded %u MMIO accesses (%u dropped) to %ws.\n", header.RecordCount, header.DroppedRecords, fileName);
+        }
+
+        pool::Free(recorder.buffer);
+        RtlZeroMemory(&recorder, sizeof(recorder));
+        return status;
+#else
+        UNREFERENCED_PARAMETER(fileName);
+        return STATUS_SUCCESS;
+#endif
+    }
+}
@@ -0,0 +1,329 @@
+#pragma once
+
+//
+// Replay of a trace written with MMIO_RECORD in place of the device. Compiled in with MMIO_REPLAY;
+// everything here is a no-op otherwise.
+//
+// Nothing is mapped: each register read returns the value of the next record, and each register
+// write must match it in address, width and bytes. The CRB data buffer is a shadow in pool memory
+// whose bulk transfers are replayed at the recorded physical address of the buffer. The first
+// access that differs from the trace fails the replay; it and every access after it return false,
+// reads returning 0xFF as from an absent device.
+//
+// The replayed build must make the same accesses in the same order as the recorded one: the same
+// flags, no clients of the device before the replay is checked, and a trace without dropped records.
+//
+static_assert(!(MMIO_REPLAY && (MMIO_RECORD || TPM_SIMULATOR)), "MMIO_REPLAY stands in for the device; build it without MMIO_RECORD and TPM_SIMULATOR");
+
+namespace replay
+{
+    struct MMIO_REPLAY_STATE
+    {
+        uint8_t* records;               // Records as they follow the header in the file
+        uint64_t size;
+        uint64_t offset;                // Next record
+        uint32_t recordCount;
+        uint32_t replayed;
+        uint8_t* dataBuffer;            // Shadow of the CRB data buffer
+        uintptr_t dataBufferAddress;    // Physical address it stands for
+        KSPIN_LOCK lock;
+        bool failed;
+    };
+
+    inline MMIO_REPLAY_STATE& State()
+    {
+        static MMIO_REPLAY_STATE state = { 0 };
+        return state;
+    }
+
+    inline const char* GetDirectionName(_In_ uint8_t direction)
+    {
+        return (direction == TpmMmioRead) ? "read" : "write";
+    }
+
+    //
+    // Loads a trace and checks that its records can be walked. Must be called at PASSIVE_LEVEL,
+    // before any register access.
+    //
+    // Parameters:
+    // - fileName: Path of the trace file, e.g. MMIO_REPLAY_FILE_NAME.
+    //
+    // Returns:
+    // - STATUS_SUCCESS: Replaying, or MMIO_REPLAY is off.
+    // - STATUS_INVALID_IMAGE_FORMAT: Not a trace of this version, empty, or with dropped records.
+    // - STATUS_INSUFFICIENT_RESOURCES: The trace could not be allocated.
+    // - Any status returned by ZwCreateFile, ZwQueryInformationFile or ZwReadFile.
+    //
+    inline NTSTATUS Start(_In_ PCWSTR fileName)
+    {
+#if MMIO_REPLAY
+        MMIO_REPLAY_STATE& state = State();
+        KeInitializeSpinLock(&state.lock);
+
+        UNICODE_STRING name;
+        RtlInitUnicodeString(&name, fileName);
+        OBJECT_ATTRIBUTES attributes;
+        InitializeObjectAttributes(&attributes, &name, OBJ_KERNEL_HANDLE | OBJ_CASE_INSENSITIVE, NULL, NULL);
+
+        HANDLE file = NULL;
+        IO_STATUS_BLOCK ioStatus;
+        NTSTATUS status = ZwCreateFile(&file, FILE_GENERIC_READ, &attributes, &ioStatus, NULL, FILE_ATTRIBUTE_NORMAL,
+            FILE_SHARE_READ, FILE_OPEN, FILE_SYNCHRONOUS_IO_NONALERT | FILE_NON_DIRECTORY_FILE, NULL, 0);
+        if (NT_ERROR(status))
+        {
+            DbgError("replay::Start - failed to open %ws - 0x%08x.\n", fileName, status);
+            return status;
+        }
+
+        FILE_STANDARD_INFORMATION information;
+        TPM_MMIO_TRACE_HEADER header;
+        RtlZeroMemory(&header, sizeof(header));
+        status = ZwQueryInformationFile(file, &ioStatus, &information, sizeof(information), FileStandardInformation);
+        if (NT_SUCCESS(status))
+        {
+            status = ZwReadFile(file, NULL, NULL, NULL, &ioStatus, &header, sizeof(header), NULL, NULL);
+        }
+        if (NT_SUCCESS(status) &&
+            (ioStatus.Information != sizeof(header) ||
+             header.Magic != MMIO_TRACE_MAGIC ||
+             header.Version != MMIO_TRACE_VERSION ||
+             header.HeaderSize != sizeof(header) ||
+             header.RecordCount == 0 ||
+             header.DroppedRecords != 0 ||
+             header.DataSize > MMIO_RECORD_BUFFER_SIZE ||
+             header.DataSize != (uint64_t)information.EndOfFile.QuadPart - sizeof(header)))
+        {
+            status = STATUS_INVALID_IMAGE_FORMAT;
+        }
+        if (NT_SUCCESS(status))
+        {
+            state.records = (uint8_t*)pool::Allocate((size_t)header.DataSize);
+            status = state.records ? STATUS_SUCCESS : STATUS_INSUFFICIENT_RESOURCES;
+        }
+        if (NT_SUCCESS(status))
+        {
+            status = ZwReadFile(file, NULL, NULL, NULL, &ioStatus, state.records, (ULONG)header.DataSize, NULL, NULL);
+            if (NT_SUCCESS(status) && ioStatus.Information != header.DataSize)
+            {
+                status = STATUS_INVALID_IMAGE_FORMAT;
+            }
+        }
+        (void)ZwClose(file);
+
+        //
+        // Walk the records once, so replaying never reads past the trace.
+        //
+        uint64_t offset = 0;
+        for (uint32_t i = 0; NT_SUCCESS(status) && i < header.RecordCount; i++)
+        {
+            const TPM_MMIO_RECORD* entry = (const TPM_MMIO_RECORD*)(state.records + offset);
+            if (header.DataSize - offset < sizeof(TPM_MMIO_RECORD) ||
+                entry->Direction > TpmMmioWrite ||
+                header.DataSize - offset - sizeof(TPM_MMIO_RECORD) < ALIGN_UP_BY(entry->Length, 8))
+            {
+                status = STATUS_INVALID_IMAGE_FORMAT;
+                break;
+            }
+            offset += sizeof(TPM_MMIO_RECORD) + ALIGN_UP_BY(entry->Length, 8);
+        }
+        if (NT_SUCCESS(status) && offset != header.DataSize)
+        {
+            status = STATUS_INVALID_IMAGE_FORMAT;
+        }
+
+        if (NT_ERROR(status))
+        {
+            DbgError("replay::Start - failed to load %ws - 0x%08x.\n", fileName, status);
+            pool::Free(state.records);
+            state.records = nullptr;
+            return status;
+        }
+
+        state.size = header.DataSize;
+        state.recordCount = header.RecordCount;
+        Dbg("Replaying %u MMIO accesses from %ws.\n", header.RecordCount, fileName);
+#else
+        UNREFERENCED_PARAMETER(fileName);
+#endif
+        return STATUS_SUCCESS;
+    }
+
+    //
+    // Returns the interface base of the recorded TPM: the address of the first record, since every
+    // session starts with TpmPtp::Init reading the interface base.
+    //
+    inline bool GetBaseAddress(_Out_ uintptr_t* baseAddress)
+    {
+        *baseAddress = 0;
+#if MMIO_REPLAY
+        MMIO_REPLAY_STATE& state = State();
+        if (state.records)
+        {
+            *baseAddress = (uintptr_t)((const TPM_MMIO_RECORD*)state.records)->Address;
+            return true;
+        }
+#endif
+        return false;
+    }
+
+    //
+    // Replays one access against the next record. Safe at any IRQL and from concurrent callers.
+    //
+    // Parameters:
+    // - direction: TpmMmioRead or TpmMmioWrite.
+    // - physicalAddress: Physical address of the access.
+    // - length: Width of the access, or size of the bulk transfer.
+    // - data: Receives the recorded bytes of a read; holds the bytes of a write.
+    //
+    // Returns:
+    // - true: The access matches the record.
+    // - false: The replay has failed, now or before.
+    //
+    inline bool Access(
+        _In_ TPM_MMIO_DIRECTION direction,
+        _In_ uint64_t physicalAddress,
+        _In_ uint32_t length,
+        _Inout_updates_bytes_(length) void* data
+    )
+    {
+#if MMIO_REPLAY
+        MMIO_REPLAY_STATE& state = State();
+        bool matched = false;
+        if (state.records)
+        {
+            KIRQL irql;
+            KeAcquireSpinLock(&state.lock, &irql);
+            if (!state.failed)
+            {
+                const TPM_MMIO_RECORD* entry = (const TPM_MMIO_RECORD*)(state.records + state.offset);
+                if (state.offset == state.size)
+                {
+                    DbgError("replay::Access - %s of 0x%llx (%u bytes) past the end of the trace.\n",
+                        GetDirectionName(direction), physicalAddress, length);
+                }
+                else if (entry->Direction != direction || entry->Address != physicalAddress || entry->Length != length)
+                {
+                    DbgError("replay::Access - record %u is a %s of 0x%llx (%u bytes), not a %s of 0x%llx (%u bytes).\n",
+                        state.replayed, GetDirectionName(entry->Direction), entry->Address, entry->Length,
+                        GetDirectionName(direction), physicalAddress, length);
+                }
+                else if (direction == TpmMmioWrite && RtlCompareMemory(entry + 1, data, length) != length)
+                {
+                    DbgError("replay::Access - record %u wrote other bytes to 0x%llx.\n", state.replayed, physicalAddress);
+                }
+                else
+                {
+                    if (direction == TpmMmioRead)
+                    {
+                        RtlCopyMemory(data, entry + 1, length);
+                    }
+                    state.offset += sizeof(TPM_MMIO_RECORD) + ALIGN_UP_BY(length, 8);
+                    state.replayed++;
+                    matched = true;
+                }
+                state.failed = !matched;
+            }
+            KeReleaseSpinLock(&state.lock, irql);
+        }
+
+        if (!matched && direction == TpmMmioRead)
+        {
+            RtlFillMemory(data, length, 0xFF);
+        }
+        return matched;
+#else
+        UNREFERENCED_PARAMETER(direction);
+        UNREFERENCED_PARAMETER(physicalAddress);
+        UNREFERENCED_PARAMETER(length);
+        UNREFERENCED_PARAMETER(data);
+        return true;
+#endif
+    }
+
+    //
+    // Replays a bulk transfer through the shadow returned by MapDataBuffer, at the physical address
+    // the shadow stands for.
+    //
+    inline bool Bulk(
+        _In_ TPM_MMIO_DIRECTION direction,
+        _In_ const volatile void* virtualAddress,
+        _In_ uint32_t length,
+        _Inout_updates_bytes_(length) void* data
+    )
+    {
+#if MMIO_REPLAY
+        MMIO_REPLAY_STATE& state = State();
+        uintptr_t offset = (uintptr_t)virtualAddress - (uintptr_t)state.dataBuffer;
+        return Access(direction, state.dataBufferAddress + offset, length, data);
+#else
+        UNREFERENCED_PARAMETER(direction);
+        UNREFERENCED_PARAMETER(virtualAddress);
+        UNREFERENCED_PARAMETER(length);
+        UNREFERENCED_PARAMETER(data);
+        return true;
+#endif
+    }
+
+    //
+    // Returns the shadow standing in for a mapping of the CRB data buffer, allocated on first use.
+    // It lives until Stop, so callers never unmap it.
+    //
+    // Parameters:
+    // - physicalAddress: Physical address of the data buffer.
+    // - size: Size of the data buffer in bytes.
+    //
+    // Returns:
+    // - The shadow, or nullptr if it could not be allocated or MMIO_REPLAY is off.
+    //
+    inline uint8_t* MapDataBuffer(
+        _In_ uintptr_t physicalAddress,
+        _In_ uint32_t size
+    )
+    {
+#if MMIO_REPLAY
+        MMIO_REPLAY_STATE& state = State();
+        if (!state.dataBuffer)
+        {
+            state.dataBuffer = (uint8_t*)pool::Allocate(size);
+            state.dataBufferAddress = physicalAddress;
+        }
+        return state.dataBuffer;
+#else
+        UNREFERENCED_PARAMETER(physicalAddress);
+        UNREFERENCED_PARAMETER(size);
+        return nullptr;
+#endif
+    }
+
+    //
+    // Returns:
+    // - STATUS_SUCCESS: Every access so far matched the trace, or MMIO_REPLAY is off.
+    // - STATUS_UNSUCCESSFUL: An access diverged from the trace.
+    //
+    inline NTSTATUS Check()
+    {
+        return State().failed ? STATUS_UNSUCCESSFUL : STATUS_SUCCESS;
+    }
+
+    //
+    // Stops replaying and frees the trace. Must be called once no more accesses can be made.
+    //
+    // Returns:
+    // - The status returned by Check.
+    //
+    inline NTSTATUS Stop()
+    {
+        NTSTATUS status = Check();
+#if MMIO_REPLAY
+        MMIO_REPLAY_STATE& state = State();
+        if (state.records)
+        {
+            Dbg("Replayed %u of %u MMIO accesses%s.\n", state.replayed, state.recordCount, state.failed ? " before diverging" : "");
+        }
+        pool::Free(state.records);
+        pool::Free(state.dataBuffer);
+        RtlZeroMemory(&state, sizeof(state));
+#endif
+        return status;
+    }
+}
@@ -0,0 +1,385 @@
+#pragma once
+
+//
+// Bookkeeping for virtualized transient objects.
+//
+// Callers only ever see virtual handles (RM_VIRTUAL_HANDLE_FIRST + slot). Each slot is either loaded,
+// with a physical handle on the TPM, or swapped out, with its context held in the slot's block of the
+// context arena. TpmEngine drives the ContextSave/ContextLoad/FlushContext traffic; this class only
+// decides which slot goes and where its context lives.
+//
+class TpmResourceManager
+{
+private:
+
+    struct RM_SLOT
+    {
+        bool       used;
+
+        //
+        // Physical handle while loaded, 0 while swapped out.
+        //
+        TPM_HANDLE physicalHandle;
+
+        //
+        // The saved context can be loaded again as-is, so the object can be flushed without a
+        // new ContextSave. Only true for objects whose state never changes (not sequences).
+        //
+        bool       contextReusable;
+        bool       contextValid;
+        uint32_t   contextSize;
+        uint64_t   lastUse;
+    };
+
+    RM_SLOT slots[RM_MAX_OBJECTS] = { };
+
+    //
+    // One block of RM_CONTEXT_BLOCK_SIZE per slot. A block holds a TPM2_CONTEXT_SAVE_RESPONSE, whose
+    // header is the same size as a command header, so it can be resubmitted as TPM2_CONTEXT_LOAD_COMMAND
+    // in place.
+    //
+    uint8_t* contextArena = nullptr;
+
+    //
+    // Command attributes reported by TPM_CAP_COMMANDS, used to find the handle area.
+    //
+    TPMA_CC commandAttributes[MAX_CAP_CC] = { };
+    uint32_t commandCount = 0;
+
+    uint64_t useCounter = 0;
+    uint32_t loadedCount = 0;
+    uint32_t loadedLimit = 0;
+
+    RM_SLOT* GetSlot(_In_ TPM_HANDLE virtualHandle)
+    {
+        if (!IsVirtualHandle(virtualHandle))
+        {
+            return nullptr;
+        }
+
+        RM_SLOT* slot = &this->slots[virtualHandle - RM_VIRTUAL_HANDLE_FIRST];
+        return slot->used ? slot : nullptr;
+    }
+
+public:
+
+    ~TpmResourceManager()
+    {
+        delete[] this->contextArena;
+    }
+
+    //
+    // Allocates the context arena.
+    //
+    // Parameters:
+    // - limit: Number of objects that may be loaded on the TPM at the same time.
+    //
+    // Returns:
+    // - true: The resource manager is ready.
+    // - false: Out of memory.
+    //
+    bool Init(_In_ uint32_t limit)
+    {
+        if (this->contextArena == nullptr)
+        {
+            this->contextArena = new uint8_t[RM_MAX_OBJECTS * RM_CONTEXT_BLOCK_SIZE];
+            if (!this->contextArena)
+            {
+                return false;
+            }
+        }
+
+        this->loadedLimit = limit == 0 ? 1 : min(limit, (uint32_t)RM_MAX_OBJECTS);
+        return true;
+    }
+
+    bool IsInitialized() const
+    {
+        return this->contextArena != nullptr;
+    }
+
+    //
+    // Appends command attributes read from the TPM.
+    //
+    // Returns:
+    // - true: The attributes were stored.
+    // - false: The table is full.
+    //
+    bool AddCommandAttributes(
+        _In_reads_(count) const TPMA_CC* attributes,
+        _In_ uint32_t count
+    )
+    {
+        if (count > MAX_CAP_CC - this->commandCount)
+        {
+            return false;
+        }
+
+        memcpy(&this->commandAttributes[this->commandCount], attributes, count * sizeof(TPMA_CC));
+        this->commandCount += count;
+        return true;
+    }
+
+    //
+    // Looks up the attributes of a command code.
+    //
+    // Returns:
+    // - true: attributes was filled.
+    // - false: The TPM does not implement the command.
+    //
+    bool GetCommandAttributes(
+        _In_ TPM_CC commandCode,
+        _Out_ TPMA_CC* attributes
+    )
+    {
+        for (uint32_t i = 0; i < this->commandCount; i++)
+        {
+            TPMA_CC* entry = &this->commandAttributes[i];
+            if (entry->commandIndex == (commandCode & 0xFFFF) && entry->V == ((commandCode & CC_VEND) != 0))
+            {
+                *attributes = *entry;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    static bool IsVirtualHandle(_In_ TPM_HANDLE handle)
+    {
+        return handle >= RM_VIRTUAL_HANDLE_FIRST && handle < RM_VIRTUAL_HANDLE_FIRST + RM_MAX_OBJECTS;
+    }
+
+    //
+    // Registers an object the TPM just loaded.
+    //
+    // Parameters:
+    // - physicalHandle: Handle returned by the TPM.
+    // - contextReusable: The object state never changes, so one saved context can be loaded repeatedly.
+    //
+    // Returns:
+    // - TPM_HANDLE: The virtual handle of the object, or 0 if every slot is in use.
+    //
+    TPM_HANDLE AddObject(
+        _In_ TPM_HANDLE physicalHandle,
+        _In_ bool contextReusable
+    )
+    {
+        for (uint32_t i = 0; i < RM_MAX_OBJECTS; i++)
+        {
+            RM_SLOT* slot = &this->slots[i];
+            if (!slot->used)
+            {
+                slot->used = true;
+                slot->physicalHandle = physicalHandle;
+                slot->contextReusable = contextReusable;
+                slot->contextValid = false;
+                slot->contextSize = 0;
+                slot->lastUse = ++this->useCounter;
+                this->loadedCount++;
+                return RM_VIRTUAL_HANDLE_FIRST + i;
+            }
+        }
+        return 0;
+    }
+
+    //
+    // Forgets an object. The caller flushes it from the TPM first if it is loaded.
+    //
+    void RemoveObject(_In_ TPM_HANDLE virtualHandle)
+    {
+        RM_SLOT* slot = this->GetSlot(virtualHandle);
+        if (slot == nullptr)
+        {
+            return;
+        }
+
+        if (slot->physicalHandle != 0)
+        {
+            this->loadedCount--;
+        }
+        RtlZeroMemory(slot, sizeof(*slot));
+    }
+
+    bool IsObject(_In_ TPM_HANDLE virtualHandle)
+    {
+        return this->GetSlot(virtualHandle) != nullptr;
+    }
+
+    //
+    // Returns the physical handle of a loaded object, or 0 if it is swapped out or unknown.
+    //
+    TPM_HANDLE GetPhysicalHandle(_In_ TPM_HANDLE virtualHandle)
+    {
+        RM_SLOT* slot = this->GetSlot(virtualHandle);
+        return slot != nullptr ? slot->physicalHandle : 0;
+    }
+
+    //
+    // Marks an object as most recently used.
+    //
+    void Touch(_In_ TPM_HANDLE virtualHandle)
+    {
+        RM_SLOT* slot = this->GetSlot(virtualHandle);
+        if (slot != nullptr)
+        {
+            slot->lastUse = ++this->useCounter;
+        }
+    }
+
+    //
+    // Picks the least recently used loaded object that is not referenced by the current command.
+    //
+    // Parameters:
+    // - pinned: Virtual handles that must stay loaded.
+    // - pinnedCount: Number of entries in pinned.
+    //
+    // Returns:
+    // - TPM_HANDLE: Virtual handle of the object to swap out, or 0 if there is none.
+    //
+    TPM_HANDLE GetEvictionCandidate(
+        _In_reads_(pinnedCount) const TPM_HANDLE* pinned,
+        _In_ uint32_t pinnedCount
+    )
+    {
+        RM_SLOT* victim = nullptr;
+        TPM_HANDLE victimHandle = 0;
+
+        for (uint32_t i = 0; i < RM_MAX_OBJECTS; i++)
+        {
+            RM_SLOT* slot = &this->slots[i];
+            if (!slot->used || slot->physicalHandle == 0)
+            {
+                continue;
+            }
+
+            TPM_HANDLE virtualHandle = RM_VIRTUAL_HANDLE_FIRST + i;
+            bool isPinned = false;
+            for (uint32_t j = 0; j < pinnedCount; j++)
+            {
+                if (pinned[j] == virtualHandle)
+                {
+                    isPinned = true;
+                    break;
+                }
+            }
+
+            if (!isPinned && (victim == nullptr || slot->lastUse < victim->lastUse))
+            {
+                victim = slot;
+                victimHandle = virtualHandle;
+            }
+        }
+        return victimHandle;
+    }
+
+    //
+    // Returns the context block of an object, RM_CONTEXT_BLOCK_SIZE bytes.
+    //
+    uint8_t* GetContextBlock(_In_ TPM_HANDLE virtualHandle)
+    {
+        if (this->GetSlot(virtualHandle) == nullptr)
+        {
+            return nullptr;
+        }
+        return this->contextArena + (virtualHandle - RM_VIRTUAL_HANDLE_FIRST) * RM_CONTEXT_BLOCK_SIZE;
+    }
+
+    //
+    // Returns the size of the marshalled TPMS_CONTEXT in the block, or 0 if a new ContextSave is needed.
+    //
+    uint32_t GetSavedContextSize(_In_ TPM_HANDLE virtualHandle)
+    {
+        RM_SLOT* slot = this->GetSlot(virtualHandle);
+        return (slot != nullptr && slot->contextValid) ? slot->contextSize : 0;
+    }
+
+    //
+    // Records that an object was flushed from the TPM after its context was saved to its block.
+    //
+    void SetSwappedOut(
+        _In_ TPM_HANDLE virtualHandle,
+        _In_ uint32_t contextSize
+    )
+    {
+        RM_SLOT* slot = this->GetSlot(virtualHandle);
+        if (slot == nullptr || slot->physicalHandle == 0)
+        {
+            return;
+        }
+
+        slot->physicalHandle = 0;
+        slot->contextValid = true;
+        slot->contextSize = contextSize;
+        this->loadedCount--;
+    }
+
+    //
+    // Records that an object was loaded back from its block.
+    //
+    void SetLoaded(
+        _In_ TPM_HANDLE virtualHandle,
+        _In_ TPM_HANDLE physicalHandle
+    )
+    {
+        RM_SLOT* slot = this->GetSlot(virtualHandle);
+        if (slot == nullptr || slot->physicalHandle != 0)
+        {
+            return;
+        }
+
+        slot->physicalHandle = physicalHandle;
+        slot->contextValid = slot->contextReusable;
+        slot->lastUse = ++this->useCounter;
+        this->loadedCount++;
+    }
+
+    uint32_t GetLoadedCount() const
+    {
+        return this->loadedCount;
+    }
+
+    uint32_t GetLoadedLimit() const
+    {
+        return this->loadedLimit;
+    }
+
+    //
+    // Lists the virtual handles in use, in ascending order.
+    //
+    // Parameters:
+    // - first: Lowest handle to return.
+    // - handles: Array that receives the handles.
+    // - maxCount: Capacity of handles.
+    // - more: Receives true if handles were left out.
+    //
+    // Returns:
+    // - uint32_t: Number of handles written.
+    //
+    uint32_t ListHandles(
+        _In_ TPM_HANDLE first,
+        _Out_writes_(maxCount) TPM_HANDLE* handles,
+        _In_ uint32_t maxCount,
+        _Out_ bool* more
+    )
+    {
+        uint32_t count = 0;
+        *more = false;
+
+        for (uint32_t i = 0; i < RM_MAX_OBJECTS; i++)
+        {
+            TPM_HANDLE virtualHandle = RM_VIRTUAL_HANDLE_FIRST + i;
+            if (!this->slots[i].used || virtualHandle < first)
+            {
+                continue;
+            }
+
+            if (count == maxCount)
+            {
+                *more = true;
+                break;
+            }
+            handles[count++] = virtualHandle;
+        }
+        return count;
+    }
+};
@@ -0,0 +1,179 @@
+#pragma once
+
+//
+// Counters exposed by TpmRetryPolicy.
+//
+struct TPM_RETRY_STATISTICS
+{
+    uint64_t Retries;
+    uint64_t Yielded;
+    uint64_t Retry;
+    uint64_t Testing;
+    uint64_t NvRate;
+    uint64_t NvUnavailable;
+    uint64_t Exhausted;
+    uint64_t DelayMicroseconds;
+};
+
+//
+// Classifies TPM warning codes that mean "send the same command again" and decides how long to
+// back off before doing so.
+//
+class TpmRetryPolicy
+{
+private:
+
+    TPM_RETRY_STATISTICS statistics = { };
+
+    //
+    // Looks up the retry budget of a response code.
+    //
+    // Parameters:
+    // - responseCode: Response code returned by the TPM.
+    // - maxRetries: Receives the number of times the command may be resubmitted.
+    // - initialDelay: Receives the delay before the first resubmission, in microseconds.
+    // - maxDelay: Receives the cap of the doubling delay, in microseconds.
+    // - counter: Receives the per-code counter.
+    //
+    // Returns:
+    // - true: The code is retryable.
+    // - false: The code is final.
+    //
+    bool GetPolicy(
+        _In_ TPM_RC responseCode,
+        _Out_ uint32_t* maxRetries,
+        _Out_ uint32_t* initialDelay,
+        _Out_ uint32_t* maxDelay,
+        _Out_ uint64_t** counter
+    )
+    {
+        switch (responseCode)
+        {
+        case TPM_RC_YIELDED:
+            // The TPM suspended a long operation and expects it back right away.
+            *maxRetries = RETRY_YIELDED_MAX_RETRIES;
+            *initialDelay = RETRY_YIELDED_DELAY_US;
+            *maxDelay = RETRY_YIELDED_DELAY_US;
+            *counter = &this->statistics.Yielded;
+            return true;
+        case TPM_RC_RETRY:
+            *maxRetries = RETRY_RETRY_MAX_RETRIES;
+            *initialDelay = RETRY_RETRY_DELAY_US;
+            *maxDelay = RETRY_RETRY_MAX_DELAY_US;
+            *counter = &this->statistics.Retry;
+            return true;
+        case TPM_RC_TESTING:
+            // Self-test is running in the background.
+            *maxRetries = RETRY_TESTING_MAX_RETRIES;
+            *initialDelay = RETRY_TESTING_DELAY_US;
+            *maxDelay = RETRY_TESTING_MAX_DELAY_US;
+            *counter = &this->statistics.Testing;
+            return true;
+        case TPM_RC_NV_RATE:
+            // NV wear protection, the TPM needs a while before it accepts another write.
+            *maxRetries = RETRY_NV_RATE_MAX_RETRIES;
+            *initialDelay = RETRY_NV_RATE_DELAY_US;
+            *maxDelay = RETRY_NV_RATE_MAX_DELAY_US;
+            *counter = &this->statistics.NvRate;
+            return true;
+        case TPM_RC_NV_UNAVAILABLE:
+            *maxRetries = RETRY_NV_UNAVAILABLE_MAX_RETRIES;
+            *initialDelay = RETRY_NV_UNAVAILABLE_DELAY_US;
+            *maxDelay = RETRY_NV_UNAVAILABLE_MAX_DELAY_US;
+            *counter = &this->statistics.NvUnavailable;
+            return true;
+        default:
+            return false;
+        }
+    }
+
+public:
+
+    //
+    // Decides whether a command that returned responseCode should be resubmitted.
+    //
+    // Parameters:
+    // - responseCode: Response code returned by the TPM.
+    // - attempt: Number of retries already made for this command.
+    // - delayMicroseconds: Receives how long to wait before resubmitting.
+    //
+    // Returns:
+    // - true: Wait delayMicroseconds, then resubmit the same command.
+    // - false: The response is final.
+    //
+    bool ShouldRetry(
+        _In_ TPM_RC responseCode,
+        _In_ uint32_t attempt,
+        _Out_ uint32_t* delayMicroseconds
+    )
+    {
+        uint32_t maxRetries = 0;
+        uint32_t initialDelay = 0;
+        uint32_t maxDelay = 0;
+        uint64_t* counter = nullptr;
+
+        *delayMicroseconds = 0;
+
+        if (!this->GetPolicy(responseCode, &maxRetries, &initialDelay, &maxDelay, &counter))
+        {
+            return false;
+        }
+
+        if (attempt >= maxRetries)
+        {
+            DbgError("Giving up on response code 0x%08x after %u retries.\n", responseCode, attempt);
+            this->statistics.Exhausted++;
+            return false;
+        }
+
+        uint64_t delay = (uint64_t)initialDelay << min(attempt, 31u);
+        *delayMicroseconds = (uint32_t)min(delay, (uint64_t)maxDelay);
+
+        (*counter)++;
+        this->statistics.Retries++;
+        this->statistics.DelayMicroseconds += *delayMicroseconds;
+        return true;
+    }
+
+    //
+    // Waits before a resubmission. Sleeps when the IRQL allows it. Otherwise stalls, for at most
+    // RETRY_STALL_MAX_US, since the processor can do nothing else meanwhile; the retry count
+    // still bounds how often the command is resubmitted.
+    //
+    // Parameters:
+    // - microseconds: Time to wait.
+    //
+    static void Delay(_In_ uint32_t microseconds)
+    {
+        if (microseconds == 0)
+        {
+            return;
+        }
+
+        if (KeGetCurrentIrql() <= APC_LEVEL)
+        {
+            LARGE_INTEGER interval;
+            interval.QuadPart = -(LONGLONG)microseconds * 10;
+            KeDelayExecutionThread(KernelMode, FALSE, &interval);
+            return;
+        }
+
+        KeStallExecutionProcessor(min(microseconds, (uint32_t)RETRY_STALL_MAX_US));
+    }
+
+    //
+    // Copies the retry counters.
+    //
+    void GetStatistics(_Out_ TPM_RETRY_STATISTICS* statisticsOut)
+    {
+        *statisticsOut = this->statistics;
+    }
+
+    //
+    // Zeroes the retry counters.
+    //
+    void ResetStatistics()
+    {
+        RtlZeroMemory(&this->statistics, sizeof(this->statistics));
+    }
+};
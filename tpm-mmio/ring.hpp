@@ -0,0 +1,314 @@
+#pragma once
+
+//
+// Layout of a command ring shared with a user-mode process, registered with
+// IOCTL_TPM_MMIO_REGISTER_RING. The region starts with a TPM_RING_HEADER, followed by the
+// submission and completion arrays at the offsets it gives, followed by Entries slots of SlotSize
+// bytes each.
+//
+// The process writes a command into a free slot, fills the next submission entry, advances
+// SubmissionTail and sets the doorbell event. The worker of the command queue copies the command
+// out of the slot, runs it, copies the response back into the same slot, fills the next completion
+// entry, advances CompletionTail and sets the completion event, if one was registered. The slot
+// belongs to the driver from submission until the completion is reaped.
+//
+// Indices are free-running uint32_t counters; an entry lives at index & (Entries - 1).
+//
+struct TPM_RING_HEADER
+{
+    volatile LONG SubmissionHead;       // Written by the driver
+    volatile LONG SubmissionTail;       // Written by the process
+    volatile LONG CompletionHead;       // Written by the process
+    volatile LONG CompletionTail;       // Written by the driver
+    uint32_t Entries;
+    uint32_t SlotSize;
+    uint32_t SubmissionOffset;
+    uint32_t CompletionOffset;
+    uint32_t SlotOffset;
+};
+
+struct TPM_RING_SUBMISSION
+{
+    uint64_t UserData;
+    uint32_t Slot;
+    uint32_t CommandSize;
+};
+
+struct TPM_RING_COMPLETION
+{
+    uint64_t UserData;
+    NTSTATUS Status;
+    uint32_t ResponseSize;
+};
+
+//
+// Input of IOCTL_TPM_MMIO_REGISTER_RING. Handles are widened so the layout is the same for 32-bit
+// callers.
+//
+struct TPM_RING_REGISTRATION
+{
+    uint64_t DoorbellEvent;             // Event set by the process after submitting
+    uint64_t CompletionEvent;           // Event set by the driver after completing, or 0
+    uint32_t Entries;                   // Power of two, up to RING_ENTRIES_MAX
+    uint32_t Reserved;
+};
+
+//
+// Output of IOCTL_TPM_MMIO_REGISTER_RING.
+//
+struct TPM_RING_MAPPING
+{
+    uint64_t Address;                   // Address of the TPM_RING_HEADER in the process
+    uint32_t Size;
+    uint32_t Reserved;
+};
+
+//
+// Kernel side of a registered ring. The pages are allocated for the ring alone and mapped both in
+// system space, where the worker accesses them from any context, and in the registering process.
+//
+// Everything the process can write is read once and validated before use: indices are checked
+// against Entries, and commands are copied out of their slot before the engine sees them.
+//
+class TpmCommandRing
+{
+private:
+
+    PMDL mdl = nullptr;
+    uint8_t* systemAddress = nullptr;
+    PVOID userAddress = nullptr;
+    uint32_t size = 0;
+    PKEVENT doorbell = nullptr;
+    PKEVENT completionEvent = nullptr;
+
+    TPM_RING_HEADER* header = nullptr;
+    TPM_RING_SUBMISSION* submissions = nullptr;
+    TPM_RING_COMPLETION* completions = nullptr;
+    uint32_t entries = 0;
+    uint32_t slotOffset = 0;
+
+    //
+    // Private copy of SubmissionHead and CompletionTail, so a process rewriting them cannot make
+    // the driver skip or replay entries.
+    //
+    uint32_t submissionHead = 0;
+    uint32_t completionTail = 0;
+
+    static NTSTATUS ReferenceEvent(
+        _In_ uint64_t handle,
+        _Out_ PKEVENT* event
+    )
+    {
+        return ObReferenceObjectByHandle((HANDLE)(ULONG_PTR)handle, EVENT_MODIFY_STATE | SYNCHRONIZE, *ExEventObjectType, UserMode, (PVOID*)event, NULL);
+    }
+
+public:
+
+    ~TpmCommandRing()
+    {
+        if (this->doorbell)
+        {
+            ObDereferenceObject(this->doorbell);
+        }
+        if (this->completionEvent)
+        {
+            ObDereferenceObject(this->completionEvent);
+        }
+        if (this->mdl)
+        {
+            if (this->systemAddress)
+            {
+                MmUnmapLockedPages(this->systemAddress, this->mdl);
+            }
+            MmFreePagesFromMdl(this->mdl);
+            ExFreePool(this->mdl);
+        }
+    }
+
+    //
+    // Allocates the ring and maps it into the current process. Must be called in the context of
+    // the registering process, at PASSIVE_LEVEL.
+    //
+    // Parameters:
+    // - registration: Ring parameters from the process.
+    // - mapping: Receives the address and size of the ring in the process.
+    //
+    // Returns:
+    // - STATUS_SUCCESS: The ring is mapped.
+    // - STATUS_INVALID_PARAMETER: Entries is not a power of two up to RING_ENTRIES_MAX.
+    // - STATUS_INSUFFICIENT_RESOURCES: The pages could not be allocated or mapped.
+    // - Any status returned by ObReferenceObjectByHandle for the events.
+    //
+    NTSTATUS Init(
+        _In_ const TPM_RING_REGISTRATION* registration,
+        _Out_ TPM_RING_MAPPING* mapping
+    )
+    {
+        RtlZeroMemory(mapping, sizeof(*mapping));
+
+        uint32_t entries = registration->Entries;
+        if (entries == 0 || entries > RING_ENTRIES_MAX || (entries & (entries - 1)) != 0)
+        {
+            DbgError("TpmCommandRing::Init - invalid number of entries - %u.\n", entries);
+            return STATUS_INVALID_PARAMETER;
+        }
+
+        NTSTATUS status = ReferenceEvent(registration->DoorbellEvent, &this->doorbell);
+        if (NT_ERROR(status))
+        {
+            this->doorbell = nullptr;
+            return status;
+        }
+        if (registration->CompletionEvent)
+        {
+            status = ReferenceEvent(registration->CompletionEvent, &this->completionEvent);
+            if (NT_ERROR(status))
+            {
+                this->completionEvent = nullptr;
+                return status;
+            }
+        }
+
+        uint32_t submissionOffset = sizeof(TPM_RING_HEADER);
+        uint32_t completionOffset = submissionOffset + entries * sizeof(TPM_RING_SUBMISSION);
+        uint32_t slotOffset = (uint32_t)ROUND_TO_PAGES(completionOffset + entries * sizeof(TPM_RING_COMPLETION));
+        this->size = slotOffset + entries * RING_SLOT_SIZE;
+
+        //
+        // Whole zeroed pages, so nothing else in system memory is shared with the process.
+        //
+        PHYSICAL_ADDRESS low = { 0 };
+        PHYSICAL_ADDRESS high;
+        high.QuadPart = -1;
+        PHYSICAL_ADDRESS skip = { 0 };
+        this->mdl = MmAllocatePagesForMdlEx(low, high, skip, this->size, MmCached, MM_ALLOCATE_FULLY_REQUIRED);
+        if (!this->mdl)
+        {
+            DbgError("TpmCommandRing::Init - failed to allocate %u bytes.\n", this->size);
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        this->systemAddress = (uint8_t*)MmGetSystemAddressForMdlSafe(this->mdl, NormalPagePriority | MdlMappingNoExecute);
+        if (!this->systemAddress)
+        {
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        __try
+        {
+            this->userAddress = MmMapLockedPagesSpecifyCache(this->mdl, UserMode, MmCached, NULL, FALSE, NormalPagePriority | MdlMappingNoExecute);
+        }
+        __except (EXCEPTION_EXECUTE_HANDLER)
+        {
+            this->userAddress = nullptr;
+        }
+        if (!this->userAddress)
+        {
+            DbgError("TpmCommandRing::Init - failed to map the ring into the process.\n");
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        this->entries = entries;
+        this->slotOffset = slotOffset;
+        this->header = (TPM_RING_HEADER*)this->systemAddress;
+        this->submissions = (TPM_RING_SUBMISSION*)(this->systemAddress + submissionOffset);
+        this->completions = (TPM_RING_COMPLETION*)(this->systemAddress + completionOffset);
+        this->header->Entries = entries;
+        this->header->SlotSize = RING_SLOT_SIZE;
+        this->header->SubmissionOffset = submissionOffset;
+        this->header->CompletionOffset = completionOffset;
+        this->header->SlotOffset = slotOffset;
+
+        mapping->Address = (uint64_t)(ULONG_PTR)this->userAddress;
+        mapping->Size = this->size;
+        return STATUS_SUCCESS;
+    }
+
+    //
+    // Unmaps the ring from the registering process. Must be called in its context, once the ring
+    // is no longer registered with the command queue.
+    //
+    void Unmap()
+    {
+        if (this->userAddress)
+        {
+            MmUnmapLockedPages(this->userAddress, this->mdl);
+            this->userAddress = nullptr;
+        }
+    }
+
+    PKEVENT GetDoorbell()
+    {
+        return this->doorbell;
+    }
+
+    //
+    // Takes the next submission, if there is one and the completion ring has room for its result.
+    //
+    // Parameters:
+    // - submission: Receives a copy of the submission entry.
+    //
+    // Returns:
+    // - true: submission holds the next command. It must be completed with Complete.
+    // - false: Nothing to run now.
+    //
+    bool Next(_Out_ TPM_RING_SUBMISSION* submission)
+    {
+        uint32_t tail = (uint32_t)ReadAcquire(&this->header->SubmissionTail);
+        uint32_t completionHead = (uint32_t)ReadAcquire(&this->header->CompletionHead);
+
+        if (tail == this->submissionHead || tail - this->submissionHead > this->entries)
+        {
+            return false;
+        }
+        if (this->completionTail - completionHead >= this->entries)
+        {
+            return false;
+        }
+
+        *submission = this->submissions[this->submissionHead & (this->entries - 1)];
+        this->submissionHead++;
+        WriteRelease(&this->header->SubmissionHead, (LONG)this->submissionHead);
+        return true;
+    }
+
+    //
+    // Returns the slot of a submission, or nullptr if the submission names no valid slot.
+    //
+    uint8_t* GetSlot(_In_ const TPM_RING_SUBMISSION* submission)
+    {
+        if (submission->Slot >= this->entries)
+        {
+            return nullptr;
+        }
+        return this->systemAddress + this->slotOffset + submission->Slot * RING_SLOT_SIZE;
+    }
+
+    //
+    // Publishes the result of a submission taken with Next.
+    //
+    void Complete(
+        _In_ const TPM_RING_SUBMISSION* submission,
+        _In_ NTSTATUS status,
+        _In_ uint32_t responseSize
+    )
+    {
+        TPM_RING_COMPLETION* completion = &this->completions[this->completionTail & (this->entries - 1)];
+        completion->UserData = submission->UserData;
+        completion->Status = status;
+        completion->ResponseSize = responseSize;
+        this->completionTail++;
+        WriteRelease(&this->header->CompletionTail, (LONG)this->completionTail);
+    }
+
+    //
+    // Wakes the process after a batch of completions.
+    //
+    void Notify()
+    {
+        if (this->completionEvent)
+        {
+            (void)KeSetEvent(this->completionEvent, IO_NO_INCREMENT, FALSE);
+        }
+    }
+};
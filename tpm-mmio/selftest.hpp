@@ -0,0 +1,97 @@
+#pragma once
+
+//
+// Tracks which algorithms the TPM has already self-tested, so IncrementalSelfTest is only sent
+// for the ones a command is about to use.
+//
+class TpmSelfTestState
+{
+private:
+
+    //
+    // One bit per TPM_ALG_ID up to TPM_ALG_LAST.
+    //
+    uint8_t tested[(TPM_ALG_LAST >> 3) + 1] = { };
+
+    //
+    // Set once the TPM reports nothing left to test.
+    //
+    bool allTested = false;
+
+public:
+
+    //
+    // Returns whether an algorithm is known to be tested. Algorithms outside the tracked range
+    // are reported as tested, since the TPM will test them on first use anyway.
+    //
+    bool IsTested(_In_ TPM_ALG_ID algorithm) const
+    {
+        if (this->allTested || algorithm == TPM_ALG_NULL || algorithm > TPM_ALG_LAST)
+        {
+            return true;
+        }
+        return (this->tested[algorithm >> 3] & (1 << (algorithm & 7))) != 0;
+    }
+
+    void SetTested(_In_ TPM_ALG_ID algorithm)
+    {
+        if (algorithm <= TPM_ALG_LAST)
+        {
+            this->tested[algorithm >> 3] |= (uint8_t)(1 << (algorithm & 7));
+        }
+    }
+
+    void SetAllTested()
+    {
+        this->allTested = true;
+    }
+
+    bool IsAllTested() const
+    {
+        return this->allTested;
+    }
+
+    //
+    // Collects the algorithms of a workload that still need testing, without duplicates.
+    //
+    // Parameters:
+    // - algorithms: Algorithms the workload is about to use.
+    // - count: Number of entries in algorithms.
+    // - untested: Receives the algorithms to pass to IncrementalSelfTest.
+    //
+    // Returns:
+    // - uint32_t: Number of algorithms written to untested.
+    //
+    uint32_t GetUntested(
+        _In_reads_(count) const TPM_ALG_ID* algorithms,
+        _In_ uint32_t count,
+        _Out_ TPML_ALG* untested
+    )
+    {
+        untested->count = 0;
+
+        for (uint32_t i = 0; i < count && untested->count < MAX_ALG_LIST_SIZE; i++)
+        {
+            if (this->IsTested(algorithms[i]))
+            {
+                continue;
+            }
+
+            bool duplicate = false;
+            for (uint32_t j = 0; j < untested->count; j++)
+            {
+                if (untested->algorithms[j] == algorithms[i])
+                {
+                    duplicate = true;
+                    break;
+                }
+            }
+
+            if (!duplicate)
+            {
+                untested->algorithms[untested->count++] = algorithms[i];
+            }
+        }
+        return untested->count;
+    }
+};
@@ -0,0 +1,503 @@
+#pragma once
+
+//
+// Client of the TPM 2.0 reference simulator's TCP protocol, over Winsock Kernel. The platform port
+// is used once, to power the simulated TPM and its NV on; the command port connection is opened
+// once and reused for every command.
+//
+// A command goes out as one frame: TPM_SEND_COMMAND, locality and command size (big-endian),
+// then the command. The simulator answers with the response size, the response and a zero
+// acknowledgement. The frame header sits in front of the command in the buffer returned by
+// GetBuffer, so a command marshalled there is sent with a single send and no copy.
+//
+// A stream error leaves part of a frame unread or unsent, so the command connection is closed
+// and every later command fails with STATUS_CONNECTION_DISCONNECTED; the simulator has to be
+// restarted with the driver.
+//
+// Phases are marked like a register interface: TransferIn ends when the frame is sent, Execute
+// when the response size arrives, and TransferOut when the response is read. Execute is the
+// simulator's execution time plus one loopback round trip; the other phases are the transport.
+//
+class TpmSimulator
+{
+private:
+
+    WSK_REGISTRATION registration;
+    WSK_PROVIDER_NPI provider;
+    bool registered = false;
+    bool captured = false;
+    PWSK_SOCKET commandSocket = nullptr;
+
+    //
+    // Every WSK request is made with this IRP and waited for on completed.
+    //
+    PIRP irp = nullptr;
+    KEVENT completed;
+
+    //
+    // Frame header followed by room for TRANSPORT_STAGING_BUFFER_SIZE bytes of command or response.
+    // Every transfer goes through it, the 32-bit values of the protocol in its header, so the one
+    // MDL describing it serves every request.
+    //
+    uint8_t* frame = nullptr;
+    PMDL frameMdl = nullptr;
+
+    //
+    // Command in flight, whose phases are marked as the simulator moves through them. May be nullptr.
+    //
+    TPM_COMMAND_TRACE* commandTrace = nullptr;
+
+    void Mark(_In_ TPM_PHASE phase)
+    {
+        if (this->commandTrace)
+        {
+            trace::Mark(this->commandTrace, phase);
+        }
+    }
+
+    static NTSTATUS Complete(
+        _In_ PDEVICE_OBJECT deviceObject,
+        _In_ PIRP irp,
+        _In_ PVOID context
+    )
+    {
+        UNREFERENCED_PARAMETER(deviceObject);
+        UNREFERENCED_PARAMETER(irp);
+        (void)KeSetEvent((PKEVENT)context, IO_NO_INCREMENT, FALSE);
+        return STATUS_MORE_PROCESSING_REQUIRED;
+    }
+
+    void PrepareRequest()
+    {
+        IoReuseIrp(this->irp, STATUS_UNSUCCESSFUL);
+        KeClearEvent(&this->completed);
+        IoSetCompletionRoutine(this->irp, Complete, &this->completed, TRUE, TRUE, TRUE);
+    }
+
+    NTSTATUS WaitRequest(_In_ NTSTATUS status)
+    {
+        if (status == STATUS_PENDING)
+        {
+            (void)KeWaitForSingleObject(&this->completed, Executive, KernelMode, FALSE, NULL);
+            status = this->irp->IoStatus.Status;
+        }
+        return status;
+    }
+
+    //
+    // Connects a stream socket to a port of the simulator.
+    //
+    NTSTATUS Connect(
+        _In_ uint16_t port,
+        _Out_ PWSK_SOCKET* socket
+    )
+    {
+        *socket = nullptr;
+
+        SOCKADDR_IN localAddress;
+        RtlZeroMemory(&localAddress, sizeof(localAddress));
+        localAddress.sin_family = AF_INET;
+
+        SOCKADDR_IN remoteAddress;
+        RtlZeroMemory(&remoteAddress, sizeof(remoteAddress));
+        remoteAddress.sin_family = AF_INET;
+        remoteAddress.sin_port = _byteswap_ushort(port);
+        remoteAddress.sin_addr.S_un.S_addr = _byteswap_ulong(SIMULATOR_ADDRESS);
+
+        this->PrepareRequest();
+        NTSTATUS status = this->WaitRequest(this->provider.Dispatch->WskSocketConnect(
+            this->provider.Client, SOCK_STREAM, IPPROTO_TCP, (PSOCKADDR)&localAddress, (PSOCKADDR)&remoteAddress,
+            0, NULL, NULL, NULL, NULL, NULL, this->irp));
+        if (NT_ERROR(status))
+        {
+            DbgError("TpmSimulator::Connect - port %u failed with 0x%08x.\n", port, status);
+            return status;
+        }
+
+        *socket = (PWSK_SOCKET)this->irp->IoStatus.Information;
+        return STATUS_SUCCESS;
+    }
+
+    void Close(_In_ PWSK_SOCKET socket)
+    {
+        this->PrepareRequest();
+        (void)this->WaitRequest(((PWSK_PROVIDER_CONNECTION_DISPATCH)socket->Dispatch)->WskCloseSocket(socket, this->irp));
+    }
+
+    //
+    // Closes the command connection after a stream error, since the stream is no longer at a
+    // frame boundary.
+    //
+    // Returns:
+    // - NTSTATUS: status, for the caller to return.
+    //
+    NTSTATUS Disconnect(_In_ NTSTATUS status)
+    {
+        DbgError("TpmSimulator - closing the command connection after 0x%08x.\n", status);
+        this->Close(this->commandSocket);
+        this->commandSocket = nullptr;
+        return status;
+    }
+
+    //
+    // Sends or receives exactly size bytes at offset in the frame.
+    //
+    // Returns:
+    // - STATUS_SUCCESS: All size bytes were transferred.
+    // - STATUS_CONNECTION_RESET: The simulator closed the connection.
+    // - Any status returned by WskSend or WskReceive.
+    //
+    NTSTATUS Transfer(
+        _In_ PWSK_SOCKET socket,
+        _In_ bool send,
+        _In_ uint32_t offset,
+        _In_ uint32_t size
+    )
+    {
+        WSK_BUF wskBuffer;
+        wskBuffer.Mdl = this->frameMdl;
+        wskBuffer.Offset = offset;
+        wskBuffer.Length = size;
+
+        const WSK_PROVIDER_CONNECTION_DISPATCH* dispatch = (const WSK_PROVIDER_CONNECTION_DISPATCH*)socket->Dispatch;
+        this->PrepareRequest();
+        NTSTATUS status = this->WaitRequest(send ?
+            dispatch->WskSend(socket, &wskBuffer, 0, this->irp) :
+            dispatch->WskReceive(socket, &wskBuffer, WSK_FLAG_WAITALL, this->irp));
+        if (NT_SUCCESS(status) && this->irp->IoStatus.Information != size)
+        {
+            status = STATUS_CONNECTION_RESET;
+        }
+        return status;
+    }
+
+    NTSTATUS Send32(
+        _In_ PWSK_SOCKET socket,
+        _In_ uint32_t value
+    )
+    {
+        value = _byteswap_ulong(value);
+        memcpy(this->frame, &value, sizeof(value));
+        return this->Transfer(socket, true, 0, sizeof(value));
+    }
+
+    NTSTATUS Receive32(
+        _In_ PWSK_SOCKET socket,
+        _Out_ uint32_t* value
+    )
+    {
+        *value = 0;
+        NTSTATUS status = this->Transfer(socket, false, 0, sizeof(*value));
+        if (NT_SUCCESS(status))
+        {
+            memcpy(value, this->frame, sizeof(*value));
+            *value = _byteswap_ulong(*value);
+        }
+        return status;
+    }
+
+    //
+    // Powers the simulated TPM and its NV on through the platform port.
+    //
+    NTSTATUS PowerOn()
+    {
+        PWSK_SOCKET platformSocket = nullptr;
+        NTSTATUS status = this->Connect(SIMULATOR_PLATFORM_PORT, &platformSocket);
+        if (NT_ERROR(status))
+        {
+            return status;
+        }
+
+        const uint32_t signals[] = { SIMULATOR_SIGNAL_POWER_ON, SIMULATOR_SIGNAL_NV_ON };
+        for (uint32_t signal : signals)
+        {
+            uint32_t acknowledgement = 0;
+            status = this->Send32(platformSocket, signal);
+            if (NT_SUCCESS(status))
+            {
+                status = this->Receive32(platformSocket, &acknowledgement);
+            }
+            if (NT_SUCCESS(status) && acknowledgement != 0)
+            {
+                status = STATUS_INVALID_NETWORK_RESPONSE;
+            }
+            if (NT_ERROR(status))
+            {
+                DbgError("TpmSimulator::PowerOn - signal %u failed with 0x%08x.\n", signal, status);
+                break;
+            }
+        }
+
+        (void)this->Send32(platformSocket, SIMULATOR_SESSION_END);
+        this->Close(platformSocket);
+        return status;
+    }
+
+    //
+    // Sends TPM2_Startup(TPM_SU_CLEAR), which platform firmware would have sent to a real TPM. A
+    // simulator that is already started answers TPM_RC_INITIALIZE.
+    //
+    NTSTATUS Startup()
+    {
+        uint8_t* command = this->GetBuffer();
+        TPM2_COMMAND_HEADER header;
+        header.tag = _byteswap_ushort(TPM_ST_NO_SESSIONS);
+        header.paramSize = _byteswap_ulong(sizeof(TPM2_COMMAND_HEADER) + sizeof(TPM_SU));
+        header.commandCode = _byteswap_ulong(TPM_CC_Startup);
+        TPM_SU startupType = _byteswap_ushort(TPM_SU_CLEAR);
+        memcpy(command, &header, sizeof(header));
+        memcpy(command + sizeof(header), &startupType, sizeof(startupType));
+
+        NTSTATUS status = this->Send(command, sizeof(TPM2_COMMAND_HEADER) + sizeof(TPM_SU));
+        uint32_t size = TRANSPORT_STAGING_BUFFER_SIZE;
+        if (NT_SUCCESS(status))
+        {
+            status = this->Receive(command, &size);
+        }
+        if (NT_ERROR(status))
+        {
+            return status;
+        }
+
+        TPM2_RESPONSE_HEADER response;
+        memcpy(&response, command, sizeof(response));
+        TPM_RC responseCode = _byteswap_ulong(response.responseCode);
+        if (responseCode != TPM_RC_SUCCESS && responseCode != TPM_RC_INITIALIZE)
+        {
+            DbgError("TpmSimulator::Startup - responseCode - 0x%08x.\n", responseCode);
+            return STATUS_DEVICE_HARDWARE_ERROR;
+        }
+        return STATUS_SUCCESS;
+    }
+
+public:
+
+    ~TpmSimulator()
+    {
+        if (this->commandSocket)
+        {
+            (void)this->Send32(this->commandSocket, SIMULATOR_SESSION_END);
+            this->Close(this->commandSocket);
+        }
+        if (this->irp)
+        {
+            IoFreeIrp(this->irp);
+        }
+        if (this->frameMdl)
+        {
+            IoFreeMdl(this->frameMdl);
+        }
+        if (this->captured)
+        {
+            WskReleaseProviderNPI(&this->registration);
+        }
+        if (this->registered)
+        {
+            WskDeregister(&this->registration);
+        }
+        pool::Free(this->frame);
+    }
+
+    //
+    // Registers with WSK, powers the simulator on, connects the command port and starts the TPM.
+    // Must be called at PASSIVE_LEVEL.
+    //
+    // Parameters:
+    // - commandTrace: Record the phases of each command are charged to, or nullptr.
+    //
+    // Returns:
+    // - STATUS_SUCCESS: Commands can be sent.
+    // - STATUS_INSUFFICIENT_RESOURCES: The IRP, frame buffer or its MDL could not be allocated.
+    // - STATUS_INVALID_NETWORK_RESPONSE: The simulator refused a platform signal.
+    // - STATUS_DEVICE_HARDWARE_ERROR: TPM2_Startup failed.
+    // - Any status returned by WskRegister, WskCaptureProviderNPI or WskSocketConnect;
+    //   WskCaptureProviderNPI fails with STATUS_NOINTERFACE if WSK is not ready within SIMULATOR_WSK_WAIT_MS.
+    //
+    NTSTATUS Init(_In_opt_ TPM_COMMAND_TRACE* commandTrace)
+    {
+        static const WSK_CLIENT_DISPATCH clientDispatch = { MAKE_WSK_VERSION(1, 0), 0, NULL };
+
+        this->commandTrace = commandTrace;
+        KeInitializeEvent(&this->completed, SynchronizationEvent, FALSE);
+
+        this->frame = (uint8_t*)pool::Allocate(SIMULATOR_FRAME_HEADER_SIZE + TRANSPORT_STAGING_BUFFER_SIZE);
+        this->irp = IoAllocateIrp(1, FALSE);
+        if (this->frame)
+        {
+            this->frameMdl = IoAllocateMdl(this->frame, SIMULATOR_FRAME_HEADER_SIZE + TRANSPORT_STAGING_BUFFER_SIZE, FALSE, FALSE, NULL);
+        }
+        if (!this->frameMdl || !this->irp)
+        {
+            DbgError("TpmSimulator::Init - failed to allocate the frame buffer, its MDL or IRP.\n");
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+        MmBuildMdlForNonPagedPool(this->frameMdl);
+
+        WSK_CLIENT_NPI client = { NULL, &clientDispatch };
+        NTSTATUS status = WskRegister(&client, &this->registration);
+        if (NT_ERROR(status))
+        {
+            DbgError("TpmSimulator::Init - WskRegister failed with 0x%08x.\n", status);
+            return status;
+        }
+        this->registered = true;
+
+        //
+        // Init runs in DriverEntry, so a WSK subsystem that never comes up must not hold up the load.
+        //
+        status = WskCaptureProviderNPI(&this->registration, SIMULATOR_WSK_WAIT_MS, &this->provider);
+        if (NT_ERROR(status))
+        {
+            DbgError("TpmSimulator::Init - WskCaptureProviderNPI failed with 0x%08x.\n", status);
+            return status;
+        }
+        this->captured = true;
+
+        status = this->PowerOn();
+        if (NT_ERROR(status))
+        {
+            return status;
+        }
+        status = this->Connect(SIMULATOR_COMMAND_PORT, &this->commandSocket);
+        if (NT_ERROR(status))
+        {
+            return status;
+        }
+        return this->Startup();
+    }
+
+    //
+    // Returns the buffer commands can be marshalled into and responses read from, of
+    // TRANSPORT_STAGING_BUFFER_SIZE bytes.
+    //
+    uint8_t* GetBuffer()
+    {
+        return this->frame + SIMULATOR_FRAME_HEADER_SIZE;
+    }
+
+    //
+    // Sends a command in one frame. Returns once it is sent; the response is collected with Receive.
+    //
+    // Parameters:
+    // - command: Command, copied into the frame unless it is GetBuffer().
+    // - size: Size of the command, up to TRANSPORT_STAGING_BUFFER_SIZE.
+    //
+    // Returns:
+    // - STATUS_SUCCESS: The command was sent.
+    // - STATUS_INVALID_PARAMETER: The command is too large.
+    // - STATUS_CONNECTION_DISCONNECTED: The command connection was closed after an earlier error.
+    // - Any status returned by Transfer. The command connection is closed.
+    //
+    NTSTATUS Send(
+        _In_reads_bytes_(size) const uint8_t* command,
+        _In_ uint32_t size
+    )
+    {
+        if (size > TRANSPORT_STAGING_BUFFER_SIZE)
+        {
+            return STATUS_INVALID_PARAMETER;
+        }
+        if (!this->commandSocket)
+        {
+            return STATUS_CONNECTION_DISCONNECTED;
+        }
+        this->Mark(TpmPhaseReady);
+
+        if (command != this->GetBuffer())
+        {
+            memcpy(this->GetBuffer(), command, size);
+        }
+
+        uint32_t sendCommand = _byteswap_ulong(SIMULATOR_SEND_COMMAND);
+        uint32_t commandSize = _byteswap_ulong(size);
+        memcpy(this->frame, &sendCommand, sizeof(sendCommand));
+        this->frame[sizeof(sendCommand)] = 0;      // Locality
+        memcpy(this->frame + sizeof(sendCommand) + sizeof(uint8_t), &commandSize, sizeof(commandSize));
+
+        NTSTATUS status = this->Transfer(this->commandSocket, true, 0, SIMULATOR_FRAME_HEADER_SIZE + size);
+        if (NT_ERROR(status))
+        {
+            DbgError("TpmSimulator::Send - failed with 0x%08x.\n", status);
+            return this->Disconnect(status);
+        }
+        this->Mark(TpmPhaseTransferIn);
+        return STATUS_SUCCESS;
+    }
+
+    //
+    // Receives the response to the command sent last.
+    //
+    // Parameters:
+    // - response: Buffer that receives the response. May be GetBuffer().
+    // - size: Size of the buffer on input, size of the response on output.
+    //
+    // Returns:
+    // - STATUS_SUCCESS: The response is in the buffer.
+    // - STATUS_BUFFER_TOO_SMALL: The response is larger than the buffer. It was discarded.
+    // - STATUS_INVALID_NETWORK_RESPONSE: The response is malformed or was not acknowledged. The
+    //   command connection is closed.
+    // - STATUS_CONNECTION_DISCONNECTED: The command connection was closed after an earlier error.
+    // - Any status returned by Transfer. The command connection is closed.
+    //
+    NTSTATUS Receive(
+        _Out_writes_bytes_(*size) uint8_t* response,
+        _Inout_ uint32_t* size
+    )
+    {
+        if (!this->commandSocket)
+        {
+            return STATUS_CONNECTION_DISCONNECTED;
+        }
+
+        uint32_t responseSize = 0;
+        NTSTATUS status = this->Receive32(this->commandSocket, &responseSize);
+        if (NT_ERROR(status))
+        {
+            DbgError("TpmSimulator::Receive - failed with 0x%08x.\n", status);
+            return this->Disconnect(status);
+        }
+        this->Mark(TpmPhaseExecute);
+
+        //
+        // The frame cannot be skipped without trusting its size, so the connection is dropped.
+        //
+        if (responseSize < sizeof(TPM2_RESPONSE_HEADER) || responseSize > TRANSPORT_STAGING_BUFFER_SIZE)
+        {
+            DbgError("TpmSimulator::Receive - response size %x.\n", responseSize);
+            return this->Disconnect(STATUS_INVALID_NETWORK_RESPONSE);
+        }
+
+        //
+        // The response is read into the frame, even one that does not fit, to keep the stream in
+        // step, and copied out once acknowledged.
+        //
+        bool fits = (responseSize <= *size);
+        status = this->Transfer(this->commandSocket, false, SIMULATOR_FRAME_HEADER_SIZE, responseSize);
+        uint32_t acknowledgement = 0;
+        if (NT_SUCCESS(status))
+        {
+            status = this->Receive32(this->commandSocket, &acknowledgement);
+        }
+        if (NT_ERROR(status))
+        {
+            DbgError("TpmSimulator::Receive - failed with 0x%08x.\n", status);
+            return this->Disconnect(status);
+        }
+        if (acknowledgement != 0)
+        {
+            return this->Disconnect(STATUS_INVALID_NETWORK_RESPONSE);
+        }
+        if (!fits)
+        {
+            return STATUS_BUFFER_TOO_SMALL;
+        }
+
+        if (response != this->GetBuffer())
+        {
+            memcpy(response, this->GetBuffer(), responseSize);
+        }
+        *size = responseSize;
+        this->Mark(TpmPhaseTransferOut);
+        return STATUS_SUCCESS;
+    }
+};
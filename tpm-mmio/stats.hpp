@@ -0,0 +1,260 @@
+#pragma once
+
+//
+// Log-linear latency histogram in microseconds. Values below LATENCY_HISTOGRAM_SUB_BUCKETS get
+// a bucket each; above that, every power of two is split into LATENCY_HISTOGRAM_SUB_BUCKETS
+// buckets, so the relative error is bounded at any scale. Values past the last bucket land in it.
+//
+struct TPM_LATENCY_HISTOGRAM
+{
+    uint32_t Count;
+    uint32_t Buckets[LATENCY_HISTOGRAM_BUCKETS];
+    uint64_t SumMicroseconds;
+    uint64_t MinMicroseconds;
+    uint64_t MaxMicroseconds;
+};
+
+//
+// Everything recorded for one command code.
+//
+struct TPM_COMMAND_STATISTICS
+{
+    TPM_CC CommandCode;
+    uint64_t Commands;
+    uint64_t Errors;        // No response, or a response code other than TPM_RC_SUCCESS
+    uint64_t MmioReads;
+    uint64_t MmioWrites;
+    uint64_t MmioMaps;
+    TPM_LATENCY_HISTOGRAM Phases[TpmPhaseCount];
+    TPM_LATENCY_HISTOGRAM Total;
+};
+
+//
+// Per-command-code latency and MMIO statistics, fed from the trace record of every command.
+// The entries of every command code are allocated by Init, so recording never touches the pool.
+// Command codes outside TPM_CC_FIRST..TPM_CC_LAST share the last slot.
+//
+class TpmCommandStatistics
+{
+private:
+
+    TPM_COMMAND_STATISTICS* entries = nullptr;
+
+    static uint32_t GetSlot(_In_ TPM_CC commandCode)
+    {
+        if (commandCode < TPM_CC_FIRST || commandCode > TPM_CC_LAST)
+        {
+            return COMMAND_STATISTICS_SLOTS - 1;
+        }
+        return commandCode - TPM_CC_FIRST;
+    }
+
+public:
+
+    ~TpmCommandStatistics()
+    {
+        pool::Free(this->entries);
+    }
+
+    //
+    // Allocates the entries of every slot. Until it succeeds, nothing is recorded.
+    //
+    // Returns:
+    // - true: Commands are recorded.
+    // - false: The entries could not be allocated.
+    //
+    bool Init()
+    {
+        if (this->entries)
+        {
+            return true;
+        }
+
+        this->entries = (TPM_COMMAND_STATISTICS*)pool::Allocate(COMMAND_STATISTICS_SLOTS * sizeof(TPM_COMMAND_STATISTICS));
+        if (!this->entries)
+        {
+            DbgError("TpmCommandStatistics::Init - failed to allocate the entries.\n");
+            return false;
+        }
+        this->Reset();
+        return true;
+    }
+
+    //
+    // Adds a latency to a histogram.
+    //
+    static void Add(
+        _Inout_ TPM_LATENCY_HISTOGRAM* histogram,
+        _In_ uint64_t microseconds
+    )
+    {
+        if (histogram->Count == 0 || microseconds < histogram->MinMicroseconds)
+        {
+            histogram->MinMicroseconds = microseconds;
+        }
+        histogram->MaxMicroseconds = max(histogram->MaxMicroseconds, microseconds);
+        histogram->SumMicroseconds += microseconds;
+        histogram->Count++;
+        histogram->Buckets[GetBucket(microseconds)]++;
+    }
+
+    //
+    // Returns the histogram bucket of a latency.
+    //
+    static uint32_t GetBucket(_In_ uint64_t microseconds)
+    {
+        if (microseconds < LATENCY_HISTOGRAM_SUB_BUCKETS)
+        {
+            return (uint32_t)microseconds;
+        }
+
+        // exponent >= 2, the top two bits below the leading one pick the sub-bucket.
+        unsigned long exponent = 0;
+        (void)_BitScanReverse64(&exponent, microseconds);
+        uint32_t subBucket = (uint32_t)(microseconds >> (exponent - 2)) & (LATENCY_HISTOGRAM_SUB_BUCKETS - 1);
+        uint32_t bucket = LATENCY_HISTOGRAM_SUB_BUCKETS + (exponent - 2) * LATENCY_HISTOGRAM_SUB_BUCKETS + subBucket;
+        return min(bucket, (uint32_t)LATENCY_HISTOGRAM_BUCKETS - 1);
+    }
+
+    //
+    // Returns the smallest latency that falls into a bucket.
+    //
+    static uint64_t GetBucketLowerBound(_In_ uint32_t bucket)
+    {
+        if (bucket < LATENCY_HISTOGRAM_SUB_BUCKETS)
+        {
+            return bucket;
+        }
+
+        uint32_t exponent = 2 + (bucket - LATENCY_HISTOGRAM_SUB_BUCKETS) / LATENCY_HISTOGRAM_SUB_BUCKETS;
+        uint32_t subBucket = (bucket - LATENCY_HISTOGRAM_SUB_BUCKETS) % LATENCY_HISTOGRAM_SUB_BUCKETS;
+        return (uint64_t)(LATENCY_HISTOGRAM_SUB_BUCKETS + subBucket) << (exponent - 2);
+    }
+
+    //
+    // Estimates a quantile of a histogram, as the upper bound of the bucket it falls into.
+    //
+    // Parameters:
+    // - histogram: Histogram to read.
+    // - perMille: Quantile in thousandths, 0 to 1000.
+    //
+    // Returns:
+    // - The quantile in microseconds, never above MaxMicroseconds. 0 if the histogram is empty.
+    //
+    static uint64_t GetQuantile(
+        _In_ const TPM_LATENCY_HISTOGRAM* histogram,
+        _In_ uint32_t perMille
+    )
+    {
+        if (histogram->Count == 0)
+        {
+            return 0;
+        }
+
+        uint64_t rank = ((uint64_t)histogram->Count * min(perMille, 1000u) + 999) / 1000;
+        uint64_t seen = 0;
+        for (uint32_t bucket = 0; bucket < LATENCY_HISTOGRAM_BUCKETS; bucket++)
+        {
+            seen += histogram->Buckets[bucket];
+            if (seen >= max(rank, 1ull))
+            {
+                uint64_t upperBound = (bucket + 1 < LATENCY_HISTOGRAM_BUCKETS) ?
+                    GetBucketLowerBound(bucket + 1) - 1 : histogram->MaxMicroseconds;
+                return min(upperBound, histogram->MaxMicroseconds);
+            }
+        }
+        return histogram->MaxMicroseconds;
+    }
+
+    //
+    // Estimates a percentile of a histogram. See GetQuantile.
+    //
+    static uint64_t GetPercentile(
+        _In_ const TPM_LATENCY_HISTOGRAM* histogram,
+        _In_ uint32_t percent
+    )
+    {
+        return GetQuantile(histogram, min(percent, 100u) * 10);
+    }
+
+    //
+    // Adds a finished command.
+    //
+    // Parameters:
+    // - record: Trace record of the command.
+    // - mmio: Register accesses and mappings made by the command.
+    //
+    void Record(
+        _In_ const TPM_COMMAND_TRACE* record,
+        _In_ const mmio::MMIO_COUNTERS* mmio
+    )
+    {
+        if (!this->entries)
+        {
+            return;
+        }
+
+        TPM_COMMAND_STATISTICS* entry = &this->entries[GetSlot(record->commandCode)];
+        entry->Commands++;
+        if (record->responseCode != TPM_RC_SUCCESS)
+        {
+            entry->Errors++;
+        }
+        entry->MmioReads += mmio->Reads;
+        entry->MmioWrites += mmio->Writes;
+        entry->MmioMaps += mmio->Maps;
+
+        uint64_t total = 0;
+        for (uint32_t phase = 0; phase < TpmPhaseCount; phase++)
+        {
+            uint64_t microseconds = trace::ToMicroseconds(record->phaseTime[phase]);
+            Add(&entry->Phases[phase], microseconds);
+            total += microseconds;
+        }
+        Add(&entry->Total, total);
+    }
+
+    //
+    // Copies the statistics of a command code.
+    //
+    // Parameters:
+    // - commandCode: Command code, or 0 for the codes outside TPM_CC_FIRST..TPM_CC_LAST.
+    // - statistics: Receives the statistics.
+    //
+    // Returns:
+    // - STATUS_SUCCESS: statistics holds at least one command.
+    // - STATUS_NOT_FOUND: No command with that code was recorded since the last Reset.
+    //
+    NTSTATUS Get(
+        _In_ TPM_CC commandCode,
+        _Out_ TPM_COMMAND_STATISTICS* statistics
+    )
+    {
+        TPM_COMMAND_STATISTICS* entry = this->entries ? &this->entries[GetSlot(commandCode)] : nullptr;
+        if (!entry || entry->Commands == 0)
+        {
+            RtlZeroMemory(statistics, sizeof(*statistics));
+            return STATUS_NOT_FOUND;
+        }
+
+        *statistics = *entry;
+        return STATUS_SUCCESS;
+    }
+
+    //
+    // Zeroes every entry.
+    //
+    void Reset()
+    {
+        if (!this->entries)
+        {
+            return;
+        }
+
+        RtlZeroMemory(this->entries, COMMAND_STATISTICS_SLOTS * sizeof(TPM_COMMAND_STATISTICS));
+        for (uint32_t i = 0; i < COMMAND_STATISTICS_SLOTS - 1; i++)
+        {
+            this->entries[i].CommandCode = TPM_CC_FIRST + i;
+        }
+    }
+};
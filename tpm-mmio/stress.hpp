@@ -0,0 +1,211 @@
+#pragma once
+
+//
+// Concurrent client stress of the command queue, compiled in with TPM_STRESS. One client thread
+// per processor, pinned to it, submits STRESS_COMMANDS_PER_CLIENT commands from a mixed workload
+// through TpmCommandQueue::Submit, the path of IOCTL_TPM_MMIO_SUBMIT_COMMAND. Each client
+// allocates its command and response from the pool for every command, as an IRP would.
+//
+// Reports aggregate throughput, how often the queue lock was found held, the time spent in the
+// allocator and the tail latency seen by every client. Commands the queue turns away because it
+// is full are counted, not treated as failures.
+//
+// Only one queue and engine are stressed. Several engines would drive the same TPM interface from
+// separate workers with nothing ordering their register accesses, and the reference simulator
+// serves one command connection, so a fleet of independent instances is not run.
+//
+namespace stress
+{
+    struct TPM_STRESS_COMMAND
+    {
+        const char* Name;
+        uint32_t Size;
+        uint8_t Command[22];
+    };
+
+    static constexpr TPM_STRESS_COMMAND Workload[] =
+    {
+        { "GetRandom", 12, { 0x80, 0x01, 0x00, 0x00, 0x00, 0x0C, 0x00, 0x00, 0x01, 0x7B, 0x00, 0x20 } },
+        { "ReadClock", 10, { 0x80, 0x01, 0x00, 0x00, 0x00, 0x0A, 0x00, 0x00, 0x01, 0x81 } },
+        // TPM_CAP_TPM_PROPERTIES, TPM_PT_FIXED, 8 properties
+        { "GetCapability", 22, { 0x80, 0x01, 0x00, 0x00, 0x00, 0x16, 0x00, 0x00, 0x01, 0x7A,
+            0x00, 0x00, 0x00, 0x06, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00, 0x08 } },
+        { "GetTestResult", 10, { 0x80, 0x01, 0x00, 0x00, 0x00, 0x0A, 0x00, 0x00, 0x01, 0x7C } },
+    };
+
+    struct TPM_STRESS_CLIENT
+    {
+        TpmCommandQueue* commandQueue;
+        uint32_t index;
+        HANDLE thread;
+        NTSTATUS status;
+        uint32_t rejected;                  // Submissions refused with STATUS_DEVICE_BUSY
+        uint64_t allocatorTicks;            // Spent allocating and freeing command buffers
+        uint64_t allocatorMaxTicks;         // Longest single command's allocations and frees
+        TPM_LATENCY_HISTOGRAM latency;      // Submit round trip
+    };
+
+    //
+    // Client thread. Pins itself to processor index, runs its share of the workload and exits.
+    //
+    inline void ClientRoutine(_In_ PVOID context)
+    {
+        TPM_STRESS_CLIENT* client = (TPM_STRESS_CLIENT*)context;
+
+        PROCESSOR_NUMBER processor;
+        GROUP_AFFINITY affinity;
+        GROUP_AFFINITY previousAffinity;
+        RtlZeroMemory(&affinity, sizeof(affinity));
+        if (NT_SUCCESS(KeGetProcessorNumberFromIndex(client->index, &processor)))
+        {
+            affinity.Group = processor.Group;
+            affinity.Mask = (KAFFINITY)1 << processor.Number;
+            KeSetSystemGroupAffinityThread(&affinity, &previousAffinity);
+        }
+
+        client->status = STATUS_SUCCESS;
+        for (uint32_t i = 0; i < STRESS_COMMANDS_PER_CLIENT; i++)
+        {
+            const TPM_STRESS_COMMAND& workload = Workload[(client->index + i) % ARRAYSIZE(Workload)];
+
+            uint64_t allocateStart = trace::Timestamp();
+            uint8_t* command = new uint8_t[workload.Size];
+            uint8_t* response = new uint8_t[TRANSPORT_STAGING_BUFFER_SIZE];
+            uint64_t allocatorTicks = trace::Timestamp() - allocateStart;
+
+            NTSTATUS status = STATUS_INSUFFICIENT_RESOURCES;
+            if (command && response)
+            {
+                memcpy(command, workload.Command, workload.Size);
+
+                TPM_QUEUED_COMMAND queuedCommand;
+                RtlZeroMemory(&queuedCommand, sizeof(queuedCommand));
+                queuedCommand.command = command;
+                queuedCommand.commandSize = workload.Size;
+                queuedCommand.response = response;
+                queuedCommand.responseSize = TRANSPORT_STAGING_BUFFER_SIZE;
+
+                uint64_t start = trace::Timestamp();
+                status = client->commandQueue->Submit(&queuedCommand);
+                TpmCommandStatistics::Add(&client->latency, trace::ToMicroseconds(trace::Timestamp() - start));
+            }
+
+            uint64_t freeStart = trace::Timestamp();
+            delete[] response;
+            delete[] command;
+            allocatorTicks += trace::Timestamp() - freeStart;
+            client->allocatorTicks += allocatorTicks;
+            client->allocatorMaxTicks = max(client->allocatorMaxTicks, allocatorTicks);
+
+            if (status == STATUS_DEVICE_BUSY)
+            {
+                client->rejected++;
+            }
+            else if (NT_ERROR(status))
+            {
+                DbgError("stress::ClientRoutine - client %u %s failed with 0x%08x.\n", client->index, workload.Name, status);
+                client->status = status;
+                break;
+            }
+        }
+
+        if (affinity.Mask)
+        {
+            KeRevertToUserGroupAffinityThread(&previousAffinity);
+        }
+        (void)PsTerminateSystemThread(STATUS_SUCCESS);
+    }
+
+    //
+    // Runs one client per processor, up to STRESS_CLIENTS_MAX, against a started queue and prints
+    // the results. Must be called at PASSIVE_LEVEL.
+    //
+    // Parameters:
+    // - commandQueue: Started command queue.
+    //
+    // Returns:
+    // - STATUS_SUCCESS: Every client ran its workload.
+    // - STATUS_INSUFFICIENT_RESOURCES: The clients could not be allocated.
+    // - Any status returned by PsCreateSystemThread, or by a client's command.
+    //
+    inline NTSTATUS Run(_In_ TpmCommandQueue* commandQueue)
+    {
+        uint32_t clientCount = min((uint32_t)KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS), (uint32_t)STRESS_CLIENTS_MAX);
+        TPM_STRESS_CLIENT* clients = new TPM_STRESS_CLIENT[clientCount];
+        if (!clients)
+        {
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+        RtlZeroMemory(clients, clientCount * sizeof(TPM_STRESS_CLIENT));
+
+        uint64_t acquisitions = 0;
+        uint64_t contentions = 0;
+        commandQueue->GetLockStatistics(&acquisitions, &contentions);
+
+        NTSTATUS status = STATUS_SUCCESS;
+        uint64_t start = trace::Timestamp();
+        for (uint32_t i = 0; i < clientCount; i++)
+        {
+            clients[i].commandQueue = commandQueue;
+            clients[i].index = i;
+
+            OBJECT_ATTRIBUTES attributes;
+            InitializeObjectAttributes(&attributes, NULL, OBJ_KERNEL_HANDLE, NULL, NULL);
+            status = PsCreateSystemThread(&clients[i].thread, THREAD_ALL_ACCESS, &attributes, NULL, NULL, ClientRoutine, &clients[i]);
+            if (NT_ERROR(status))
+            {
+                DbgError("stress::Run - PsCreateSystemThread failed with 0x%08x.\n", status);
+                clients[i].thread = NULL;
+                break;
+            }
+        }
+
+        for (uint32_t i = 0; i < clientCount; i++)
+        {
+            if (clients[i].thread)
+            {
+                (void)ZwWaitForSingleObject(clients[i].thread, FALSE, NULL);
+                (void)ZwClose(clients[i].thread);
+            }
+        }
+        uint64_t elapsed = trace::Timestamp() - start;
+
+        uint64_t endAcquisitions = 0;
+        uint64_t endContentions = 0;
+        commandQueue->GetLockStatistics(&endAcquisitions, &endContentions);
+
+        uint64_t commands = 0;
+        uint64_t rejected = 0;
+        uint64_t allocatorTicks = 0;
+        uint64_t worstP99 = 0;
+        for (uint32_t i = 0; i < clientCount; i++)
+        {
+            const TPM_STRESS_CLIENT& client = clients[i];
+            uint64_t p99 = TpmCommandStatistics::GetQuantile(&client.latency, 990);
+            Dbg("Stress client %2u: %u commands, %u rejected, p50 %llu us, p99 %llu us, p999 %llu us, max %llu us, allocator max %llu us.\n",
+                client.index, client.latency.Count, client.rejected,
+                TpmCommandStatistics::GetQuantile(&client.latency, 500), p99,
+                TpmCommandStatistics::GetQuantile(&client.latency, 999), client.latency.MaxMicroseconds,
+                trace::ToMicroseconds(client.allocatorMaxTicks));
+
+            commands += client.latency.Count;
+            rejected += client.rejected;
+            allocatorTicks += client.allocatorTicks;
+            worstP99 = max(worstP99, p99);
+            if (NT_SUCCESS(status) && NT_ERROR(client.status))
+            {
+                status = client.status;
+            }
+        }
+
+        uint64_t frequency = trace::Frequency();
+        Dbg("Stress %u clients: %llu commands/s, %llu rejected, worst client p99 %llu us.\n",
+            clientCount, elapsed ? (commands * frequency) / elapsed : 0, rejected, worstP99);
+        Dbg("Stress queue lock: %llu of %llu acquisitions contended; allocator %llu ns per command.\n",
+            endContentions - contentions, endAcquisitions - acquisitions,
+            (commands && frequency) ? (allocatorTicks * 1000000000) / frequency / commands : 0);
+
+        delete[] clients;
+        return status;
+    }
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+//
+// Prebuilt, already big-endian commands for the fixed-shape commands the driver sends. They are
+// constant-initialized into read-only data, so building a command is a copy of the template plus
+// a byteswap of each variable field (handles, capability selectors).
+//
+namespace templates
+{
+    constexpr uint16_t Swap16(_In_ uint16_t value)
+    {
+        return (uint16_t)((value >> 8) | (value << 8));
+    }
+
+    constexpr uint32_t Swap32(_In_ uint32_t value)
+    {
+        return (value >> 24) | ((value >> 8) & 0x0000FF00) | ((value << 8) & 0x00FF0000) | (value << 24);
+    }
+
+    constexpr TPM2_COMMAND_HEADER Header(
+        _In_ TPM_ST tag,
+        _In_ uint32_t paramSize,
+        _In_ TPM_CC commandCode
+    )
+    {
+        return { Swap16(tag), Swap32(paramSize), Swap32(commandCode) };
+    }
+
+    //
+    // ObjectHandle is patched.
+    //
+    constexpr TPM2_READ_PUBLIC_COMMAND ReadPublic =
+    {
+        Header(TPM_ST_NO_SESSIONS, sizeof(TPM2_READ_PUBLIC_COMMAND), TPM_CC_ReadPublic), 0
+    };
+
+    //
+    // Capability, Property and PropertyCount are patched.
+    //
+    constexpr TPM2_GET_CAPABILITY_COMMAND GetCapability =
+    {
+        Header(TPM_ST_NO_SESSIONS, sizeof(TPM2_GET_CAPABILITY_COMMAND), TPM_CC_GetCapability), 0, 0, 0
+    };
+
+    //
+    // NvIndex is patched.
+    //
+    constexpr TPM2_NV_READPUBLIC_COMMAND NvReadPublic =
+    {
+        Header(TPM_ST_NO_SESSIONS, sizeof(TPM2_NV_READPUBLIC_COMMAND), TPM_CC_NV_ReadPublic), 0
+    };
+
+    //
+    // SaveHandle is patched.
+    //
+    constexpr TPM2_CONTEXT_SAVE_COMMAND ContextSave =
+    {
+        Header(TPM_ST_NO_SESSIONS, sizeof(TPM2_CONTEXT_SAVE_COMMAND), TPM_CC_ContextSave), 0
+    };
+
+    //
+    // FlushHandle is patched.
+    //
+    constexpr TPM2_FLUSH_CONTEXT_COMMAND FlushContext =
+    {
+        Header(TPM_ST_NO_SESSIONS, sizeof(TPM2_FLUSH_CONTEXT_COMMAND), TPM_CC_FlushContext), 0
+    };
+
+    //
+    // Header only; the saved TPMS_CONTEXT follows it.
+    //
+    constexpr TPM2_COMMAND_HEADER ContextLoadHeader = Header(TPM_ST_NO_SESSIONS, sizeof(TPM2_COMMAND_HEADER), TPM_CC_ContextLoad);
+
+    //
+    // Complete as-is: background self-test of everything not yet tested.
+    //
+    constexpr TPM2_SELF_TEST_COMMAND SelfTestBackground =
+    {
+        Header(TPM_ST_NO_SESSIONS, sizeof(TPM2_SELF_TEST_COMMAND), TPM_CC_SelfTest), NO
+    };
+
+    static_assert(Swap32(TPM_CC_ReadPublic) == 0x73010000, "templates must be big-endian");
+}
@@ -3,6 +3,19 @@
 class TpmTis
 {
 private:
+
+    //
+    // Command in flight, whose phases are marked as the FIFO moves through them. May be nullptr.
+    //
+    TPM_COMMAND_TRACE* commandTrace = nullptr;
+
+    void Mark(_In_ TPM_PHASE phase)
+    {
+        if (this->commandTrace)
+        {
+            trace::Mark(this->commandTrace, phase);
+        }
+    }
 	
     //
     // Polls an 8-bit hardware register at the specified address, waiting for specified bits to be set and/or cleared within a timeout period.
@@ -36,6 +49,7 @@ private:
                 KeStallExecutionProcessor(30);
             }
         }
+        history::Stall((uintptr_t)registerAddress, timeOut);
         return STATUS_TIMEOUT;
     }
 
@@ -124,6 +138,7 @@ private:
                 waitTime += 30;
             } while (waitTime < TIS_TIMEOUT_D);
 
+            history::Stall((uintptr_t)&tisReg->BurstCount, waitTime);
             return STATUS_TIMEOUT;
         }
         return STATUS_INVALID_PARAMETER;
@@ -132,32 +147,35 @@ private:
 public:
 
     //
-    // Sends a command to the TPM using the TPM Interface Specification (TIS) device and retrieves the response.
+    // Sets the record the phases of each command are charged to.
     //
-    // This function writes a command buffer to the TPM, issues the command, and then reads the response
-    // from the TPM into the provided output buffer. The function ensures that the TPM is ready to receive
-    // a command before writing, and waits for the TPM to become ready after the command has been issued.
+    // Parameters:
+    // - commandTrace: Command trace record, or nullptr.
+    //
+    void Init(_In_opt_ TPM_COMMAND_TRACE* commandTrace)
+    {
+        this->commandTrace = commandTrace;
+    }
+
+    //
+    // Writes a command into the TIS FIFO and sets tpmGo. Returns as soon as the TPM has been told
+    // to execute, so the caller can do useful work while the command runs and collect the response
+    // later with TisReceive.
     //
     // Parameters:
     // - tisReg: Pointer to the tisReg registers used to initiate commands and read responses.
     // - bufferIn: Pointer to the buffer containing the command data to be sent to the TPM.
     // - sizeIn: Size of the input buffer in bytes.
-    // - bufferOut: Pointer to the buffer where the TPM's response will be stored.
-    // - sizeOut: Pointer to a variable that on input specifies the maximum size of the output buffer,
-    //            and on output reflects the actual size of the data written to the output buffer.
     //
     // Returns:
-    // - STATUS_SUCCESS: The command was successfully sent and a response was received.
+    // - STATUS_SUCCESS: The command was written and the TPM started executing it.
     // - STATUS_DEVICE_BUSY: The device is busy or in idle mode.
-    // - STATUS_NOT_SUPPORTED: The command or TPM version aren't supported.
-    // - STATUS_BUFFER_TOO_SMALL: The response is too small.
+    // - STATUS_BUFFER_TOO_SMALL: The TPM still expects more data after the whole command was written.
     //
-    NTSTATUS TisCommand(
+    NTSTATUS TisSend(
         _In_ TIS_PC_REGISTERS* tisReg,
         _In_reads_bytes_(sizeIn) const uint8_t* bufferIn,
-        _In_ uint32_t sizeIn,
-        _Inout_updates_bytes_(*sizeOut) uint8_t* bufferOut,
-        _Inout_ uint32_t* sizeOut
+        _In_ uint32_t sizeIn
     )
     {
         NTSTATUS status = this->TisPrepareCommand(tisReg);
@@ -166,12 +184,14 @@ public:
             DbgError("Tpm2 is not ready for a command.\n");
             return STATUS_DEVICE_BUSY;
         }
+        this->Mark(TpmPhaseReady);
 
         //
         // Send the command data to Tpm
         //
         uint32_t i = 0;
         uint16_t burstCount = 0;
+        uint8_t bit = 0;
         while (i < sizeIn)
         {
             status = this->TisReadBurstCount(tisReg, &burstCount);
@@ -208,13 +228,49 @@ public:
         //
         // Executed the TPM command and waiting for the response data ready
         //
-        uint8_t bit = TIS_PC_STS_GO;
+        bit = TIS_PC_STS_GO;
+        (void)mmio::Write((uintptr_t)&tisReg->Status, sizeof(uint8_t), &bit);
+        this->Mark(TpmPhaseTransferIn);
+
+        return STATUS_SUCCESS;
+
+    Exit:
+
+        bit = TIS_PC_STS_READY;
         (void)mmio::Write((uintptr_t)&tisReg->Status, sizeof(uint8_t), &bit);
+        return status;
+    }
+
+    //
+    // Waits for a command started by TisSend to complete, reads the response out of the FIFO
+    // and returns the TPM to the Ready state.
+    //
+    // Parameters:
+    // - tisReg: Pointer to the tisReg registers used to initiate commands and read responses.
+    // - bufferOut: Pointer to the buffer where the TPM's response will be stored.
+    // - sizeOut: Pointer to a variable that on input specifies the maximum size of the output buffer,
+    //            and on output reflects the actual size of the data written to the output buffer.
+    //
+    // Returns:
+    // - STATUS_SUCCESS: A response was received.
+    // - STATUS_DEVICE_BUSY: The command did not complete, even after a cancel.
+    // - STATUS_NOT_SUPPORTED: The command or TPM version aren't supported.
+    // - STATUS_BUFFER_TOO_SMALL: The response is too small.
+    //
+    NTSTATUS TisReceive(
+        _In_ TIS_PC_REGISTERS* tisReg,
+        _Inout_updates_bytes_(*sizeOut) uint8_t* bufferOut,
+        _Inout_ uint32_t* sizeOut
+    )
+    {
+        uint32_t i = 0;
+        uint16_t burstCount = 0;
+        uint8_t bit = 0;
 
         //
         // NOTE: That may take many seconds to minutes for certain commands, such as key generation.
         //
-        status = this->TisWaitRegisterBits(
+        NTSTATUS status = this->TisWaitRegisterBits(
             &tisReg->Status,
             (uint8_t)(TIS_PC_VALID | TIS_PC_STS_DATA),
             0,
@@ -250,12 +306,11 @@ public:
                 goto Exit;
             }
         }
+        this->Mark(TpmPhaseExecute);
 
         //
         // Get response data header
         //
-        i = 0;
-        burstCount = 0;
         while (i < sizeof(TPM2_RESPONSE_HEADER))
         {
             status = this->TisReadBurstCount(tisReg, &burstCount);
@@ -326,8 +381,49 @@ public:
 
         bit = TIS_PC_STS_READY;
         (void)mmio::Write((uintptr_t)&tisReg->Status, sizeof(uint8_t), &bit);
+        if (NT_SUCCESS(status))
+        {
+            this->Mark(TpmPhaseTransferOut);
+        }
         return status;
     }
 
+    //
+    // Sends a command to the TPM using the TPM Interface Specification (TIS) device and retrieves the response.
+    //
+    // This function writes a command buffer to the TPM, issues the command, and then reads the response
+    // from the TPM into the provided output buffer. The function ensures that the TPM is ready to receive
+    // a command before writing, and waits for the TPM to become ready after the command has been issued.
+    //
+    // Parameters:
+    // - tisReg: Pointer to the tisReg registers used to initiate commands and read responses.
+    // - bufferIn: Pointer to the buffer containing the command data to be sent to the TPM.
+    // - sizeIn: Size of the input buffer in bytes.
+    // - bufferOut: Pointer to the buffer where the TPM's response will be stored.
+    // - sizeOut: Pointer to a variable that on input specifies the maximum size of the output buffer,
+    //            and on output reflects the actual size of the data written to the output buffer.
+    //
+    // Returns:
+    // - STATUS_SUCCESS: The command was successfully sent and a response was received.
+    // - STATUS_DEVICE_BUSY: The device is busy or in idle mode.
+    // - STATUS_NOT_SUPPORTED: The command or TPM version aren't supported.
+    // - STATUS_BUFFER_TOO_SMALL: The response is too small.
+    //
+    NTSTATUS TisCommand(
+        _In_ TIS_PC_REGISTERS* tisReg,
+        _In_reads_bytes_(sizeIn) const uint8_t* bufferIn,
+        _In_ uint32_t sizeIn,
+        _Inout_updates_bytes_(*sizeOut) uint8_t* bufferOut,
+        _Inout_ uint32_t* sizeOut
+    )
+    {
+        NTSTATUS status = this->TisSend(tisReg, bufferIn, sizeIn);
+        if (NT_ERROR(status))
+        {
+            return status;
+        }
+        return this->TisReceive(tisReg, bufferOut, sizeOut);
+    }
+
 
 };
\ No newline at end of file
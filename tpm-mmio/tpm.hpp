@@ -1,19 +1,85 @@
 #pragma once
 
-class Tpm
+//
+// TPM command engine, specialized for the transport of the TPM's interface (see transport.hpp).
+// Created through RunTpmEngine, which picks the specialization once.
+//
+template<typename Transport>
+class TpmEngine
 {
-private:
+    //
+    // Runs the response decoders over its corpus (see corpus.hpp).
+    //
+    friend class TpmParserCorpus;
 
-	//
-	// TPM register base address.
-	//
-	uintptr_t tpmBaseAddress = 0;
+private:
 
     //
-    // Cached PTP pointer.
+    // Owned PTP interface the transport was set up from.
     //
 	TpmPtp* ptpInterface = nullptr;
 
+    //
+    // Interface state, for the lifetime of the engine.
+    //
+    Transport transport;
+
+    //
+    // Transient buffers of the command in progress.
+    //
+    TpmScratchArena scratch;
+
+    //
+    // Buffers handed out to callers, sized from TPM_PT_MAX_COMMAND_SIZE and TPM_PT_MAX_RESPONSE_SIZE,
+    // and compact public areas.
+    //
+    TpmLookasideList commandBuffers;
+    TpmLookasideList responseBuffers;
+    TpmLookasideList objectBuffers;
+
+    //
+    // Command in flight, for its Command trace event and the command statistics. The transport
+    // marks its phases in it.
+    //
+    TPM_COMMAND_TRACE commandTrace = { 0 };
+    mmio::MMIO_COUNTERS commandMmio = { 0 };
+    bool commandPending = false;
+
+    //
+    // Time the next command spent in the command queue, in performance counter ticks.
+    //
+    uint64_t queueTime = 0;
+
+    //
+    // Phase latencies and MMIO counts per command code.
+    //
+    TpmCommandStatistics commandStatistics;
+
+    //
+    // Cached TPM_PT_NV_BUFFER_MAX, 0 until first queried.
+    //
+    uint32_t nvBufferMax = 0;
+
+    //
+    // Responses to side-effect-free commands, replayed without a TPM round trip.
+    //
+    TpmResponseCache responseCache;
+
+    //
+    // Virtual transient handles for SubmitVirtualizedCommand.
+    //
+    TpmResourceManager resourceManager;
+
+    //
+    // Backoff for TPM_RC_RETRY, TPM_RC_YIELDED, TPM_RC_TESTING and friends.
+    //
+    TpmRetryPolicy retryPolicy;
+
+    //
+    // Algorithms already covered by IncrementalSelfTest or SelfTest.
+    //
+    TpmSelfTestState selfTestState;
+
     //
     // Reads a value of type T from an unaligned memory address.
     // This function uses RtlCopyMemory to safely read the value without assuming alignment.
@@ -47,281 +113,807 @@ private:
     }
     
     //
-    // Submits a command to the TPM through the appropriate TPM interface based on the configured interface type.
-    // This function routes the command to either a CRB or FIFO interface handling routine.
+    // Strips the handle, parameter or session number from a format-one response code,
+    // so it can be compared against the TPM_RC_* constants.
+    //
+    // Parameters:
+    // - responseCode: Response code returned by the TPM.
+    //
+    // Returns:
+    // - TPM_RC: The response code without the number field.
+    //
+    TPM_RC GetBaseResponseCode(_In_ TPM_RC responseCode)
+    {
+        if ((responseCode & RC_FMT1) != 0)
+        {
+            return responseCode & (RC_FMT1 | 0x3F);
+        }
+        return responseCode;
+    }
+
+    //
+    // Reads the command code of a marshalled command, or 0 if it has no header.
+    //
+    TPM_CC GetCommandCode(
+        _In_ uint32_t inputParameterBlockSize,
+        _In_reads_bytes_(inputParameterBlockSize) const uint8_t* inputParameterBlock
+    )
+    {
+        if (inputParameterBlockSize < sizeof(TPM2_COMMAND_HEADER))
+        {
+            return 0;
+        }
+        return _byteswap_ulong(this->ReadUnaligned<uint32_t>(inputParameterBlock + FIELD_OFFSET(TPM2_COMMAND_HEADER, commandCode)));
+    }
+
+    //
+    // Starts the trace record of a command. Its phases are marked by the transport and by the
+    // engine as the command goes through them.
+    //
+    void TraceStart(_In_ TPM_CC commandCode)
+    {
+        trace::Begin(&this->commandTrace, commandCode);
+        this->commandTrace.phaseTime[TpmPhaseQueue] = this->queueTime;
+        this->queueTime = 0;
+        this->commandMmio = mmio::Counters();
+        this->commandPending = true;
+    }
+
+    //
+    // Completes the trace record of a command, adds it to the command statistics and emits its
+    // Command trace event. Does nothing if no command is pending, so every exit path of a command
+    // may call it.
+    //
+    // Parameters:
+    // - responseCode: TPM_RC of the response, or TPM_RC_FAILURE if none was received.
+    //
+    void TraceFinish(_In_ TPM_RC responseCode)
+    {
+        if (!this->commandPending)
+        {
+            return;
+        }
+        this->commandPending = false;
+        this->commandTrace.responseCode = responseCode;
+
+        mmio::MMIO_COUNTERS& counters = mmio::Counters();
+        mmio::MMIO_COUNTERS commandMmio = {
+            counters.Reads - this->commandMmio.Reads,
+            counters.Writes - this->commandMmio.Writes,
+            counters.Maps - this->commandMmio.Maps
+        };
+        this->commandStatistics.Record(&this->commandTrace, &commandMmio);
+        trace::Command(Transport::Name, &this->commandTrace);
+    }
+
+    //
+    // Starts a command on the TPM through the engine's transport. Returns once the TPM is executing
+    // the command; the response must be collected with FinishCommand before another command is started.
     //
     // Parameters:
     // - inputParameterBlockSize: Size of the input parameter block.
     // - inputParameterBlock: Pointer to the input parameters for the TPM command.
+    //
+    // Returns:
+    // - STATUS_SUCCESS: Command successfully sent and the TPM is executing it.
+    // - Any status returned by the transport.
+    //
+    NTSTATUS StartCommand(
+        _In_ uint32_t inputParameterBlockSize,
+        _In_reads_bytes_(inputParameterBlockSize) const uint8_t* inputParameterBlock
+    )
+    {
+        if (this->responseCache.IsInvalidating(inputParameterBlock, inputParameterBlockSize))
+        {
+            this->responseCache.Invalidate();
+        }
+
+        this->TraceStart(this->GetCommandCode(inputParameterBlockSize, inputParameterBlock));
+        NTSTATUS status = this->transport.Send(inputParameterBlock, inputParameterBlockSize);
+        if (NT_ERROR(status))
+        {
+            this->TraceFinish(TPM_RC_FAILURE);
+        }
+        return status;
+    }
+
+    //
+    // Waits for the command started by StartCommand to complete and reads its response.
+    //
+    // Parameters:
     // - outputParameterBlockSize: Pointer to the size of the output parameter block, which may be updated.
     // - outputParameterBlock: Pointer to the buffer that will receive the TPM command's output.
     //
     // Returns:
-    // - STATUS_SUCCESS: Command successfully sent and response received.
-    // - STATUS_UNSUCCESSFUL: PTP interface not initialized or other failure.
-    // - STATUS_DEVICE_NOT_CONNECTED: No valid PTP interface is connected.
-    // - STATUS_INVALID_PARAMETER: Unknown or unsupported PTP interface type.
+    // - STATUS_SUCCESS: Response received.
+    // - Any status returned by the transport.
     //
-    NTSTATUS SubmitCommand(
-        _In_ uint32_t inputParameterBlockSize,
-        _In_reads_bytes_(inputParameterBlockSize) const uint8_t* inputParameterBlock,
+    NTSTATUS FinishCommand(
         _Inout_ uint32_t* outputParameterBlockSize,
         _Out_writes_bytes_(*outputParameterBlockSize) uint8_t* outputParameterBlock
     )
     {
-        PTP_INTERFACE_TYPE interfaceType = this->ptpInterface->cachedInterface;
+        NTSTATUS status = this->transport.Receive(outputParameterBlock, outputParameterBlockSize);
+        this->TraceFinish((NT_SUCCESS(status) && *outputParameterBlockSize >= sizeof(TPM2_RESPONSE_HEADER)) ?
+            _byteswap_ulong(this->ReadUnaligned<uint32_t>(outputParameterBlock + FIELD_OFFSET(TPM2_RESPONSE_HEADER, responseCode))) :
+            TPM_RC_FAILURE);
+        return status;
+    }
 
-        if (interfaceType == PTP_INTERFACE_TYPE::PtpInterfaceTis || interfaceType == PTP_INTERFACE_TYPE::PtpInterfaceFifo) 
+    //
+    // Gets the transport ready for a command and points a writer at the buffer the command is sent
+    // from, so the caller can marshal it there directly. Must be followed by StartCommand.
+    //
+    // Parameters:
+    // - writer: Pointer to the writer to reset.
+    //
+    // Returns:
+    // - STATUS_SUCCESS: The writer is ready.
+    // - STATUS_DEVICE_BUSY: The CRB did not become ready.
+    //
+    NTSTATUS BeginCommand(_Out_ TpmCommandWriter* writer)
+    {
+        this->TraceStart(0);
+        NTSTATUS status = this->transport.Begin(writer);
+        if (NT_ERROR(status))
         {
-            TpmTis tisInterface;           
-            return tisInterface.TisCommand(
-                (TIS_PC_REGISTERS*)this->tpmBaseAddress,
-                inputParameterBlock,
-                inputParameterBlockSize,
-                outputParameterBlock,
-                outputParameterBlockSize
-            );
+            this->TraceFinish(TPM_RC_FAILURE);
         }
-        else if (interfaceType == PTP_INTERFACE_TYPE::PtpInterfaceCrb) 
+        return status;
+    }
+
+    //
+    // Starts a command marshalled with a writer from BeginCommand.
+    //
+    // Parameters:
+    // - writer: Pointer to the writer holding the command.
+    //
+    // Returns:
+    // - STATUS_SUCCESS: The TPM is executing the command.
+    // - STATUS_BUFFER_TOO_SMALL: The command did not fit in the transport buffer.
+    // - Any status returned by the transport.
+    //
+    NTSTATUS StartCommand(_In_ TpmCommandWriter* writer)
+    {
+        if (TpmResponseCache::IsInvalidatingCommandCode(writer->GetCommandCode()))
         {
-            TpmCrb crbInterface(this->ptpInterface);
-            return crbInterface.CrbCommand(
-                (PTP_CRB_REGISTERS*)this->tpmBaseAddress,
-                inputParameterBlock,
-                inputParameterBlockSize,
-                outputParameterBlock,
-                outputParameterBlockSize
-            );  
+            this->responseCache.Invalidate();
         }
-        else if (interfaceType == PTP_INTERFACE_TYPE::PtpInterfaceNull) 
+
+        trace::Mark(&this->commandTrace, TpmPhaseMarshal);
+        this->commandTrace.commandCode = writer->GetCommandCode();
+        NTSTATUS status = this->transport.Start(writer);
+        if (NT_ERROR(status))
         {
-            return STATUS_DEVICE_NOT_CONNECTED; 
+            this->TraceFinish(TPM_RC_FAILURE);
         }
-        else 
+        return status;
+    }
+
+    //
+    // Waits for a command started with a writer and points a reader at its response, where the
+    // transport left it. The response must be released with ReleaseResponse once decoded.
+    //
+    // Parameters:
+    // - reader: Pointer to the reader to reset.
+    //
+    // Returns:
+    // - STATUS_SUCCESS: The reader holds the response.
+    // - Any status returned by the transport. No response is held in that case.
+    //
+    NTSTATUS FinishCommand(_Out_ TpmResponseReader* reader)
+    {
+        NTSTATUS status = this->transport.Wait(reader);
+        if (NT_ERROR(status))
         {
-            DbgError("Unknown PTP interface type.\n");
-            return STATUS_INVALID_PARAMETER; 
+            this->TraceFinish(TPM_RC_FAILURE);
+            return status;
         }
+        this->commandTrace.responseCode = reader->PeekResponseCode();
+        return status;
     }
 
-public:
-
-	~Tpm()
-	{
-		delete this->ptpInterface;
-	}
+    //
+    // Releases the response held by a reader from FinishCommand. The time since FinishCommand is
+    // charged to parsing.
+    //
+    void ReleaseResponse()
+    {
+        trace::Mark(&this->commandTrace, TpmPhaseParse);
+        this->transport.Release();
+        this->TraceFinish(this->commandTrace.responseCode);
+    }
 
     //
-    // Instantiate and initialize TpmPtp class then cache pointer to access PTP interface.
-    // 
+    // Same as ShouldRetryCommand, for a response held by a reader. The response is released if the
+    // command must be resubmitted, since it has to be marshalled again.
+    //
+    // Parameters:
+    // - reader: Pointer to the reader holding the response.
+    // - attempt: Number of retries already made for this command.
+    //
     // Returns:
-    // - true: Instantiated and initialized successfully.
-    // - false: Failed to instantiate or initialize.
+    // - true: The command must be resubmitted.
+    // - false: The response is final and still held.
     //
-    bool Init()
+    bool ShouldRetryCommand(
+        _In_ TpmResponseReader* reader,
+        _In_ uint32_t attempt
+    )
     {
-        if (!acpi::GetTpm2PhysicalAddress(&this->tpmBaseAddress))
+        uint32_t delay = 0;
+        if (!this->retryPolicy.ShouldRetry(reader->PeekResponseCode(), attempt, &delay))
         {
-            // Already prints detailed error inside function.
             return false;
         }
-        this->ptpInterface = new TpmPtp(this->tpmBaseAddress);
-        if (!this->ptpInterface)
+
+        this->ReleaseResponse();
+        TpmRetryPolicy::Delay(delay);
+        return true;
+    }
+
+    //
+    // Checks the response of a finished command for a warning that asks for the same command to be
+    // sent again, and waits out the backoff for it.
+    //
+    // Parameters:
+    // - outputParameterBlockSize: Size of the response.
+    // - outputParameterBlock: Pointer to the response.
+    // - attempt: Number of retries already made for this command.
+    //
+    // Returns:
+    // - true: The command must be resubmitted.
+    // - false: The response is final.
+    //
+    bool ShouldRetryCommand(
+        _In_ uint32_t outputParameterBlockSize,
+        _In_reads_bytes_(outputParameterBlockSize) const uint8_t* outputParameterBlock,
+        _In_ uint32_t attempt
+    )
+    {
+        if (outputParameterBlockSize < sizeof(TPM2_RESPONSE_HEADER))
         {
-            DbgError("Failed to instantiate TpmPtp class.\n");
             return false;
         }
-        if (!this->ptpInterface->Init())
+
+        TPM_RC responseCode = _byteswap_ulong(this->ReadUnaligned<uint32_t>(outputParameterBlock + FIELD_OFFSET(TPM2_RESPONSE_HEADER, responseCode)));
+        uint32_t delay = 0;
+        if (!this->retryPolicy.ShouldRetry(responseCode, attempt, &delay))
         {
-            DbgError("Failed to initialize TpmPtp class.\n");
             return false;
         }
-        Dbg("Instantiated and initialized TpmPtp class.\n");
+
+        TpmRetryPolicy::Delay(delay);
         return true;
     }
-    
-    //
-    // Reads the public area of a TPM object.
+
     //
-    // This function retrieves the public area of a TPM object specified by its handle.
-    // It constructs the command to send to the TPM, sends the command, receives the response,
-    // and extracts the public area, the name, and the qualified name of the object.
+    // Submits a command to the TPM through the appropriate TPM interface based on the configured interface type.
+    // This function routes the command to either a CRB or FIFO interface handling routine.
+    // Side-effect-free commands are answered from the response cache when possible, and commands
+    // answered with a retryable warning are resubmitted with backoff.
     //
     // Parameters:
-    // - objectHandle: Handle to the TPM object whose public area is to be read.
-    // - outPublic: Pointer to a TPM2B_PUBLIC structure that will receive the public area of the object.
-    // - name: Pointer to a TPM2B_NAME structure that will receive the name of the object.
-    // - qualifiedName: Pointer to a TPM2B_NAME structure that will receive the qualified name of the object.
+    // - inputParameterBlockSize: Size of the input parameter block.
+    // - inputParameterBlock: Pointer to the input parameters for the TPM command.
+    // - outputParameterBlockSize: Pointer to the size of the output parameter block, which may be updated.
+    // - outputParameterBlock: Pointer to the buffer that will receive the TPM command's output.
     //
     // Returns:
-    // - STATUS_SUCCESS: The public area was successfully read.
-    // - STATUS_UNSUCCESSFUL: An error occurred while reading the public area.
-    // - STATUS_BUFFER_TOO_SMALL: recvBuffer size was too small.
-    // - STATUS_INVALID_PARAMETER: One or more of the parameters are invalid.
-    // - STATUS_DEVICE_BUSY: TPM device exception.
-    // - STATUS_NOT_SUPPORTED: Read operation not supported.
+    // - STATUS_SUCCESS: Command successfully sent and response received.
+    // - STATUS_UNSUCCESSFUL: PTP interface not initialized or other failure.
+    // - STATUS_DEVICE_NOT_CONNECTED: No valid PTP interface is connected.
+    // - STATUS_INVALID_PARAMETER: Unknown or unsupported PTP interface type.
     //
-    NTSTATUS ReadPublic(
-        _In_ TPMI_DH_OBJECT objectHandle,
-        _Out_ TPM2B_PUBLIC* outPublic,
-        _Out_ TPM2B_NAME* name,
-        _Out_ TPM2B_NAME* qualifiedName
+    NTSTATUS SubmitCommand(
+        _In_ uint32_t inputParameterBlockSize,
+        _In_reads_bytes_(inputParameterBlockSize) const uint8_t* inputParameterBlock,
+        _Inout_ uint32_t* outputParameterBlockSize,
+        _Out_writes_bytes_(*outputParameterBlockSize) uint8_t* outputParameterBlock
     )
     {
-        //
-        // Construct command
-        //
-        TPM2_READ_PUBLIC_COMMAND sendBuffer = { { 0 } };
-
-        sendBuffer.Header.tag = _byteswap_ushort(TPM_ST_NO_SESSIONS);
-        sendBuffer.Header.commandCode = _byteswap_ulong(TPM_CC_ReadPublic);
-
-        sendBuffer.ObjectHandle = _byteswap_ulong(objectHandle);
-
-        uint32_t sendBufferSize = (uint32_t)sizeof(sendBuffer);
-        sendBuffer.Header.paramSize = _byteswap_ulong(sendBufferSize);
-
-        //
-        // send Tpm command
-        //
-        TPM2_READ_PUBLIC_RESPONSE recvBuffer = { { 0 } };
-
-        uint32_t recvBufferSize = sizeof(recvBuffer);
-        NTSTATUS status = this->SubmitCommand(sendBufferSize, (uint8_t*)&sendBuffer, &recvBufferSize, (uint8_t*)&recvBuffer);
-        if (NT_ERROR(status)) 
+        bool cacheable = this->responseCache.IsCacheable(inputParameterBlock, inputParameterBlockSize);
+        if (cacheable &&
+            NT_SUCCESS(this->responseCache.Lookup(inputParameterBlock, inputParameterBlockSize, outputParameterBlock, outputParameterBlockSize)))
         {
-            return status;
+            trace::CacheHit(this->GetCommandCode(inputParameterBlockSize, inputParameterBlock));
+            return STATUS_SUCCESS;
         }
 
-        if (recvBufferSize < sizeof(TPM2_RESPONSE_HEADER)) 
+        uint32_t outputSize = 0;
+        NTSTATUS status = STATUS_SUCCESS;
+        for (uint32_t attempt = 0; ; attempt++)
         {
-            DbgError("ReadPublic - recvBufferSize Error - %x.\n", recvBufferSize);
-            return STATUS_BUFFER_TOO_SMALL;
+            status = this->StartCommand(inputParameterBlockSize, inputParameterBlock);
+            if (NT_ERROR(status))
+            {
+                return status;
+            }
+
+            outputSize = *outputParameterBlockSize;
+            status = this->FinishCommand(&outputSize, outputParameterBlock);
+            if (NT_ERROR(status) || !this->ShouldRetryCommand(outputSize, outputParameterBlock, attempt))
+            {
+                break;
+            }
         }
 
-        TPM_RC responseCode = _byteswap_ulong(recvBuffer.Header.responseCode);
-        if (responseCode != TPM_RC_SUCCESS) 
+        *outputParameterBlockSize = outputSize;
+        if (NT_SUCCESS(status) && cacheable && outputSize >= sizeof(TPM2_RESPONSE_HEADER))
         {
-            DbgError("ReadPublic - responseCode - 0x%08x.\n", _byteswap_ulong(recvBuffer.Header.responseCode));
+            TPM_RC responseCode = _byteswap_ulong(this->ReadUnaligned<uint32_t>(outputParameterBlock + FIELD_OFFSET(TPM2_RESPONSE_HEADER, responseCode)));
+            if (responseCode == TPM_RC_SUCCESS)
+            {
+                this->responseCache.Insert(inputParameterBlock, inputParameterBlockSize, outputParameterBlock, outputSize);
+            }
         }
+        return status;
+    }
 
-        switch (responseCode) {
-        case TPM_RC_SUCCESS:
-            // return data
-            break;
-        case TPM_RC_SEQUENCE:
-            // objectHandle references a sequence object
-            return STATUS_INVALID_PARAMETER;
-        default:
-            return STATUS_DEVICE_BUSY;
-        }
+    //
+    // Marshals an authorization session into a command buffer.
+    //
+    // Parameters:
+    // - authSessionIn: Session to marshal, or nullptr for an empty password session (TPM_RS_PW).
+    // - authSessionOut: Pointer to the command buffer position that receives the session.
+    //
+    // Returns:
+    // - uint32_t: Number of bytes written to authSessionOut.
+    //
+    uint32_t CopyAuthSessionCommand(
+        _In_opt_ const TPMS_AUTH_COMMAND* authSessionIn,
+        _Out_ uint8_t* authSessionOut
+    )
+    {
+        uint8_t* buffer = authSessionOut;
 
-        //
-        // Basic check
-        //
-        uint16_t outPublicSize = _byteswap_ushort(recvBuffer.OutPublic.size);
-        if (outPublicSize > sizeof(TPMT_PUBLIC)) 
+        if (authSessionIn != nullptr)
         {
-            DbgError("ReadPublic - outPublicSize error %x.\n", outPublicSize);
-            return STATUS_DEVICE_BUSY;
-        }
+            this->WriteUnaligned<uint32_t>(buffer, _byteswap_ulong(authSessionIn->sessionHandle));
+            buffer += sizeof(uint32_t);
 
-        uint16_t nameSize = _byteswap_ushort(
-            this->ReadUnaligned<uint16_t>(
-                (uint16_t*)((uint8_t*)&recvBuffer + sizeof(TPM2_RESPONSE_HEADER) +
-                    sizeof(uint16_t) + outPublicSize)
-            )
-        );
-        if (nameSize > sizeof(TPMU_NAME)) 
-        {
-            DbgError("ReadPublic - nameSize error %x.\n", nameSize);
-            return STATUS_DEVICE_BUSY;
-        }
+            this->WriteUnaligned<uint16_t>(buffer, _byteswap_ushort(authSessionIn->nonce.size));
+            buffer += sizeof(uint16_t);
+            memcpy(buffer, authSessionIn->nonce.buffer, authSessionIn->nonce.size);
+            buffer += authSessionIn->nonce.size;
 
-        uint16_t qualifiedNameSize = _byteswap_ushort(
-            this->ReadUnaligned<uint16_t>(
-                (uint16_t*)((uint8_t*)&recvBuffer + sizeof(TPM2_RESPONSE_HEADER) +
-                    sizeof(uint16_t) + outPublicSize +
-                    sizeof(uint16_t) + nameSize)
-            )
-        );
-        if (qualifiedNameSize > sizeof(TPMU_NAME)) 
+            memcpy(buffer, &authSessionIn->sessionAttributes, sizeof(uint8_t));
+            buffer += sizeof(uint8_t);
+
+            this->WriteUnaligned<uint16_t>(buffer, _byteswap_ushort(authSessionIn->hmac.size));
+            buffer += sizeof(uint16_t);
+            memcpy(buffer, authSessionIn->hmac.buffer, authSessionIn->hmac.size);
+            buffer += authSessionIn->hmac.size;
+        }
+        else
+        {
+            //
+            // Empty password session: TPM_RS_PW, no nonce, no attributes, no hmac.
+            //
+            this->WriteUnaligned<uint32_t>(buffer, _byteswap_ulong(TPM_RS_PW));
+            buffer += sizeof(uint32_t);
+            this->WriteUnaligned<uint16_t>(buffer, 0);
+            buffer += sizeof(uint16_t);
+            *buffer = 0;
+            buffer += sizeof(uint8_t);
+            this->WriteUnaligned<uint16_t>(buffer, 0);
+            buffer += sizeof(uint16_t);
+        }
+
+        return (uint32_t)(buffer - authSessionOut);
+    }
+
+    //
+    // Builds a TPM2_NV_Read command for one chunk of an NV index.
+    //
+    // Parameters:
+    // - authHandle: Handle used to authorize the read (the index itself or a hierarchy).
+    // - nvIndex: NV index to read from.
+    // - size: Number of bytes to read.
+    // - offset: Offset into the NV index.
+    // - sendBuffer: Pointer to the command structure to fill.
+    //
+    // Returns:
+    // - uint32_t: Marshalled size of the command.
+    //
+    uint32_t BuildNvReadCommand(
+        _In_ TPMI_RH_NV_AUTH authHandle,
+        _In_ TPMI_RH_NV_INDEX nvIndex,
+        _In_ uint16_t size,
+        _In_ uint16_t offset,
+        _Out_ TPM2_NV_READ_COMMAND* sendBuffer
+    )
+    {
+        sendBuffer->Header.tag = _byteswap_ushort(TPM_ST_SESSIONS);
+        sendBuffer->Header.commandCode = _byteswap_ulong(TPM_CC_NV_Read);
+
+        sendBuffer->AuthHandle = _byteswap_ulong(authHandle);
+        sendBuffer->NvIndex = _byteswap_ulong(nvIndex);
+
+        uint8_t* buffer = (uint8_t*)&sendBuffer->AuthSession;
+        uint32_t sessionInfoSize = this->CopyAuthSessionCommand(nullptr, buffer);
+        buffer += sessionInfoSize;
+        sendBuffer->AuthSessionSize = _byteswap_ulong(sessionInfoSize);
+
+        this->WriteUnaligned<uint16_t>(buffer, _byteswap_ushort(size));
+        buffer += sizeof(uint16_t);
+        this->WriteUnaligned<uint16_t>(buffer, _byteswap_ushort(offset));
+        buffer += sizeof(uint16_t);
+
+        uint32_t sendBufferSize = (uint32_t)(buffer - (uint8_t*)sendBuffer);
+        sendBuffer->Header.paramSize = _byteswap_ulong(sendBufferSize);
+        return sendBufferSize;
+    }
+
+    //
+    // Validates a TPM2_NV_Read response and copies the returned data out.
+    //
+    // Parameters:
+    // - recvBuffer: Pointer to the raw response.
+    // - recvBufferSize: Size of the raw response.
+    // - data: Pointer to the buffer that receives the chunk.
+    // - size: Number of bytes that were requested for this chunk.
+    //
+    // Returns:
+    // - STATUS_SUCCESS: The chunk was copied to data.
+    // - STATUS_BUFFER_TOO_SMALL: The response is too small.
+    // - STATUS_ACCESS_DENIED: The NV index could not be read with the supplied authorization.
+    // - STATUS_DEVICE_BUSY: TPM device exception.
+    //
+    NTSTATUS ParseNvReadResponse(
+        _In_ const TPM2_NV_READ_RESPONSE* recvBuffer,
+        _In_ uint32_t recvBufferSize,
+        _Out_writes_bytes_(size) uint8_t* data,
+        _In_ uint16_t size
+    )
+    {
+        if (recvBufferSize < sizeof(TPM2_RESPONSE_HEADER)) 
+        {
+            DbgError("NvRead - recvBufferSize Error - %x.\n", recvBufferSize);
+            return STATUS_BUFFER_TOO_SMALL;
+        }
+
+        TPM_RC responseCode = _byteswap_ulong(recvBuffer->Header.responseCode);
+        if (responseCode != TPM_RC_SUCCESS) 
         {
-            DbgError("ReadPublic - qualifiedNameSize error %x.\n", qualifiedNameSize);
+            DbgError("NvRead - responseCode - 0x%08x.\n", responseCode);
+        }
+
+        switch (this->GetBaseResponseCode(responseCode)) 
+        {
+        case TPM_RC_SUCCESS:
+            // return data
+            break;
+        case TPM_RC_NV_AUTHORIZATION:
+        case TPM_RC_NV_LOCKED:
+        case TPM_RC_AUTH_FAIL:
+        case TPM_RC_BAD_AUTH:
+            return STATUS_ACCESS_DENIED;
+        case TPM_RC_NV_RANGE:
+        case TPM_RC_NV_UNINITIALIZED:
+            return STATUS_INVALID_PARAMETER;
+        default:
             return STATUS_DEVICE_BUSY;
         }
 
-        if (recvBufferSize != sizeof(TPM2_RESPONSE_HEADER) + sizeof(uint16_t) + outPublicSize + sizeof(uint16_t) + nameSize + sizeof(uint16_t) + qualifiedNameSize) 
+        if (recvBufferSize < sizeof(TPM2_RESPONSE_HEADER) + sizeof(uint32_t) + sizeof(uint16_t)) 
+        {
+            DbgError("NvRead - recvBufferSize Error - %x.\n", recvBufferSize);
+            return STATUS_BUFFER_TOO_SMALL;
+        }
+
+        uint16_t dataSize = _byteswap_ushort(recvBuffer->Data.size);
+        if (dataSize != size || dataSize > sizeof(recvBuffer->Data.buffer) ||
+            recvBufferSize < sizeof(TPM2_RESPONSE_HEADER) + sizeof(uint32_t) + sizeof(uint16_t) + dataSize) 
         {
-            DbgError("ReadPublic - recvBufferSize %x Error - outPublicSize %x, nameSize %x, qualifiedNameSize %x.\n", recvBufferSize, outPublicSize, nameSize, qualifiedNameSize);
+            DbgError("NvRead - dataSize error %x, expected %x.\n", dataSize, size);
             return STATUS_DEVICE_BUSY;
         }
 
-        //
-        // Return the response
-        //
-        uint8_t* buffer = (uint8_t*)&recvBuffer.OutPublic;
-        memcpy(outPublic, &recvBuffer.OutPublic, sizeof(uint16_t) + outPublicSize);
-        outPublic->size = outPublicSize;
-        outPublic->publicArea.type = _byteswap_ushort(outPublic->publicArea.type);
-        outPublic->publicArea.nameAlg = _byteswap_ushort(outPublic->publicArea.nameAlg);
+        memcpy(data, recvBuffer->Data.buffer, dataSize);
+        return STATUS_SUCCESS;
+    }
 
-        this->WriteUnaligned<uint32_t>((uint32_t*)&outPublic->publicArea.objectAttributes, _byteswap_ulong(this->ReadUnaligned<uint32_t>((uint32_t*)&outPublic->publicArea.objectAttributes)));
+    //
+    // Validates a TPM2_GetCapability response and decodes it. TPM_CAP_TPM_PROPERTIES,
+    // TPM_CAP_COMMANDS, TPM_CAP_HANDLES and TPM_CAP_PCRS are returned in host byte order; other
+    // capabilities are not decoded yet.
+    //
+    // Parameters:
+    // - recvBuffer: Pointer to the raw response.
+    // - recvBufferSize: Size of the raw response.
+    // - moreData: Pointer that receives YES if the TPM has more values than were returned.
+    // - capabilityData: Pointer to a TPMS_CAPABILITY_DATA structure that receives the values.
+    //
+    // Returns:
+    // - STATUS_SUCCESS: The response was decoded.
+    // - STATUS_BUFFER_TOO_SMALL: recvBuffer size was too small.
+    // - STATUS_NOT_SUPPORTED: Decoding of this capability is not supported.
+    // - STATUS_DEVICE_BUSY: TPM device exception, or a list that does not match the response size.
+    //
+    NTSTATUS ParseGetCapabilityResponse(
+        _In_ const TPM2_GET_CAPABILITY_RESPONSE* recvBuffer,
+        _In_ uint32_t recvBufferSize,
+        _Out_ TPMI_YES_NO* moreData,
+        _Out_ TPMS_CAPABILITY_DATA* capabilityData
+    )
+    {
+        if (recvBufferSize <= sizeof(TPM2_RESPONSE_HEADER) + sizeof(TPMI_YES_NO) + sizeof(TPM_CAP)) 
+        {
+            DbgError("GetCapability - recvBufferSize Error - %x.\n", recvBufferSize);
+            return STATUS_BUFFER_TOO_SMALL;
+        }
 
-        buffer = (uint8_t*)&recvBuffer.OutPublic.publicArea.authPolicy;
-        outPublic->publicArea.authPolicy.size = _byteswap_ushort(this->ReadUnaligned<uint16_t>((uint16_t*)buffer));
-        buffer += sizeof(uint16_t);
+        TPM_RC responseCode = _byteswap_ulong(recvBuffer->Header.responseCode);
+        if (responseCode != TPM_RC_SUCCESS) 
+        {
+            DbgError("GetCapability - responseCode - 0x%08x.\n", responseCode);
+            return STATUS_DEVICE_BUSY;
+        }
 
-        if (outPublic->publicArea.authPolicy.size > sizeof(TPMU_HA)) 
+        *moreData = recvBuffer->MoreData;
+        capabilityData->capability = _byteswap_ulong(recvBuffer->CapabilityData.capability);
+
+        uint32_t dataSize = recvBufferSize - (sizeof(TPM2_RESPONSE_HEADER) + sizeof(TPMI_YES_NO) + sizeof(TPM_CAP));
+
+        switch (capabilityData->capability)
         {
-            DbgError("ReadPublic - authPolicy.size error %x.\n", outPublic->publicArea.authPolicy.size);
+        case TPM_CAP_TPM_PROPERTIES:
+        {
+            const TPML_TAGGED_TPM_PROPERTY* properties = &recvBuffer->CapabilityData.data.tpmProperties;
+            uint32_t count = _byteswap_ulong(properties->count);
+            if (count > MAX_TPM_PROPERTIES || dataSize != sizeof(uint32_t) + count * sizeof(TPMS_TAGGED_PROPERTY)) 
+            {
+                DbgError("GetCapability - tpmProperties.count error %x.\n", count);
+                return STATUS_DEVICE_BUSY;
+            }
+
+            capabilityData->data.tpmProperties.count = count;
+            for (uint32_t i = 0; i < count; i++)
+            {
+                capabilityData->data.tpmProperties.tpmProperty[i].property = _byteswap_ulong(properties->tpmProperty[i].property);
+                capabilityData->data.tpmProperties.tpmProperty[i].value = _byteswap_ulong(properties->tpmProperty[i].value);
+            }
+            break;
+        }
+        case TPM_CAP_COMMANDS:
+        {
+            const TPML_CCA* commands = &recvBuffer->CapabilityData.data.command;
+            uint32_t count = _byteswap_ulong(commands->count);
+            if (count > MAX_CAP_CC || dataSize != sizeof(uint32_t) + count * sizeof(TPMA_CC)) 
+            {
+                DbgError("GetCapability - command.count error %x.\n", count);
+                return STATUS_DEVICE_BUSY;
+            }
+
+            capabilityData->data.command.count = count;
+            for (uint32_t i = 0; i < count; i++)
+            {
+                this->WriteUnaligned<uint32_t>(&capabilityData->data.command.commandAttributes[i], _byteswap_ulong(this->ReadUnaligned<uint32_t>(&commands->commandAttributes[i])));
+            }
+            break;
+        }
+        case TPM_CAP_HANDLES:
+        {
+            const TPML_HANDLE* handles = &recvBuffer->CapabilityData.data.handles;
+            uint32_t count = _byteswap_ulong(handles->count);
+            if (count > MAX_CAP_HANDLES || dataSize != sizeof(uint32_t) + count * sizeof(TPM_HANDLE)) 
+            {
+                DbgError("GetCapability - handles.count error %x.\n", count);
+                return STATUS_DEVICE_BUSY;
+            }
+
+            capabilityData->data.handles.count = count;
+            for (uint32_t i = 0; i < count; i++)
+            {
+                capabilityData->data.handles.handle[i] = _byteswap_ulong(handles->handle[i]);
+            }
+            break;
+        }
+        case TPM_CAP_PCRS:
+        {
+            TpmResponseReader reader;
+            reader.Reset((const uint8_t*)&recvBuffer->CapabilityData.data, dataSize, false);
+            if (!ReadPcrSelection(&reader, &capabilityData->data.assignedPCR) || reader.GetOffset() != dataSize)
+            {
+                DbgError("GetCapability - assignedPCR error.\n");
+                return STATUS_DEVICE_BUSY;
+            }
+            break;
+        }
+        default:
+            return STATUS_NOT_SUPPORTED;
+        }
+
+        return STATUS_SUCCESS;
+    }
+
+    //
+    // Reads a TPML_PCR_SELECTION.
+    //
+    // Returns:
+    // - true: selection holds the list.
+    // - false: The list is truncated, or has more banks or select bytes than a TPML_PCR_SELECTION holds.
+    //
+    static bool ReadPcrSelection(
+        _Inout_ TpmResponseReader* reader,
+        _Out_ TPML_PCR_SELECTION* selection
+    )
+    {
+        selection->count = reader->ReadUint32();
+        if (!reader->IsValid() || selection->count > HASH_COUNT)
+        {
+            return false;
+        }
+
+        for (uint32_t i = 0; i < selection->count; i++)
+        {
+            TPMS_PCR_SELECTION* bank = &selection->pcrSelections[i];
+            bank->hash = reader->ReadUint16();
+            bank->sizeofSelect = reader->ReadUint8();
+            if (!reader->IsValid() || bank->sizeofSelect > PCR_SELECT_MAX)
+            {
+                return false;
+            }
+            reader->ReadBytes(bank->pcrSelect, bank->sizeofSelect);
+        }
+        return reader->IsValid();
+    }
+
+    //
+    // Validates a TPM2_PCR_Read response and decodes it.
+    //
+    // Parameters:
+    // - recvBuffer: Pointer to the raw response.
+    // - recvBufferSize: Size of the raw response.
+    // - pcrUpdateCounter: Receives the PCR update counter.
+    // - pcrSelectionOut: Receives the PCRs the values were read from.
+    // - pcrValues: Receives the PCR values.
+    //
+    // Returns:
+    // - STATUS_SUCCESS: The response was decoded.
+    // - STATUS_BUFFER_TOO_SMALL: recvBuffer size was too small.
+    // - STATUS_DEVICE_BUSY: TPM device exception, or a malformed response.
+    //
+    NTSTATUS ParsePcrReadResponse(
+        _In_reads_bytes_(recvBufferSize) const uint8_t* recvBuffer,
+        _In_ uint32_t recvBufferSize,
+        _Out_ uint32_t* pcrUpdateCounter,
+        _Out_ TPML_PCR_SELECTION* pcrSelectionOut,
+        _Out_ TPML_DIGEST* pcrValues
+    )
+    {
+        if (recvBufferSize < sizeof(TPM2_RESPONSE_HEADER))
+        {
+            DbgError("PcrRead - recvBufferSize Error - %x.\n", recvBufferSize);
+            return STATUS_BUFFER_TOO_SMALL;
+        }
+
+        TpmResponseReader reader;
+        reader.Reset(recvBuffer, recvBufferSize, false);
+        TPM_RC responseCode = reader.ReadHeader();
+        if (responseCode != TPM_RC_SUCCESS)
+        {
+            DbgError("PcrRead - responseCode - 0x%08x.\n", responseCode);
             return STATUS_DEVICE_BUSY;
         }
 
-        memcpy(outPublic->publicArea.authPolicy.buffer, buffer, outPublic->publicArea.authPolicy.size);
-        buffer += outPublic->publicArea.authPolicy.size;
+        *pcrUpdateCounter = reader.ReadUint32();
+        if (!ReadPcrSelection(&reader, pcrSelectionOut))
+        {
+            DbgError("PcrRead - pcrSelectionOut error.\n");
+            return STATUS_DEVICE_BUSY;
+        }
 
-        // TPMU_PUBLIC_PARMS
-        switch (outPublic->publicArea.type) 
+        pcrValues->count = reader.ReadUint32();
+        if (!reader.IsValid() || pcrValues->count > ARRAYSIZE(pcrValues->digests))
+        {
+            DbgError("PcrRead - pcrValues.count error %x.\n", pcrValues->count);
+            return STATUS_DEVICE_BUSY;
+        }
+        for (uint32_t i = 0; i < pcrValues->count; i++)
+        {
+            TPM2B_DIGEST* digest = &pcrValues->digests[i];
+            digest->size = reader.ReadUint16();
+            if (digest->size > sizeof(digest->buffer))
+            {
+                DbgError("PcrRead - digest size error %x.\n", digest->size);
+                return STATUS_DEVICE_BUSY;
+            }
+            reader.ReadBytes(digest->buffer, digest->size);
+        }
+
+        if (!reader.IsValid() || reader.GetOffset() != recvBufferSize)
+        {
+            DbgError("PcrRead - response size error %x.\n", recvBufferSize);
+            return STATUS_DEVICE_BUSY;
+        }
+        return STATUS_SUCCESS;
+    }
+
+    //
+    // Builds a TPM2_ReadPublic command.
+    //
+    // Parameters:
+    // - objectHandle: Handle of the object to read.
+    // - sendBuffer: Pointer to the command structure to fill.
+    //
+    // Returns:
+    // - uint32_t: Marshalled size of the command.
+    //
+    uint32_t BuildReadPublicCommand(
+        _In_ TPMI_DH_OBJECT objectHandle,
+        _Out_ TPM2_READ_PUBLIC_COMMAND* sendBuffer
+    )
+    {
+        *sendBuffer = templates::ReadPublic;
+        sendBuffer->ObjectHandle = _byteswap_ulong(objectHandle);
+        return (uint32_t)sizeof(*sendBuffer);
+    }
+
+    //
+    // Decodes the TPMU_PUBLIC_PARMS of a marshalled public area.
+    //
+    // Parameters:
+    // - type: Object type selecting the union member.
+    // - bufferPosition: Pointer to the read position, advanced past the parameters.
+    // - parameters: Pointer to a TPMU_PUBLIC_PARMS union that receives the decoded parameters.
+    //
+    // Returns:
+    // - STATUS_SUCCESS: The parameters were decoded.
+    // - STATUS_NOT_SUPPORTED: The object type or one of its schemes is not supported.
+    //
+    NTSTATUS UnmarshalPublicParameters(
+        _In_ TPMI_ALG_PUBLIC type,
+        _Inout_ const uint8_t** bufferPosition,
+        _Out_ TPMU_PUBLIC_PARMS* parameters
+    )
+    {
+        const uint8_t* buffer = *bufferPosition;
+
+        switch (type) 
         {
         case TPM_ALG_KEYEDHASH:
-            outPublic->publicArea.parameters.keyedHashDetail.scheme.scheme = _byteswap_ushort(this->ReadUnaligned<uint16_t>((uint16_t*)buffer));
+            parameters->keyedHashDetail.scheme.scheme = _byteswap_ushort(this->ReadUnaligned<uint16_t>((uint16_t*)buffer));
             buffer += sizeof(uint16_t);
-            switch (outPublic->publicArea.parameters.keyedHashDetail.scheme.scheme) 
+            switch (parameters->keyedHashDetail.scheme.scheme) 
             {
             case TPM_ALG_HMAC:
-                outPublic->publicArea.parameters.keyedHashDetail.scheme.details.hmac.hashAlg = _byteswap_ushort(this->ReadUnaligned<uint16_t>((uint16_t*)buffer));
+                parameters->keyedHashDetail.scheme.details.hmac.hashAlg = _byteswap_ushort(this->ReadUnaligned<uint16_t>((uint16_t*)buffer));
                 buffer += sizeof(uint16_t);
                 break;
             case TPM_ALG_XOR:
-                outPublic->publicArea.parameters.keyedHashDetail.scheme.details. xor .hashAlg = _byteswap_ushort(this->ReadUnaligned<uint16_t>((uint16_t*)buffer));
+                parameters->keyedHashDetail.scheme.details. xor .hashAlg = _byteswap_ushort(this->ReadUnaligned<uint16_t>((uint16_t*)buffer));
                 buffer += sizeof(uint16_t);
-                outPublic->publicArea.parameters.keyedHashDetail.scheme.details. xor .kdf = _byteswap_ushort(this->ReadUnaligned<uint16_t>((uint16_t*)buffer));
+                parameters->keyedHashDetail.scheme.details. xor .kdf = _byteswap_ushort(this->ReadUnaligned<uint16_t>((uint16_t*)buffer));
                 buffer += sizeof(uint16_t);
                 break;
+            case TPM_ALG_NULL:
+                break;
             default:
                 return STATUS_NOT_SUPPORTED;
             }
 
+            break;
         case TPM_ALG_SYMCIPHER:
-            outPublic->publicArea.parameters.symDetail.algorithm = _byteswap_ushort(this->ReadUnaligned<uint16_t>((uint16_t*)buffer));
+            parameters->symDetail.algorithm = _byteswap_ushort(this->ReadUnaligned<uint16_t>((uint16_t*)buffer));
             buffer += sizeof(uint16_t);
-            switch (outPublic->publicArea.parameters.symDetail.algorithm) 
+            switch (parameters->symDetail.algorithm) 
             {
             case TPM_ALG_AES:
-                outPublic->publicArea.parameters.symDetail.keyBits.aes = _byteswap_ushort(this->ReadUnaligned<uint16_t>((uint16_t*)buffer));
+                parameters->symDetail.keyBits.aes = _byteswap_ushort(this->ReadUnaligned<uint16_t>((uint16_t*)buffer));
                 buffer += sizeof(uint16_t);
-                outPublic->publicArea.parameters.symDetail.mode.aes = _byteswap_ushort(this->ReadUnaligned<uint16_t>((uint16_t*)buffer));
+                parameters->symDetail.mode.aes = _byteswap_ushort(this->ReadUnaligned<uint16_t>((uint16_t*)buffer));
                 buffer += sizeof(uint16_t);
                 break;
             case TPM_ALG_SM4:
-                outPublic->publicArea.parameters.symDetail.keyBits.SM4 = _byteswap_ushort(this->ReadUnaligned<uint16_t>((uint16_t*)buffer));
+                parameters->symDetail.keyBits.SM4 = _byteswap_ushort(this->ReadUnaligned<uint16_t>((uint16_t*)buffer));
                 buffer += sizeof(uint16_t);
-                outPublic->publicArea.parameters.symDetail.mode.SM4 = _byteswap_ushort(this->ReadUnaligned<uint16_t>((uint16_t*)buffer));
+                parameters->symDetail.mode.SM4 = _byteswap_ushort(this->ReadUnaligned<uint16_t>((uint16_t*)buffer));
                 buffer += sizeof(uint16_t);
                 break;
             case TPM_ALG_XOR:
-                outPublic->publicArea.parameters.symDetail.keyBits. xor = _byteswap_ushort(this->ReadUnaligned<uint16_t>((uint16_t*)buffer));
+                parameters->symDetail.keyBits. xor = _byteswap_ushort(this->ReadUnaligned<uint16_t>((uint16_t*)buffer));
                 buffer += sizeof(uint16_t);
                 break;
             case TPM_ALG_NULL:
@@ -332,20 +924,20 @@ public:
 
             break;
         case TPM_ALG_RSA:
-            outPublic->publicArea.parameters.rsaDetail.symmetric.algorithm = _byteswap_ushort(this->ReadUnaligned<uint16_t>((uint16_t*)buffer));
+            parameters->rsaDetail.symmetric.algorithm = _byteswap_ushort(this->ReadUnaligned<uint16_t>((uint16_t*)buffer));
             buffer += sizeof(uint16_t);
-            switch (outPublic->publicArea.parameters.rsaDetail.symmetric.algorithm) 
+            switch (parameters->rsaDetail.symmetric.algorithm) 
             {
             case TPM_ALG_AES:
-                outPublic->publicArea.parameters.rsaDetail.symmetric.keyBits.aes = _byteswap_ushort(this->ReadUnaligned<uint16_t>((uint16_t*)buffer));
+                parameters->rsaDetail.symmetric.keyBits.aes = _byteswap_ushort(this->ReadUnaligned<uint16_t>((uint16_t*)buffer));
                 buffer += sizeof(uint16_t);
-                outPublic->publicArea.parameters.rsaDetail.symmetric.mode.aes = _byteswap_ushort(this->ReadUnaligned<uint16_t>((uint16_t*)buffer));
+                parameters->rsaDetail.symmetric.mode.aes = _byteswap_ushort(this->ReadUnaligned<uint16_t>((uint16_t*)buffer));
                 buffer += sizeof(uint16_t);
                 break;
             case TPM_ALG_SM4:
-                outPublic->publicArea.parameters.rsaDetail.symmetric.keyBits.SM4 = _byteswap_ushort(this->ReadUnaligned<uint16_t>((uint16_t*)buffer));
+                parameters->rsaDetail.symmetric.keyBits.SM4 = _byteswap_ushort(this->ReadUnaligned<uint16_t>((uint16_t*)buffer));
                 buffer += sizeof(uint16_t);
-                outPublic->publicArea.parameters.rsaDetail.symmetric.mode.SM4 = _byteswap_ushort(this->ReadUnaligned<uint16_t>((uint16_t*)buffer));
+                parameters->rsaDetail.symmetric.mode.SM4 = _byteswap_ushort(this->ReadUnaligned<uint16_t>((uint16_t*)buffer));
                 buffer += sizeof(uint16_t);
                 break;
             case TPM_ALG_NULL:
@@ -354,22 +946,22 @@ public:
                 return STATUS_NOT_SUPPORTED;
             }
 
-            outPublic->publicArea.parameters.rsaDetail.scheme.scheme = _byteswap_ushort(this->ReadUnaligned<uint16_t>((uint16_t*)buffer));
+            parameters->rsaDetail.scheme.scheme = _byteswap_ushort(this->ReadUnaligned<uint16_t>((uint16_t*)buffer));
             buffer += sizeof(uint16_t);
-            switch (outPublic->publicArea.parameters.rsaDetail.scheme.scheme) 
+            switch (parameters->rsaDetail.scheme.scheme) 
             {
             case TPM_ALG_RSASSA:
-                outPublic->publicArea.parameters.rsaDetail.scheme.details.rsassa.hashAlg = _byteswap_ushort(this->ReadUnaligned<uint16_t>((uint16_t*)buffer));
+                parameters->rsaDetail.scheme.details.rsassa.hashAlg = _byteswap_ushort(this->ReadUnaligned<uint16_t>((uint16_t*)buffer));
                 buffer += sizeof(uint16_t);
                 break;
             case TPM_ALG_RSAPSS:
-                outPublic->publicArea.parameters.rsaDetail.scheme.details.rsapss.hashAlg = _byteswap_ushort(this->ReadUnaligned<uint16_t>((uint16_t*)buffer));
+                parameters->rsaDetail.scheme.details.rsapss.hashAlg = _byteswap_ushort(this->ReadUnaligned<uint16_t>((uint16_t*)buffer));
                 buffer += sizeof(uint16_t);
                 break;
             case TPM_ALG_RSAES:
                 break;
             case TPM_ALG_OAEP:
-                outPublic->publicArea.parameters.rsaDetail.scheme.details.oaep.hashAlg = _byteswap_ushort(this->ReadUnaligned<uint16_t>((uint16_t*)buffer));
+                parameters->rsaDetail.scheme.details.oaep.hashAlg = _byteswap_ushort(this->ReadUnaligned<uint16_t>((uint16_t*)buffer));
                 buffer += sizeof(uint16_t);
                 break;
             case TPM_ALG_NULL:
@@ -378,26 +970,26 @@ public:
                 return STATUS_NOT_SUPPORTED;
             }
 
-            outPublic->publicArea.parameters.rsaDetail.keyBits = _byteswap_ushort(this->ReadUnaligned<uint16_t>((uint16_t*)buffer));
+            parameters->rsaDetail.keyBits = _byteswap_ushort(this->ReadUnaligned<uint16_t>((uint16_t*)buffer));
             buffer += sizeof(uint16_t);
-            outPublic->publicArea.parameters.rsaDetail.exponent = _byteswap_ushort(this->ReadUnaligned<uint16_t>((uint16_t*)buffer));
+            parameters->rsaDetail.exponent = _byteswap_ulong(this->ReadUnaligned<uint32_t>((uint32_t*)buffer));
             buffer += sizeof(uint32_t);
             break;
         case TPM_ALG_ECC:
-            outPublic->publicArea.parameters.eccDetail.symmetric.algorithm = _byteswap_ushort(this->ReadUnaligned<uint16_t>((uint16_t*)buffer));
+            parameters->eccDetail.symmetric.algorithm = _byteswap_ushort(this->ReadUnaligned<uint16_t>((uint16_t*)buffer));
             buffer += sizeof(uint16_t);
-            switch (outPublic->publicArea.parameters.eccDetail.symmetric.algorithm) 
+            switch (parameters->eccDetail.symmetric.algorithm) 
             {
             case TPM_ALG_AES:
-                outPublic->publicArea.parameters.eccDetail.symmetric.keyBits.aes = _byteswap_ushort(this->ReadUnaligned<uint16_t>((uint16_t*)buffer));
+                parameters->eccDetail.symmetric.keyBits.aes = _byteswap_ushort(this->ReadUnaligned<uint16_t>((uint16_t*)buffer));
                 buffer += sizeof(uint16_t);
-                outPublic->publicArea.parameters.eccDetail.symmetric.mode.aes = _byteswap_ushort(this->ReadUnaligned<uint16_t>((uint16_t*)buffer));
+                parameters->eccDetail.symmetric.mode.aes = _byteswap_ushort(this->ReadUnaligned<uint16_t>((uint16_t*)buffer));
                 buffer += sizeof(uint16_t);
                 break;
             case TPM_ALG_SM4:
-                outPublic->publicArea.parameters.eccDetail.symmetric.keyBits.SM4 = _byteswap_ushort(this->ReadUnaligned<uint16_t>((uint16_t*)buffer));
+                parameters->eccDetail.symmetric.keyBits.SM4 = _byteswap_ushort(this->ReadUnaligned<uint16_t>((uint16_t*)buffer));
                 buffer += sizeof(uint16_t);
-                outPublic->publicArea.parameters.eccDetail.symmetric.mode.SM4 = _byteswap_ushort(this->ReadUnaligned<uint16_t>((uint16_t*)buffer));
+                parameters->eccDetail.symmetric.mode.SM4 = _byteswap_ushort(this->ReadUnaligned<uint16_t>((uint16_t*)buffer));
                 buffer += sizeof(uint16_t);
                 break;
             case TPM_ALG_NULL:
@@ -406,20 +998,20 @@ public:
                 return STATUS_NOT_SUPPORTED;
             }
 
-            outPublic->publicArea.parameters.eccDetail.scheme.scheme = _byteswap_ushort(this->ReadUnaligned<uint16_t>((uint16_t*)buffer));
+            parameters->eccDetail.scheme.scheme = _byteswap_ushort(this->ReadUnaligned<uint16_t>((uint16_t*)buffer));
             buffer += sizeof(uint16_t);
-            switch (outPublic->publicArea.parameters.eccDetail.scheme.scheme) 
+            switch (parameters->eccDetail.scheme.scheme) 
             {
             case TPM_ALG_ECDSA:
-                outPublic->publicArea.parameters.eccDetail.scheme.details.ecdsa.hashAlg = _byteswap_ushort(this->ReadUnaligned<uint16_t>((uint16_t*)buffer));
+                parameters->eccDetail.scheme.details.ecdsa.hashAlg = _byteswap_ushort(this->ReadUnaligned<uint16_t>((uint16_t*)buffer));
                 buffer += sizeof(uint16_t);
                 break;
             case TPM_ALG_ECDAA:
-                outPublic->publicArea.parameters.eccDetail.scheme.details.ecdaa.hashAlg = _byteswap_ushort(this->ReadUnaligned<uint16_t>((uint16_t*)buffer));
+                parameters->eccDetail.scheme.details.ecdaa.hashAlg = _byteswap_ushort(this->ReadUnaligned<uint16_t>((uint16_t*)buffer));
                 buffer += sizeof(uint16_t);
                 break;
             case TPM_ALG_ECSCHNORR:
-                outPublic->publicArea.parameters.eccDetail.scheme.details.ecSchnorr.hashAlg = _byteswap_ushort(this->ReadUnaligned<uint16_t>((uint16_t*)buffer));
+                parameters->eccDetail.scheme.details.ecSchnorr.hashAlg = _byteswap_ushort(this->ReadUnaligned<uint16_t>((uint16_t*)buffer));
                 buffer += sizeof(uint16_t);
                 break;
             case TPM_ALG_ECDH:
@@ -430,26 +1022,26 @@ public:
                 return STATUS_NOT_SUPPORTED;
             }
 
-            outPublic->publicArea.parameters.eccDetail.curveID = _byteswap_ushort(this->ReadUnaligned<uint16_t>((uint16_t*)buffer));
+            parameters->eccDetail.curveID = _byteswap_ushort(this->ReadUnaligned<uint16_t>((uint16_t*)buffer));
             buffer += sizeof(uint16_t);
-            outPublic->publicArea.parameters.eccDetail.kdf.scheme = _byteswap_ushort(this->ReadUnaligned<uint16_t>((uint16_t*)buffer));
+            parameters->eccDetail.kdf.scheme = _byteswap_ushort(this->ReadUnaligned<uint16_t>((uint16_t*)buffer));
             buffer += sizeof(uint16_t);
-            switch (outPublic->publicArea.parameters.eccDetail.kdf.scheme) 
+            switch (parameters->eccDetail.kdf.scheme) 
             {
             case TPM_ALG_MGF1:
-                outPublic->publicArea.parameters.eccDetail.kdf.details.mgf1.hashAlg = _byteswap_ushort(this->ReadUnaligned<uint16_t>((uint16_t*)buffer));
+                parameters->eccDetail.kdf.details.mgf1.hashAlg = _byteswap_ushort(this->ReadUnaligned<uint16_t>((uint16_t*)buffer));
                 buffer += sizeof(uint16_t);
                 break;
             case TPM_ALG_KDF1_SP800_108:
-                outPublic->publicArea.parameters.eccDetail.kdf.details.kdf1_sp800_108.hashAlg = _byteswap_ushort(this->ReadUnaligned<uint16_t>((uint16_t*)buffer));
+                parameters->eccDetail.kdf.details.kdf1_sp800_108.hashAlg = _byteswap_ushort(this->ReadUnaligned<uint16_t>((uint16_t*)buffer));
                 buffer += sizeof(uint16_t);
                 break;
             case TPM_ALG_KDF1_SP800_56a:
-                outPublic->publicArea.parameters.eccDetail.kdf.details.kdf1_SP800_56a.hashAlg = _byteswap_ushort(this->ReadUnaligned<uint16_t>((uint16_t*)buffer));
+                parameters->eccDetail.kdf.details.kdf1_SP800_56a.hashAlg = _byteswap_ushort(this->ReadUnaligned<uint16_t>((uint16_t*)buffer));
                 buffer += sizeof(uint16_t);
                 break;
             case TPM_ALG_KDF2:
-                outPublic->publicArea.parameters.eccDetail.kdf.details.kdf2.hashAlg = _byteswap_ushort(this->ReadUnaligned<uint16_t>((uint16_t*)buffer));
+                parameters->eccDetail.kdf.details.kdf2.hashAlg = _byteswap_ushort(this->ReadUnaligned<uint16_t>((uint16_t*)buffer));
                 buffer += sizeof(uint16_t);
                 break;
             case TPM_ALG_NULL:
@@ -463,6 +1055,67 @@ public:
             return STATUS_NOT_SUPPORTED;
         }
 
+        *bufferPosition = buffer;
+        return STATUS_SUCCESS;
+    }
+
+    //
+    // Decodes a marshalled TPM2B_PUBLIC into host byte order.
+    //
+    // Every sized field is checked against the capacity of its destination rather than against the
+    // marshalled size, so publicBuffer must be readable for sizeof(TPM2B_PUBLIC) bytes.
+    //
+    // Parameters:
+    // - publicBuffer: Pointer to the marshalled TPM2B_PUBLIC.
+    // - outPublic: Pointer to a TPM2B_PUBLIC structure that receives the decoded public area.
+    //
+    // Returns:
+    // - STATUS_SUCCESS: The public area was decoded.
+    // - STATUS_BUFFER_TOO_SMALL: The key does not fit in a TPM2B_PUBLIC, use UnmarshalCompactPublic.
+    // - STATUS_DEVICE_BUSY: The public area is malformed.
+    // - STATUS_NOT_SUPPORTED: The object type or one of its schemes is not supported.
+    //
+    NTSTATUS UnmarshalPublic(
+        _In_reads_bytes_(sizeof(TPM2B_PUBLIC)) const uint8_t* publicBuffer,
+        _Out_ TPM2B_PUBLIC* outPublic
+    )
+    {
+        uint16_t outPublicSize = _byteswap_ushort(this->ReadUnaligned<uint16_t>(publicBuffer));
+        if (outPublicSize > sizeof(TPMT_PUBLIC)) 
+        {
+            DbgError("ReadPublic - outPublicSize error %x.\n", outPublicSize);
+            return outPublicSize <= PUBLIC_AREA_MAX_SIZE ? STATUS_BUFFER_TOO_SMALL : STATUS_DEVICE_BUSY;
+        }
+
+        const TPM2B_PUBLIC* inPublic = (const TPM2B_PUBLIC*)publicBuffer;
+        const uint8_t* buffer = publicBuffer;
+        memcpy(outPublic, publicBuffer, sizeof(uint16_t) + outPublicSize);
+        outPublic->size = outPublicSize;
+        outPublic->publicArea.type = _byteswap_ushort(outPublic->publicArea.type);
+        outPublic->publicArea.nameAlg = _byteswap_ushort(outPublic->publicArea.nameAlg);
+
+        this->WriteUnaligned<uint32_t>((uint32_t*)&outPublic->publicArea.objectAttributes, _byteswap_ulong(this->ReadUnaligned<uint32_t>((uint32_t*)&outPublic->publicArea.objectAttributes)));
+
+        buffer = (const uint8_t*)&inPublic->publicArea.authPolicy;
+        outPublic->publicArea.authPolicy.size = _byteswap_ushort(this->ReadUnaligned<uint16_t>((uint16_t*)buffer));
+        buffer += sizeof(uint16_t);
+
+        if (outPublic->publicArea.authPolicy.size > sizeof(TPMU_HA)) 
+        {
+            DbgError("ReadPublic - authPolicy.size error %x.\n", outPublic->publicArea.authPolicy.size);
+            return STATUS_DEVICE_BUSY;
+        }
+
+        memcpy(outPublic->publicArea.authPolicy.buffer, buffer, outPublic->publicArea.authPolicy.size);
+        buffer += outPublic->publicArea.authPolicy.size;
+
+        // TPMU_PUBLIC_PARMS
+        NTSTATUS status = this->UnmarshalPublicParameters(outPublic->publicArea.type, &buffer, &outPublic->publicArea.parameters);
+        if (NT_ERROR(status))
+        {
+            return status;
+        }
+
         // TPMU_PUBLIC_ID
         switch (outPublic->publicArea.type) 
         {
@@ -496,7 +1149,7 @@ public:
             if (outPublic->publicArea.unique.rsa.size > MAX_RSA_KEY_BYTES) 
             {
                 DbgError("ReadPublic - rsa.size error %x.\n", outPublic->publicArea.unique.rsa.size);
-                return STATUS_DEVICE_BUSY;
+                return outPublic->publicArea.unique.rsa.size <= COMPACT_RSA_KEY_BYTES_MAX ? STATUS_BUFFER_TOO_SMALL : STATUS_DEVICE_BUSY;
             }
 
             memcpy(outPublic->publicArea.unique.rsa.buffer, buffer, outPublic->publicArea.unique.rsa.size);
@@ -508,7 +1161,7 @@ public:
             if (outPublic->publicArea.unique.ecc.x.size > MAX_ECC_KEY_BYTES) 
             {
                 DbgError("ReadPublic - ecc.x.size error %x.\n", outPublic->publicArea.unique.ecc.x.size);
-                return STATUS_DEVICE_BUSY;
+                return outPublic->publicArea.unique.ecc.x.size <= COMPACT_ECC_KEY_BYTES_MAX ? STATUS_BUFFER_TOO_SMALL : STATUS_DEVICE_BUSY;
             }
 
             memcpy(outPublic->publicArea.unique.ecc.x.buffer, buffer, outPublic->publicArea.unique.ecc.x.size);
@@ -518,7 +1171,7 @@ public:
             if (outPublic->publicArea.unique.ecc.y.size > MAX_ECC_KEY_BYTES) 
             {
                 DbgError("ReadPublic - ecc.y.size error %x.\n", outPublic->publicArea.unique.ecc.y.size);
-                return STATUS_DEVICE_BUSY;
+                return outPublic->publicArea.unique.ecc.y.size <= COMPACT_ECC_KEY_BYTES_MAX ? STATUS_BUFFER_TOO_SMALL : STATUS_DEVICE_BUSY;
             }
 
             memcpy(outPublic->publicArea.unique.ecc.y.buffer, buffer, outPublic->publicArea.unique.ecc.y.size);
@@ -528,14 +1181,2299 @@ public:
             return STATUS_NOT_SUPPORTED;
         }
 
-        memcpy(name->name, (uint8_t*)&recvBuffer + sizeof(TPM2_RESPONSE_HEADER) + sizeof(uint16_t) + outPublicSize + sizeof(uint16_t), nameSize);
-        name->size = nameSize;
-
-        memcpy(qualifiedName->name, (uint8_t*)&recvBuffer + sizeof(TPM2_RESPONSE_HEADER) + sizeof(uint16_t) + outPublicSize + sizeof(uint16_t) + nameSize + sizeof(uint16_t), qualifiedNameSize);
-        qualifiedName->size = qualifiedNameSize;
-
         return STATUS_SUCCESS;
     }
 
-};
-
+    //
+    // Decodes a marshalled TPM2B_PUBLIC into a TPM_COMPACT_PUBLIC, which also holds keys larger
+    // than a TPM2B_PUBLIC. Every read is checked against publicBufferSize.
+    //
+    // Parameters:
+    // - publicBuffer: Pointer to the marshalled TPM2B_PUBLIC.
+    // - publicBufferSize: Number of readable bytes at publicBuffer.
+    // - compactPublic: Pointer to the buffer that receives the compact public area.
+    // - compactPublicSize: Size of the compact public area buffer, COMPACT_PUBLIC_MAX_SIZE fits any key.
+    //
+    // Returns:
+    // - STATUS_SUCCESS: The public area was decoded.
+    // - STATUS_BUFFER_TOO_SMALL: compactPublicSize is too small for this key.
+    // - STATUS_DEVICE_BUSY: The public area is malformed.
+    // - STATUS_NOT_SUPPORTED: The object type or one of its schemes is not supported.
+    //
+    NTSTATUS UnmarshalCompactPublic(
+        _In_reads_bytes_(publicBufferSize) const uint8_t* publicBuffer,
+        _In_ uint32_t publicBufferSize,
+        _Out_writes_bytes_(compactPublicSize) TPM_COMPACT_PUBLIC* compactPublic,
+        _In_ uint32_t compactPublicSize
+    )
+    {
+        if (publicBufferSize < sizeof(uint16_t) || compactPublicSize < sizeof(TPM_COMPACT_PUBLIC))
+        {
+            return STATUS_BUFFER_TOO_SMALL;
+        }
+
+        uint16_t outPublicSize = _byteswap_ushort(this->ReadUnaligned<uint16_t>(publicBuffer));
+        if (outPublicSize > PUBLIC_AREA_MAX_SIZE || outPublicSize > publicBufferSize - sizeof(uint16_t))
+        {
+            DbgError("UnmarshalCompactPublic - outPublicSize error %x.\n", outPublicSize);
+            return STATUS_DEVICE_BUSY;
+        }
+
+        const uint8_t* buffer = publicBuffer + sizeof(uint16_t);
+        const uint8_t* end = buffer + outPublicSize;
+
+        //
+        // type, nameAlg, objectAttributes and the authPolicy size.
+        //
+        if ((uint32_t)(end - buffer) < 2 * sizeof(uint16_t) + sizeof(uint32_t) + sizeof(uint16_t))
+        {
+            DbgError("UnmarshalCompactPublic - outPublicSize error %x.\n", outPublicSize);
+            return STATUS_DEVICE_BUSY;
+        }
+
+        RtlZeroMemory(compactPublic, sizeof(TPM_COMPACT_PUBLIC));
+        compactPublic->type = _byteswap_ushort(this->ReadUnaligned<uint16_t>(buffer));
+        buffer += sizeof(uint16_t);
+        compactPublic->nameAlg = _byteswap_ushort(this->ReadUnaligned<uint16_t>(buffer));
+        buffer += sizeof(uint16_t);
+        this->WriteUnaligned<uint32_t>(&compactPublic->objectAttributes, _byteswap_ulong(this->ReadUnaligned<uint32_t>(buffer)));
+        buffer += sizeof(uint32_t);
+
+        uint16_t authPolicySize = _byteswap_ushort(this->ReadUnaligned<uint16_t>(buffer));
+        buffer += sizeof(uint16_t);
+        if (authPolicySize > sizeof(TPMU_HA) || authPolicySize > (uint32_t)(end - buffer))
+        {
+            DbgError("UnmarshalCompactPublic - authPolicy.size error %x.\n", authPolicySize);
+            return STATUS_DEVICE_BUSY;
+        }
+        const uint8_t* authPolicy = buffer;
+        buffer += authPolicySize;
+
+        //
+        // UnmarshalPublicParameters reads without bounds, so hand it a zero-padded copy and make
+        // sure it did not consume more than the public area holds.
+        //
+        uint8_t parametersBuffer[sizeof(TPMU_PUBLIC_PARMS)] = { 0 };
+        uint32_t parametersAvailable = min((uint32_t)(end - buffer), (uint32_t)sizeof(parametersBuffer));
+        memcpy(parametersBuffer, buffer, parametersAvailable);
+
+        const uint8_t* parametersPosition = parametersBuffer;
+        NTSTATUS status = this->UnmarshalPublicParameters(compactPublic->type, &parametersPosition, &compactPublic->parameters);
+        if (NT_ERROR(status))
+        {
+            return status;
+        }
+
+        uint32_t parametersSize = (uint32_t)(parametersPosition - parametersBuffer);
+        if (parametersSize > parametersAvailable)
+        {
+            DbgError("UnmarshalCompactPublic - parameters truncated.\n");
+            return STATUS_DEVICE_BUSY;
+        }
+        buffer += parametersSize;
+
+        // TPMU_PUBLIC_ID
+        uint32_t uniqueCapacity = 0;
+        switch (compactPublic->type)
+        {
+        case TPM_ALG_KEYEDHASH:
+        case TPM_ALG_SYMCIPHER:
+            uniqueCapacity = sizeof(TPMU_HA);
+            break;
+        case TPM_ALG_RSA:
+            uniqueCapacity = COMPACT_RSA_KEY_BYTES_MAX;
+            break;
+        case TPM_ALG_ECC:
+            uniqueCapacity = COMPACT_ECC_KEY_BYTES_MAX;
+            break;
+        default:
+            return STATUS_NOT_SUPPORTED;
+        }
+
+        const uint8_t* unique[2] = { };
+        uint16_t uniqueSizes[2] = { };
+        uint32_t uniqueCount = compactPublic->type == TPM_ALG_ECC ? 2 : 1;
+
+        for (uint32_t i = 0; i < uniqueCount; i++)
+        {
+            if ((uint32_t)(end - buffer) < sizeof(uint16_t))
+            {
+                DbgError("UnmarshalCompactPublic - unique truncated.\n");
+                return STATUS_DEVICE_BUSY;
+            }
+
+            uniqueSizes[i] = _byteswap_ushort(this->ReadUnaligned<uint16_t>(buffer));
+            buffer += sizeof(uint16_t);
+            if (uniqueSizes[i] > uniqueCapacity || uniqueSizes[i] > (uint32_t)(end - buffer))
+            {
+                DbgError("UnmarshalCompactPublic - unique size error %x.\n", uniqueSizes[i]);
+                return STATUS_DEVICE_BUSY;
+            }
+
+            unique[i] = buffer;
+            buffer += uniqueSizes[i];
+        }
+
+        compactPublic->authPolicySize = authPolicySize;
+        compactPublic->uniqueSize = uniqueSizes[0];
+        compactPublic->uniqueYSize = uniqueSizes[1];
+        if (TpmCompactPublic::GetSize(compactPublic) > compactPublicSize)
+        {
+            return STATUS_BUFFER_TOO_SMALL;
+        }
+
+        uint8_t* payload = (uint8_t*)(compactPublic + 1);
+        memcpy(payload, authPolicy, authPolicySize);
+        payload += authPolicySize;
+        for (uint32_t i = 0; i < uniqueCount; i++)
+        {
+            memcpy(payload, unique[i], uniqueSizes[i]);
+            payload += uniqueSizes[i];
+        }
+
+        return STATUS_SUCCESS;
+    }
+
+    //
+    // Validates a TPM2_ReadPublic response and returns the sizes of its sized fields.
+    // The public area may be larger than a TPM2B_PUBLIC, up to PUBLIC_AREA_MAX_SIZE.
+    //
+    // Parameters:
+    // - recvBuffer: Pointer to the raw response.
+    // - recvBufferSize: Size of the raw response.
+    // - outPublicSize: Receives the size of the marshalled TPMT_PUBLIC.
+    // - nameSize: Receives the size of the Name.
+    // - qualifiedNameSize: Receives the size of the qualified Name.
+    //
+    // Returns:
+    // - STATUS_SUCCESS: The response is well-formed.
+    // - STATUS_BUFFER_TOO_SMALL: recvBuffer size was too small.
+    // - STATUS_INVALID_PARAMETER: The handle references a sequence object.
+    // - STATUS_NOT_FOUND: The handle does not reference a loaded or persistent object.
+    // - STATUS_DEVICE_BUSY: TPM device exception.
+    //
+    NTSTATUS CheckReadPublicResponse(
+        _In_reads_bytes_(recvBufferSize) const uint8_t* recvBuffer,
+        _In_ uint32_t recvBufferSize,
+        _Out_ uint16_t* outPublicSize,
+        _Out_ uint16_t* nameSize,
+        _Out_ uint16_t* qualifiedNameSize
+    )
+    {
+        if (recvBufferSize < sizeof(TPM2_RESPONSE_HEADER)) 
+        {
+            DbgError("ReadPublic - recvBufferSize Error - %x.\n", recvBufferSize);
+            return STATUS_BUFFER_TOO_SMALL;
+        }
+
+        TPM_RC responseCode = _byteswap_ulong(((const TPM2_RESPONSE_HEADER*)recvBuffer)->responseCode);
+        if (responseCode != TPM_RC_SUCCESS) 
+        {
+            DbgError("ReadPublic - responseCode - 0x%08x.\n", responseCode);
+        }
+
+        switch (this->GetBaseResponseCode(responseCode)) {
+        case TPM_RC_SUCCESS:
+            // return data
+            break;
+        case TPM_RC_SEQUENCE:
+            // objectHandle references a sequence object
+            return STATUS_INVALID_PARAMETER;
+        case TPM_RC_HANDLE:
+            // objectHandle is not loaded or persistent
+            return STATUS_NOT_FOUND;
+        default:
+            return STATUS_DEVICE_BUSY;
+        }
+
+        //
+        // Walk the three sized fields, checking each size against what is left of the response.
+        //
+        uint32_t offset = sizeof(TPM2_RESPONSE_HEADER);
+        uint16_t* sizes[3] = { outPublicSize, nameSize, qualifiedNameSize };
+        const uint32_t capacities[3] = { PUBLIC_AREA_MAX_SIZE, sizeof(TPMU_NAME), sizeof(TPMU_NAME) };
+
+        for (uint32_t i = 0; i < ARRAYSIZE(sizes); i++)
+        {
+            if (recvBufferSize - offset < sizeof(uint16_t))
+            {
+                DbgError("ReadPublic - recvBufferSize %x too small for field %u.\n", recvBufferSize, i);
+                return STATUS_DEVICE_BUSY;
+            }
+
+            *sizes[i] = _byteswap_ushort(this->ReadUnaligned<uint16_t>(recvBuffer + offset));
+            offset += sizeof(uint16_t);
+
+            if (*sizes[i] > capacities[i] || *sizes[i] > recvBufferSize - offset)
+            {
+                DbgError("ReadPublic - field %u size error %x.\n", i, *sizes[i]);
+                return STATUS_DEVICE_BUSY;
+            }
+            offset += *sizes[i];
+        }
+
+        if (offset != recvBufferSize) 
+        {
+            DbgError("ReadPublic - recvBufferSize %x Error - outPublicSize %x, nameSize %x, qualifiedNameSize %x.\n", recvBufferSize, *outPublicSize, *nameSize, *qualifiedNameSize);
+            return STATUS_DEVICE_BUSY;
+        }
+
+        return STATUS_SUCCESS;
+    }
+
+    //
+    // Copies the Name and qualified Name out of a response checked by CheckReadPublicResponse.
+    //
+    void CopyReadPublicNames(
+        _In_ const uint8_t* recvBuffer,
+        _In_ uint16_t outPublicSize,
+        _In_ uint16_t nameSize,
+        _In_ uint16_t qualifiedNameSize,
+        _Out_ TPM2B_NAME* name,
+        _Out_ TPM2B_NAME* qualifiedName
+    )
+    {
+        const uint8_t* buffer = recvBuffer + sizeof(TPM2_RESPONSE_HEADER) + sizeof(uint16_t) + outPublicSize + sizeof(uint16_t);
+        memcpy(name->name, buffer, nameSize);
+        name->size = nameSize;
+
+        buffer += nameSize + sizeof(uint16_t);
+        memcpy(qualifiedName->name, buffer, qualifiedNameSize);
+        qualifiedName->size = qualifiedNameSize;
+    }
+
+    //
+    // Validates a TPM2_ReadPublic response and decodes the public area and Names.
+    //
+    // Parameters:
+    // - recvBuffer: Pointer to the raw response.
+    // - recvBufferSize: Size of the raw response.
+    // - outPublic: Pointer to a TPM2B_PUBLIC structure that will receive the public area of the object.
+    // - name: Pointer to a TPM2B_NAME structure that will receive the name of the object.
+    // - qualifiedName: Pointer to a TPM2B_NAME structure that will receive the qualified name of the object.
+    //
+    // Returns:
+    // - STATUS_SUCCESS: The response was decoded.
+    // - STATUS_BUFFER_TOO_SMALL: recvBuffer size was too small, or the key does not fit in a TPM2B_PUBLIC.
+    // - STATUS_INVALID_PARAMETER: The handle references a sequence object.
+    // - STATUS_NOT_FOUND: The handle does not reference a loaded or persistent object.
+    // - STATUS_DEVICE_BUSY: TPM device exception.
+    // - STATUS_NOT_SUPPORTED: The object type or one of its schemes is not supported.
+    //
+    NTSTATUS ParseReadPublicResponse(
+        _In_ const TPM2_READ_PUBLIC_RESPONSE* recvBuffer,
+        _In_ uint32_t recvBufferSize,
+        _Out_ TPM2B_PUBLIC* outPublic,
+        _Out_ TPM2B_NAME* name,
+        _Out_ TPM2B_NAME* qualifiedName
+    )
+    {
+        uint16_t outPublicSize = 0;
+        uint16_t nameSize = 0;
+        uint16_t qualifiedNameSize = 0;
+        NTSTATUS status = this->CheckReadPublicResponse((const uint8_t*)recvBuffer, recvBufferSize, &outPublicSize, &nameSize, &qualifiedNameSize);
+        if (NT_ERROR(status))
+        {
+            return status;
+        }
+
+        status = this->UnmarshalPublic((const uint8_t*)&recvBuffer->OutPublic, outPublic);
+        if (NT_ERROR(status))
+        {
+            return status;
+        }
+
+        this->CopyReadPublicNames((const uint8_t*)recvBuffer, outPublicSize, nameSize, qualifiedNameSize, name, qualifiedName);
+        return STATUS_SUCCESS;
+    }
+
+    //
+    // Validates a TPM2_ReadPublic response and decodes the public area into a TPM_COMPACT_PUBLIC.
+    //
+    // Parameters:
+    // - recvBuffer: Pointer to the raw response.
+    // - recvBufferSize: Size of the raw response.
+    // - compactPublic: Pointer to the buffer that receives the compact public area.
+    // - compactPublicSize: Size of the compact public area buffer, COMPACT_PUBLIC_MAX_SIZE fits any key.
+    // - name: Pointer to a TPM2B_NAME structure that will receive the name of the object.
+    // - qualifiedName: Pointer to a TPM2B_NAME structure that will receive the qualified name of the object.
+    //
+    // Returns:
+    // - STATUS_SUCCESS: The response was decoded.
+    // - Any status returned by CheckReadPublicResponse or UnmarshalCompactPublic.
+    //
+    NTSTATUS ParseReadPublicResponseCompact(
+        _In_reads_bytes_(recvBufferSize) const uint8_t* recvBuffer,
+        _In_ uint32_t recvBufferSize,
+        _Out_writes_bytes_(compactPublicSize) TPM_COMPACT_PUBLIC* compactPublic,
+        _In_ uint32_t compactPublicSize,
+        _Out_ TPM2B_NAME* name,
+        _Out_ TPM2B_NAME* qualifiedName
+    )
+    {
+        uint16_t outPublicSize = 0;
+        uint16_t nameSize = 0;
+        uint16_t qualifiedNameSize = 0;
+        NTSTATUS status = this->CheckReadPublicResponse(recvBuffer, recvBufferSize, &outPublicSize, &nameSize, &qualifiedNameSize);
+        if (NT_ERROR(status))
+        {
+            return status;
+        }
+
+        status = this->UnmarshalCompactPublic(
+            recvBuffer + sizeof(TPM2_RESPONSE_HEADER),
+            sizeof(uint16_t) + outPublicSize,
+            compactPublic,
+            compactPublicSize
+        );
+        if (NT_ERROR(status))
+        {
+            return status;
+        }
+
+        this->CopyReadPublicNames(recvBuffer, outPublicSize, nameSize, qualifiedNameSize, name, qualifiedName);
+        return STATUS_SUCCESS;
+    }
+
+    //
+    // Writes a parameterless response, used when the resource manager answers a command itself.
+    //
+    // Parameters:
+    // - responseCode: Response code to return.
+    // - outputParameterBlockSize: Pointer to the size of the output buffer, updated to the response size.
+    // - outputParameterBlock: Pointer to the buffer that receives the response.
+    //
+    // Returns:
+    // - STATUS_SUCCESS: The response was written.
+    // - STATUS_BUFFER_TOO_SMALL: The output buffer cannot hold a response header.
+    //
+    NTSTATUS WriteResponseHeader(
+        _In_ TPM_RC responseCode,
+        _Inout_ uint32_t* outputParameterBlockSize,
+        _Out_writes_bytes_(*outputParameterBlockSize) uint8_t* outputParameterBlock
+    )
+    {
+        if (*outputParameterBlockSize < sizeof(TPM2_RESPONSE_HEADER))
+        {
+            return STATUS_BUFFER_TOO_SMALL;
+        }
+
+        TPM2_RESPONSE_HEADER header;
+        header.tag = _byteswap_ushort(TPM_ST_NO_SESSIONS);
+        header.paramSize = _byteswap_ulong((uint32_t)sizeof(header));
+        header.responseCode = _byteswap_ulong(responseCode);
+        memcpy(outputParameterBlock, &header, sizeof(header));
+
+        *outputParameterBlockSize = sizeof(header);
+        return STATUS_SUCCESS;
+    }
+
+    //
+    // Reads the command attribute table and the number of loaded object slots from the TPM.
+    //
+    // Returns:
+    // - STATUS_SUCCESS: The resource manager is ready.
+    // - STATUS_INSUFFICIENT_RESOURCES: The context arena could not be allocated.
+    // - Any status returned by GetCapability.
+    //
+    NTSTATUS InitResourceManager()
+    {
+        uint32_t transientMin = 0;
+        if (NT_ERROR(this->GetTpmProperty(TPM_PT_HR_TRANSIENT_MIN, &transientMin)) || transientMin == 0)
+        {
+            transientMin = MAX_LOADED_OBJECTS;
+        }
+
+        TpmScratchScope scope(&this->scratch);
+        TPMS_CAPABILITY_DATA* capabilityData = this->scratch.Allocate<TPMS_CAPABILITY_DATA>();
+        if (!capabilityData)
+        {
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+        TPMI_YES_NO moreData = YES;
+        uint32_t property = TPM_CC_FIRST;
+
+        while (moreData == YES)
+        {
+            NTSTATUS status = this->GetCapability(TPM_CAP_COMMANDS, property, MAX_CAP_CC, &moreData, capabilityData);
+            if (NT_ERROR(status))
+            {
+                return status;
+            }
+
+            uint32_t count = capabilityData->data.command.count;
+            if (count == 0 || !this->resourceManager.AddCommandAttributes(capabilityData->data.command.commandAttributes, count))
+            {
+                break;
+            }
+
+            TPMA_CC* last = &capabilityData->data.command.commandAttributes[count - 1];
+            property = (last->commandIndex | (last->V ? CC_VEND : 0)) + 1;
+        }
+
+        if (!this->resourceManager.Init(transientMin))
+        {
+            DbgError("InitResourceManager - failed to allocate context arena.\n");
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        Dbg("Resource manager: %u loaded objects, %u virtual slots.\n", this->resourceManager.GetLoadedLimit(), RM_MAX_OBJECTS);
+        return STATUS_SUCCESS;
+    }
+
+    //
+    // Sizes the lookaside lists of caller buffers from TPM_PT_MAX_COMMAND_SIZE and TPM_PT_MAX_RESPONSE_SIZE.
+    // Limits the TPM does not report, or that exceed the transport buffer, fall back to its size.
+    //
+    // Returns:
+    // - STATUS_SUCCESS: The lists are ready.
+    // - Any status returned by TpmLookasideList::Init.
+    //
+    NTSTATUS InitBufferLists()
+    {
+        uint32_t maxCommandSize = 0;
+        if (NT_ERROR(this->GetTpmProperty(TPM_PT_MAX_COMMAND_SIZE, &maxCommandSize)) ||
+            maxCommandSize < sizeof(TPM2_COMMAND_HEADER) || maxCommandSize > TRANSPORT_STAGING_BUFFER_SIZE)
+        {
+            maxCommandSize = TRANSPORT_STAGING_BUFFER_SIZE;
+        }
+
+        uint32_t maxResponseSize = 0;
+        if (NT_ERROR(this->GetTpmProperty(TPM_PT_MAX_RESPONSE_SIZE, &maxResponseSize)) ||
+            maxResponseSize < sizeof(TPM2_RESPONSE_HEADER) || maxResponseSize > TRANSPORT_STAGING_BUFFER_SIZE)
+        {
+            maxResponseSize = TRANSPORT_STAGING_BUFFER_SIZE;
+        }
+
+        NTSTATUS status = this->commandBuffers.Init(maxCommandSize);
+        if (NT_SUCCESS(status))
+        {
+            status = this->responseBuffers.Init(maxResponseSize);
+        }
+        if (NT_SUCCESS(status))
+        {
+            status = this->objectBuffers.Init(COMPACT_PUBLIC_MAX_SIZE);
+        }
+
+        Dbg("Buffers: %u byte commands, %u byte responses.\n", maxCommandSize, maxResponseSize);
+        return status;
+    }
+
+    //
+    // Flushes a loaded object, session or sequence from the TPM.
+    //
+    // Parameters:
+    // - flushHandle: Physical handle to flush.
+    //
+    // Returns:
+    // - STATUS_SUCCESS: The handle was flushed.
+    // - STATUS_BUFFER_TOO_SMALL: recvBuffer size was too small.
+    // - STATUS_DEVICE_BUSY: TPM device exception.
+    //
+    NTSTATUS FlushContext(_In_ TPMI_DH_CONTEXT flushHandle)
+    {
+        TpmCommandWriter writer;
+        TpmResponseReader reader;
+
+        for (uint32_t attempt = 0; ; attempt++)
+        {
+            NTSTATUS status = this->BeginCommand(&writer);
+            if (NT_ERROR(status))
+            {
+                return status;
+            }
+
+            writer.WriteHeader(templates::FlushContext.Header);
+            writer.WriteUint32(flushHandle);
+
+            status = this->StartCommand(&writer);
+            if (NT_ERROR(status))
+            {
+                return status;
+            }
+
+            status = this->FinishCommand(&reader);
+            if (NT_ERROR(status))
+            {
+                return status;
+            }
+
+            if (!this->ShouldRetryCommand(&reader, attempt))
+            {
+                break;
+            }
+        }
+
+        TPM_RC responseCode = reader.ReadHeader();
+        this->ReleaseResponse();
+
+        if (!reader.IsValid()) 
+        {
+            DbgError("FlushContext - recvBufferSize Error - %x.\n", reader.GetSize());
+            return STATUS_BUFFER_TOO_SMALL;
+        }
+
+        if (responseCode != TPM_RC_SUCCESS) 
+        {
+            DbgError("FlushContext - responseCode - 0x%08x.\n", responseCode);
+            return STATUS_DEVICE_BUSY;
+        }
+
+        return STATUS_SUCCESS;
+    }
+
+    //
+    // Saves the context of a loaded virtual object to its arena block and flushes it from the TPM.
+    // Objects whose saved context is still valid are flushed without a new ContextSave.
+    //
+    // Parameters:
+    // - virtualHandle: Virtual handle of the object.
+    //
+    // Returns:
+    // - STATUS_SUCCESS: The object is swapped out.
+    // - STATUS_BUFFER_TOO_SMALL: recvBuffer size was too small.
+    // - STATUS_DEVICE_BUSY: TPM device exception.
+    //
+    NTSTATUS SwapOutObject(_In_ TPM_HANDLE virtualHandle)
+    {
+        TPM_HANDLE physicalHandle = this->resourceManager.GetPhysicalHandle(virtualHandle);
+        uint32_t contextSize = this->resourceManager.GetSavedContextSize(virtualHandle);
+
+        if (contextSize == 0)
+        {
+            TPM2_CONTEXT_SAVE_COMMAND sendBuffer = templates::ContextSave;
+            sendBuffer.SaveHandle = _byteswap_ulong(physicalHandle);
+
+            uint32_t sendBufferSize = (uint32_t)sizeof(sendBuffer);
+
+            //
+            // The response lands directly in the arena block.
+            //
+            TPM2_CONTEXT_SAVE_RESPONSE* recvBuffer = (TPM2_CONTEXT_SAVE_RESPONSE*)this->resourceManager.GetContextBlock(virtualHandle);
+
+            uint32_t recvBufferSize = RM_CONTEXT_BLOCK_SIZE;
+            NTSTATUS status = this->SubmitCommand(sendBufferSize, (uint8_t*)&sendBuffer, &recvBufferSize, (uint8_t*)recvBuffer);
+            if (NT_ERROR(status)) 
+            {
+                return status;
+            }
+
+            if (recvBufferSize <= sizeof(TPM2_RESPONSE_HEADER)) 
+            {
+                DbgError("ContextSave - recvBufferSize Error - %x.\n", recvBufferSize);
+                return STATUS_BUFFER_TOO_SMALL;
+            }
+
+            TPM_RC responseCode = _byteswap_ulong(recvBuffer->Header.responseCode);
+            if (responseCode != TPM_RC_SUCCESS) 
+            {
+                DbgError("ContextSave - responseCode - 0x%08x.\n", responseCode);
+                return STATUS_DEVICE_BUSY;
+            }
+
+            contextSize = recvBufferSize - sizeof(TPM2_RESPONSE_HEADER);
+        }
+
+        NTSTATUS status = this->FlushContext(physicalHandle);
+        if (NT_ERROR(status))
+        {
+            return status;
+        }
+
+        this->resourceManager.SetSwappedOut(virtualHandle, contextSize);
+        return STATUS_SUCCESS;
+    }
+
+    //
+    // Swaps out least recently used objects until another one can be loaded.
+    //
+    // Parameters:
+    // - pinned: Virtual handles used by the current command, which must stay loaded.
+    // - pinnedCount: Number of entries in pinned.
+    //
+    // Returns:
+    // - STATUS_SUCCESS: There is room for one more object.
+    // - STATUS_INSUFFICIENT_RESOURCES: Every loaded object is pinned.
+    // - Any status returned by SwapOutObject.
+    //
+    NTSTATUS MakeRoomForObject(
+        _In_reads_(pinnedCount) const TPM_HANDLE* pinned,
+        _In_ uint32_t pinnedCount
+    )
+    {
+        while (this->resourceManager.GetLoadedCount() >= this->resourceManager.GetLoadedLimit())
+        {
+            TPM_HANDLE victim = this->resourceManager.GetEvictionCandidate(pinned, pinnedCount);
+            if (victim == 0)
+            {
+                return STATUS_INSUFFICIENT_RESOURCES;
+            }
+
+            NTSTATUS status = this->SwapOutObject(victim);
+            if (NT_ERROR(status))
+            {
+                return status;
+            }
+        }
+        return STATUS_SUCCESS;
+    }
+
+    //
+    // Loads a swapped out virtual object back from its arena block.
+    //
+    // Parameters:
+    // - virtualHandle: Virtual handle of the object.
+    // - pinned: Virtual handles used by the current command, which must stay loaded.
+    // - pinnedCount: Number of entries in pinned.
+    //
+    // Returns:
+    // - STATUS_SUCCESS: The object is loaded.
+    // - STATUS_BUFFER_TOO_SMALL: recvBuffer size was too small.
+    // - STATUS_DEVICE_BUSY: TPM device exception.
+    // - Any status returned by MakeRoomForObject.
+    //
+    NTSTATUS SwapInObject(
+        _In_ TPM_HANDLE virtualHandle,
+        _In_reads_(pinnedCount) const TPM_HANDLE* pinned,
+        _In_ uint32_t pinnedCount
+    )
+    {
+        NTSTATUS status = this->MakeRoomForObject(pinned, pinnedCount);
+        if (NT_ERROR(status))
+        {
+            return status;
+        }
+
+        //
+        // The block holds the TPM2_CONTEXT_SAVE_RESPONSE; its TPMS_CONTEXT is marshalled straight
+        // behind a ContextLoad header.
+        //
+        const uint8_t* context = this->resourceManager.GetContextBlock(virtualHandle) + sizeof(TPM2_RESPONSE_HEADER);
+        uint32_t contextSize = this->resourceManager.GetSavedContextSize(virtualHandle);
+
+        TpmCommandWriter writer;
+        TpmResponseReader reader;
+
+        for (uint32_t attempt = 0; ; attempt++)
+        {
+            status = this->BeginCommand(&writer);
+            if (NT_ERROR(status))
+            {
+                return status;
+            }
+
+            writer.WriteHeader(templates::ContextLoadHeader);
+            writer.WriteBytes(context, contextSize);
+
+            status = this->StartCommand(&writer);
+            if (NT_ERROR(status))
+            {
+                return status;
+            }
+
+            status = this->FinishCommand(&reader);
+            if (NT_ERROR(status))
+            {
+                return status;
+            }
+
+            if (!this->ShouldRetryCommand(&reader, attempt))
+            {
+                break;
+            }
+        }
+
+        TPM_RC responseCode = reader.ReadHeader();
+        TPM_HANDLE loadedHandle = reader.ReadUint32();
+        this->ReleaseResponse();
+
+        if (reader.GetSize() < sizeof(TPM2_RESPONSE_HEADER)) 
+        {
+            DbgError("ContextLoad - recvBufferSize Error - %x.\n", reader.GetSize());
+            return STATUS_BUFFER_TOO_SMALL;
+        }
+
+        if (responseCode != TPM_RC_SUCCESS) 
+        {
+            DbgError("ContextLoad - responseCode - 0x%08x.\n", responseCode);
+            return STATUS_DEVICE_BUSY;
+        }
+
+        if (reader.GetSize() != sizeof(TPM2_CONTEXT_LOAD_RESPONSE)) 
+        {
+            DbgError("ContextLoad - recvBufferSize Error - %x.\n", reader.GetSize());
+            return STATUS_DEVICE_BUSY;
+        }
+
+        this->resourceManager.SetLoaded(virtualHandle, loadedHandle);
+        return STATUS_SUCCESS;
+    }
+
+    //
+    // Answers GetCapability(TPM_CAP_HANDLES) for the transient range with the virtual handles,
+    // since the physical ones would be meaningless to the caller.
+    //
+    // Parameters:
+    // - property: First handle to return.
+    // - propertyCount: Maximum number of handles to return.
+    // - outputParameterBlockSize: Pointer to the size of the output buffer, updated to the response size.
+    // - outputParameterBlock: Pointer to the buffer that receives the response.
+    //
+    // Returns:
+    // - STATUS_SUCCESS: The response was written.
+    // - STATUS_BUFFER_TOO_SMALL: The output buffer cannot hold the response.
+    //
+    NTSTATUS GetVirtualHandles(
+        _In_ TPM_HANDLE property,
+        _In_ uint32_t propertyCount,
+        _Inout_ uint32_t* outputParameterBlockSize,
+        _Out_writes_bytes_(*outputParameterBlockSize) uint8_t* outputParameterBlock
+    )
+    {
+        TPM_HANDLE handles[RM_MAX_OBJECTS] = { 0 };
+        bool more = false;
+        uint32_t count = this->resourceManager.ListHandles(property, handles, min(propertyCount, (uint32_t)RM_MAX_OBJECTS), &more);
+
+        uint32_t size = sizeof(TPM2_RESPONSE_HEADER) + sizeof(TPMI_YES_NO) + sizeof(TPM_CAP) + sizeof(uint32_t) + count * sizeof(TPM_HANDLE);
+        if (*outputParameterBlockSize < size)
+        {
+            return STATUS_BUFFER_TOO_SMALL;
+        }
+
+        uint8_t* buffer = outputParameterBlock;
+        this->WriteUnaligned<uint16_t>(buffer, _byteswap_ushort(TPM_ST_NO_SESSIONS));
+        buffer += sizeof(uint16_t);
+        this->WriteUnaligned<uint32_t>(buffer, _byteswap_ulong(size));
+        buffer += sizeof(uint32_t);
+        this->WriteUnaligned<uint32_t>(buffer, _byteswap_ulong(TPM_RC_SUCCESS));
+        buffer += sizeof(uint32_t);
+        *buffer = more ? YES : NO;
+        buffer += sizeof(TPMI_YES_NO);
+        this->WriteUnaligned<uint32_t>(buffer, _byteswap_ulong(TPM_CAP_HANDLES));
+        buffer += sizeof(uint32_t);
+        this->WriteUnaligned<uint32_t>(buffer, _byteswap_ulong(count));
+        buffer += sizeof(uint32_t);
+        for (uint32_t i = 0; i < count; i++)
+        {
+            this->WriteUnaligned<uint32_t>(buffer, _byteswap_ulong(handles[i]));
+            buffer += sizeof(uint32_t);
+        }
+
+        *outputParameterBlockSize = size;
+        return STATUS_SUCCESS;
+    }
+
+    //
+    // Sends TPM2_IncrementalSelfTest for a list of algorithms.
+    //
+    // Parameters:
+    // - toTest: Algorithms to test, in host byte order.
+    // - toDoList: Receives the algorithms the TPM still has to test, in host byte order.
+    //
+    // Returns:
+    // - STATUS_SUCCESS: The algorithms were tested or scheduled.
+    // - STATUS_BUFFER_TOO_SMALL: recvBuffer size was too small.
+    // - STATUS_NOT_SUPPORTED: The TPM rejected one of the algorithms or the command.
+    // - STATUS_DEVICE_BUSY: TPM device exception.
+    //
+    NTSTATUS IncrementalSelfTest(
+        _In_ const TPML_ALG* toTest,
+        _Out_ TPML_ALG* toDoList
+    )
+    {
+        //
+        // Construct command
+        //
+        TPM2_INCREMENTAL_SELF_TEST_COMMAND sendBuffer = { { 0 } };
+
+        sendBuffer.Header.tag = _byteswap_ushort(TPM_ST_NO_SESSIONS);
+        sendBuffer.Header.commandCode = _byteswap_ulong(TPM_CC_IncrementalSelfTest);
+
+        sendBuffer.ToTest.count = _byteswap_ulong(toTest->count);
+        for (uint32_t i = 0; i < toTest->count; i++)
+        {
+            sendBuffer.ToTest.algorithms[i] = _byteswap_ushort(toTest->algorithms[i]);
+        }
+
+        uint32_t sendBufferSize = (uint32_t)(sizeof(TPM2_COMMAND_HEADER) + sizeof(uint32_t) + toTest->count * sizeof(TPM_ALG_ID));
+        sendBuffer.Header.paramSize = _byteswap_ulong(sendBufferSize);
+
+        //
+        // send Tpm command
+        //
+        TPM2_INCREMENTAL_SELF_TEST_RESPONSE recvBuffer = { { 0 } };
+
+        uint32_t recvBufferSize = sizeof(recvBuffer);
+        NTSTATUS status = this->SubmitCommand(sendBufferSize, (uint8_t*)&sendBuffer, &recvBufferSize, (uint8_t*)&recvBuffer);
+        if (NT_ERROR(status)) 
+        {
+            return status;
+        }
+
+        if (recvBufferSize < sizeof(TPM2_RESPONSE_HEADER)) 
+        {
+            DbgError("IncrementalSelfTest - recvBufferSize Error - %x.\n", recvBufferSize);
+            return STATUS_BUFFER_TOO_SMALL;
+        }
+
+        TPM_RC responseCode = _byteswap_ulong(recvBuffer.Header.responseCode);
+        if (responseCode != TPM_RC_SUCCESS) 
+        {
+            DbgError("IncrementalSelfTest - responseCode - 0x%08x.\n", responseCode);
+        }
+
+        switch (this->GetBaseResponseCode(responseCode)) 
+        {
+        case TPM_RC_SUCCESS:
+            // return data
+            break;
+        case TPM_RC_VALUE:
+        case TPM_RC_COMMAND_CODE:
+            // an algorithm or the command itself is not implemented
+            return STATUS_NOT_SUPPORTED;
+        default:
+            return STATUS_DEVICE_BUSY;
+        }
+
+        uint32_t count = 0;
+        if (recvBufferSize >= sizeof(TPM2_RESPONSE_HEADER) + sizeof(uint32_t))
+        {
+            count = _byteswap_ulong(recvBuffer.ToDoList.count);
+        }
+        if (count > MAX_ALG_LIST_SIZE || recvBufferSize != sizeof(TPM2_RESPONSE_HEADER) + sizeof(uint32_t) + count * sizeof(TPM_ALG_ID)) 
+        {
+            DbgError("IncrementalSelfTest - toDoList.count error %x.\n", count);
+            return STATUS_DEVICE_BUSY;
+        }
+
+        toDoList->count = count;
+        for (uint32_t i = 0; i < count; i++)
+        {
+            toDoList->algorithms[i] = _byteswap_ushort(recvBuffer.ToDoList.algorithms[i]);
+        }
+        return STATUS_SUCCESS;
+    }
+
+public:
+
+	~TpmEngine()
+	{
+		delete this->ptpInterface;
+	}
+
+    //
+    // Takes ownership of an initialized TpmPtp and sets up the transport from it.
+    //
+    // Parameters:
+    // - ptpInterface: Initialized PTP interface, deleted with the engine.
+    // - tpmBaseAddress: TPM register base address.
+    //
+    // Returns:
+    // - true: The engine is ready.
+    // - false: The transport could not be set up.
+    //
+    bool Init(
+        _In_ TpmPtp* ptpInterface,
+        _In_ uintptr_t tpmBaseAddress
+    )
+    {
+        this->ptpInterface = ptpInterface;
+        if (!this->transport.Init(ptpInterface, tpmBaseAddress, &this->commandTrace))
+        {
+            return false;
+        }
+
+        if (!this->scratch.Init(SCRATCH_ARENA_SIZE) || !this->responseCache.Init() || !this->commandStatistics.Init())
+        {
+            return false;
+        }
+        return NT_SUCCESS(this->InitBufferLists());
+    }
+
+    //
+    // Returns a buffer that holds any command the TPM accepts, or nullptr. Release it with FreeCommandBuffer.
+    //
+    // Parameters:
+    // - size: Receives the size of the buffer.
+    //
+    uint8_t* AllocateCommandBuffer(_Out_ uint32_t* size)
+    {
+        *size = this->commandBuffers.GetSize();
+        return this->commandBuffers.Allocate();
+    }
+
+    void FreeCommandBuffer(_In_opt_ uint8_t* buffer)
+    {
+        this->commandBuffers.Free(buffer);
+    }
+
+    //
+    // Returns a buffer that holds any response the TPM sends, or nullptr. Release it with FreeResponseBuffer.
+    //
+    // Parameters:
+    // - size: Receives the size of the buffer.
+    //
+    uint8_t* AllocateResponseBuffer(_Out_ uint32_t* size)
+    {
+        *size = this->responseBuffers.GetSize();
+        return this->responseBuffers.Allocate();
+    }
+
+    void FreeResponseBuffer(_In_opt_ uint8_t* buffer)
+    {
+        this->responseBuffers.Free(buffer);
+    }
+
+    //
+    // Returns a COMPACT_PUBLIC_MAX_SIZE buffer for a compact public area, or nullptr. Release it
+    // with FreeCompactPublic.
+    //
+    TPM_COMPACT_PUBLIC* AllocateCompactPublic()
+    {
+        return (TPM_COMPACT_PUBLIC*)this->objectBuffers.Allocate();
+    }
+
+    void FreeCompactPublic(_In_opt_ TPM_COMPACT_PUBLIC* compactPublic)
+    {
+        this->objectBuffers.Free((uint8_t*)compactPublic);
+    }
+
+    //
+    // Reads the response cache hit/miss counters.
+    //
+    // Parameters:
+    // - statistics: Pointer to a structure that receives the counters.
+    //
+    void GetResponseCacheStatistics(_Out_ TPM_RESPONSE_CACHE_STATISTICS* statistics)
+    {
+        this->responseCache.GetStatistics(statistics);
+    }
+
+    //
+    // Reads the number of commands resubmitted after a retryable warning.
+    //
+    // Parameters:
+    // - statistics: Pointer to a structure that receives the counters.
+    //
+    void GetRetryStatistics(_Out_ TPM_RETRY_STATISTICS* statistics)
+    {
+        this->retryPolicy.GetStatistics(statistics);
+    }
+
+    //
+    // Drops every cached response and zeroes the counters.
+    //
+    void ResetResponseCache()
+    {
+        this->responseCache.Invalidate();
+        this->responseCache.ResetStatistics();
+    }
+
+    //
+    // Reads the phase latency histograms and MMIO counts of a command code. Commands answered from
+    // the response cache are not included.
+    //
+    // Parameters:
+    // - commandCode: Command code, or 0 for the codes outside TPM_CC_FIRST..TPM_CC_LAST.
+    // - statistics: Pointer to a structure that receives the statistics.
+    //
+    // Returns:
+    // - STATUS_SUCCESS: statistics holds at least one command.
+    // - STATUS_NOT_FOUND: No command with that code was sent since the last reset.
+    //
+    NTSTATUS GetCommandStatistics(
+        _In_ TPM_CC commandCode,
+        _Out_ TPM_COMMAND_STATISTICS* statistics
+    )
+    {
+        return this->commandStatistics.Get(commandCode, statistics);
+    }
+
+    //
+    // Zeroes the statistics of every command code.
+    //
+    void ResetCommandStatistics()
+    {
+        this->commandStatistics.Reset();
+    }
+
+    //
+    // Returns the transport, for the benchmark to change how it maps the TPM between commands.
+    //
+    Transport* GetTransport()
+    {
+        return &this->transport;
+    }
+
+    //
+    // Charges time spent waiting in a command queue to the next command sent to the TPM.
+    //
+    // Parameters:
+    // - ticks: Performance counter ticks, or 0 to discard a charge no command consumed.
+    //
+    void SetQueueTime(_In_ uint64_t ticks)
+    {
+        this->queueTime = ticks;
+    }
+
+    //
+    // Queries the TPM for a capability, decoded by ParseGetCapabilityResponse.
+    //
+    // Parameters:
+    // - capability: Group selection (TPM_CAP_*).
+    // - property: First property of the group to return.
+    // - propertyCount: Maximum number of properties to return.
+    // - moreData: Pointer that receives YES if the TPM has more values than were returned.
+    // - capabilityData: Pointer to a TPMS_CAPABILITY_DATA structure that receives the values.
+    //
+    // Returns:
+    // - STATUS_SUCCESS: The capability was read.
+    // - STATUS_BUFFER_TOO_SMALL: recvBuffer size was too small.
+    // - STATUS_NOT_SUPPORTED: Decoding of this capability is not supported.
+    // - STATUS_DEVICE_BUSY: TPM device exception.
+    //
+    NTSTATUS GetCapability(
+        _In_ TPM_CAP capability,
+        _In_ uint32_t property,
+        _In_ uint32_t propertyCount,
+        _Out_ TPMI_YES_NO* moreData,
+        _Out_ TPMS_CAPABILITY_DATA* capabilityData
+    )
+    {
+        //
+        // Construct command
+        //
+        TPM2_GET_CAPABILITY_COMMAND sendBuffer = templates::GetCapability;
+        sendBuffer.Capability = _byteswap_ulong(capability);
+        sendBuffer.Property = _byteswap_ulong(property);
+        sendBuffer.PropertyCount = _byteswap_ulong(propertyCount);
+
+        uint32_t sendBufferSize = (uint32_t)sizeof(sendBuffer);
+
+        //
+        // send Tpm command
+        //
+        TpmScratchScope scope(&this->scratch);
+        TPM2_GET_CAPABILITY_RESPONSE* recvBuffer = this->scratch.Allocate<TPM2_GET_CAPABILITY_RESPONSE>();
+        if (!recvBuffer)
+        {
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        uint32_t recvBufferSize = sizeof(*recvBuffer);
+        NTSTATUS status = this->SubmitCommand(sendBufferSize, (uint8_t*)&sendBuffer, &recvBufferSize, (uint8_t*)recvBuffer);
+        if (NT_ERROR(status)) 
+        {
+            return status;
+        }
+
+        return this->ParseGetCapabilityResponse(recvBuffer, recvBufferSize, moreData, capabilityData);
+    }
+
+    //
+    // Reads a single TPM_PT property value.
+    //
+    // Parameters:
+    // - property: Property to read (TPM_PT_*).
+    // - value: Pointer that receives the property value.
+    //
+    // Returns:
+    // - STATUS_SUCCESS: The property was read.
+    // - STATUS_NOT_FOUND: The TPM does not report this property.
+    // - Any status returned by GetCapability.
+    //
+    NTSTATUS GetTpmProperty(
+        _In_ TPM_PT property,
+        _Out_ uint32_t* value
+    )
+    {
+        TPMI_YES_NO moreData = NO;
+        TpmScratchScope scope(&this->scratch);
+        TPMS_CAPABILITY_DATA* capabilityData = this->scratch.Allocate<TPMS_CAPABILITY_DATA>();
+        if (!capabilityData)
+        {
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        NTSTATUS status = this->GetCapability(TPM_CAP_TPM_PROPERTIES, property, 1, &moreData, capabilityData);
+        if (NT_ERROR(status))
+        {
+            return status;
+        }
+
+        if (capabilityData->data.tpmProperties.count == 0 ||
+            capabilityData->data.tpmProperties.tpmProperty[0].property != property)
+        {
+            return STATUS_NOT_FOUND;
+        }
+
+        *value = capabilityData->data.tpmProperties.tpmProperty[0].value;
+        return STATUS_SUCCESS;
+    }
+
+    //
+    // Reads PCR values.
+    //
+    // Parameters:
+    // - pcrSelectionIn: PCRs to read, in host byte order.
+    // - pcrUpdateCounter: Receives the PCR update counter.
+    // - pcrSelectionOut: Receives the PCRs the values were read from; the TPM may return fewer.
+    // - pcrValues: Receives the PCR values.
+    //
+    // Returns:
+    // - STATUS_SUCCESS: The values were read.
+    // - STATUS_INVALID_PARAMETER: pcrSelectionIn has more banks or select bytes than a TPML_PCR_SELECTION holds.
+    // - Any status returned by SubmitCommand or ParsePcrReadResponse.
+    //
+    NTSTATUS PcrRead(
+        _In_ const TPML_PCR_SELECTION* pcrSelectionIn,
+        _Out_ uint32_t* pcrUpdateCounter,
+        _Out_ TPML_PCR_SELECTION* pcrSelectionOut,
+        _Out_ TPML_DIGEST* pcrValues
+    )
+    {
+        if (pcrSelectionIn->count > HASH_COUNT)
+        {
+            return STATUS_INVALID_PARAMETER;
+        }
+
+        //
+        // Construct command
+        //
+        uint8_t sendBuffer[sizeof(TPM2_COMMAND_HEADER) + sizeof(TPML_PCR_SELECTION)];
+        uint8_t* buffer = sendBuffer + sizeof(TPM2_COMMAND_HEADER);
+        this->WriteUnaligned<uint32_t>(buffer, _byteswap_ulong(pcrSelectionIn->count));
+        buffer += sizeof(uint32_t);
+        for (uint32_t i = 0; i < pcrSelectionIn->count; i++)
+        {
+            const TPMS_PCR_SELECTION* bank = &pcrSelectionIn->pcrSelections[i];
+            if (bank->sizeofSelect > PCR_SELECT_MAX)
+            {
+                return STATUS_INVALID_PARAMETER;
+            }
+            this->WriteUnaligned<uint16_t>(buffer, _byteswap_ushort(bank->hash));
+            buffer += sizeof(uint16_t);
+            *buffer++ = bank->sizeofSelect;
+            memcpy(buffer, bank->pcrSelect, bank->sizeofSelect);
+            buffer += bank->sizeofSelect;
+        }
+
+        uint32_t sendBufferSize = (uint32_t)(buffer - sendBuffer);
+        TPM2_COMMAND_HEADER header;
+        header.tag = _byteswap_ushort(TPM_ST_NO_SESSIONS);
+        header.paramSize = _byteswap_ulong(sendBufferSize);
+        header.commandCode = _byteswap_ulong(TPM_CC_PCR_Read);
+        memcpy(sendBuffer, &header, sizeof(header));
+
+        //
+        // send Tpm command
+        //
+        TpmScratchScope scope(&this->scratch);
+        uint8_t* recvBuffer = (uint8_t*)this->scratch.Allocate(PCR_READ_RESPONSE_MAX_SIZE);
+        if (!recvBuffer)
+        {
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        uint32_t recvBufferSize = PCR_READ_RESPONSE_MAX_SIZE;
+        NTSTATUS status = this->SubmitCommand(sendBufferSize, sendBuffer, &recvBufferSize, recvBuffer);
+        if (NT_ERROR(status))
+        {
+            return status;
+        }
+
+        return this->ParsePcrReadResponse(recvBuffer, recvBufferSize, pcrUpdateCounter, pcrSelectionOut, pcrValues);
+    }
+
+    //
+    // Reads the public area and Name of an NV index.
+    //
+    // Parameters:
+    // - nvIndex: NV index to query.
+    // - nvPublic: Pointer to a TPM2B_NV_PUBLIC structure that receives the public area in host byte order.
+    // - nvName: Pointer to a TPM2B_NAME structure that receives the Name of the index.
+    //
+    // Returns:
+    // - STATUS_SUCCESS: The public area was read.
+    // - STATUS_BUFFER_TOO_SMALL: recvBuffer size was too small.
+    // - STATUS_NOT_FOUND: The NV index is not defined.
+    // - STATUS_DEVICE_BUSY: TPM device exception.
+    //
+    NTSTATUS NvReadPublic(
+        _In_ TPMI_RH_NV_INDEX nvIndex,
+        _Out_ TPM2B_NV_PUBLIC* nvPublic,
+        _Out_ TPM2B_NAME* nvName
+    )
+    {
+        //
+        // Construct command
+        //
+        TPM2_NV_READPUBLIC_COMMAND sendBuffer = templates::NvReadPublic;
+        sendBuffer.NvIndex = _byteswap_ulong(nvIndex);
+
+        uint32_t sendBufferSize = (uint32_t)sizeof(sendBuffer);
+
+        //
+        // send Tpm command
+        //
+        TPM2_NV_READPUBLIC_RESPONSE recvBuffer = { { 0 } };
+
+        uint32_t recvBufferSize = sizeof(recvBuffer);
+        NTSTATUS status = this->SubmitCommand(sendBufferSize, (uint8_t*)&sendBuffer, &recvBufferSize, (uint8_t*)&recvBuffer);
+        if (NT_ERROR(status)) 
+        {
+            return status;
+        }
+
+        if (recvBufferSize < sizeof(TPM2_RESPONSE_HEADER)) 
+        {
+            DbgError("NvReadPublic - recvBufferSize Error - %x.\n", recvBufferSize);
+            return STATUS_BUFFER_TOO_SMALL;
+        }
+
+        TPM_RC responseCode = _byteswap_ulong(recvBuffer.Header.responseCode);
+        if (responseCode != TPM_RC_SUCCESS) 
+        {
+            DbgError("NvReadPublic - responseCode - 0x%08x.\n", responseCode);
+        }
+
+        switch (this->GetBaseResponseCode(responseCode)) 
+        {
+        case TPM_RC_SUCCESS:
+            // return data
+            break;
+        case TPM_RC_HANDLE:
+            // nvIndex is not defined
+            return STATUS_NOT_FOUND;
+        default:
+            return STATUS_DEVICE_BUSY;
+        }
+
+        //
+        // Basic check
+        //
+        uint16_t nvPublicSize = _byteswap_ushort(recvBuffer.NvPublic.size);
+        if (nvPublicSize > sizeof(TPMS_NV_PUBLIC) || 
+            recvBufferSize < sizeof(TPM2_RESPONSE_HEADER) + sizeof(uint16_t) + nvPublicSize + sizeof(uint16_t)) 
+        {
+            DbgError("NvReadPublic - nvPublicSize error %x.\n", nvPublicSize);
+            return STATUS_DEVICE_BUSY;
+        }
+
+        uint16_t nvNameSize = _byteswap_ushort(
+            this->ReadUnaligned<uint16_t>(
+                (uint8_t*)&recvBuffer + sizeof(TPM2_RESPONSE_HEADER) + sizeof(uint16_t) + nvPublicSize
+            )
+        );
+        if (nvNameSize > sizeof(TPMU_NAME)) 
+        {
+            DbgError("NvReadPublic - nvNameSize error %x.\n", nvNameSize);
+            return STATUS_DEVICE_BUSY;
+        }
+
+        if (recvBufferSize != sizeof(TPM2_RESPONSE_HEADER) + sizeof(uint16_t) + nvPublicSize + sizeof(uint16_t) + nvNameSize) 
+        {
+            DbgError("NvReadPublic - recvBufferSize %x Error - nvPublicSize %x, nvNameSize %x.\n", recvBufferSize, nvPublicSize, nvNameSize);
+            return STATUS_DEVICE_BUSY;
+        }
+
+        //
+        // Return the response
+        //
+        uint8_t* buffer = (uint8_t*)&recvBuffer.NvPublic.nvPublic;
+        nvPublic->size = nvPublicSize;
+        nvPublic->nvPublic.nvIndex = _byteswap_ulong(this->ReadUnaligned<uint32_t>(buffer));
+        buffer += sizeof(uint32_t);
+        nvPublic->nvPublic.nameAlg = _byteswap_ushort(this->ReadUnaligned<uint16_t>(buffer));
+        buffer += sizeof(uint16_t);
+        this->WriteUnaligned<uint32_t>(&nvPublic->nvPublic.attributes, _byteswap_ulong(this->ReadUnaligned<uint32_t>(buffer)));
+        buffer += sizeof(uint32_t);
+
+        nvPublic->nvPublic.authPolicy.size = _byteswap_ushort(this->ReadUnaligned<uint16_t>(buffer));
+        buffer += sizeof(uint16_t);
+        if (nvPublic->nvPublic.authPolicy.size > sizeof(TPMU_HA)) 
+        {
+            DbgError("NvReadPublic - authPolicy.size error %x.\n", nvPublic->nvPublic.authPolicy.size);
+            return STATUS_DEVICE_BUSY;
+        }
+
+        memcpy(nvPublic->nvPublic.authPolicy.buffer, buffer, nvPublic->nvPublic.authPolicy.size);
+        buffer += nvPublic->nvPublic.authPolicy.size;
+
+        nvPublic->nvPublic.dataSize = _byteswap_ushort(this->ReadUnaligned<uint16_t>(buffer));
+        buffer += sizeof(uint16_t);
+
+        if (buffer != (uint8_t*)&recvBuffer.NvPublic.nvPublic + nvPublicSize)
+        {
+            DbgError("NvReadPublic - nvPublic layout error.\n");
+            return STATUS_DEVICE_BUSY;
+        }
+
+        buffer += sizeof(uint16_t);
+        memcpy(nvName->name, buffer, nvNameSize);
+        nvName->size = nvNameSize;
+
+        return STATUS_SUCCESS;
+    }
+
+    //
+    // Reads a range of an NV index in chunks of TPM_PT_NV_BUFFER_MAX.
+    //
+    // The reads are pipelined: as soon as the response for chunk N is out of the TPM, the command
+    // for chunk N+1 is started, and chunk N is validated and copied while the TPM executes it.
+    //
+    // Parameters:
+    // - authHandle: Handle used to authorize the read (the index itself or a hierarchy), with an empty password.
+    // - nvIndex: NV index to read from.
+    // - offset: Offset into the NV index to start reading at.
+    // - data: Pointer to the buffer that receives the data.
+    // - dataSize: Pointer to a variable that on input specifies how many bytes to read,
+    //             and on output reflects the number of bytes actually read.
+    //
+    // Returns:
+    // - STATUS_SUCCESS: The range was read.
+    // - STATUS_INVALID_PARAMETER: One or more of the parameters are invalid.
+    // - STATUS_ACCESS_DENIED: The NV index could not be read with the supplied authorization.
+    // - STATUS_BUFFER_TOO_SMALL: recvBuffer size was too small.
+    // - STATUS_DEVICE_BUSY: TPM device exception.
+    //
+    NTSTATUS NvRead(
+        _In_ TPMI_RH_NV_AUTH authHandle,
+        _In_ TPMI_RH_NV_INDEX nvIndex,
+        _In_ uint16_t offset,
+        _Out_writes_bytes_(*dataSize) uint8_t* data,
+        _Inout_ uint32_t* dataSize
+    )
+    {
+        if (data == nullptr || dataSize == nullptr)
+        {
+            return STATUS_INVALID_PARAMETER;
+        }
+
+        uint32_t total = *dataSize;
+        *dataSize = 0;
+        if ((uint32_t)offset + total > 0x10000)
+        {
+            return STATUS_INVALID_PARAMETER;
+        }
+        if (total == 0)
+        {
+            return STATUS_SUCCESS;
+        }
+
+        NTSTATUS status = STATUS_SUCCESS;
+        if (this->nvBufferMax == 0)
+        {
+            status = this->GetTpmProperty(TPM_PT_NV_BUFFER_MAX, &this->nvBufferMax);
+            if (NT_ERROR(status) || this->nvBufferMax == 0)
+            {
+                DbgError("NvRead - failed to read TPM_PT_NV_BUFFER_MAX.\n");
+                this->nvBufferMax = 0;
+                return NT_ERROR(status) ? status : STATUS_DEVICE_BUSY;
+            }
+        }
+
+        TPM2_NV_READ_COMMAND sendBuffer = { { 0 } };
+        TpmScratchScope scope(&this->scratch);
+        TPM2_NV_READ_RESPONSE* recvBuffer = this->scratch.Allocate<TPM2_NV_READ_RESPONSE>();
+        if (!recvBuffer)
+        {
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+        uint32_t chunkMax = min(this->nvBufferMax, (uint32_t)sizeof(recvBuffer->Data.buffer));
+
+        //
+        // Start chunk 0.
+        //
+        uint32_t done = 0;
+        uint16_t chunk = (uint16_t)min(chunkMax, total);
+        uint32_t sendBufferSize = this->BuildNvReadCommand(authHandle, nvIndex, chunk, offset, &sendBuffer);
+        status = this->StartCommand(sendBufferSize, (uint8_t*)&sendBuffer);
+        if (NT_ERROR(status))
+        {
+            return status;
+        }
+
+        uint32_t attempt = 0;
+        while (true)
+        {
+            uint32_t recvBufferSize = sizeof(*recvBuffer);
+            status = this->FinishCommand(&recvBufferSize, (uint8_t*)recvBuffer);
+            if (NT_ERROR(status))
+            {
+                return status;
+            }
+
+            //
+            // Nothing else is in flight yet and sendBuffer still holds chunk N, so a warning
+            // can be retried in place.
+            //
+            if (this->ShouldRetryCommand(recvBufferSize, (uint8_t*)recvBuffer, attempt++))
+            {
+                status = this->StartCommand(sendBufferSize, (uint8_t*)&sendBuffer);
+                if (NT_ERROR(status))
+                {
+                    *dataSize = done;
+                    return status;
+                }
+                continue;
+            }
+            attempt = 0;
+
+            uint32_t chunkOffset = done;
+            uint16_t chunkSize = chunk;
+            done += chunkSize;
+
+            //
+            // Start chunk N+1 before touching chunk N, so the TPM is busy while we decode.
+            //
+            bool more = done < total;
+            if (more)
+            {
+                chunk = (uint16_t)min(chunkMax, total - done);
+                sendBufferSize = this->BuildNvReadCommand(authHandle, nvIndex, chunk, (uint16_t)(offset + done), &sendBuffer);
+                status = this->StartCommand(sendBufferSize, (uint8_t*)&sendBuffer);
+                if (NT_ERROR(status))
+                {
+                    more = false;
+                }
+            }
+
+            NTSTATUS parseStatus = this->ParseNvReadResponse(recvBuffer, recvBufferSize, data + chunkOffset, chunkSize);
+            if (NT_ERROR(parseStatus))
+            {
+                if (more)
+                {
+                    //
+                    // Drain the chunk that is still executing so the TPM is left idle.
+                    //
+                    recvBufferSize = sizeof(*recvBuffer);
+                    (void)this->FinishCommand(&recvBufferSize, (uint8_t*)recvBuffer);
+                }
+                *dataSize = chunkOffset;
+                return parseStatus;
+            }
+
+            if (NT_ERROR(status))
+            {
+                *dataSize = done;
+                return status;
+            }
+
+            if (!more)
+            {
+                break;
+            }
+        }
+
+        *dataSize = done;
+        return STATUS_SUCCESS;
+    }
+    
+    //
+    // Reads the public area of a TPM object.
+    //
+    // This function retrieves the public area of a TPM object specified by its handle.
+    // It constructs the command to send to the TPM, sends the command, receives the response,
+    // and extracts the public area, the name, and the qualified name of the object.
+    //
+    // Parameters:
+    // - objectHandle: Handle to the TPM object whose public area is to be read.
+    // - outPublic: Pointer to a TPM2B_PUBLIC structure that will receive the public area of the object.
+    // - name: Pointer to a TPM2B_NAME structure that will receive the name of the object.
+    // - qualifiedName: Pointer to a TPM2B_NAME structure that will receive the qualified name of the object.
+    //
+    // Returns:
+    // - STATUS_SUCCESS: The public area was successfully read.
+    // - STATUS_UNSUCCESSFUL: An error occurred while reading the public area.
+    // - STATUS_BUFFER_TOO_SMALL: recvBuffer size was too small, or the key needs ReadPublicCompact.
+    // - STATUS_INVALID_PARAMETER: One or more of the parameters are invalid.
+    // - STATUS_DEVICE_BUSY: TPM device exception.
+    // - STATUS_NOT_SUPPORTED: Read operation not supported.
+    //
+    NTSTATUS ReadPublic(
+        _In_ TPMI_DH_OBJECT objectHandle,
+        _Out_ TPM2B_PUBLIC* outPublic,
+        _Out_ TPM2B_NAME* name,
+        _Out_ TPM2B_NAME* qualifiedName
+    )
+    {
+        //
+        // Construct command
+        //
+        TPM2_READ_PUBLIC_COMMAND sendBuffer = { { 0 } };
+        uint32_t sendBufferSize = this->BuildReadPublicCommand(objectHandle, &sendBuffer);
+
+        //
+        // send Tpm command
+        //
+        TPM2_READ_PUBLIC_RESPONSE recvBuffer = { { 0 } };
+
+        uint32_t recvBufferSize = sizeof(recvBuffer);
+        NTSTATUS status = this->SubmitCommand(sendBufferSize, (uint8_t*)&sendBuffer, &recvBufferSize, (uint8_t*)&recvBuffer);
+        if (NT_ERROR(status)) 
+        {
+            return status;
+        }
+
+        return this->ParseReadPublicResponse(&recvBuffer, recvBufferSize, outPublic, name, qualifiedName);
+    }
+
+    //
+    // Reads the public area of an object into a TPM_COMPACT_PUBLIC. Unlike ReadPublic this also
+    // handles 3072/4096-bit RSA and P-384/P-521 keys.
+    //
+    // Parameters:
+    // - objectHandle: Handle to the TPM object whose public area is to be read.
+    // - compactPublic: Pointer to the buffer that receives the compact public area.
+    // - compactPublicSize: Size of the compact public area buffer, COMPACT_PUBLIC_MAX_SIZE fits any key.
+    // - name: Pointer to a TPM2B_NAME structure that will receive the name of the object.
+    // - qualifiedName: Pointer to a TPM2B_NAME structure that will receive the qualified name of the object.
+    //
+    // Returns:
+    // - STATUS_SUCCESS: The public area was successfully read.
+    // - Any status returned by SubmitCommand, CheckReadPublicResponse or UnmarshalCompactPublic.
+    //
+    NTSTATUS ReadPublicCompact(
+        _In_ TPMI_DH_OBJECT objectHandle,
+        _Out_writes_bytes_(compactPublicSize) TPM_COMPACT_PUBLIC* compactPublic,
+        _In_ uint32_t compactPublicSize,
+        _Out_ TPM2B_NAME* name,
+        _Out_ TPM2B_NAME* qualifiedName
+    )
+    {
+        TPM2_READ_PUBLIC_COMMAND sendBuffer = { { 0 } };
+        uint32_t sendBufferSize = this->BuildReadPublicCommand(objectHandle, &sendBuffer);
+
+        TpmScratchScope scope(&this->scratch);
+        uint8_t* recvBuffer = (uint8_t*)this->scratch.Allocate(READ_PUBLIC_RESPONSE_MAX_SIZE);
+        if (!recvBuffer)
+        {
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        uint32_t recvBufferSize = READ_PUBLIC_RESPONSE_MAX_SIZE;
+        NTSTATUS status = this->SubmitCommand(sendBufferSize, (uint8_t*)&sendBuffer, &recvBufferSize, recvBuffer);
+        if (NT_ERROR(status)) 
+        {
+            return status;
+        }
+
+        return this->ParseReadPublicResponseCompact(recvBuffer, recvBufferSize, compactPublic, compactPublicSize, name, qualifiedName);
+    }
+
+    //
+    // Enumerates every persistent object (TPM_HT_PERSISTENT) and reads its public area, Name and
+    // qualified Name into a compact inventory.
+    //
+    // The ReadPublic commands are pipelined: as soon as the response for object N is out of the TPM,
+    // the command for object N+1 is started, and object N is validated and stored while the TPM
+    // executes it. Objects that disappear or fail to decode in between are skipped.
+    //
+    // Parameters:
+    // - inventory: Pointer to the inventory that receives the objects. Previous contents are dropped.
+    //
+    // Returns:
+    // - STATUS_SUCCESS: The inventory was filled.
+    // - STATUS_INSUFFICIENT_RESOURCES: The inventory arena could not be allocated.
+    // - Any status returned by GetCapability, StartCommand or FinishCommand.
+    //
+    NTSTATUS ReadPersistentObjects(_Out_ TpmObjectInventory* inventory)
+    {
+        inventory->Clear();
+
+        TpmScratchScope scope(&this->scratch);
+        TPML_HANDLE* handleList = this->scratch.Allocate<TPML_HANDLE>();
+        TPMS_CAPABILITY_DATA* capabilityData = this->scratch.Allocate<TPMS_CAPABILITY_DATA>();
+        if (!handleList || !capabilityData)
+        {
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        //
+        // Collect the handles first, so the arena can be sized in one go.
+        //
+        TPML_HANDLE& handles = *handleList;
+        handles.count = 0;
+        TPMI_YES_NO moreData = YES;
+        uint32_t property = PERSISTENT_FIRST;
+
+        while (moreData == YES && handles.count < MAX_CAP_HANDLES)
+        {
+            NTSTATUS status = this->GetCapability(TPM_CAP_HANDLES, property, MAX_CAP_HANDLES - handles.count, &moreData, capabilityData);
+            if (NT_ERROR(status))
+            {
+                return status;
+            }
+
+            uint32_t count = capabilityData->data.handles.count;
+            if (count == 0)
+            {
+                break;
+            }
+
+            memcpy(&handles.handle[handles.count], capabilityData->data.handles.handle, count * sizeof(TPM_HANDLE));
+            handles.count += count;
+            property = capabilityData->data.handles.handle[count - 1] + 1;
+        }
+
+        if (handles.count == 0)
+        {
+            return STATUS_SUCCESS;
+        }
+
+        if (!inventory->Reserve(handles.count))
+        {
+            DbgError("ReadPersistentObjects - failed to allocate inventory for %u objects.\n", handles.count);
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        //
+        // Responses are received into a buffer sized for the largest keys, and each public area is
+        // test-decoded into a compact scratch copy before its marshalled form is stored.
+        //
+        TPM_COMPACT_PUBLIC* compactPublic = (TPM_COMPACT_PUBLIC*)this->scratch.Allocate(COMPACT_PUBLIC_MAX_SIZE);
+        uint8_t* recvBuffer = (uint8_t*)this->scratch.Allocate(READ_PUBLIC_RESPONSE_MAX_SIZE);
+        if (!compactPublic || !recvBuffer)
+        {
+            inventory->Clear();
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        TPM2_READ_PUBLIC_COMMAND sendBuffer = { { 0 } };
+
+        //
+        // Start object 0.
+        //
+        uint32_t sendBufferSize = this->BuildReadPublicCommand(handles.handle[0], &sendBuffer);
+        NTSTATUS status = this->StartCommand(sendBufferSize, (uint8_t*)&sendBuffer);
+        if (NT_ERROR(status))
+        {
+            return status;
+        }
+
+        uint32_t attempt = 0;
+        uint32_t i = 0;
+        while (true)
+        {
+            uint32_t recvBufferSize = READ_PUBLIC_RESPONSE_MAX_SIZE;
+            status = this->FinishCommand(&recvBufferSize, recvBuffer);
+            if (NT_ERROR(status))
+            {
+                break;
+            }
+
+            //
+            // Nothing else is in flight yet and sendBuffer still holds object i, so a warning
+            // can be retried in place. The retry policy bounds the attempts.
+            //
+            if (this->ShouldRetryCommand(recvBufferSize, recvBuffer, attempt++))
+            {
+                status = this->StartCommand(sendBufferSize, (uint8_t*)&sendBuffer);
+                if (NT_ERROR(status))
+                {
+                    break;
+                }
+                continue;
+            }
+            attempt = 0;
+
+            //
+            // Start object N+1 before touching object N, so the TPM is busy while we decode.
+            //
+            bool more = i + 1 < handles.count;
+            if (more)
+            {
+                sendBufferSize = this->BuildReadPublicCommand(handles.handle[i + 1], &sendBuffer);
+                status = this->StartCommand(sendBufferSize, (uint8_t*)&sendBuffer);
+                if (NT_ERROR(status))
+                {
+                    more = false;
+                }
+            }
+
+            uint16_t outPublicSize = 0;
+            uint16_t nameSize = 0;
+            uint16_t qualifiedNameSize = 0;
+            NTSTATUS parseStatus = this->CheckReadPublicResponse(recvBuffer, recvBufferSize, &outPublicSize, &nameSize, &qualifiedNameSize);
+            if (NT_SUCCESS(parseStatus))
+            {
+                parseStatus = this->UnmarshalCompactPublic(
+                    recvBuffer + sizeof(TPM2_RESPONSE_HEADER),
+                    sizeof(uint16_t) + outPublicSize,
+                    compactPublic,
+                    COMPACT_PUBLIC_MAX_SIZE
+                );
+            }
+
+            if (NT_SUCCESS(parseStatus))
+            {
+                const uint8_t* publicArea = recvBuffer + sizeof(TPM2_RESPONSE_HEADER);
+                const uint8_t* name = publicArea + sizeof(uint16_t) + outPublicSize + sizeof(uint16_t);
+                const uint8_t* qualifiedName = name + nameSize + sizeof(uint16_t);
+                inventory->Append(
+                    handles.handle[i],
+                    publicArea,
+                    (uint16_t)(sizeof(uint16_t) + outPublicSize),
+                    name,
+                    nameSize,
+                    qualifiedName,
+                    qualifiedNameSize
+                );
+            }
+            else
+            {
+                DbgError("ReadPersistentObjects - skipping handle 0x%08x, status 0x%08x.\n", handles.handle[i], parseStatus);
+            }
+
+            if (NT_ERROR(status) || !more)
+            {
+                break;
+            }
+            i++;
+        }
+
+        inventory->Shrink();
+        return status;
+    }
+
+    //
+    // Decodes one object of an inventory filled by ReadPersistentObjects.
+    //
+    // Parameters:
+    // - inventory: Pointer to the inventory.
+    // - index: Index of the object, below inventory->GetCount().
+    // - objectHandle: Pointer that receives the persistent handle of the object.
+    // - outPublic: Pointer to a TPM2B_PUBLIC structure that will receive the public area of the object.
+    // - name: Pointer to a TPM2B_NAME structure that will receive the name of the object.
+    // - qualifiedName: Pointer to a TPM2B_NAME structure that will receive the qualified name of the object.
+    //
+    // Returns:
+    // - STATUS_SUCCESS: The object was decoded.
+    // - STATUS_INVALID_PARAMETER: index is out of range.
+    // - STATUS_BUFFER_TOO_SMALL: The key does not fit in a TPM2B_PUBLIC, use GetInventoryObjectCompact.
+    // - Any status returned by UnmarshalPublic.
+    //
+    NTSTATUS GetInventoryObject(
+        _In_ const TpmObjectInventory* inventory,
+        _In_ uint32_t index,
+        _Out_ TPMI_DH_OBJECT* objectHandle,
+        _Out_ TPM2B_PUBLIC* outPublic,
+        _Out_ TPM2B_NAME* name,
+        _Out_ TPM2B_NAME* qualifiedName
+    )
+    {
+        const TPM_INVENTORY_RECORD* record = inventory->GetRecord(index);
+        if (record == nullptr)
+        {
+            return STATUS_INVALID_PARAMETER;
+        }
+
+        if (record->publicSize > sizeof(TPM2B_PUBLIC))
+        {
+            return STATUS_BUFFER_TOO_SMALL;
+        }
+
+        //
+        // UnmarshalPublic may read up to sizeof(TPM2B_PUBLIC) bytes, but the record only holds
+        // the marshalled size, so decode from a zero-padded copy.
+        //
+        uint8_t publicBuffer[sizeof(TPM2B_PUBLIC)] = { 0 };
+        memcpy(publicBuffer, TpmObjectInventory::GetPublicArea(record), record->publicSize);
+
+        NTSTATUS status = this->UnmarshalPublic(publicBuffer, outPublic);
+        if (NT_ERROR(status))
+        {
+            return status;
+        }
+
+        *objectHandle = record->handle;
+
+        memcpy(name->name, TpmObjectInventory::GetName(record), record->nameSize);
+        name->size = record->nameSize;
+
+        memcpy(qualifiedName->name, TpmObjectInventory::GetQualifiedName(record), record->qualifiedNameSize);
+        qualifiedName->size = record->qualifiedNameSize;
+
+        return STATUS_SUCCESS;
+    }
+
+    //
+    // Decodes one object of an inventory filled by ReadPersistentObjects into a TPM_COMPACT_PUBLIC.
+    //
+    // Parameters:
+    // - inventory: Pointer to the inventory.
+    // - index: Index of the object, below inventory->GetCount().
+    // - objectHandle: Pointer that receives the persistent handle of the object.
+    // - compactPublic: Pointer to the buffer that receives the compact public area.
+    // - compactPublicSize: Size of the compact public area buffer, COMPACT_PUBLIC_MAX_SIZE fits any key.
+    // - name: Pointer to a TPM2B_NAME structure that will receive the name of the object.
+    // - qualifiedName: Pointer to a TPM2B_NAME structure that will receive the qualified name of the object.
+    //
+    // Returns:
+    // - STATUS_SUCCESS: The object was decoded.
+    // - STATUS_INVALID_PARAMETER: index is out of range.
+    // - Any status returned by UnmarshalCompactPublic.
+    //
+    NTSTATUS GetInventoryObjectCompact(
+        _In_ const TpmObjectInventory* inventory,
+        _In_ uint32_t index,
+        _Out_ TPMI_DH_OBJECT* objectHandle,
+        _Out_writes_bytes_(compactPublicSize) TPM_COMPACT_PUBLIC* compactPublic,
+        _In_ uint32_t compactPublicSize,
+        _Out_ TPM2B_NAME* name,
+        _Out_ TPM2B_NAME* qualifiedName
+    )
+    {
+        const TPM_INVENTORY_RECORD* record = inventory->GetRecord(index);
+        if (record == nullptr)
+        {
+            return STATUS_INVALID_PARAMETER;
+        }
+
+        NTSTATUS status = this->UnmarshalCompactPublic(TpmObjectInventory::GetPublicArea(record), record->publicSize, compactPublic, compactPublicSize);
+        if (NT_ERROR(status))
+        {
+            return status;
+        }
+
+        *objectHandle = record->handle;
+
+        memcpy(name->name, TpmObjectInventory::GetName(record), record->nameSize);
+        name->size = record->nameSize;
+
+        memcpy(qualifiedName->name, TpmObjectInventory::GetQualifiedName(record), record->qualifiedNameSize);
+        qualifiedName->size = record->qualifiedNameSize;
+
+        return STATUS_SUCCESS;
+    }
+
+
+    //
+    // Submits a caller-built command with transient object handles virtualized.
+    //
+    // Objects created by the command are returned under a virtual handle that stays valid until the
+    // caller flushes it, regardless of how many objects the TPM can hold: the least recently used ones
+    // are swapped out with ContextSave/FlushContext and loaded back with ContextLoad when referenced.
+    // Handles in the handle area of the command are rewritten in place. Sessions are passed through.
+    //
+    // Parameters:
+    // - inputParameterBlockSize: Size of the command.
+    // - inputParameterBlock: Pointer to the marshalled command. Virtual handles are replaced with physical ones.
+    // - outputParameterBlockSize: Pointer to the size of the output parameter block, which may be updated.
+    // - outputParameterBlock: Pointer to the buffer that will receive the TPM command's output.
+    //
+    // Returns:
+    // - STATUS_SUCCESS: Command sent and response received; the TPM response code is in the response.
+    // - STATUS_INVALID_PARAMETER: The command is malformed.
+    // - STATUS_INVALID_HANDLE: The command references a transient handle that is not a live virtual handle.
+    // - STATUS_INSUFFICIENT_RESOURCES: No object slot could be freed for the command.
+    // - Any status returned by SubmitCommand.
+    //
+    NTSTATUS SubmitVirtualizedCommand(
+        _In_ uint32_t inputParameterBlockSize,
+        _Inout_updates_bytes_(inputParameterBlockSize) uint8_t* inputParameterBlock,
+        _Inout_ uint32_t* outputParameterBlockSize,
+        _Out_writes_bytes_(*outputParameterBlockSize) uint8_t* outputParameterBlock
+    )
+    {
+        if (inputParameterBlockSize < sizeof(TPM2_COMMAND_HEADER))
+        {
+            return STATUS_INVALID_PARAMETER;
+        }
+
+        NTSTATUS status = STATUS_SUCCESS;
+        if (!this->resourceManager.IsInitialized())
+        {
+            status = this->InitResourceManager();
+            if (NT_ERROR(status))
+            {
+                return status;
+            }
+        }
+
+        TPM_CC commandCode = _byteswap_ulong(this->ReadUnaligned<uint32_t>(inputParameterBlock + FIELD_OFFSET(TPM2_COMMAND_HEADER, commandCode)));
+        uint8_t* parameters = inputParameterBlock + sizeof(TPM2_COMMAND_HEADER);
+        uint32_t parametersSize = inputParameterBlockSize - sizeof(TPM2_COMMAND_HEADER);
+
+        //
+        // Commands that only concern virtual handles are answered here.
+        //
+        if (commandCode == TPM_CC_FlushContext && parametersSize == sizeof(TPMI_DH_CONTEXT))
+        {
+            TPM_HANDLE flushHandle = _byteswap_ulong(this->ReadUnaligned<uint32_t>(parameters));
+            if (TpmResourceManager::IsVirtualHandle(flushHandle))
+            {
+                TPM_RC responseCode = TPM_RC_SUCCESS;
+                TPM_HANDLE physicalHandle = this->resourceManager.GetPhysicalHandle(flushHandle);
+                if (!this->resourceManager.IsObject(flushHandle))
+                {
+                    responseCode = TPM_RC_HANDLE | TPM_RC_P | TPM_RC_1;
+                }
+                else if (physicalHandle != 0 && NT_ERROR(this->FlushContext(physicalHandle)))
+                {
+                    return STATUS_DEVICE_BUSY;
+                }
+
+                this->resourceManager.RemoveObject(flushHandle);
+                return this->WriteResponseHeader(responseCode, outputParameterBlockSize, outputParameterBlock);
+            }
+        }
+        else if (commandCode == TPM_CC_GetCapability && parametersSize == sizeof(TPM_CAP) + 2 * sizeof(uint32_t))
+        {
+            TPM_CAP capability = _byteswap_ulong(this->ReadUnaligned<uint32_t>(parameters));
+            uint32_t property = _byteswap_ulong(this->ReadUnaligned<uint32_t>(parameters + sizeof(TPM_CAP)));
+            uint32_t propertyCount = _byteswap_ulong(this->ReadUnaligned<uint32_t>(parameters + sizeof(TPM_CAP) + sizeof(uint32_t)));
+            if (capability == TPM_CAP_HANDLES && (property & HR_RANGE_MASK) == HR_TRANSIENT)
+            {
+                return this->GetVirtualHandles(property, propertyCount, outputParameterBlockSize, outputParameterBlock);
+            }
+        }
+
+        TPMA_CC attributes = { 0 };
+        if (!this->resourceManager.GetCommandAttributes(commandCode, &attributes))
+        {
+            //
+            // Unknown to the TPM, let it report the error.
+            //
+            return this->SubmitCommand(inputParameterBlockSize, inputParameterBlock, outputParameterBlockSize, outputParameterBlock);
+        }
+
+        uint32_t handleCount = attributes.cHandles;
+        if (parametersSize < handleCount * sizeof(TPM_HANDLE))
+        {
+            return STATUS_INVALID_PARAMETER;
+        }
+
+        //
+        // Make sure every referenced object is loaded, then rewrite the handle area.
+        //
+        TPM_HANDLE handles[8] = { 0 };
+        for (uint32_t i = 0; i < handleCount; i++)
+        {
+            handles[i] = _byteswap_ulong(this->ReadUnaligned<uint32_t>(parameters + i * sizeof(TPM_HANDLE)));
+            if ((handles[i] & HR_RANGE_MASK) == HR_TRANSIENT && !this->resourceManager.IsObject(handles[i]))
+            {
+                DbgError("SubmitVirtualizedCommand - unknown transient handle 0x%08x.\n", handles[i]);
+                return STATUS_INVALID_HANDLE;
+            }
+        }
+
+        for (uint32_t i = 0; i < handleCount; i++)
+        {
+            if (TpmResourceManager::IsVirtualHandle(handles[i]) && this->resourceManager.GetPhysicalHandle(handles[i]) == 0)
+            {
+                status = this->SwapInObject(handles[i], handles, handleCount);
+                if (NT_ERROR(status))
+                {
+                    return status;
+                }
+            }
+        }
+
+        for (uint32_t i = 0; i < handleCount; i++)
+        {
+            if (TpmResourceManager::IsVirtualHandle(handles[i]))
+            {
+                this->resourceManager.Touch(handles[i]);
+                this->WriteUnaligned<uint32_t>(parameters + i * sizeof(TPM_HANDLE), _byteswap_ulong(this->resourceManager.GetPhysicalHandle(handles[i])));
+            }
+        }
+
+        //
+        // A command that returns a handle may need a free object slot.
+        //
+        if (attributes.rHandle)
+        {
+            status = this->MakeRoomForObject(handles, handleCount);
+            if (NT_ERROR(status))
+            {
+                return status;
+            }
+        }
+
+        uint32_t outputSize = *outputParameterBlockSize;
+        status = this->SubmitCommand(inputParameterBlockSize, inputParameterBlock, &outputSize, outputParameterBlock);
+        if (NT_ERROR(status) || outputSize < sizeof(TPM2_RESPONSE_HEADER))
+        {
+            *outputParameterBlockSize = outputSize;
+            return status;
+        }
+        *outputParameterBlockSize = outputSize;
+
+        TPM_RC responseCode = _byteswap_ulong(this->ReadUnaligned<uint32_t>(outputParameterBlock + FIELD_OFFSET(TPM2_RESPONSE_HEADER, responseCode)));
+        if (responseCode != TPM_RC_SUCCESS || !attributes.rHandle || outputSize < sizeof(TPM2_RESPONSE_HEADER) + sizeof(TPM_HANDLE))
+        {
+            return STATUS_SUCCESS;
+        }
+
+        uint8_t* responseHandle = outputParameterBlock + sizeof(TPM2_RESPONSE_HEADER);
+        TPM_HANDLE physicalHandle = _byteswap_ulong(this->ReadUnaligned<uint32_t>(responseHandle));
+        if ((physicalHandle & HR_RANGE_MASK) != HR_TRANSIENT)
+        {
+            return STATUS_SUCCESS;
+        }
+
+        //
+        // Sequence objects change with every update, so only these keep a reusable context.
+        //
+        bool contextReusable =
+            commandCode == TPM_CC_Load ||
+            commandCode == TPM_CC_LoadExternal ||
+            commandCode == TPM_CC_CreatePrimary;
+
+        TPM_HANDLE virtualHandle = this->resourceManager.AddObject(physicalHandle, contextReusable);
+        if (virtualHandle == 0)
+        {
+            DbgError("SubmitVirtualizedCommand - out of virtual handles.\n");
+            (void)this->FlushContext(physicalHandle);
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        this->WriteUnaligned<uint32_t>(responseHandle, _byteswap_ulong(virtualHandle));
+        return STATUS_SUCCESS;
+    }
+
+    //
+    // Flushes every object created through SubmitVirtualizedCommand and releases its virtual handle.
+    //
+    void FlushVirtualObjects()
+    {
+        TPM_HANDLE handles[RM_MAX_OBJECTS] = { 0 };
+        bool more = false;
+        uint32_t count = this->resourceManager.ListHandles(RM_VIRTUAL_HANDLE_FIRST, handles, RM_MAX_OBJECTS, &more);
+
+        for (uint32_t i = 0; i < count; i++)
+        {
+            TPM_HANDLE physicalHandle = this->resourceManager.GetPhysicalHandle(handles[i]);
+            if (physicalHandle != 0)
+            {
+                (void)this->FlushContext(physicalHandle);
+            }
+            this->resourceManager.RemoveObject(handles[i]);
+        }
+    }
+
+    //
+    // Makes sure the algorithms a workload is about to use have been self-tested, so its first
+    // command neither stalls on a full self-test nor returns TPM_RC_TESTING. Only algorithms not
+    // yet known to be tested are sent to IncrementalSelfTest; if the TPM rejects that, a
+    // SelfTest(fullTest=NO) is started instead.
+    //
+    // Parameters:
+    // - algorithms: Algorithms the workload will use, e.g. the nameAlg and type of a key.
+    // - count: Number of entries in algorithms.
+    //
+    // Returns:
+    // - STATUS_SUCCESS: The algorithms are tested or being tested.
+    // - Any status returned by IncrementalSelfTest or StartBackgroundSelfTest.
+    //
+    NTSTATUS EnsureAlgorithmsTested(
+        _In_reads_(count) const TPM_ALG_ID* algorithms,
+        _In_ uint32_t count
+    )
+    {
+        TPML_ALG toTest = { 0 };
+        if (this->selfTestState.GetUntested(algorithms, count, &toTest) == 0)
+        {
+            return STATUS_SUCCESS;
+        }
+
+        TPML_ALG toDoList = { 0 };
+        NTSTATUS status = this->IncrementalSelfTest(&toTest, &toDoList);
+        if (NT_ERROR(status))
+        {
+            return this->StartBackgroundSelfTest();
+        }
+
+        if (toDoList.count == 0)
+        {
+            this->selfTestState.SetAllTested();
+            return STATUS_SUCCESS;
+        }
+
+        for (uint32_t i = 0; i < toTest.count; i++)
+        {
+            bool pending = false;
+            for (uint32_t j = 0; j < toDoList.count; j++)
+            {
+                if (toDoList.algorithms[j] == toTest.algorithms[i])
+                {
+                    pending = true;
+                    break;
+                }
+            }
+
+            if (!pending)
+            {
+                this->selfTestState.SetTested(toTest.algorithms[i]);
+            }
+        }
+        return STATUS_SUCCESS;
+    }
+
+    //
+    // Asks the TPM to test every algorithm it has not tested yet (SelfTest with fullTest=NO), meant
+    // for deferred initialization once the latency-sensitive work is done. The TPM may run the tests
+    // in the background; commands issued meanwhile are retried on TPM_RC_TESTING.
+    //
+    // Returns:
+    // - STATUS_SUCCESS: The self-test completed or was started.
+    // - STATUS_BUFFER_TOO_SMALL: recvBuffer size was too small.
+    // - STATUS_DEVICE_BUSY: TPM device exception, or the self-test failed.
+    //
+    NTSTATUS StartBackgroundSelfTest()
+    {
+        if (this->selfTestState.IsAllTested())
+        {
+            return STATUS_SUCCESS;
+        }
+
+        //
+        // Construct command
+        //
+        uint32_t sendBufferSize = (uint32_t)sizeof(templates::SelfTestBackground);
+
+        //
+        // send Tpm command, bypassing the retry engine: TPM_RC_TESTING means the tests were started.
+        //
+        TPM2_SELF_TEST_RESPONSE recvBuffer = { { 0 } };
+
+        NTSTATUS status = this->StartCommand(sendBufferSize, (const uint8_t*)&templates::SelfTestBackground);
+        if (NT_ERROR(status)) 
+        {
+            return status;
+        }
+
+        uint32_t recvBufferSize = sizeof(recvBuffer);
+        status = this->FinishCommand(&recvBufferSize, (uint8_t*)&recvBuffer);
+        if (NT_ERROR(status)) 
+        {
+            return status;
+        }
+
+        if (recvBufferSize < sizeof(TPM2_RESPONSE_HEADER)) 
+        {
+            DbgError("SelfTest - recvBufferSize Error - %x.\n", recvBufferSize);
+            return STATUS_BUFFER_TOO_SMALL;
+        }
+
+        TPM_RC responseCode = _byteswap_ulong(recvBuffer.Header.responseCode);
+        switch (responseCode) 
+        {
+        case TPM_RC_SUCCESS:
+            this->selfTestState.SetAllTested();
+            return STATUS_SUCCESS;
+        case TPM_RC_TESTING:
+            Dbg("SelfTest running in background.\n");
+            return STATUS_SUCCESS;
+        default:
+            DbgError("SelfTest - responseCode - 0x%08x.\n", responseCode);
+            return STATUS_DEVICE_BUSY;
+        }
+    }
+};
+
+//
+// Runs handler with an engine specialized for the given transport, and deletes the engine afterwards.
+//
+template<typename Transport, typename Handler>
+NTSTATUS RunTpmEngine(
+    _In_ TpmPtp* ptpInterface,
+    _In_ uintptr_t tpmBaseAddress,
+    _In_ Handler handler
+)
+{
+    TpmEngine<Transport>* tpm = new TpmEngine<Transport>();
+    if (!tpm)
+    {
+        DbgError("Failed to instantiate TpmEngine class.\n");
+        delete ptpInterface;
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    if (!tpm->Init(ptpInterface, tpmBaseAddress))
+    {
+        DbgError("Failed to initialize TpmEngine class.\n");
+        delete tpm;
+        return STATUS_DEVICE_HARDWARE_ERROR;
+    }
+
+    return handler(tpm);
+}
+
+//
+// Locates the TPM, detects its PTP interface once, and runs handler with the TpmEngine specialized
+// for that interface, or with the simulator transport when built with TPM_SIMULATOR. With
+// MMIO_REPLAY the TPM is the recorded one, at the base address the trace starts with. handler is
+// called as handler(TpmEngine<Transport>*) and owns the engine: it must delete it, or hand it to
+// something that will, such as TpmCommandQueue::Start.
+//
+// Parameters:
+// - handler: Callable that uses the engine.
+//
+// Returns:
+// - The status returned by handler.
+// - STATUS_DEVICE_HARDWARE_ERROR: No TPM was found, or it could not be initialized.
+// - STATUS_DEVICE_NOT_CONNECTED: No valid PTP interface is connected.
+// - STATUS_INSUFFICIENT_RESOURCES: Allocation failure.
+//
+template<typename Handler>
+NTSTATUS RunTpmEngine(_In_ Handler handler)
+{
+#if TPM_SIMULATOR
+    //
+    // No platform TPM is touched. The PTP interface is only there to be owned by the engine.
+    //
+    TpmPtp* simulatorInterface = new TpmPtp(0);
+    if (!simulatorInterface)
+    {
+        DbgError("Failed to instantiate TpmPtp class.\n");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    return RunTpmEngine<SimulatorTransport>(simulatorInterface, 0, handler);
+#else
+
+    uintptr_t tpmBaseAddress = 0;
+#if MMIO_REPLAY
+    if (!replay::GetBaseAddress(&tpmBaseAddress))
+    {
+        DbgError("No trace is being replayed.\n");
+        return STATUS_DEVICE_HARDWARE_ERROR;
+    }
+#else
+    if (!acpi::GetTpm2PhysicalAddress(&tpmBaseAddress))
+    {
+        // Already prints detailed error inside function.
+        return STATUS_DEVICE_HARDWARE_ERROR;
+    }
+#endif
+
+    TpmPtp* ptpInterface = new TpmPtp(tpmBaseAddress);
+    if (!ptpInterface)
+    {
+        DbgError("Failed to instantiate TpmPtp class.\n");
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    if (!ptpInterface->Init())
+    {
+        DbgError("Failed to initialize TpmPtp class.\n");
+        delete ptpInterface;
+        return STATUS_DEVICE_HARDWARE_ERROR;
+    }
+    Dbg("Instantiated and initialized TpmPtp class.\n");
+
+    switch (ptpInterface->cachedInterface)
+    {
+    case PTP_INTERFACE_TYPE::PtpInterfaceCrb:
+        return RunTpmEngine<CrbTransport>(ptpInterface, tpmBaseAddress, handler);
+    case PTP_INTERFACE_TYPE::PtpInterfaceFifo:
+        return RunTpmEngine<FifoTransport>(ptpInterface, tpmBaseAddress, handler);
+    case PTP_INTERFACE_TYPE::PtpInterfaceTis:
+        return RunTpmEngine<TisTransport>(ptpInterface, tpmBaseAddress, handler);
+    default:
+        delete ptpInterface;
+        return STATUS_DEVICE_NOT_CONNECTED;
+    }
+#endif
+}
@@ -0,0 +1,154 @@
+#pragma once
+
+//
+// TraceLogging provider for structured per-command events. Events above TPM_TRACE_LEVEL are
+// compiled out, like Dbg and DbgError.
+//
+// {6b1e6a3a-2f0c-4c55-9a4e-1d2f6c8b7e30}
+//
+TRACELOGGING_DEFINE_PROVIDER(
+    g_tpmTraceProvider,
+    "TpmMmio",
+    (0x6b1e6a3a, 0x2f0c, 0x4c55, 0x9a, 0x4e, 0x1d, 0x2f, 0x6c, 0x8b, 0x7e, 0x30)
+);
+
+//
+// Phases of a command round trip. The transports mark Ready through TransferOut; TpmEngine marks
+// the rest.
+//
+enum TPM_PHASE
+{
+    TpmPhaseQueue,          // Waiting for the TPM to be free
+    TpmPhaseMarshal,        // Marshalling into the transport buffer (writer commands)
+    TpmPhaseReady,          // CRB STEP 0/1, TIS commandReady
+    TpmPhaseTransferIn,     // Command transfer and Start/Go
+    TpmPhaseExecute,        // Until the TPM signals completion
+    TpmPhaseTransferOut,    // Response transfer
+    TpmPhaseParse,          // Decoding in place (reader commands)
+    TpmPhaseCount
+};
+
+//
+// One command round trip, as traced by TpmEngine.
+//
+struct TPM_COMMAND_TRACE
+{
+    TPM_CC commandCode;
+    TPM_RC responseCode;
+    uint64_t lastTime;                      // KeQueryPerformanceCounter at the last phase mark
+    uint64_t phaseTime[TpmPhaseCount];      // Performance counter ticks spent in each phase
+};
+
+namespace trace
+{
+    inline uint64_t& Frequency()
+    {
+        static uint64_t frequency = 0;
+        return frequency;
+    }
+
+    //
+    // Registers the provider. Must be paired with Unregister in DriverUnload.
+    //
+    inline void Register()
+    {
+        LARGE_INTEGER frequency;
+        (void)KeQueryPerformanceCounter(&frequency);
+        Frequency() = (uint64_t)frequency.QuadPart;
+        (void)TraceLoggingRegister(g_tpmTraceProvider);
+    }
+
+    inline void Unregister()
+    {
+        TraceLoggingUnregister(g_tpmTraceProvider);
+    }
+
+    inline uint64_t Timestamp()
+    {
+        return (uint64_t)KeQueryPerformanceCounter(NULL).QuadPart;
+    }
+
+    inline uint64_t ToMicroseconds(_In_ uint64_t ticks)
+    {
+        uint64_t frequency = Frequency();
+        return frequency ? (ticks * 1000000) / frequency : 0;
+    }
+
+    //
+    // Starts timing a command.
+    //
+    inline void Begin(
+        _Out_ TPM_COMMAND_TRACE* record,
+        _In_ TPM_CC commandCode
+    )
+    {
+        RtlZeroMemory(record, sizeof(*record));
+        record->commandCode = commandCode;
+        record->responseCode = TPM_RC_FAILURE;
+        record->lastTime = Timestamp();
+    }
+
+    //
+    // Charges the time since the previous mark to a phase.
+    //
+    inline void Mark(
+        _Inout_ TPM_COMMAND_TRACE* record,
+        _In_ TPM_PHASE phase
+    )
+    {
+        uint64_t now = Timestamp();
+        record->phaseTime[phase] += now - record->lastTime;
+        record->lastTime = now;
+    }
+
+    //
+    // Emits a Command event.
+    //
+    // Parameters:
+    // - transport: Name of the transport the command went through.
+    // - record: Command code, TPM_RC (TPM_RC_FAILURE if no response was received) and phase times.
+    //
+    inline void Command(
+        _In_z_ const char* transport,
+        _In_ const TPM_COMMAND_TRACE* record
+    )
+    {
+#if TPM_TRACE_LEVEL >= TPM_TRACE_LEVEL_INFO
+        TraceLoggingWrite(
+            g_tpmTraceProvider,
+            "Command",
+            TraceLoggingLevel(TPM_TRACE_LEVEL_INFO),
+            TraceLoggingHexUInt32(record->commandCode, "CommandCode"),
+            TraceLoggingString(transport, "Transport"),
+            TraceLoggingUInt64(ToMicroseconds(record->phaseTime[TpmPhaseQueue]), "QueueMicroseconds"),
+            TraceLoggingUInt64(ToMicroseconds(record->phaseTime[TpmPhaseMarshal]), "MarshalMicroseconds"),
+            TraceLoggingUInt64(ToMicroseconds(record->phaseTime[TpmPhaseReady]), "ReadyMicroseconds"),
+            TraceLoggingUInt64(ToMicroseconds(record->phaseTime[TpmPhaseTransferIn]), "TransferInMicroseconds"),
+            TraceLoggingUInt64(ToMicroseconds(record->phaseTime[TpmPhaseExecute]), "ExecuteMicroseconds"),
+            TraceLoggingUInt64(ToMicroseconds(record->phaseTime[TpmPhaseTransferOut]), "TransferOutMicroseconds"),
+            TraceLoggingUInt64(ToMicroseconds(record->phaseTime[TpmPhaseParse]), "ParseMicroseconds"),
+            TraceLoggingHexUInt32(record->responseCode, "ResponseCode")
+        );
+#else
+        UNREFERENCED_PARAMETER(transport);
+        UNREFERENCED_PARAMETER(record);
+#endif
+    }
+
+    //
+    // Emits a CacheHit event for a command answered from the response cache.
+    //
+    inline void CacheHit(_In_ TPM_CC commandCode)
+    {
+#if TPM_TRACE_LEVEL >= TPM_TRACE_LEVEL_VERBOSE
+        TraceLoggingWrite(
+            g_tpmTraceProvider,
+            "CacheHit",
+            TraceLoggingLevel(TPM_TRACE_LEVEL_VERBOSE),
+            TraceLoggingHexUInt32(commandCode, "CommandCode")
+        );
+#else
+        UNREFERENCED_PARAMETER(commandCode);
+#endif
+    }
+}
@@ -0,0 +1,467 @@
+#pragma once
+
+//
+// Transports TpmEngine is specialized for. The instantiation is picked once from the interface
+// TpmPtp detected, so sending a command neither switches on the interface type nor constructs
+// a TpmCrb/TpmTis. Each transport keeps its interface state for the lifetime of the engine.
+//
+// Every transport provides:
+// - Init: Sets up the transport for the TPM at tpmBaseAddress. The interface marks the Ready,
+//   TransferIn, Execute and TransferOut phases of each command in the engine's trace record.
+// - Send/Receive: Starts a command from a caller buffer, and collects its response into one.
+// - Begin/Start/Wait/Release: Same, with the command marshalled and the response decoded in the
+//   transport's own buffer through TpmCommandWriter and TpmResponseReader.
+//
+
+//
+// CRB devices whose data buffer may be mapped write-combined. Uploads are then combined into full
+// bus writes and fenced once before Start; the control registers stay uncached. Only devices whose
+// data buffer behaves like memory (no side effects on access, no ordering needs within the buffer)
+// may be listed. TPM_DEVICE_ID_ANY matches any device ID of the vendor.
+//
+// The entries are candidates, not verified devices: firmware TPMs are expected to keep the buffer
+// in host memory, but a part whose buffer is device MMIO would see writes merged or reordered
+// around Start. Listed devices are only mapped write-combined with CRB_WRITE_COMBINED, which is off
+// by default. The TPM_BENCHMARK build runs every size and a set of hashed payloads both ways on a
+// listed device and fails if any response byte differs; enable it for a device only once that
+// comparison passes and shows a gain.
+//
+struct TPM_DEVICE_ID
+{
+    uint16_t VendorId;
+    uint16_t DeviceId;
+};
+
+static constexpr TPM_DEVICE_ID CrbWriteCombinedDevices[] =
+{
+    { 0x8086, TPM_DEVICE_ID_ANY },      // Intel PTT, unmeasured
+    { 0x1022, TPM_DEVICE_ID_ANY },      // AMD fTPM, unmeasured
+};
+
+//
+// CRB. The data buffer is mapped once; commands are marshalled into it and responses are decoded
+// from it. Falls back to a staging buffer if it cannot be mapped.
+//
+class CrbTransport
+{
+private:
+
+    PTP_CRB_REGISTERS* crbReg = nullptr;
+    uint8_t* dataBuffer = nullptr;
+    bool writeCombined = false;
+    bool writeCombinedAllowed = false;
+    uint8_t* stagingBuffer = nullptr;
+    TpmCrb crbInterface;
+
+    //
+    // Kept to remap the data buffer after Init.
+    //
+    uint8_t idleByPassState = 0;
+    TPM_COMMAND_TRACE* commandTrace = nullptr;
+
+    static bool IsWriteCombinedAllowed(_In_ const TpmPtp* ptpInterface)
+    {
+        for (const TPM_DEVICE_ID& device : CrbWriteCombinedDevices)
+        {
+            if (device.VendorId == ptpInterface->vendorId &&
+                (device.DeviceId == TPM_DEVICE_ID_ANY || device.DeviceId == ptpInterface->deviceId))
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+public:
+
+    static constexpr const char* Name = "CRB";
+
+    ~CrbTransport()
+    {
+        if (this->dataBuffer && !MMIO_REPLAY)
+        {
+            MmUnmapIoSpace(this->dataBuffer, sizeof(this->crbReg->CrbDataBuffer));
+        }
+        delete[] this->stagingBuffer;
+    }
+
+    //
+    // Maps the data buffer and caches the IdleByPass state. The data buffer is mapped write-combined
+    // if CRB_WRITE_COMBINED is enabled and the device is in CrbWriteCombinedDevices, uncached otherwise.
+    //
+    // Parameters:
+    // - ptpInterface: Initialized PTP interface.
+    // - tpmBaseAddress: TPM register base address.
+    // - commandTrace: Record the phases of each command are charged to, or nullptr.
+    //
+    // Returns:
+    // - true: The transport is ready.
+    // - false: Neither the data buffer nor a staging buffer is available.
+    //
+    bool Init(
+        _In_ TpmPtp* ptpInterface,
+        _In_ uintptr_t tpmBaseAddress,
+        _In_opt_ TPM_COMMAND_TRACE* commandTrace
+    )
+    {
+        this->crbReg = (PTP_CRB_REGISTERS*)tpmBaseAddress;
+        this->idleByPassState = ptpInterface->idleByPassState;
+        this->commandTrace = commandTrace;
+        this->writeCombinedAllowed = IsWriteCombinedAllowed(ptpInterface);
+
+        if (!this->MapDataBuffer(CRB_WRITE_COMBINED && this->writeCombinedAllowed))
+        {
+            // Not fatal, commands go through the staging buffer.
+            DbgError("Failed to map the CRB data buffer.\n");
+            this->stagingBuffer = new uint8_t[TRANSPORT_STAGING_BUFFER_SIZE];
+            if (!this->stagingBuffer)
+            {
+                DbgError("Failed to allocate the transport staging buffer.\n");
+                return false;
+            }
+        }
+        Dbg("CRB data buffer mapped %s.\n", this->writeCombined ? "write-combined" : "uncached");
+        return true;
+    }
+
+    //
+    // Maps the data buffer write-combined or uncached, replacing the current mapping. Falls back to
+    // uncached if the write-combined mapping fails. Must only be called between commands.
+    //
+    // Parameters:
+    // - writeCombined: true to map the data buffer MmWriteCombined.
+    //
+    // Returns:
+    // - true: The data buffer is mapped; IsWriteCombined tells how.
+    // - false: The data buffer could not be mapped at all.
+    //
+    bool MapDataBuffer(_In_ bool writeCombined)
+    {
+#if MMIO_REPLAY
+        //
+        // Nothing is mapped in a replay. The shadow takes the caching asked for, so the replayed
+        // session fences and compares like the recorded one.
+        //
+        this->dataBuffer = replay::MapDataBuffer((uintptr_t)this->crbReg->CrbDataBuffer, sizeof(this->crbReg->CrbDataBuffer));
+        this->writeCombined = writeCombined && this->dataBuffer;
+#else
+        if (this->dataBuffer)
+        {
+            MmUnmapIoSpace(this->dataBuffer, sizeof(this->crbReg->CrbDataBuffer));
+            this->dataBuffer = nullptr;
+        }
+
+        PHYSICAL_ADDRESS physAddress;
+        physAddress.QuadPart = (LONGLONG)(uintptr_t)this->crbReg->CrbDataBuffer;
+        if (writeCombined)
+        {
+            this->dataBuffer = (uint8_t*)MmMapIoSpace(physAddress, sizeof(this->crbReg->CrbDataBuffer), MmWriteCombined);
+        }
+        this->writeCombined = (this->dataBuffer != nullptr);
+        if (!this->dataBuffer)
+        {
+            this->dataBuffer = (uint8_t*)MmMapIoSpace(physAddress, sizeof(this->crbReg->CrbDataBuffer), MmNonCached);
+        }
+#endif
+
+        this->crbInterface.Init(this->idleByPassState, this->dataBuffer, this->writeCombined, this->commandTrace);
+        return this->dataBuffer != nullptr;
+    }
+
+    //
+    // Returns whether the device is in CrbWriteCombinedDevices, whatever CRB_WRITE_COMBINED says.
+    //
+    bool IsWriteCombinedAllowed() const
+    {
+        return this->writeCombinedAllowed;
+    }
+
+    bool IsWriteCombined() const
+    {
+        return this->writeCombined;
+    }
+
+    NTSTATUS Send(
+        _In_reads_bytes_(size) const uint8_t* buffer,
+        _In_ uint32_t size
+    )
+    {
+        return this->crbInterface.CrbSend(this->crbReg, buffer, size);
+    }
+
+    NTSTATUS Receive(
+        _Out_writes_bytes_(*size) uint8_t* buffer,
+        _Inout_ uint32_t* size
+    )
+    {
+        return this->crbInterface.CrbReceive(this->crbReg, buffer, size);
+    }
+
+    NTSTATUS Begin(_Out_ TpmCommandWriter* writer)
+    {
+        if (!this->dataBuffer)
+        {
+            writer->Reset(this->stagingBuffer, TRANSPORT_STAGING_BUFFER_SIZE, false);
+            return STATUS_SUCCESS;
+        }
+
+        NTSTATUS status = this->crbInterface.CrbPrepare(this->crbReg);
+        if (NT_ERROR(status))
+        {
+            return status;
+        }
+        writer->Reset(this->dataBuffer, TRANSPORT_STAGING_BUFFER_SIZE, true);
+        return STATUS_SUCCESS;
+    }
+
+    NTSTATUS Start(_In_ TpmCommandWriter* writer)
+    {
+        uint32_t size = 0;
+        NTSTATUS status = writer->Finish(&size);
+        if (!this->dataBuffer)
+        {
+            return NT_ERROR(status) ? status : this->Send(this->stagingBuffer, size);
+        }
+
+        if (NT_ERROR(status))
+        {
+            this->crbInterface.CrbGoIdle(this->crbReg);
+            return status;
+        }
+        this->crbInterface.CrbStart(this->crbReg);
+        return STATUS_SUCCESS;
+    }
+
+    NTSTATUS Wait(_Out_ TpmResponseReader* reader)
+    {
+        uint32_t size = TRANSPORT_STAGING_BUFFER_SIZE;
+        if (!this->dataBuffer)
+        {
+            NTSTATUS status = this->Receive(this->stagingBuffer, &size);
+            if (NT_ERROR(status))
+            {
+                return status;
+            }
+            reader->Reset(this->stagingBuffer, size, false);
+            return STATUS_SUCCESS;
+        }
+
+        TPM2_RESPONSE_HEADER header = { 0 };
+        NTSTATUS status = this->crbInterface.CrbWaitResponse(this->crbReg, &header, &size);
+        if (NT_ERROR(status))
+        {
+            return status;
+        }
+        reader->Reset(this->dataBuffer, size, true);
+        return STATUS_SUCCESS;
+    }
+
+    //
+    // Returns the TPM to Idle, after which the data buffer must no longer be read.
+    //
+    void Release()
+    {
+        if (this->dataBuffer)
+        {
+            this->crbInterface.CrbGoIdle(this->crbReg);
+        }
+    }
+};
+
+//
+// TIS 1.3. Commands are marshalled into a staging buffer and written through the FIFO.
+//
+class TisTransport
+{
+private:
+
+    TIS_PC_REGISTERS* tisReg = nullptr;
+    uint8_t* stagingBuffer = nullptr;
+    TpmTis tisInterface;
+
+public:
+
+    static constexpr const char* Name = "TIS";
+
+    ~TisTransport()
+    {
+        delete[] this->stagingBuffer;
+    }
+
+    //
+    // Allocates the staging buffer.
+    //
+    // Parameters:
+    // - ptpInterface: Initialized PTP interface.
+    // - tpmBaseAddress: TPM register base address.
+    // - commandTrace: Record the phases of each command are charged to, or nullptr.
+    //
+    // Returns:
+    // - true: The transport is ready.
+    // - false: The staging buffer could not be allocated.
+    //
+    bool Init(
+        _In_ TpmPtp* ptpInterface,
+        _In_ uintptr_t tpmBaseAddress,
+        _In_opt_ TPM_COMMAND_TRACE* commandTrace
+    )
+    {
+        UNREFERENCED_PARAMETER(ptpInterface);
+
+        this->tisReg = (TIS_PC_REGISTERS*)tpmBaseAddress;
+        this->tisInterface.Init(commandTrace);
+        this->stagingBuffer = new uint8_t[TRANSPORT_STAGING_BUFFER_SIZE];
+        if (!this->stagingBuffer)
+        {
+            DbgError("Failed to allocate the transport staging buffer.\n");
+            return false;
+        }
+        return true;
+    }
+
+    NTSTATUS Send(
+        _In_reads_bytes_(size) const uint8_t* buffer,
+        _In_ uint32_t size
+    )
+    {
+        return this->tisInterface.TisSend(this->tisReg, buffer, size);
+    }
+
+    NTSTATUS Receive(
+        _Out_writes_bytes_(*size) uint8_t* buffer,
+        _Inout_ uint32_t* size
+    )
+    {
+        return this->tisInterface.TisReceive(this->tisReg, buffer, size);
+    }
+
+    NTSTATUS Begin(_Out_ TpmCommandWriter* writer)
+    {
+        writer->Reset(this->stagingBuffer, TRANSPORT_STAGING_BUFFER_SIZE, false);
+        return STATUS_SUCCESS;
+    }
+
+    NTSTATUS Start(_In_ TpmCommandWriter* writer)
+    {
+        uint32_t size = 0;
+        NTSTATUS status = writer->Finish(&size);
+        return NT_ERROR(status) ? status : this->Send(this->stagingBuffer, size);
+    }
+
+    NTSTATUS Wait(_Out_ TpmResponseReader* reader)
+    {
+        uint32_t size = TRANSPORT_STAGING_BUFFER_SIZE;
+        NTSTATUS status = this->Receive(this->stagingBuffer, &size);
+        if (NT_ERROR(status))
+        {
+            return status;
+        }
+        reader->Reset(this->stagingBuffer, size, false);
+        return STATUS_SUCCESS;
+    }
+
+    void Release()
+    {
+    }
+};
+
+//
+// PTP FIFO. Register-compatible with TIS 1.3 for everything the driver uses.
+//
+class FifoTransport : public TisTransport
+{
+public:
+
+    static constexpr const char* Name = "FIFO";
+};
+
+//
+// TPM 2.0 reference simulator over TCP, for TPM_SIMULATOR builds. Commands are marshalled behind
+// the frame header in the simulator's own buffer and sent in one write on the connection opened
+// at Init. Execute is the simulator's time; TransferIn and TransferOut are the socket's.
+//
+class SimulatorTransport
+{
+private:
+
+    TpmSimulator simulator;
+
+public:
+
+    static constexpr const char* Name = "SIM";
+
+    //
+    // Powers the simulator on and connects to it.
+    //
+    // Parameters:
+    // - ptpInterface: Unused.
+    // - tpmBaseAddress: Unused.
+    // - commandTrace: Record the phases of each command are charged to, or nullptr.
+    //
+    // Returns:
+    // - true: The transport is ready.
+    // - false: The simulator could not be reached.
+    //
+    bool Init(
+        _In_ TpmPtp* ptpInterface,
+        _In_ uintptr_t tpmBaseAddress,
+        _In_opt_ TPM_COMMAND_TRACE* commandTrace
+    )
+    {
+        UNREFERENCED_PARAMETER(ptpInterface);
+        UNREFERENCED_PARAMETER(tpmBaseAddress);
+
+        NTSTATUS status = this->simulator.Init(commandTrace);
+        if (NT_ERROR(status))
+        {
+            DbgError("Failed to connect to the TPM simulator - 0x%08x.\n", status);
+            return false;
+        }
+        return true;
+    }
+
+    NTSTATUS Send(
+        _In_reads_bytes_(size) const uint8_t* buffer,
+        _In_ uint32_t size
+    )
+    {
+        return this->simulator.Send(buffer, size);
+    }
+
+    NTSTATUS Receive(
+        _Out_writes_bytes_(*size) uint8_t* buffer,
+        _Inout_ uint32_t* size
+    )
+    {
+        return this->simulator.Receive(buffer, size);
+    }
+
+    NTSTATUS Begin(_Out_ TpmCommandWriter* writer)
+    {
+        writer->Reset(this->simulator.GetBuffer(), TRANSPORT_STAGING_BUFFER_SIZE, false);
+        return STATUS_SUCCESS;
+    }
+
+    NTSTATUS Start(_In_ TpmCommandWriter* writer)
+    {
+        uint32_t size = 0;
+        NTSTATUS status = writer->Finish(&size);
+        return NT_ERROR(status) ? status : this->Send(this->simulator.GetBuffer(), size);
+    }
+
+    NTSTATUS Wait(_Out_ TpmResponseReader* reader)
+    {
+        uint32_t size = TRANSPORT_STAGING_BUFFER_SIZE;
+        NTSTATUS status = this->Receive(this->simulator.GetBuffer(), &size);
+        if (NT_ERROR(status))
+        {
+            return status;
+        }
+        reader->Reset(this->simulator.GetBuffer(), size, false);
+        return STATUS_SUCCESS;
+    }
+
+    void Release()
+    {
+    }
+};